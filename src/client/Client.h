@@ -335,6 +335,10 @@ protected:
 
   // global client lock
   //  - protects Client and buffer cache both!
+  //  - so unlike librbd's (rbd_cache_shards), the buffer cache is one
+  //    ObjectCacher: every read and write already holds this for caps and
+  //    inode state, and per-shard cache locks would buy nothing until
+  //    those paths stop taking it
   Mutex                  client_lock;
 
   // helpers
@@ -81,6 +81,8 @@ cls_method_handle_t h_snapshot_add;
 cls_method_handle_t h_snapshot_remove;
 cls_method_handle_t h_get_all_features;
 cls_method_handle_t h_copyup;
+cls_method_handle_t h_object_map_update;
+cls_method_handle_t h_object_map_merge;
 cls_method_handle_t h_get_id;
 cls_method_handle_t h_set_id;
 cls_method_handle_t h_dir_get_id;
@@ -1383,6 +1385,123 @@ int copyup(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
 }
 
 
+/************************ object map methods **************************/
+
+/*
+ * An object map object holds one bit per data object of an image (or
+ * of one of its snapshots), bit (n % 8) of byte (n / 8) for object n.
+ * A set bit means the object may exist; a clear bit means it does
+ * not.  Bytes past the end of the object read as zero.  The object is
+ * created along with the image, so -ENOENT from these methods tells
+ * the client the map is missing and must not be trusted.
+ */
+
+/**
+ * Set or clear the bits for a range of objects.
+ *
+ * Input:
+ * @param start_object_no first object of the range
+ * @param end_object_no object past the end of the range
+ * @param new_state 1 to mark the objects as existing, 0 to clear them
+ *
+ * Output:
+ * @returns 0 on success, negative error code on failure
+ */
+int object_map_update(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
+{
+  uint64_t start_object_no, end_object_no;
+  uint8_t new_state;
+  try {
+    bufferlist::iterator iter = in->begin();
+    ::decode(start_object_no, iter);
+    ::decode(end_object_no, iter);
+    ::decode(new_state, iter);
+  } catch (const buffer::error &err) {
+    return -EINVAL;
+  }
+  if (start_object_no >= end_object_no)
+    return -EINVAL;
+
+  uint64_t size;
+  int r = cls_cxx_stat(hctx, &size, NULL);
+  if (r < 0)
+    return r;
+
+  uint64_t byte_off = start_object_no / 8;
+  uint64_t byte_end = (end_object_no + 7) / 8;
+  if (!new_state) {
+    // nothing to clear past the end
+    if (byte_off >= size)
+      return 0;
+    if (byte_end > size) {
+      byte_end = size;
+      end_object_no = size * 8;
+    }
+  }
+
+  bufferlist data;
+  r = cls_cxx_read(hctx, byte_off, byte_end - byte_off, &data);
+  if (r < 0)
+    return r;
+
+  bufferptr bp(byte_end - byte_off);
+  bp.zero();
+  data.copy(0, data.length(), bp.c_str());
+  unsigned char *bits = (unsigned char *)bp.c_str();
+  for (uint64_t i = start_object_no; i < end_object_no; ++i) {
+    uint64_t b = i / 8 - byte_off;
+    if (new_state)
+      bits[b] |= 1 << (i % 8);
+    else
+      bits[b] &= ~(1 << (i % 8));
+  }
+
+  CLS_LOG(20, "object_map_update: %llu~%llu -> %d",
+	  (unsigned long long)start_object_no,
+	  (unsigned long long)(end_object_no - start_object_no), (int)new_state);
+  bufferlist bl;
+  bl.push_back(bp);
+  return cls_cxx_write(hctx, byte_off, bl.length(), &bl);
+}
+
+/**
+ * Mark every object set in the given map as existing, leaving the
+ * other bits alone.
+ *
+ * Input:
+ * @param in object map bytes, in the on-disk format
+ *
+ * Output:
+ * @returns 0 on success, negative error code on failure
+ */
+int object_map_merge(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
+{
+  uint64_t size;
+  int r = cls_cxx_stat(hctx, &size, NULL);
+  if (r < 0)
+    return r;
+  if (in->length() == 0)
+    return 0;
+
+  bufferlist data;
+  r = cls_cxx_read(hctx, 0, in->length(), &data);
+  if (r < 0)
+    return r;
+
+  bufferptr bp(in->length());
+  bp.zero();
+  data.copy(0, data.length(), bp.c_str());
+  unsigned char *bits = (unsigned char *)bp.c_str();
+  const unsigned char *merge = (const unsigned char *)in->c_str();
+  for (unsigned i = 0; i < bp.length(); ++i)
+    bits[i] |= merge[i];
+
+  bufferlist bl;
+  bl.push_back(bp);
+  return cls_cxx_write(hctx, 0, bl.length(), &bl);
+}
+
+
 /************************ rbd_id object methods **************************/
 
 /**
@@ -2061,6 +2180,12 @@ void __cls_init()
   cls_register_cxx_method(h_class, "copyup",
 			  CLS_METHOD_RD | CLS_METHOD_WR,
 			  copyup, &h_copyup);
+  cls_register_cxx_method(h_class, "object_map_update",
+			  CLS_METHOD_RD | CLS_METHOD_WR,
+			  object_map_update, &h_object_map_update);
+  cls_register_cxx_method(h_class, "object_map_merge",
+			  CLS_METHOD_RD | CLS_METHOD_WR,
+			  object_map_merge, &h_object_map_merge);
   cls_register_cxx_method(h_class, "get_parent",
 			  CLS_METHOD_RD,
 			  get_parent, &h_get_parent);
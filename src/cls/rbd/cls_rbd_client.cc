@@ -451,6 +451,39 @@ namespace librbd {
       return ioctx->exec(oid, "rbd", "copyup", data, out);
     }
 
+    int object_map_update(librados::IoCtx *ioctx, const std::string &oid,
+			  uint64_t start_object_no, uint64_t end_object_no,
+			  uint8_t new_state)
+    {
+      librados::ObjectWriteOperation op;
+      object_map_update(&op, start_object_no, end_object_no, new_state);
+      return ioctx->operate(oid, &op);
+    }
+
+    void object_map_update(librados::ObjectWriteOperation *op,
+			   uint64_t start_object_no, uint64_t end_object_no,
+			   uint8_t new_state)
+    {
+      bufferlist in;
+      ::encode(start_object_no, in);
+      ::encode(end_object_no, in);
+      ::encode(new_state, in);
+      op->exec("rbd", "object_map_update", in);
+    }
+
+    int object_map_merge(librados::IoCtx *ioctx, const std::string &oid,
+			 bufferlist& map)
+    {
+      librados::ObjectWriteOperation op;
+      object_map_merge(&op, map);
+      return ioctx->operate(oid, &op);
+    }
+
+    void object_map_merge(librados::ObjectWriteOperation *op, bufferlist& map)
+    {
+      op->exec("rbd", "object_map_merge", map);
+    }
+
     int get_protection_status(librados::IoCtx *ioctx, const std::string &oid,
 			      snapid_t snap_id, uint8_t *protection_status)
     {
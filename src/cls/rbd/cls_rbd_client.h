@@ -70,6 +70,15 @@ namespace librbd {
 		      std::vector<uint8_t> *protection_statuses);
     int copyup(librados::IoCtx *ioctx, const std::string &oid,
 	       bufferlist data);
+    int object_map_update(librados::IoCtx *ioctx, const std::string &oid,
+			  uint64_t start_object_no, uint64_t end_object_no,
+			  uint8_t new_state);
+    void object_map_update(librados::ObjectWriteOperation *op,
+			   uint64_t start_object_no, uint64_t end_object_no,
+			   uint8_t new_state);
+    int object_map_merge(librados::IoCtx *ioctx, const std::string &oid,
+			 bufferlist& map);
+    void object_map_merge(librados::ObjectWriteOperation *op, bufferlist& map);
     int get_protection_status(librados::IoCtx *ioctx, const std::string &oid,
 			      snapid_t snap_id, uint8_t *protection_status);
     int set_protection_status(librados::IoCtx *ioctx, const std::string &oid,
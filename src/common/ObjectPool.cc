@@ -0,0 +1,107 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <new>
+
+#include "include/assert.h"
+#include "common/ObjectPool.h"
+
+ObjectPool::ObjectPool(size_t size, unsigned batch, unsigned max_batches)
+  : size(size), batch(batch), max_batches(max_batches),
+    depot(NULL), depot_batches(0)
+{
+  assert(size >= sizeof(Node));
+  assert(batch > 0);
+  // plain pthread primitives: pools are built during static init,
+  // before lockdep or any CephContext exists
+  pthread_mutex_init(&lock, NULL);
+  int r = pthread_key_create(&key, put_cache);
+  assert(r == 0);
+}
+
+ObjectPool::Cache *ObjectPool::new_cache()
+{
+  Cache *c = new Cache;
+  c->pool = this;
+  c->head = NULL;
+  c->count = 0;
+  pthread_setspecific(key, c);
+  return c;
+}
+
+void *ObjectPool::refill(Cache *c)
+{
+  pthread_mutex_lock(&lock);
+  Node *b = depot;
+  if (b) {
+    depot = b->next_batch;
+    depot_batches--;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (!b)
+    return ::operator new(size);
+  c->head = b->next;
+  c->count = batch - 1;
+  return b;
+}
+
+void ObjectPool::drain(Cache *c)
+{
+  // split the newest batch off the cache; the rest stays local
+  Node *b = c->head;
+  Node *tail = b;
+  for (unsigned i = 1; i < batch; ++i)
+    tail = tail->next;
+  c->head = tail->next;
+  c->count -= batch;
+  tail->next = NULL;
+
+  pthread_mutex_lock(&lock);
+  if (depot_batches < max_batches) {
+    b->next_batch = depot;
+    depot = b;
+    depot_batches++;
+    b = NULL;
+  }
+  pthread_mutex_unlock(&lock);
+
+  while (b) {
+    Node *n = b->next;
+    ::operator delete(b);
+    b = n;
+  }
+}
+
+unsigned ObjectPool::get_depot_batches()
+{
+  pthread_mutex_lock(&lock);
+  unsigned n = depot_batches;
+  pthread_mutex_unlock(&lock);
+  return n;
+}
+
+void ObjectPool::put_cache(void *p)
+{
+  Cache *c = static_cast<Cache*>(p);
+  ObjectPool *pool = c->pool;
+  while (c->count >= pool->batch)
+    pool->drain(c);
+  while (c->head) {
+    Node *n = c->head->next;
+    ::operator delete(c->head);
+    c->head = n;
+  }
+  delete c;
+}
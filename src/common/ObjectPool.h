@@ -0,0 +1,112 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OBJECTPOOL_H
+#define CEPH_OBJECTPOOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * Thread-safe free lists for one size of object.
+ *
+ * Each thread keeps a small cache of free objects and allocates from
+ * and frees to it without any locking.  When a thread's cache grows
+ * past two batches, one batch is handed to a shared depot; when it runs
+ * dry, it takes a batch from the depot before falling back to malloc.
+ * Objects on the client path are usually freed by a different thread
+ * than the one that allocated them (the messenger finishes what user
+ * threads submit), and the depot is what lets them flow back, at the
+ * cost of one lock per batch instead of one per object.
+ *
+ * A class uses it like the boost::pool in CDentry:
+ *
+ *   static ObjectPool pool;
+ *   static void *operator new(size_t n) { return pool.alloc(n); }
+ *   void operator delete(void *p, size_t n) { pool.free(p, n); }
+ *
+ * Requests for any other size (a derived class) go straight to malloc.
+ * Pools are never destroyed, so objects may still be freed during
+ * static destruction.
+ */
+class ObjectPool {
+  struct Node {
+    Node *next;         ///< next free object in this batch or cache
+    Node *next_batch;   ///< next batch in the depot (first node only)
+  };
+  struct Cache {
+    ObjectPool *pool;
+    Node *head;
+    unsigned count;
+  };
+
+  size_t size;
+  unsigned batch;
+  unsigned max_batches;     ///< cap on batches held by the depot
+  pthread_key_t key;
+  pthread_mutex_t lock;
+  Node *depot;
+  unsigned depot_batches;
+
+  Cache *get_cache() {
+    Cache *c = static_cast<Cache*>(pthread_getspecific(key));
+    if (!c)
+      c = new_cache();
+    return c;
+  }
+  Cache *new_cache();
+  void *refill(Cache *c);
+  void drain(Cache *c);
+  static void put_cache(void *c);
+
+public:
+  /**
+   * @param size bytes per object
+   * @param batch objects moved between a thread and the depot at once
+   * @param max_batches batches the depot holds before freeing the rest
+   */
+  ObjectPool(size_t size, unsigned batch = 32, unsigned max_batches = 64);
+
+  void *alloc(size_t n) {
+    if (n != size)
+      return ::operator new(n);
+    Cache *c = get_cache();
+    if (!c->head)
+      return refill(c);
+    Node *p = c->head;
+    c->head = p->next;
+    c->count--;
+    return p;
+  }
+
+  void free(void *p, size_t n) {
+    if (!p)
+      return;
+    if (n != size) {
+      ::operator delete(p);
+      return;
+    }
+    Cache *c = get_cache();
+    Node *node = static_cast<Node*>(p);
+    node->next = c->head;
+    c->head = node;
+    if (++c->count >= 2 * batch)
+      drain(c);
+  }
+
+  /// batches waiting in the depot
+  unsigned get_depot_batches();
+};
+
+#endif
@@ -0,0 +1,77 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <algorithm>
+
+#include "common/Readahead.h"
+
+Readahead::Readahead()
+  : m_lock("Readahead::m_lock"),
+    m_trigger_requests(10),
+    m_max_readahead_size(0),
+    m_nr_consec_read(0),
+    m_consec_read_bytes(0),
+    m_last_pos(0),
+    m_readahead_pos(0),
+    m_readahead_trigger_pos(0),
+    m_readahead_size(0)
+{
+}
+
+void Readahead::reset()
+{
+  m_nr_consec_read = 0;
+  m_consec_read_bytes = 0;
+  m_readahead_pos = 0;
+  m_readahead_trigger_pos = 0;
+  m_readahead_size = 0;
+}
+
+Readahead::extent_t Readahead::update(uint64_t offset, uint64_t length,
+				      uint64_t limit, read_type_t *type)
+{
+  Mutex::Locker l(m_lock);
+  if (offset != m_last_pos)
+    reset();
+  m_last_pos = offset + length;
+  m_nr_consec_read++;
+  m_consec_read_bytes += length;
+
+  if (m_nr_consec_read < m_trigger_requests || !m_max_readahead_size) {
+    if (type)
+      *type = READ_RANDOM;
+    return extent_t(0, 0);
+  }
+  if (type)
+    *type = m_last_pos <= m_readahead_pos ? READ_SEQ_HIT : READ_SEQ_MISS;
+
+  if (m_last_pos < m_readahead_trigger_pos)
+    return extent_t(0, 0);
+
+  if (m_readahead_size == 0)
+    m_readahead_size = m_consec_read_bytes;
+  else
+    m_readahead_size *= 2;
+  m_readahead_size = std::min(m_readahead_size, m_max_readahead_size);
+
+  uint64_t start = std::max(m_readahead_pos, m_last_pos);
+  uint64_t end = std::min(start + m_readahead_size, limit);
+  if (start >= end)
+    return extent_t(0, 0);
+
+  m_readahead_pos = end;
+  m_readahead_trigger_pos = end - (end - start) / 2;
+  return extent_t(start, end - start);
+}
+
+void Readahead::set_trigger_requests(unsigned trigger_requests)
+{
+  Mutex::Locker l(m_lock);
+  m_trigger_requests = trigger_requests;
+}
+
+void Readahead::set_max_readahead_size(uint64_t max_readahead_size)
+{
+  Mutex::Locker l(m_lock);
+  m_max_readahead_size = max_readahead_size;
+}
@@ -0,0 +1,65 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_READAHEAD_H
+#define CEPH_READAHEAD_H
+
+#include <utility>
+
+#include "include/inttypes.h"
+#include "common/Mutex.h"
+
+/**
+ * Sequential access detection for readahead.
+ *
+ * The caller reports every read with update(), which returns the
+ * extent to prefetch, if any.  Once trigger_requests reads in a row
+ * have each started where the previous one ended, readahead starts
+ * with a window the size of what has been read sequentially so far;
+ * the window doubles each time the reader gets halfway into the
+ * previous one, up to max_readahead_size.  Any other read resets it.
+ */
+class Readahead {
+public:
+  typedef std::pair<uint64_t, uint64_t> extent_t;
+
+  enum read_type_t {
+    READ_RANDOM,    ///< not (yet) part of a sequential stream
+    READ_SEQ_MISS,  ///< sequential, but not covered by readahead
+    READ_SEQ_HIT,   ///< sequential, and already prefetched
+  };
+
+  Readahead();
+
+  /**
+   * Note a read and decide what to prefetch.
+   *
+   * @param offset start of the read
+   * @param length length of the read
+   * @param limit nothing at or past this offset is prefetched
+   * @param type [out] what kind of read this was (optional)
+   * @returns the extent to prefetch; its length is 0 if there is none
+   */
+  extent_t update(uint64_t offset, uint64_t length, uint64_t limit,
+		  read_type_t *type = 0);
+
+  void set_trigger_requests(unsigned trigger_requests);
+  /// 0 disables readahead
+  void set_max_readahead_size(uint64_t max_readahead_size);
+
+private:
+  void reset();
+
+  Mutex m_lock;
+  unsigned m_trigger_requests;
+  uint64_t m_max_readahead_size;
+
+  unsigned m_nr_consec_read;  ///< sequential reads in a row
+  uint64_t m_consec_read_bytes;
+  uint64_t m_last_pos;        ///< where the last read ended
+  uint64_t m_readahead_pos;   ///< end of what has been prefetched
+  uint64_t m_readahead_trigger_pos;  ///< prefetch more once reads pass this
+  uint64_t m_readahead_size;  ///< current window
+};
+
+#endif
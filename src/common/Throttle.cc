@@ -1,3 +1,4 @@
+#include <errno.h>
 
 #include "common/Throttle.h"
 #include "common/dout.h"
@@ -205,3 +206,44 @@ int64_t Throttle::put(int64_t c)
   }
   return count.read();
 }
+
+SimpleThrottle::SimpleThrottle(uint64_t max, bool ignore_enoent)
+  : m_lock("SimpleThrottle"),
+    m_max(max),
+    m_current(0),
+    m_ret(0),
+    m_ignore_enoent(ignore_enoent)
+{
+}
+
+SimpleThrottle::~SimpleThrottle()
+{
+  Mutex::Locker l(m_lock);
+  assert(m_current == 0);
+}
+
+void SimpleThrottle::start_op()
+{
+  Mutex::Locker l(m_lock);
+  while (m_current >= m_max)
+    m_cond.Wait(m_lock);
+  ++m_current;
+}
+
+void SimpleThrottle::end_op(int r)
+{
+  Mutex::Locker l(m_lock);
+  --m_current;
+  if (r < 0 && !m_ret && !(r == -ENOENT && m_ignore_enoent))
+    m_ret = r;
+  // start_op() and wait_for_ret() share the cond
+  m_cond.SignalAll();
+}
+
+int SimpleThrottle::wait_for_ret()
+{
+  Mutex::Locker l(m_lock);
+  while (m_current > 0)
+    m_cond.Wait(m_lock);
+  return m_ret;
+}
@@ -8,6 +8,7 @@
 #include "Cond.h"
 #include <list>
 #include "include/atomic.h"
+#include "include/Context.h"
 
 class CephContext;
 class PerfCounters;
@@ -58,5 +59,40 @@ public:
   int64_t put(int64_t c = 1);
 };
 
+/**
+ * Limit the number of outstanding asynchronous operations.
+ *
+ * start_op() blocks while max ops are in flight; end_op() is called
+ * when one completes (usually via C_SimpleThrottle).  wait_for_ret()
+ * waits for all of them and returns the first error seen.
+ */
+class SimpleThrottle {
+public:
+  SimpleThrottle(uint64_t max, bool ignore_enoent);
+  ~SimpleThrottle();
+  void start_op();
+  void end_op(int r);
+  int wait_for_ret();
+private:
+  Mutex m_lock;
+  Cond m_cond;
+  uint64_t m_max;
+  uint64_t m_current;
+  int m_ret;
+  bool m_ignore_enoent;
+};
+
+class C_SimpleThrottle : public Context {
+public:
+  C_SimpleThrottle(SimpleThrottle *throttle) : m_throttle(throttle) {
+    m_throttle->start_op();
+  }
+  virtual void finish(int r) {
+    m_throttle->end_op(r);
+  }
+private:
+  SimpleThrottle *m_throttle;
+};
+
 
 #endif
@@ -770,6 +770,7 @@ bool buffer_track_alloc = get_env_bool("CEPH_BUFFER_TRACK");
     }
     _buffers.clear();
     _buffers.push_back(nb);
+    last_p = begin();
   }
 
 void buffer::list::rebuild_page_aligned()
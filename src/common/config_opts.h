@@ -200,6 +200,7 @@ OPTION(paxos_stash_full_interval, OPT_INT, 25)   // how often (in commits) to st
 OPTION(paxos_max_join_drift, OPT_INT, 10) // max paxos iterations before we must first sync the monitor stores
 OPTION(paxos_propose_interval, OPT_DOUBLE, 1.0)  // gather updates for this long before proposing a map update
 OPTION(paxos_min_wait, OPT_DOUBLE, 0.05)  // min time to gather updates for after period of inactivity
+OPTION(paxos_max_batch_proposals, OPT_INT, 32)  // max queued proposals to commit in a single paxos round (0 = no limit)
 OPTION(paxos_trim_min, OPT_INT, 500)  // number of extra proposals tolerated before trimming
 OPTION(paxos_trim_max, OPT_INT, 1000) // max number of extra proposals to trim at a time
 OPTION(paxos_trim_disabled_max_versions, OPT_INT, 100) // maximum amount of versions we shall allow passing by without trimming
@@ -384,6 +385,7 @@ OPTION(osd_pool_default_flags, OPT_INT, 0)   // default flags for new pools
 OPTION(osd_map_dedup, OPT_BOOL, true)
 OPTION(osd_map_cache_size, OPT_INT, 500)
 OPTION(osd_map_message_max, OPT_INT, 100)  // max maps per MOSDMap message
+OPTION(osd_map_message_cache_size, OPT_INT, 50)  // encoded MOSDMap messages to keep (mon and osd)
 OPTION(osd_op_threads, OPT_INT, 2)    // 0 == no threading
 OPTION(osd_op_pq_max_tokens_per_priority, OPT_U64, 4194304)
 OPTION(osd_op_pq_min_cost, OPT_U64, 65536)
@@ -486,6 +488,8 @@ OPTION(filestore_index_retry_probability, OPT_DOUBLE, 0)
 OPTION(filestore_debug_inject_read_err, OPT_BOOL, false)
 
 OPTION(filestore_debug_omap_check, OPT_BOOL, 0) // Expensive debugging check on sync
+OPTION(filestore_omap_header_cache_size, OPT_INT, 1024) // decoded omap headers to keep in DBObjectMap
+OPTION(filestore_omap_batch, OPT_BOOL, false) // one omap db transaction per _do_transactions
 // Use omap for xattrs for attrs over
 OPTION(filestore_xattr_use_omap, OPT_BOOL, false)
 // filestore_max_inline_xattr_size or
@@ -502,6 +506,19 @@ OPTION(filestore_fiemap, OPT_BOOL, false)     // (try to) use fiemap
 OPTION(filestore_flusher, OPT_BOOL, true)
 OPTION(filestore_flusher_max_fds, OPT_INT, 512)
 OPTION(filestore_flush_min, OPT_INT, 65536)
+OPTION(filestore_fd_cache_size, OPT_INT, 128)  // open object fds to keep around
+OPTION(filestore_fd_cache_shards, OPT_INT, 16)  // lock shards in the fd cache
+OPTION(filestore_read_pool_bytes, OPT_U64, 0)  // page-aligned buffers kept for large reads; 0 = off
+OPTION(filestore_read_pool_min, OPT_INT, 65536)  // reads at least this big use the pooled buffers
+OPTION(filestore_read_pool_max, OPT_INT, 4 << 20)  // largest buffer kept in the pool
+OPTION(filestore_read_direct, OPT_BOOL, false)  // O_DIRECT for page-aligned pooled reads
+OPTION(filestore_direct_fd_cache_size, OPT_INT, 32)  // O_DIRECT fds to keep around for those, on top of filestore_fd_cache_size
+OPTION(filestore_wbthrottle_enable, OPT_BOOL, false)  // size dirty data to measured sync bandwidth
+OPTION(filestore_wbthrottle_target_latency, OPT_DOUBLE, 1.0)  // seconds a commit should take at most
+OPTION(filestore_wbthrottle_min_bytes, OPT_U64, 16 << 20)  // dirty limit floor
+OPTION(filestore_wbthrottle_max_bytes, OPT_U64, 1024 << 20)  // dirty limit cap; also the limit before the first measured commit
+OPTION(filestore_wbthrottle_flush_ratio, OPT_DOUBLE, .25)  // start writeback on every write past this fraction of the limit
+OPTION(filestore_wbthrottle_max_delay, OPT_DOUBLE, .1)  // per-op delay once dirty data reaches twice the limit
 OPTION(filestore_sync_flush, OPT_BOOL, false)
 OPTION(filestore_journal_parallel, OPT_BOOL, false)
 OPTION(filestore_journal_writeahead, OPT_BOOL, false)
@@ -517,6 +534,11 @@ OPTION(filestore_commit_timeout, OPT_FLOAT, 600)
 OPTION(filestore_fiemap_threshold, OPT_INT, 4096)
 OPTION(filestore_merge_threshold, OPT_INT, 10)
 OPTION(filestore_split_multiple, OPT_INT, 2)
+OPTION(filestore_index_cache_layout, OPT_BOOL, true) // keep HashIndex subdir trees in memory
+OPTION(filestore_split_background, OPT_BOOL, true)  // split subdirs in a background thread rather than in the op
+OPTION(filestore_split_ops_per_sec, OPT_INT, 1000)  // object link+unlink budget for background splits; 0 = unlimited
+OPTION(filestore_split_inline_fill, OPT_DOUBLE, 4)  // split inline anyway once a subdir is this many times over its split threshold
+OPTION(filestore_pre_split_objects, OPT_U64, 0)     // pre-create hash levels for this many objects in each new collection
 OPTION(filestore_update_to, OPT_INT, 1000)
 OPTION(filestore_blackhole, OPT_BOOL, false)     // drop any new transactions on the floor
 OPTION(filestore_dump_file, OPT_STR, "")         // file onto which store transaction dumps
@@ -539,6 +561,8 @@ OPTION(journal_queue_max_ops, OPT_INT, 300)
 OPTION(journal_queue_max_bytes, OPT_INT, 32 << 20)
 OPTION(journal_align_min_size, OPT_INT, 64 << 10)  // align data payloads >= this.
 OPTION(journal_replay_from, OPT_INT, 0)
+OPTION(journal_replay_threads, OPT_INT, 4)  // apply independent collections' entries in parallel on replay; <= 1 = serial
+OPTION(journal_replay_max_in_flight, OPT_INT, 1024)  // decoded entries waiting to be applied
 OPTION(journal_zero_on_create, OPT_BOOL, false)
 OPTION(journal_ignore_corruption, OPT_BOOL, false) // assume journal is not corrupt
 
@@ -549,6 +573,15 @@ OPTION(rbd_cache_max_dirty, OPT_LONGLONG, 24<<20)    // dirty limit in bytes - s
 OPTION(rbd_cache_target_dirty, OPT_LONGLONG, 16<<20) // target dirty limit in bytes
 OPTION(rbd_cache_max_dirty_age, OPT_FLOAT, 1.0)      // seconds in cache before writeback starts
 OPTION(rbd_cache_block_writes_upfront, OPT_BOOL, false) // whether to block writes to the cache before the aio_write call completes (true), or block before the aio completion is called (false)
+OPTION(rbd_cache_write_around_bytes, OPT_LONGLONG, 0) // writes at least this large skip the cache and go straight to the OSDs (0 disables)
+OPTION(rbd_cache_write_around_sequential, OPT_INT, 0) // writes after this many sequential writes in a row skip the cache (0 disables)
+OPTION(rbd_cache_shards, OPT_INT, 1) // split the cache by object into this many parts, each with its own lock and an equal share of the size; the dirty limits apply to them all together
+OPTION(rbd_write_log_path, OPT_STR, "") // directory for persistent local write-back logs, one file per image; used instead of rbd_cache (empty disables). While a process has an image's log open, nothing else may open the image for writing
+OPTION(rbd_write_log_size, OPT_LONGLONG, 1<<30) // size of each new write log file; existing ones keep theirs
+OPTION(rbd_write_log_max_in_flight, OPT_INT, 32) // writes from the log to the OSDs in flight at a time
+OPTION(rbd_readahead_trigger_requests, OPT_INT, 10) // number of sequential requests necessary to trigger readahead
+OPTION(rbd_readahead_max_bytes, OPT_LONGLONG, 512 * 1024) // largest readahead window; 0 disables readahead (only done with rbd_cache)
+OPTION(rbd_concurrent_management_ops, OPT_INT, 10) // how many operations (e.g. reads for export and export-diff, writes for import and import-diff, object removals for resize and rm) a single rbd call keeps in flight
 
 /*
  * The following options change the behavior for librbd's image creation methods that
@@ -570,7 +603,7 @@ OPTION(rbd_default_format, OPT_INT, 1)
 OPTION(rbd_default_order, OPT_INT, 22)
 OPTION(rbd_default_stripe_count, OPT_U64, 1) // changing requires stripingv2 feature
 OPTION(rbd_default_stripe_unit, OPT_U64, 4194304) // changing to non-object size requires stripingv2 feature
-OPTION(rbd_default_features, OPT_INT, 3) // 1 for layering, 3 for layering+stripingv2. only applies to format 2 images
+OPTION(rbd_default_features, OPT_INT, 3) // 1 for layering, 3 for layering+stripingv2, add 4 for an object map. only applies to format 2 images
 
 OPTION(nss_db_path, OPT_STR, "") // path to nss db
 
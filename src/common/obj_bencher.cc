@@ -204,7 +204,7 @@ int ObjBencher::aio_bench(int operation, int secondsToRun, int concurrentios, in
   sanitize_object_contents(&data, data.object_size);
 
   if (OP_WRITE == operation) {
-    r = write_bench(secondsToRun, concurrentios);
+    r = write_bench(secondsToRun, concurrentios, batch);
     if (r != 0) goto out;
   }
   else if (OP_SEQ_READ == operation) {
@@ -297,19 +297,31 @@ int ObjBencher::fetch_bench_metadata(const std::string& metadata_file, int* obje
   return 0;
 }
 
-int ObjBencher::write_bench(int secondsToRun, int concurrentios) {
-  out(cout) << "Maintaining " << concurrentios << " concurrent writes of "
-       << data.object_size << " bytes for at least "
-       << secondsToRun << " seconds." << std::endl;
-  bufferlist* newContents = 0;
+/*
+ * Each of the concurrentios slots writes batch_size objects at a time;
+ * more than one goes out as a single aio_write_batch with one completion.
+ */
+int ObjBencher::write_bench(int secondsToRun, int concurrentios,
+			    int batch_size) {
+  if (batch_size > 1)
+    out(cout) << "Maintaining " << concurrentios << " concurrent batches of "
+	      << batch_size << " writes of " << data.object_size
+	      << " bytes for at least " << secondsToRun << " seconds."
+	      << std::endl;
+  else
+    out(cout) << "Maintaining " << concurrentios << " concurrent writes of "
+	      << data.object_size << " bytes for at least "
+	      << secondsToRun << " seconds." << std::endl;
 
   std::string prefix = generate_object_prefix();
   out(cout) << "Object prefix: " << prefix << std::endl;
 
-  std::vector<string> name(concurrentios);
-  std::string newName;
-  bufferlist* contents[concurrentios];
+  std::vector<std::vector<string> > name(concurrentios,
+					 std::vector<string>(batch_size));
+  std::vector<std::vector<bufferlist> > contents(
+    concurrentios, std::vector<bufferlist>(batch_size));
   double total_latency = 0;
+  int completed = 0;
   std::vector<utime_t> start_times(concurrentios);
   utime_t stopTime;
   int r = 0;
@@ -317,112 +329,98 @@ int ObjBencher::write_bench(int secondsToRun, int concurrentios) {
   lock_cond lc(&lock);
   utime_t runtime;
   utime_t timePassed;
+  int slot = 0;
 
   r = completions_init(concurrentios);
 
-  //set up writes so I can start them together
-  for (int i = 0; i<concurrentios; ++i) {
-    name[i] = generate_object_name(i);
-    contents[i] = new bufferlist();
-    snprintf(data.object_contents, data.object_size, "I'm the %16dth object!", i);
-    contents[i]->append(data.object_contents, data.object_size);
-  }
-
   pthread_t print_thread;
 
   pthread_create(&print_thread, NULL, ObjBencher::status_printer, (void *)this);
   lock.Lock();
   data.start_time = ceph_clock_now(g_ceph_context);
   lock.Unlock();
-  for (int i = 0; i<concurrentios; ++i) {
-    start_times[i] = ceph_clock_now(g_ceph_context);
-    r = create_completion(i, _aio_cb, (void *)&lc);
-    if (r < 0)
-      goto ERR;
-    r = aio_write(name[i], i, *contents[i], data.object_size);
-    if (r < 0) { //naughty, doesn't clean up heap
-      goto ERR;
-    }
-    lock.Lock();
-    ++data.started;
-    ++data.in_flight;
-    lock.Unlock();
-  }
-
-  //keep on adding new writes as old ones complete until we've passed minimum time
-  int slot;
-
-  //don't need locking for reads because other thread doesn't write
-
   runtime.set_from_double(secondsToRun);
   stopTime = data.start_time + runtime;
-  slot = 0;
-  while( ceph_clock_now(g_ceph_context) < stopTime ) {
-    lock.Lock();
-    bool found = false;
-    while (1) {
-      int old_slot = slot;
-      do {
-	if (completion_is_done(slot)) {
-          found = true;
+
+  //start a write in every slot, then keep on adding new writes as old
+  //ones complete until we've passed minimum time
+  for (int i = 0; ; ++i) {
+    if (i < concurrentios) {
+      slot = i;
+    } else {
+      if (ceph_clock_now(g_ceph_context) >= stopTime)
+	break;
+      lock.Lock();
+      bool found = false;
+      while (1) {
+	int old_slot = slot;
+	do {
+	  if (completion_is_done(slot)) {
+	    found = true;
+	    break;
+	  }
+	  slot++;
+	  if (slot == concurrentios) {
+	    slot = 0;
+	  }
+	} while (slot != old_slot);
+	if (found)
 	  break;
-	}
-        slot++;
-        if (slot == concurrentios) {
-          slot = 0;
-        }
-      } while (slot != old_slot);
-      if (found)
-        break;
-      lc.cond.Wait(lock);
+	lc.cond.Wait(lock);
+      }
+      lock.Unlock();
     }
-    lock.Unlock();
-    //create new contents and name on the heap, and fill them
-    newContents = new bufferlist();
-    newName = generate_object_name(data.started);
-    snprintf(data.object_contents, data.object_size, "I'm the %16dth object!", data.started);
-    newContents->append(data.object_contents, data.object_size);
-    completion_wait(slot);
-    lock.Lock();
-    r = completion_ret(slot);
-    if (r != 0) {
+
+    //fill in the next objects' names and contents
+    for (int j = 0; j < batch_size; ++j) {
+      int n = data.started + j;
+      name[slot][j] = generate_object_name(n);
+      snprintf(data.object_contents, data.object_size, "I'm the %16dth object!", n);
+      contents[slot][j].clear();
+      contents[slot][j].append(data.object_contents, data.object_size);
+    }
+
+    if (i >= concurrentios) {
+      completion_wait(slot);
+      lock.Lock();
+      r = completion_ret(slot);
+      if (r != 0) {
+	lock.Unlock();
+	goto ERR;
+      }
+      data.cur_latency = ceph_clock_now(g_ceph_context) - start_times[slot];
+      data.history.latency.push_back(data.cur_latency);
+      total_latency += data.cur_latency;
+      if( data.cur_latency > data.max_latency) data.max_latency = data.cur_latency;
+      if (data.cur_latency < data.min_latency) data.min_latency = data.cur_latency;
+      data.finished += batch_size;
+      data.avg_latency = total_latency / ++completed;
+      data.in_flight -= batch_size;
       lock.Unlock();
-      goto ERR;
+      release_completion(slot);
     }
-    data.cur_latency = ceph_clock_now(g_ceph_context) - start_times[slot];
-    data.history.latency.push_back(data.cur_latency);
-    total_latency += data.cur_latency;
-    if( data.cur_latency > data.max_latency) data.max_latency = data.cur_latency;
-    if (data.cur_latency < data.min_latency) data.min_latency = data.cur_latency;
-    ++data.finished;
-    data.avg_latency = total_latency / data.finished;
-    --data.in_flight;
-    lock.Unlock();
-    release_completion(slot);
-    timePassed = ceph_clock_now(g_ceph_context) - data.start_time;
 
-    //write new stuff to backend, then delete old stuff
-    //and save locations of new stuff for later deletion
+    //write new stuff to backend
     start_times[slot] = ceph_clock_now(g_ceph_context);
-    r = create_completion(slot, _aio_cb, &lc);
+    r = create_completion(slot, _aio_cb, (void *)&lc);
     if (r < 0)
       goto ERR;
-    r = aio_write(newName, slot, *newContents, data.object_size);
-    if (r < 0) {//naughty; doesn't clean up heap space.
+    if (batch_size > 1)
+      r = aio_write_batch(name[slot], slot, contents[slot], data.object_size);
+    else
+      r = aio_write(name[slot][0], slot, contents[slot][0], data.object_size);
+    if (r < 0) {
+      release_completion(slot);
       goto ERR;
     }
     lock.Lock();
-    ++data.started;
-    ++data.in_flight;
+    data.started += batch_size;
+    data.in_flight += batch_size;
     lock.Unlock();
-    delete contents[slot];
-    name[slot] = newName;
-    contents[slot] = newContents;
-    newContents = 0;
   }
 
-  while (data.finished < data.started) {
-    slot = data.finished % concurrentios;
+  //every slot has one write in flight
+  for (slot = 0; slot < concurrentios; ++slot) {
     completion_wait(slot);
     lock.Lock();
     r = completion_ret(slot);
@@ -435,12 +433,11 @@ int ObjBencher::write_bench(int secondsToRun, int concurrentios) {
     total_latency += data.cur_latency;
     if (data.cur_latency > data.max_latency) data.max_latency = data.cur_latency;
     if (data.cur_latency < data.min_latency) data.min_latency = data.cur_latency;
-    ++data.finished;
-    data.avg_latency = total_latency / data.finished;
-    --data.in_flight;
+    data.finished += batch_size;
+    data.avg_latency = total_latency / ++completed;
+    data.in_flight -= batch_size;
     lock.Unlock();
     release_completion(slot);
-    delete contents[slot];
   }
 
   timePassed = ceph_clock_now(g_ceph_context) - data.start_time;
@@ -458,12 +455,16 @@ int ObjBencher::write_bench(int secondsToRun, int concurrentios) {
 
   out(cout) << "Total time run:         " << timePassed << std::endl
        << "Total writes made:      " << data.finished << std::endl
-       << "Write size:             " << data.object_size << std::endl
-       << "Bandwidth (MB/sec):     " << bw << std::endl
+       << "Write size:             " << data.object_size << std::endl;
+  if (batch_size > 1)
+    out(cout) << "Batch size:             " << batch_size << std::endl
+	 << "Writes/sec:             " << (double)data.finished / (double)timePassed << std::endl;
+  out(cout) << "Bandwidth (MB/sec):     " << bw << std::endl
        << "Stddev Bandwidth:       " << vec_stddev(data.history.bandwidth) << std::endl
        << "Max bandwidth (MB/sec): " << data.idata.max_bandwidth << std::endl
        << "Min bandwidth (MB/sec): " << data.idata.min_bandwidth << std::endl
-       << "Average Latency:        " << data.avg_latency << std::endl
+       << (batch_size > 1 ? "Average Batch Latency:  " : "Average Latency:        ")
+       << data.avg_latency << std::endl
        << "Stddev Latency:         " << vec_stddev(data.history.latency) << std::endl
        << "Max latency:            " << data.max_latency << std::endl
        << "Min latency:            " << data.min_latency << std::endl;
@@ -488,7 +489,8 @@ int ObjBencher::write_bench(int secondsToRun, int concurrentios) {
   data.done = 1;
   lock.Unlock();
   pthread_join(print_thread, NULL);
-  delete newContents;
+  if (r == -EOPNOTSUPP)
+    cerr << "batched writes are not supported here" << std::endl;
   return -5;
 }
 
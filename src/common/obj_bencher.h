@@ -17,6 +17,8 @@
 #include "common/config.h"
 #include "common/Cond.h"
 
+#include <errno.h>
+
 struct bench_interval_data {
   double min_bandwidth;
   double max_bandwidth;
@@ -51,6 +53,7 @@ const int OP_RAND_READ = 3;
 
 class ObjBencher {
   bool show_time;
+  int batch;
 protected:
   Mutex lock;
 
@@ -60,7 +63,7 @@ protected:
 
   int fetch_bench_metadata(const std::string& metadata_file, int* object_size, int* num_objects, int* prevPid);
 
-  int write_bench(int secondsToRun, int concurrentios);
+  int write_bench(int secondsToRun, int concurrentios, int batch_size);
   int seq_read_bench(int secondsToRun, int concurrentios, int num_objects, int writePid);
 
   int clean_up(int num_objects, int prevPid, int concurrentios);
@@ -80,6 +83,11 @@ protected:
   virtual int aio_read(const std::string& oid, int slot, bufferlist *pbl, size_t len) = 0;
   virtual int aio_write(const std::string& oid, int slot, bufferlist& bl, size_t len) = 0;
   virtual int aio_remove(const std::string& oid, int slot) = 0;
+  /// write each of oids with the matching bls, completing slot once
+  virtual int aio_write_batch(const std::vector<std::string>& oids, int slot,
+			      std::vector<bufferlist>& bls, size_t len) {
+    return -EOPNOTSUPP;
+  }
   virtual int sync_read(const std::string& oid, bufferlist& bl, size_t len) = 0;
   virtual int sync_write(const std::string& oid, bufferlist& bl, size_t len) = 0;
   virtual int sync_remove(const std::string& oid) = 0;
@@ -89,7 +97,7 @@ protected:
   ostream& out(ostream& os);
   ostream& out(ostream& os, utime_t& t);
 public:
-  ObjBencher() : show_time(false), lock("ObjBencher::lock") {}
+  ObjBencher() : show_time(false), batch(1), lock("ObjBencher::lock") {}
   virtual ~ObjBencher() {}
   int aio_bench(int operation, int secondsToRun, int concurrentios, int op_size, bool cleanup);
   int clean_up(const std::string& prefix, int concurrentios);
@@ -97,6 +105,10 @@ public:
   void set_show_time(bool dt) {
     show_time = dt;
   }
+  /// have each write slot write this many objects at once
+  void set_batch(int b) {
+    batch = b;
+  }
 };
 
 
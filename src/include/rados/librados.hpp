@@ -232,6 +232,13 @@ namespace librados
      */
     void omap_rm_keys(const std::set<std::string> &to_rm);
 
+    /**
+     * Roll the object back to a self-managed snapshot
+     *
+     * @param snapid [in] snapshot to roll back to
+     */
+    void selfmanaged_snap_rollback(uint64_t snapid);
+
     friend class IoCtx;
   };
 
@@ -582,6 +589,34 @@ namespace librados
 		    std::vector<snap_t>& snaps);
     int aio_operate(const std::string& oid, AioCompletion *c, ObjectReadOperation *op,
 		    bufferlist *pbl);
+    /**
+     * Schedule write operations on many objects at once
+     *
+     * Targets for all the ops are computed together and the ops for
+     * each OSD are sent back to back, which is much cheaper than one
+     * aio_operate() per object when the objects are small.  The ops
+     * are still independent of each other: each one may succeed or
+     * fail on its own, in any order.
+     *
+     * @param c complete once every op is complete, and safe once every
+     *          op is safe; its return value is the first error seen, or 0
+     * @param ops the objects to operate on, and what to do to each
+     * @returns 0 on success, negative error code on failure
+     */
+    int aio_operate_batch(AioCompletion *c,
+	std::vector<std::pair<std::string, ObjectWriteOperation*> >& ops);
+    /**
+     * Schedule read operations on many objects at once
+     *
+     * Results go wherever each ObjectReadOperation was told to put them.
+     *
+     * @param c complete once every op is complete; its return value is
+     *          the first error seen, or 0
+     * @param ops the objects to operate on, and what to read from each
+     * @returns 0 on success, negative error code on failure
+     */
+    int aio_operate_batch(AioCompletion *c,
+	std::vector<std::pair<std::string, ObjectReadOperation*> >& ops);
 
     // watch/notify
     int watch(const std::string& o, uint64_t ver, uint64_t *handle,
@@ -347,7 +347,8 @@ int rbd_read_iterate2(rbd_image_t image, uint64_t ofs, uint64_t len,
  * @param fromsnapname start snapshot name, or NULL
  * @param ofs start offset
  * @param len len in bytes of region to report on
- * @param cb callback to call for each allocated region
+ * @param cb callback to call for each allocated region; if it returns
+ * a negative error code, iteration stops and that is returned
  * @param arg argument to pass to the callback
  * @returns 0 on success, or negative error code on error
  */
@@ -27,11 +27,16 @@
  *   rbd_data.<id>.00000000
  *   rbd_data.<id>.00000001
  *   ...                     - data
+ *   rbd_object_map.<id>     - which data objects exist (object map feature)
+ *   rbd_object_map.<id>.<snapid> - the same, for each snapshot; only
+ *                             trusted once it has the sealed xattr
  */
 
 #define RBD_HEADER_PREFIX      "rbd_header."
 #define RBD_DATA_PREFIX        "rbd_data."
 #define RBD_ID_PREFIX          "rbd_id."
+#define RBD_OBJECT_MAP_PREFIX  "rbd_object_map."
+#define RBD_OBJECT_MAP_SEALED  "rbd.sealed"
 
 /*
  * old-style rbd image 'foo' consists of objects
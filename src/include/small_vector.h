@@ -0,0 +1,139 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_SMALL_VECTOR_H
+#define CEPH_SMALL_VECTOR_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+#include "include/assert.h"
+
+/*
+ * A vector of plain old data (pointers, ints) that holds its first N
+ * elements inline and only goes to the heap beyond that.  Elements are
+ * moved with memcpy and never constructed or destroyed, so T must be
+ * POD.  Only the bits of the std::vector interface we use are here.
+ */
+template<typename T, unsigned N>
+class small_vector {
+  T *data;
+  unsigned len, cap;
+  T inline_data[N];
+
+  void grow(unsigned n) {
+    unsigned c = cap * 2;
+    if (c < n)
+      c = n;
+    T *d = static_cast<T*>(malloc(sizeof(T) * c));
+    if (!d)
+      throw std::bad_alloc();
+    memcpy(d, data, sizeof(T) * len);
+    if (data != inline_data)
+      ::free(data);
+    data = d;
+    cap = c;
+  }
+
+public:
+  typedef T value_type;
+  typedef T* iterator;
+  typedef const T* const_iterator;
+
+  small_vector() : data(inline_data), len(0), cap(N) {}
+  explicit small_vector(unsigned n)
+    : data(inline_data), len(0), cap(N) {
+    resize(n);
+  }
+  small_vector(const small_vector& o)
+    : data(inline_data), len(0), cap(N) {
+    *this = o;
+  }
+  ~small_vector() {
+    if (data != inline_data)
+      ::free(data);
+  }
+
+  small_vector& operator=(const small_vector& o) {
+    if (this != &o) {
+      if (o.len > cap)
+	grow(o.len);
+      memcpy(data, o.data, sizeof(T) * o.len);
+      len = o.len;
+    }
+    return *this;
+  }
+
+  unsigned size() const { return len; }
+  bool empty() const { return len == 0; }
+
+  iterator begin() { return data; }
+  iterator end() { return data + len; }
+  const_iterator begin() const { return data; }
+  const_iterator end() const { return data + len; }
+
+  T& operator[](unsigned i) { return data[i]; }
+  const T& operator[](unsigned i) const { return data[i]; }
+  T& back() { assert(len); return data[len - 1]; }
+
+  /// new elements are zeroed
+  void resize(unsigned n) {
+    if (n > cap)
+      grow(n);
+    if (n > len)
+      memset(data + len, 0, sizeof(T) * (n - len));
+    len = n;
+  }
+  void push_back(const T& v) {
+    if (len == cap)
+      grow(len + 1);
+    data[len++] = v;
+  }
+  void pop_back() {
+    assert(len);
+    len--;
+  }
+  void clear() {
+    len = 0;
+  }
+  iterator erase(iterator p) {
+    assert(p >= begin() && p < end());
+    memmove(p, p + 1, sizeof(T) * (end() - p - 1));
+    len--;
+    return p;
+  }
+
+  void swap(small_vector& o) {
+    if (data != inline_data && o.data != o.inline_data) {
+      T *d = data;
+      data = o.data;
+      o.data = d;
+      unsigned c = cap;
+      cap = o.cap;
+      o.cap = c;
+    } else {
+      // at least one side is inline: go through a temporary
+      small_vector t(o);
+      o = *this;
+      *this = t;
+      return;
+    }
+    unsigned l = len;
+    len = o.len;
+    o.len = l;
+  }
+};
+
+#endif
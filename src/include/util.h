@@ -11,7 +11,7 @@
  * Foundation.  See file COPYING.
  */
 
-// is buf~len completely zero (in 8-byte chunks)
+// is buf~len completely zero
 
 #include "include/types.h"
 
@@ -17,6 +17,7 @@
 
 #include "common/Cond.h"
 #include "common/Mutex.h"
+#include "common/ObjectPool.h"
 
 #include "include/buffer.h"
 #include "include/rados/librados.h"
@@ -53,6 +54,16 @@ struct librados::AioCompletionImpl {
 			is_read(false), pbl(0), buf(0), maxlen(0),
 			io(NULL), aio_write_seq(0), aio_write_list_item(this) { }
 
+  // created by the caller's thread, usually released from a callback
+  // on the messenger's; see ObjectPool
+  static ObjectPool pool;
+  static void *operator new(size_t num_bytes) {
+    return pool.alloc(num_bytes);
+  }
+  void operator delete(void *p, size_t num_bytes) {
+    pool.free(p, num_bytes);
+  }
+
   int set_complete_callback(void *cb_arg, rados_callback_t cb) {
     lock.Lock();
     callback_complete = cb;
@@ -25,6 +25,13 @@
 #undef dout_prefix
 #define dout_prefix *_dout << "librados: "
 
+ObjectPool librados::AioCompletionImpl::pool(
+  sizeof(librados::AioCompletionImpl));
+ObjectPool librados::IoCtxImpl::C_aio_Ack::pool(
+  sizeof(librados::IoCtxImpl::C_aio_Ack));
+ObjectPool librados::IoCtxImpl::C_aio_Safe::pool(
+  sizeof(librados::IoCtxImpl::C_aio_Safe));
+
 librados::IoCtxImpl::IoCtxImpl() :
   ref_cnt(0), client(NULL), poolid(0), assert_ver(0), notify_timeout(30),
   aio_write_list_lock("librados::IoCtxImpl::aio_write_list_lock"),
@@ -393,11 +400,9 @@ int librados::IoCtxImpl::create(const object_t& oid, bool exclusive)
 
   Context *onack = new C_SafeCond(&mylock, &cond, &done, &r);
 
-  lock->Lock();
   objecter->create(oid, oloc,
 		  snapc, ut, 0, (exclusive ? CEPH_OSD_OP_FLAG_EXCL : 0),
 		  onack, NULL, &ver);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -429,9 +434,7 @@ int librados::IoCtxImpl::create(const object_t& oid, bool exclusive,
   ::ObjectOperation o;
   o.create(exclusive ? CEPH_OSD_OP_FLAG_EXCL : 0, category);
 
-  lock->Lock();
   objecter->mutate(oid, oloc, o, snapc, ut, 0, onack, NULL, &ver);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -491,11 +494,9 @@ int librados::IoCtxImpl::write(const object_t& oid, bufferlist& bl,
   ::ObjectOperation op;
   ::ObjectOperation *pop = prepare_assert_ops(&op);
 
-  lock->Lock();
   objecter->write(oid, oloc,
 		  off, len, snapc, bl, ut, 0,
 		  onack, NULL, &ver, pop);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -529,11 +530,9 @@ int librados::IoCtxImpl::append(const object_t& oid, bufferlist& bl, size_t len)
   ::ObjectOperation op;
   ::ObjectOperation *pop = prepare_assert_ops(&op);
 
-  lock->Lock();
   objecter->append(oid, oloc,
 		   len, snapc, bl, ut, 0,
 		   onack, NULL, &ver, pop);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -568,11 +567,9 @@ int librados::IoCtxImpl::write_full(const object_t& oid, bufferlist& bl)
   ::ObjectOperation op;
   ::ObjectOperation *pop = prepare_assert_ops(&op);
 
-  lock->Lock();
   objecter->write_full(oid, oloc,
 		       snapc, bl, ut, 0,
 		       onack, NULL, &ver, pop);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -605,12 +602,10 @@ int librados::IoCtxImpl::clone_range(const object_t& dst_oid,
 
   bufferlist outbl;
 
-  lock->Lock();
   ::ObjectOperation wr;
   prepare_assert_ops(&wr);
   wr.clone_range(src_oid, src_offset, len, dst_offset);
   objecter->mutate(dst_oid, oloc, wr, snapc, ut, 0, onack, NULL, &ver);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -647,11 +642,9 @@ int librados::IoCtxImpl::operate(const object_t& oid, ::ObjectOperation *o,
 
   Context *onack = new C_SafeCond(&mylock, &cond, &done, &r);
 
-  lock->Lock();
   objecter->mutate(oid, oloc,
 	           *o, snapc, ut, 0,
 	           onack, NULL, &ver);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -677,11 +670,9 @@ int librados::IoCtxImpl::operate_read(const object_t& oid,
 
   Context *onack = new C_SafeCond(&mylock, &cond, &done, &r);
 
-  lock->Lock();
   objecter->read(oid, oloc,
 	           *o, snap_seq, pbl, 0,
 	           onack, &ver);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -703,7 +694,6 @@ int librados::IoCtxImpl::aio_operate_read(const object_t &oid,
   c->io = this;
   c->pbl = pbl;
 
-  Mutex::Locker l(*lock);
   objecter->read(oid, oloc,
 		 *o, snap_seq, pbl, 0,
 		 onack, &c->objver);
@@ -725,13 +715,65 @@ int librados::IoCtxImpl::aio_operate(const object_t& oid,
   c->io = this;
   queue_aio_write(c);
 
-  Mutex::Locker l(*lock);
   objecter->mutate(oid, oloc, *o, snap_context, ut, 0, onack, oncommit,
 		   &c->objver);
 
   return 0;
 }
 
+int librados::IoCtxImpl::aio_operate_batch(
+  vector<pair<object_t, ::ObjectOperation*> >& ops,
+  AioCompletionImpl *c, bool write)
+{
+  utime_t ut = ceph_clock_now(client->cct);
+  /* can't write to a snapshot */
+  if (write && snap_seq != CEPH_NOSNAP)
+    return -EROFS;
+
+  c->io = this;
+  if (write)
+    queue_aio_write(c);
+  else
+    c->is_read = true;
+
+  // c completes when the last op does
+  Context *onack = new C_aio_Ack(c);
+  Context *oncommit = write ? new C_aio_Safe(c) : NULL;
+  if (ops.empty()) {
+    onack->complete(0);
+    if (oncommit)
+      oncommit->complete(0);
+    return 0;
+  }
+  C_GatherBuilder ack_gather(client->cct, onack);
+  C_GatherBuilder commit_gather(client->cct, oncommit);
+
+  // the ops may finish in any order, from different threads, so they
+  // don't report an object version
+  vector<Objecter::Op*> batch;
+  batch.reserve(ops.size());
+  for (vector<pair<object_t, ::ObjectOperation*> >::iterator p = ops.begin();
+       p != ops.end();
+       ++p) {
+    if (write)
+      batch.push_back(objecter->prepare_mutate_op(p->first, oloc, *p->second,
+						  snapc, ut, 0,
+						  ack_gather.new_sub(),
+						  commit_gather.new_sub()));
+    else
+      batch.push_back(objecter->prepare_read_op(p->first, oloc, *p->second,
+						snap_seq, NULL, 0,
+						ack_gather.new_sub()));
+  }
+  ack_gather.activate();
+  commit_gather.activate();
+
+  ldout(client->cct, 20) << "aio_operate_batch " << ops.size()
+			 << (write ? " writes" : " reads") << dendl;
+  objecter->op_submit_batch(batch);
+  return 0;
+}
+
 int librados::IoCtxImpl::aio_read(const object_t oid, AioCompletionImpl *c,
 				  bufferlist *pbl, size_t len, uint64_t off,
 				  uint64_t snapid)
@@ -746,7 +788,6 @@ int librados::IoCtxImpl::aio_read(const object_t oid, AioCompletionImpl *c,
   c->io = this;
   c->pbl = pbl;
 
-  Mutex::Locker l(*lock);
   objecter->read(oid, oloc,
 		 off, len, snapid, &c->bl, 0,
 		 onack, &c->objver);
@@ -767,7 +808,6 @@ int librados::IoCtxImpl::aio_read(const object_t oid, AioCompletionImpl *c,
   c->buf = buf;
   c->maxlen = len;
 
-  Mutex::Locker l(*lock);
   objecter->read(oid, oloc,
 		 off, len, snapid, &c->bl, 0,
 		 onack, &c->objver);
@@ -790,7 +830,6 @@ int librados::IoCtxImpl::aio_sparse_read(const object_t oid,
   c->io = this;
   c->pbl = NULL;
 
-  Mutex::Locker l(*lock);
   objecter->sparse_read(oid, oloc,
 		 off, len, snapid, &c->bl, 0,
 		 onack);
@@ -814,7 +853,6 @@ int librados::IoCtxImpl::aio_write(const object_t &oid, AioCompletionImpl *c,
   Context *onack = new C_aio_Ack(c);
   Context *onsafe = new C_aio_Safe(c);
 
-  Mutex::Locker l(*lock);
   objecter->write(oid, oloc,
 		  off, len, snapc, bl, ut, 0,
 		  onack, onsafe, &c->objver);
@@ -837,7 +875,6 @@ int librados::IoCtxImpl::aio_append(const object_t &oid, AioCompletionImpl *c,
   Context *onack = new C_aio_Ack(c);
   Context *onsafe = new C_aio_Safe(c);
 
-  Mutex::Locker l(*lock);
   objecter->append(oid, oloc,
 		   len, snapc, bl, ut, 0,
 		   onack, onsafe, &c->objver);
@@ -861,7 +898,6 @@ int librados::IoCtxImpl::aio_write_full(const object_t &oid,
   Context *onack = new C_aio_Ack(c);
   Context *onsafe = new C_aio_Safe(c);
 
-  Mutex::Locker l(*lock);
   objecter->write_full(oid, oloc,
 		       snapc, bl, ut, 0,
 		       onack, onsafe, &c->objver);
@@ -883,7 +919,6 @@ int librados::IoCtxImpl::aio_remove(const object_t &oid, AioCompletionImpl *c)
   Context *onack = new C_aio_Ack(c);
   Context *onsafe = new C_aio_Safe(c);
 
-  Mutex::Locker l(*lock);
   objecter->remove(oid, oloc,
 		   snapc, ut, 0,
 		   onack, onsafe, &c->objver);
@@ -898,7 +933,6 @@ int librados::IoCtxImpl::aio_stat(const object_t& oid, AioCompletionImpl *c,
   c->io = this;
   C_aio_stat_Ack *onack = new C_aio_stat_Ack(c, pmtime);
 
-  Mutex::Locker l(*lock);
   objecter->stat(oid, oloc,
 		 snap_seq, psize, &onack->mtime, 0,
 		 onack, &c->objver);
@@ -924,11 +958,9 @@ int librados::IoCtxImpl::remove(const object_t& oid)
   ::ObjectOperation op;
   ::ObjectOperation *pop = prepare_assert_ops(&op);
 
-  lock->Lock();
   objecter->remove(oid, oloc,
 		   snapc, ut, 0,
 		   onack, NULL, &ver, pop);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -959,12 +991,10 @@ int librados::IoCtxImpl::trunc(const object_t& oid, uint64_t size)
   ::ObjectOperation op;
   ::ObjectOperation *pop = prepare_assert_ops(&op);
 
-  lock->Lock();
   objecter->trunc(oid, oloc,
 		  snapc, ut, 0,
 		  size, 0,
 		  onack, NULL, &ver, pop);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -993,12 +1023,10 @@ int librados::IoCtxImpl::tmap_update(const object_t& oid, bufferlist& cmdbl)
 
   bufferlist outbl;
 
-  lock->Lock();
   ::ObjectOperation wr;
   prepare_assert_ops(&wr);
   wr.tmap_update(cmdbl);
   objecter->mutate(oid, oloc, wr, snapc, ut, 0, onack, NULL, &ver);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -1027,12 +1055,10 @@ int librados::IoCtxImpl::tmap_put(const object_t& oid, bufferlist& bl)
 
   bufferlist outbl;
 
-  lock->Lock();
   ::ObjectOperation wr;
   prepare_assert_ops(&wr);
   wr.tmap_put(bl);
   objecter->mutate(oid, oloc, wr, snapc, ut, 0, onack, NULL, &ver);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -1059,12 +1085,10 @@ int librados::IoCtxImpl::tmap_get(const object_t& oid, bufferlist& bl)
 
   bufferlist outbl;
 
-  lock->Lock();
   ::ObjectOperation rd;
   prepare_assert_ops(&rd);
   rd.tmap_get(&bl, NULL);
   objecter->read(oid, oloc, rd, snap_seq, 0, 0, onack, &ver);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -1089,12 +1113,10 @@ int librados::IoCtxImpl::exec(const object_t& oid,
   eversion_t ver;
 
 
-  lock->Lock();
   ::ObjectOperation rd;
   prepare_assert_ops(&rd);
   rd.call(cls, method, inbl);
   objecter->read(oid, oloc, rd, snap_seq, &outbl, 0, onack, &ver);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -1115,7 +1137,6 @@ int librados::IoCtxImpl::aio_exec(const object_t& oid, AioCompletionImpl *c,
   c->is_read = true;
   c->io = this;
 
-  Mutex::Locker l(*lock);
   ::ObjectOperation rd;
   prepare_assert_ops(&rd);
   rd.call(cls, method, inbl);
@@ -1141,11 +1162,9 @@ int librados::IoCtxImpl::read(const object_t& oid,
   ::ObjectOperation op;
   ::ObjectOperation *pop = prepare_assert_ops(&op);
 
-  lock->Lock();
   objecter->read(oid, oloc,
 		 off, len, snap_seq, &bl, 0,
 		 onack, &ver, pop);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -1178,11 +1197,9 @@ int librados::IoCtxImpl::mapext(const object_t& oid,
   int r;
   Context *onack = new C_SafeCond(&mylock, &cond, &done, &r);
 
-  lock->Lock();
   objecter->mapext(oid, oloc,
 		   off, len, snap_seq, &bl, 0,
 		   onack);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -1215,11 +1232,9 @@ int librados::IoCtxImpl::sparse_read(const object_t& oid,
   int r;
   Context *onack = new C_SafeCond(&mylock, &cond, &done, &r);
 
-  lock->Lock();
   objecter->sparse_read(oid, oloc,
 			off, len, snap_seq, &bl, 0,
 			onack);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -1254,11 +1269,9 @@ int librados::IoCtxImpl::stat(const object_t& oid, uint64_t *psize, time_t *pmti
   ::ObjectOperation op;
   ::ObjectOperation *pop = prepare_assert_ops(&op);
 
-  lock->Lock();
   objecter->stat(oid, oloc,
 		 snap_seq, psize, &mtime, 0,
 		 onack, &ver, pop);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -1288,11 +1301,9 @@ int librados::IoCtxImpl::getxattr(const object_t& oid,
   ::ObjectOperation op;
   ::ObjectOperation *pop = prepare_assert_ops(&op);
 
-  lock->Lock();
   objecter->getxattr(oid, oloc,
 		     name, snap_seq, &bl, 0,
 		     onack, &ver, pop);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -1327,11 +1338,9 @@ int librados::IoCtxImpl::rmxattr(const object_t& oid, const char *name)
   ::ObjectOperation op;
   ::ObjectOperation *pop = prepare_assert_ops(&op);
 
-  lock->Lock();
   objecter->removexattr(oid, oloc, name,
 			snapc, ut, 0,
 			onack, NULL, &ver, pop);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -1366,11 +1375,9 @@ int librados::IoCtxImpl::setxattr(const object_t& oid,
   ::ObjectOperation op;
   ::ObjectOperation *pop = prepare_assert_ops(&op);
 
-  lock->Lock();
   objecter->setxattr(oid, oloc, name,
 		     snapc, bl, ut, 0,
 		     onack, NULL, &ver, pop);
-  lock->Unlock();
 
   mylock.Lock();
   while (!done)
@@ -1399,12 +1406,10 @@ int librados::IoCtxImpl::getxattrs(const object_t& oid,
 
   Context *onack = new C_SafeCond(&mylock, &cond, &done, &r);
 
-  lock->Lock();
   map<string, bufferlist> aset;
   objecter->getxattrs(oid, oloc, snap_seq,
 		      aset,
 		      0, onack, &ver, pop);
-  lock->Unlock();
 
   attrset.clear();
 
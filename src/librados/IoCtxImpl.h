@@ -17,6 +17,7 @@
 
 #include "common/Cond.h"
 #include "common/Mutex.h"
+#include "common/ObjectPool.h"
 #include "common/snap_types.h"
 #include "include/atomic.h"
 #include "include/rados.h"
@@ -141,11 +142,20 @@ struct librados::IoCtxImpl {
   int aio_operate(const object_t& oid, ::ObjectOperation *o,
 		  AioCompletionImpl *c, const SnapContext& snap_context);
   int aio_operate_read(const object_t& oid, ::ObjectOperation *o, AioCompletionImpl *c, bufferlist *pbl);
+  int aio_operate_batch(vector<pair<object_t, ::ObjectOperation*> >& ops,
+			AioCompletionImpl *c, bool write);
 
   struct C_aio_Ack : public Context {
     librados::AioCompletionImpl *c;
     C_aio_Ack(AioCompletionImpl *_c);
     void finish(int r);
+    static ObjectPool pool;
+    static void *operator new(size_t num_bytes) {
+      return pool.alloc(num_bytes);
+    }
+    void operator delete(void *p, size_t num_bytes) {
+      pool.free(p, num_bytes);
+    }
   };
 
   struct C_aio_stat_Ack : public Context {
@@ -170,6 +180,13 @@ struct librados::IoCtxImpl {
     AioCompletionImpl *c;
     C_aio_Safe(AioCompletionImpl *_c);
     void finish(int r);
+    static ObjectPool pool;
+    static void *operator new(size_t num_bytes) {
+      return pool.alloc(num_bytes);
+    }
+    void operator delete(void *p, size_t num_bytes) {
+      pool.free(p, num_bytes);
+    }
   };
 
   int aio_read(const object_t oid, AioCompletionImpl *c,
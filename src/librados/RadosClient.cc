@@ -163,6 +163,7 @@ int librados::RadosClient::connect()
   if (!objecter)
     goto out;
   objecter->set_balanced_budget();
+  objecter->set_unlocked_ops();
 
   monclient.set_messenger(messenger);
 
@@ -277,6 +278,17 @@ int librados::RadosClient::create_ioctx(const char *name, IoCtxImpl **io)
 
 bool librados::RadosClient::ms_dispatch(Message *m)
 {
+  // op replies don't need our lock; the objecter takes its own.  They
+  // skip the DISCONNECTED check below, which would need our lock: the
+  // objecter exists before we are a dispatcher and is only deleted once
+  // the messenger has stopped, and handle_osd_op_reply() drops replies
+  // unless it is initialized, which it stops being (under its rwlock)
+  // before shutdown() sets DISCONNECTED.
+  if (m->get_type() == CEPH_MSG_OSD_OPREPLY) {
+    objecter->handle_osd_op_reply(static_cast<MOSDOpReply*>(m));
+    return true;
+  }
+
   Mutex::Locker l(lock);
   bool ret;
 
@@ -314,9 +326,6 @@ bool librados::RadosClient::_dispatch(Message *m)
 {
   switch (m->get_type()) {
   // OSD
-  case CEPH_MSG_OSD_OPREPLY:
-    objecter->handle_osd_op_reply(static_cast<MOSDOpReply*>(m));
-    break;
   case CEPH_MSG_OSD_MAP:
     objecter->handle_osd_map(static_cast<MOSDMap*>(m));
     cond.Signal();
@@ -295,6 +295,12 @@ void librados::ObjectWriteOperation::truncate(uint64_t off)
   o->truncate(off);
 }
 
+void librados::ObjectWriteOperation::selfmanaged_snap_rollback(uint64_t snapid)
+{
+  ::ObjectOperation *o = (::ObjectOperation *)impl;
+  o->rollback(snapid);
+}
+
 void librados::ObjectWriteOperation::zero(uint64_t off, uint64_t len)
 {
   ::ObjectOperation *o = (::ObjectOperation *)impl;
@@ -883,6 +889,34 @@ int librados::IoCtx::aio_operate(const std::string& oid, AioCompletion *c, libra
   return io_ctx_impl->aio_operate_read(obj, (::ObjectOperation*)o->impl, c->pc, pbl);
 }
 
+int librados::IoCtx::aio_operate_batch(AioCompletion *c,
+	std::vector<std::pair<std::string, ObjectWriteOperation*> >& ops)
+{
+  vector<pair<object_t, ::ObjectOperation*> > batch;
+  batch.reserve(ops.size());
+  for (std::vector<std::pair<std::string, ObjectWriteOperation*> >::iterator p =
+	 ops.begin();
+       p != ops.end();
+       ++p)
+    batch.push_back(make_pair(object_t(p->first),
+			      (::ObjectOperation*)p->second->impl));
+  return io_ctx_impl->aio_operate_batch(batch, c->pc, true);
+}
+
+int librados::IoCtx::aio_operate_batch(AioCompletion *c,
+	std::vector<std::pair<std::string, ObjectReadOperation*> >& ops)
+{
+  vector<pair<object_t, ::ObjectOperation*> > batch;
+  batch.reserve(ops.size());
+  for (std::vector<std::pair<std::string, ObjectReadOperation*> >::iterator p =
+	 ops.begin();
+       p != ops.end();
+       ++p)
+    batch.push_back(make_pair(object_t(p->first),
+			      (::ObjectOperation*)p->second->impl));
+  return io_ctx_impl->aio_operate_batch(batch, c->pc, false);
+}
+
 void librados::IoCtx::snap_set_read(snap_t seq)
 {
   io_ctx_impl->set_snap_read(seq);
@@ -87,6 +87,8 @@ namespace librbd {
       // with the read extent when it is empty.
       if (m_req->m_ext_map.empty())
 	m_req->m_ext_map[m_req->m_object_off] = m_req->data().length();
+      if (!m_req->m_logged.empty())
+	m_req->overlay_logged();
 
       m_completion->lock.Lock();
       m_completion->destriper.add_partial_sparse_result(
@@ -102,4 +104,20 @@ namespace librbd {
   {
     m_req->complete(r);
   }
+
+  void C_SendWrite::finish(int r)
+  {
+    if (r == 0)
+      r = m_req->send();
+    if (r < 0)
+      m_req->complete(r);
+  }
+
+  void C_MarkExists::finish(int r)
+  {
+    if (r < 0)
+      m_on_marked->complete(r);
+    else
+      m_ictx->object_map.aio_mark_exists(m_object_no, m_on_marked);
+  }
 }
@@ -18,6 +18,7 @@
 
 namespace librbd {
 
+  class AbstractWrite;
   class AioRead;
 
   typedef enum {
@@ -128,6 +129,13 @@ namespace librbd {
 
     void complete_request(CephContext *cct, ssize_t r);
 
+    /// fail the whole request, once the requests already added finish
+    void set_error(ssize_t r) {
+      Mutex::Locker l(lock);
+      if (rval >= 0)
+	rval = r;
+    }
+
     bool is_complete() {
       Mutex::Locker l(lock);
       return done;
@@ -204,6 +212,29 @@ namespace librbd {
     Context *m_completion;
     AioRead *m_req;
   };
+
+  /// sends the write once what it waited for is done, or fails it
+  class C_SendWrite : public Context {
+  public:
+    C_SendWrite(AbstractWrite *req) : m_req(req) {}
+    virtual ~C_SendWrite() {}
+    virtual void finish(int r);
+  private:
+    AbstractWrite *m_req;
+  };
+
+  /// has the object map mark the object before going on
+  class C_MarkExists : public Context {
+  public:
+    C_MarkExists(ImageCtx *ictx, uint64_t object_no, Context *on_marked)
+      : m_ictx(ictx), m_object_no(object_no), m_on_marked(on_marked) {}
+    virtual ~C_MarkExists() {}
+    virtual void finish(int r);
+  private:
+    ImageCtx *m_ictx;
+    uint64_t m_object_no;
+    Context *m_on_marked;
+  };
 }
 
 #endif
@@ -9,6 +9,7 @@
 #include "librbd/AioCompletion.h"
 #include "librbd/ImageCtx.h"
 #include "librbd/internal.h"
+#include "osdc/WriteLog.h"
 
 #include "librbd/AioRequest.h"
 
@@ -85,6 +86,25 @@ namespace librbd {
     return true;
   }
 
+  void AioRead::overlay_logged()
+  {
+    bufferptr bp(m_object_len);
+    bp.zero();
+    uint64_t pos = 0;
+    for (map<uint64_t, uint64_t>::iterator p = m_ext_map.begin();
+	 p != m_ext_map.end() && pos < m_read_data.length(); ++p) {
+      uint64_t len = MIN(p->second, m_read_data.length() - pos);
+      m_read_data.copy(pos, len, bp.c_str() + (p->first - m_object_off));
+      pos += len;
+    }
+    WriteLog::overlay(m_logged, m_object_off, m_object_len, bp.c_str());
+
+    m_read_data.clear();
+    m_read_data.push_back(bp);
+    m_ext_map.clear();
+    m_ext_map[m_object_off] = m_object_len;
+  }
+
   int AioRead::send() {
     ldout(m_ictx->cct, 20) << "send " << this << " " << m_oid << " " << m_object_off << "~" << m_object_len << dendl;
 
@@ -4,6 +4,8 @@
 #define CEPH_LIBRBD_AIOREQUEST_H
 
 #include <map>
+#include <utility>
+#include <vector>
 
 #include "inttypes.h"
 
@@ -77,7 +79,12 @@ namespace librbd {
     ceph::bufferlist &data() {
       return m_read_data;
     }
+    /// lay m_logged over what was read, leaving one extent in m_ext_map
+    void overlay_logged();
+
     std::map<uint64_t, uint64_t> m_ext_map;
+    /// from the write log, not written back yet (see WriteLog::read())
+    std::vector<std::pair<uint64_t, ceph::bufferlist> > m_logged;
 
     friend class C_AioRead;
 
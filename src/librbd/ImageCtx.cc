@@ -1,11 +1,14 @@
 // -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
 // vim: ts=8 sw=2 smarttab
 #include <errno.h>
+#include <unistd.h>
 
 #include "common/ceph_context.h"
 #include "common/dout.h"
 #include "common/errno.h"
 #include "common/perf_counters.h"
+#include "include/ceph_hash.h"
+#include "include/stringify.h"
 
 #include "librbd/internal.h"
 #include "librbd/WatchCtx.h"
@@ -27,6 +30,64 @@ using librados::snap_t;
 using librados::IoCtx;
 
 namespace librbd {
+  /**
+   * Header key naming the write log that may hold writes to the image
+   * that are not on the OSDs yet: the host it is on and its id.
+   */
+  static const string WRITE_LOG_OWNER_KEY = "write_log";
+
+  static string local_host()
+  {
+    char host[256];
+    if (gethostname(host, sizeof(host) - 1) < 0)
+      return "";
+    host[sizeof(host) - 1] = '\0';
+    return host;
+  }
+
+  /// what each of the cache's shards gets of a limit; 0 stays 0
+  static uint64_t shard_share(uint64_t total, uint64_t shards)
+  {
+    if (total == 0)
+      return 0;
+    return MAX(1, total / shards);
+  }
+
+  CacheShard::CacheShard(ImageCtx *ictx, const string &name,
+			 uint64_t max_size, uint64_t max_dirty,
+			 uint64_t target_dirty,
+			 ObjectCacher::DirtyBudget *budget)
+    : lock_name("librbd::CacheShard::lock " + name),
+      lock(lock_name.c_str())
+  {
+    CephContext *cct = ictx->cct;
+    Mutex::Locker l(lock);
+    writeback_handler = new LibrbdWriteback(ictx, lock);
+    object_cacher = new ObjectCacher(cct, name, *writeback_handler, lock,
+				     NULL, NULL,
+				     max_size,
+				     10,  /* reset this in init */
+				     max_dirty,
+				     target_dirty,
+				     cct->_conf->rbd_cache_max_dirty_age,
+				     cct->_conf->rbd_cache_block_writes_upfront);
+    object_cacher->set_write_around(
+      cct->_conf->rbd_cache_write_around_bytes,
+      MAX(0, cct->_conf->rbd_cache_write_around_sequential));
+    object_set = new ObjectCacher::ObjectSet(NULL, ictx->data_ctx.get_id(), 0);
+    object_set->return_enoent = true;
+    if (budget)
+      object_cacher->set_dirty_budget(budget);
+    object_cacher->start();
+  }
+
+  CacheShard::~CacheShard()
+  {
+    delete object_cacher;
+    delete writeback_handler;
+    delete object_set;
+  }
+
   ImageCtx::ImageCtx(const string &image_name, const string &image_id,
 		     const char *snap, IoCtx& p, bool ro)
     : cct((CephContext*)p.cct()),
@@ -37,23 +98,31 @@ namespace librbd {
       flush_encountered(false),
       exclusive_locked(false),
       name(image_name),
+      client_id(0),
       wctx(NULL),
       refresh_seq(0),
       last_refresh(0),
       md_lock("librbd::ImageCtx::md_lock"),
-      cache_lock("librbd::ImageCtx::cache_lock"),
       snap_lock("librbd::ImageCtx::snap_lock"),
       parent_lock("librbd::ImageCtx::parent_lock"),
       refresh_lock("librbd::ImageCtx::refresh_lock"),
       old_format(true),
       order(0), size(0), features(0),
       format_string(NULL),
-      id(image_id), parent(NULL),
+      id(image_id), parent(NULL), parent_ref(1),
       stripe_unit(0), stripe_count(0),
-      object_cacher(NULL), writeback_handler(NULL), object_set(NULL)
+      write_log_lock("librbd::ImageCtx::write_log_lock"),
+      write_log_handler(NULL), write_log(NULL),
+      object_map(this),
+      readahead_lock("librbd::ImageCtx::readahead_lock"),
+      readahead_ops(0)
   {
     md_ctx.dup(p);
     data_ctx.dup(p);
+    {
+      librados::Rados rados(md_ctx);
+      client_id = rados.get_instance_id();
+    }
 
     memset(&header, 0, sizeof(header));
     memset(&layout, 0, sizeof(layout));
@@ -67,50 +136,18 @@ namespace librbd {
     }
     perf_start(pname);
 
-    if (cct->_conf->rbd_cache) {
-      Mutex::Locker l(cache_lock);
-      ldout(cct, 20) << "enabling caching..." << dendl;
-      writeback_handler = new LibrbdWriteback(this, cache_lock);
-
-      uint64_t init_max_dirty = cct->_conf->rbd_cache_max_dirty;
-      if (cct->_conf->rbd_cache_writethrough_until_flush)
-	init_max_dirty = 0;
-      ldout(cct, 20) << "Initial cache settings:"
-		     << " size=" << cct->_conf->rbd_cache_size
-		     << " num_objects=" << 10
-		     << " max_dirty=" << init_max_dirty
-		     << " target_dirty=" << cct->_conf->rbd_cache_target_dirty
-		     << " max_dirty_age="
-		     << cct->_conf->rbd_cache_max_dirty_age << dendl;
-
-      object_cacher = new ObjectCacher(cct, pname, *writeback_handler, cache_lock,
-				       NULL, NULL,
-				       cct->_conf->rbd_cache_size,
-				       10,  /* reset this in init */
-				       init_max_dirty,
-				       cct->_conf->rbd_cache_target_dirty,
-				       cct->_conf->rbd_cache_max_dirty_age,
-				       cct->_conf->rbd_cache_block_writes_upfront);
-      object_set = new ObjectCacher::ObjectSet(NULL, data_ctx.get_id(), 0);
-      object_set->return_enoent = true;
-      object_cacher->start();
-    }
+    // with a write log, the cache is only set up if the log can't be had
+    if (cct->_conf->rbd_cache && !want_write_log())
+      init_cache();
   }
 
   ImageCtx::~ImageCtx() {
+    assert(!write_log);
     perf_stop();
-    if (object_cacher) {
-      delete object_cacher;
-      object_cacher = NULL;
-    }
-    if (writeback_handler) {
-      delete writeback_handler;
-      writeback_handler = NULL;
-    }
-    if (object_set) {
-      delete object_set;
-      object_set = NULL;
-    }
+    for (vector<CacheShard*>::iterator p = cache_shards.begin();
+	 p != cache_shards.end(); ++p)
+      delete *p;
+    cache_shards.clear();
     delete[] format_string;
   }
 
@@ -183,11 +220,16 @@ namespace librbd {
     }
 
     // size object cache appropriately
-    if (object_cacher) {
-      uint64_t obj = cct->_conf->rbd_cache_size / (1ull << order);
+    if (cache_enabled()) {
+      uint64_t obj = shard_share(cct->_conf->rbd_cache_size,
+				 cache_shards.size()) / (1ull << order);
       ldout(cct, 10) << " cache bytes " << cct->_conf->rbd_cache_size << " order " << (int)order
-		     << " -> about " << obj << " objects" << dendl;
-      object_cacher->set_max_objects(obj * 4 + 10);
+		     << " -> about " << obj << " objects per shard" << dendl;
+      for (vector<CacheShard*>::iterator p = cache_shards.begin();
+	   p != cache_shards.end(); ++p) {
+	Mutex::Locker l((*p)->lock);
+	(*p)->object_cacher->set_max_objects(obj * 4 + 10);
+      }
     }
 
     ldout(cct, 10) << "init_layout stripe_unit " << stripe_unit
@@ -222,6 +264,10 @@ namespace librbd {
     plb.add_time_avg(l_librbd_aio_discard_latency, "aio_discard_latency");
     plb.add_u64_counter(l_librbd_aio_flush, "aio_flush");
     plb.add_time_avg(l_librbd_aio_flush_latency, "aio_flush_latency");
+    plb.add_u64_counter(l_librbd_readahead, "readahead");
+    plb.add_u64_counter(l_librbd_readahead_bytes, "readahead_bytes");
+    plb.add_u64_counter(l_librbd_readahead_hit, "readahead_hit");
+    plb.add_u64_counter(l_librbd_readahead_miss, "readahead_miss");
     plb.add_u64_counter(l_librbd_snap_create, "snap_create");
     plb.add_u64_counter(l_librbd_snap_remove, "snap_remove");
     plb.add_u64_counter(l_librbd_snap_rollback, "snap_rollback");
@@ -458,35 +504,131 @@ namespace librbd {
     return 0;
   }
 
+  void ImageCtx::init_cache() {
+    ldout(cct, 20) << "enabling caching..." << dendl;
+
+    uint64_t init_max_dirty = cct->_conf->rbd_cache_max_dirty;
+    if (cct->_conf->rbd_cache_writethrough_until_flush)
+      init_max_dirty = 0;
+    unsigned shards = MAX(1, cct->_conf->rbd_cache_shards);
+    ldout(cct, 20) << "Initial cache settings:"
+		   << " size=" << cct->_conf->rbd_cache_size
+		   << " num_objects=" << 10
+		   << " max_dirty=" << init_max_dirty
+		   << " target_dirty=" << cct->_conf->rbd_cache_target_dirty
+		   << " max_dirty_age="
+		   << cct->_conf->rbd_cache_max_dirty_age
+		   << " write_around_bytes="
+		   << cct->_conf->rbd_cache_write_around_bytes
+		   << " shards=" << shards << dendl;
+
+    for (unsigned i = 0; i < shards; ++i) {
+      // keep the perf counters of an unsharded cache where they were
+      string shard_name = perfcounter->get_name();
+      if (shards > 1)
+	shard_name += "-" + stringify(i);
+      cache_shards.push_back(
+	new CacheShard(this, shard_name,
+		       shard_share(cct->_conf->rbd_cache_size, shards),
+		       init_max_dirty,
+		       cct->_conf->rbd_cache_target_dirty,
+		       shards > 1 ? &dirty_budget : NULL));
+    }
+
+    // keep readahead well inside a shard, or it just evicts itself
+    readahead.set_trigger_requests(
+      MAX(1, cct->_conf->rbd_readahead_trigger_requests));
+    readahead.set_max_readahead_size(
+      MIN((uint64_t)cct->_conf->rbd_readahead_max_bytes,
+	  shard_share(cct->_conf->rbd_cache_size, shards) / 4));
+  }
+
+  CacheShard *ImageCtx::get_cache_shard(const object_t &o) const {
+    assert(!cache_shards.empty());
+    if (cache_shards.size() == 1)
+      return cache_shards[0];
+    unsigned h = ceph_str_hash_rjenkins(o.name.c_str(), o.name.length());
+    return cache_shards[h % cache_shards.size()];
+  }
+
   void ImageCtx::aio_read_from_cache(object_t o, bufferlist *bl, size_t len,
 				     uint64_t off, Context *onfinish) {
+    CacheShard *shard = get_cache_shard(o);
     snap_lock.get_read();
-    ObjectCacher::OSDRead *rd = object_cacher->prepare_read(snap_id, bl, 0);
+    ObjectCacher::OSDRead *rd = shard->object_cacher->prepare_read(snap_id,
+								   bl, 0);
     snap_lock.put_read();
     ObjectExtent extent(o, 0 /* a lie */, off, len);
     extent.oloc.pool = data_ctx.get_id();
     extent.buffer_extents.push_back(make_pair(0, len));
     rd->extents.push_back(extent);
-    cache_lock.Lock();
-    int r = object_cacher->readx(rd, object_set, onfinish);
-    cache_lock.Unlock();
+    shard->lock.Lock();
+    int r = shard->object_cacher->readx(rd, shard->object_set, onfinish);
+    shard->lock.Unlock();
     if (r != 0)
       onfinish->complete(r);
   }
 
+  /// holds the buffer the cache fills; the data we want stays cached
+  class C_ReadaheadDone : public Context {
+  public:
+    C_ReadaheadDone(ImageCtx *ictx) : m_ictx(ictx) {}
+    bufferlist bl;
+    virtual void finish(int r) {
+      m_ictx->finish_readahead();
+    }
+  private:
+    ImageCtx *m_ictx;
+  };
+
+  void ImageCtx::readahead_to_cache(uint64_t off, uint64_t len) {
+    ldout(cct, 20) << "readahead " << off << "~" << len << dendl;
+    perfcounter->inc(l_librbd_readahead);
+    perfcounter->inc(l_librbd_readahead_bytes, len);
+
+    vector<ObjectExtent> extents;
+    Striper::file_to_extents(cct, format_string, &layout, off, len, extents);
+    for (vector<ObjectExtent>::iterator p = extents.begin();
+	 p != extents.end(); ++p) {
+      if (!object_map.object_may_exist(p->objectno))
+	continue;
+      {
+	Mutex::Locker l(readahead_lock);
+	readahead_ops++;
+      }
+      C_ReadaheadDone *ctx = new C_ReadaheadDone(this);
+      aio_read_from_cache(p->oid, &ctx->bl, p->length, p->offset, ctx);
+    }
+  }
+
+  void ImageCtx::finish_readahead() {
+    Mutex::Locker l(readahead_lock);
+    assert(readahead_ops > 0);
+    if (--readahead_ops == 0)
+      readahead_cond.Signal();
+  }
+
+  void ImageCtx::wait_for_readahead() {
+    Mutex::Locker l(readahead_lock);
+    while (readahead_ops > 0)
+      readahead_cond.Wait(readahead_lock);
+  }
+
   void ImageCtx::write_to_cache(object_t o, bufferlist& bl, size_t len,
 				uint64_t off, Context *onfinish) {
+    CacheShard *shard = get_cache_shard(o);
     snap_lock.get_read();
-    ObjectCacher::OSDWrite *wr = object_cacher->prepare_write(snapc, bl,
-							      utime_t(), 0);
+    ObjectCacher::OSDWrite *wr = shard->object_cacher->prepare_write(
+      snapc, bl, utime_t(), 0);
     snap_lock.put_read();
     ObjectExtent extent(o, 0, off, len);
     extent.oloc.pool = data_ctx.get_id();
     extent.buffer_extents.push_back(make_pair(0, len));
     wr->extents.push_back(extent);
     {
-      Mutex::Locker l(cache_lock);
-      object_cacher->writex(wr, object_set, cache_lock, onfinish);
+      Mutex::Locker l(shard->lock);
+      shard->object_cacher->writex(wr, shard->object_set, shard->lock,
+				   onfinish);
     }
   }
 
@@ -506,7 +648,7 @@ namespace librbd {
   }
 
   void ImageCtx::user_flushed() {
-    if (object_cacher && cct->_conf->rbd_cache_writethrough_until_flush) {
+    if (cache_enabled() && cct->_conf->rbd_cache_writethrough_until_flush) {
       md_lock.get_read();
       bool flushed_before = flush_encountered;
       md_lock.put_read();
@@ -518,16 +660,26 @@ namespace librbd {
 	md_lock.put_write();
 
 	ldout(cct, 10) << "saw first user flush, enabling writeback" << dendl;
-	Mutex::Locker l(cache_lock);
-	object_cacher->set_max_dirty(max_dirty);
+	for (vector<CacheShard*>::iterator p = cache_shards.begin();
+	     p != cache_shards.end(); ++p) {
+	  Mutex::Locker l((*p)->lock);
+	  (*p)->object_cacher->set_max_dirty(max_dirty);
+	}
       }
     }
   }
 
   void ImageCtx::flush_cache_aio(Context *onfinish) {
-    cache_lock.Lock();
-    object_cacher->flush_set(object_set, onfinish);
-    cache_lock.Unlock();
+    // everything written to any shard before we got here is covered
+    C_GatherBuilder gather(cct, onfinish);
+    for (vector<CacheShard*>::iterator p = cache_shards.begin();
+	 p != cache_shards.end(); ++p) {
+      Mutex::Locker l((*p)->lock);
+      (*p)->object_cacher->flush_set((*p)->object_set, gather.new_sub());
+    }
+    if (write_log)
+      write_log->flush(gather.new_sub());
+    gather.activate();
   }
 
   int ImageCtx::flush_cache() {
@@ -536,6 +688,8 @@ namespace librbd {
     Cond cond;
     bool done;
     Context *onfinish = new C_SafeCond(&mylock, &cond, &done, &r);
+    // writes waiting for the object map aren't in the cache yet
+    object_map.flush();
     flush_cache_aio(onfinish);
     mylock.Lock();
     while (!done) {
@@ -548,34 +702,192 @@ namespace librbd {
   }
 
   void ImageCtx::shutdown_cache() {
+    wait_for_readahead();
     md_lock.get_write();
     invalidate_cache();
     md_lock.put_write();
-    object_cacher->stop();
+    for (vector<CacheShard*>::iterator p = cache_shards.begin();
+	 p != cache_shards.end(); ++p)
+      (*p)->object_cacher->stop();
   }
 
   void ImageCtx::invalidate_cache() {
-    if (!object_cacher)
+    if (write_log) {
+      // nothing in the log is clean, so writing it all back is enough
+      int r = flush_cache();
+      if (r)
+	lderr(cct) << "flushing the write log returned " << r << dendl;
       return;
-    cache_lock.Lock();
-    object_cacher->release_set(object_set);
-    cache_lock.Unlock();
+    }
+    if (!cache_enabled())
+      return;
+    for (vector<CacheShard*>::iterator p = cache_shards.begin();
+	 p != cache_shards.end(); ++p) {
+      Mutex::Locker l((*p)->lock);
+      (*p)->object_cacher->release_set((*p)->object_set);
+    }
     int r = flush_cache();
     if (r)
       lderr(cct) << "flush_cache returned " << r << dendl;
-    cache_lock.Lock();
-    bool unclean = object_cacher->release_set(object_set);
-    cache_lock.Unlock();
+    bool unclean = false;
+    for (vector<CacheShard*>::iterator p = cache_shards.begin();
+	 p != cache_shards.end(); ++p) {
+      Mutex::Locker l((*p)->lock);
+      if ((*p)->object_cacher->release_set((*p)->object_set))
+	unclean = true;
+    }
     if (unclean)
       lderr(cct) << "could not release all objects from cache" << dendl;
   }
 
   void ImageCtx::clear_nonexistence_cache() {
-    if (!object_cacher)
+    if (!cache_enabled())
       return;
-    cache_lock.Lock();
-    object_cacher->clear_nonexistence(object_set);
-    cache_lock.Unlock();
+    for (vector<CacheShard*>::iterator p = cache_shards.begin();
+	 p != cache_shards.end(); ++p) {
+      Mutex::Locker l((*p)->lock);
+      (*p)->object_cacher->clear_nonexistence((*p)->object_set);
+    }
+  }
+
+  int ImageCtx::get_write_log_owner(string *host, uint64_t *log_id) {
+    set<string> keys;
+    keys.insert(WRITE_LOG_OWNER_KEY);
+    map<string, bufferlist> vals;
+    int r = md_ctx.omap_get_vals_by_keys(header_oid, keys, &vals);
+    if (r < 0)
+      return r;
+    if (!vals.count(WRITE_LOG_OWNER_KEY))
+      return -ENOENT;
+    try {
+      bufferlist::iterator it = vals[WRITE_LOG_OWNER_KEY].begin();
+      ::decode(*host, it);
+      ::decode(*log_id, it);
+    } catch (const buffer::error &err) {
+      return -EIO;
+    }
+    return 0;
+  }
+
+  int ImageCtx::check_write_log_owner() {
+    string host;
+    uint64_t log_id;
+    int r = get_write_log_owner(&host, &log_id);
+    if (r == -ENOENT)
+      return 0;
+    if (r < 0) {
+      lderr(cct) << "error reading write log owner: " << cpp_strerror(r)
+		 << dendl;
+      return r;
+    }
+    lderr(cct) << "image has write log " << log_id << " on host " << host
+	       << ", which may hold writes that are not on the OSDs yet"
+	       << dendl;
+    return -EBUSY;
+  }
+
+  bool ImageCtx::want_write_log() const {
+    return !cct->_conf->rbd_write_log_path.empty() && !read_only &&
+      snap_name.empty();
+  }
+
+  int ImageCtx::open_write_log() {
+    assert(!write_log);
+    string path = cct->_conf->rbd_write_log_path + "/rbd-" +
+      stringify(data_ctx.get_id()) + "." + object_prefix;
+    uint64_t log_size = cct->_conf->rbd_write_log_size;
+    if (log_size < 4 * get_object_size()) {
+      lderr(cct) << "rbd_write_log_size " << log_size
+		 << " is too small for objects of " << get_object_size()
+		 << " bytes" << dendl;
+      return -EINVAL;
+    }
+
+    // only the log the image names may be replayed; any other is stale
+    string host = local_host();
+    string owner_host;
+    uint64_t replay_id = WriteLog::REPLAY_NONE;
+    int r = get_write_log_owner(&owner_host, &replay_id);
+    if (r == 0 && owner_host != host) {
+      lderr(cct) << "image has write log " << replay_id << " on host "
+		 << owner_host << ", which may hold writes that are not on "
+		 << "the OSDs yet" << dendl;
+      return -EBUSY;
+    }
+    if (r < 0 && r != -ENOENT) {
+      lderr(cct) << "error reading write log owner: " << cpp_strerror(r)
+		 << dendl;
+      return r;
+    }
+
+    ldout(cct, 10) << "opening write log " << path << dendl;
+    write_log_handler = new LibrbdWriteback(this, write_log_lock);
+    write_log = new WriteLog(cct, path, log_size, *write_log_handler,
+			     write_log_lock,
+			     MAX(1, cct->_conf->rbd_write_log_max_in_flight));
+    // -EBUSY if another process on this host has it: writing around
+    // the log would have our writes undone when it writes back
+    r = write_log->open(replay_id);
+    if (r == 0 && replay_id != WriteLog::REPLAY_NONE &&
+	write_log->get_log_id() != replay_id) {
+      lderr(cct) << "write log " << replay_id << " named by the image is "
+		 << "not " << path << "; not opening the image for writes "
+		 << "until it is found or its '" << WRITE_LOG_OWNER_KEY
+		 << "' key is removed from " << header_oid << dendl;
+      r = -ESTALE;
+    }
+    if (r == 0 && replay_id == WriteLog::REPLAY_NONE) {
+      // nothing may go into the log before the image names it, and
+      // only if no one else has named theirs in the meantime
+      bufferlist bl;
+      ::encode(host, bl);
+      ::encode(write_log->get_log_id(), bl);
+      map<string, pair<bufferlist, int> > assertions;
+      assertions[WRITE_LOG_OWNER_KEY] =
+	make_pair(bufferlist(), (int)CEPH_OSD_CMPXATTR_OP_EQ);
+      map<string, bufferlist> vals;
+      vals[WRITE_LOG_OWNER_KEY] = bl;
+      librados::ObjectWriteOperation op;
+      int cmp_r;
+      op.omap_cmp(assertions, &cmp_r);
+      op.omap_set(vals);
+      r = md_ctx.operate(header_oid, &op);
+      if (r == -ECANCELED)
+	r = -EBUSY;
+    }
+    if (r < 0) {
+      if (r != -ESTALE)
+	lderr(cct) << "error opening write log " << path << ": "
+		   << cpp_strerror(r) << dendl;
+      // closes it if it was opened; the image still names whatever
+      // log it did
+      delete write_log;
+      write_log = NULL;
+      delete write_log_handler;
+      write_log_handler = NULL;
+    }
+    return r;
+  }
+
+  void ImageCtx::close_write_log() {
+    if (!write_log)
+      return;
+    bool empty = write_log->empty();
+    write_log->close();
+    delete write_log;
+    write_log = NULL;
+    delete write_log_handler;
+    write_log_handler = NULL;
+
+    if (empty) {
+      // no one needs the log any more
+      set<string> keys;
+      keys.insert(WRITE_LOG_OWNER_KEY);
+      int r = md_ctx.omap_rm_keys(header_oid, keys);
+      if (r < 0)
+	lderr(cct) << "error removing write log owner: " << cpp_strerror(r)
+		   << dendl;
+    }
   }
 
   int ImageCtx::register_watch() {
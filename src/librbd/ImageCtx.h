@@ -10,17 +10,22 @@
 #include <string>
 #include <vector>
 
+#include "common/Cond.h"
 #include "common/Mutex.h"
+#include "common/Readahead.h"
 #include "common/RWLock.h"
 #include "common/snap_types.h"
+#include "include/atomic.h"
 #include "include/buffer.h"
 #include "include/rbd/librbd.hpp"
 #include "include/rbd_types.h"
 #include "include/types.h"
 #include "osdc/ObjectCacher.h"
+#include "osdc/WriteLog.h"
 
 #include "cls/rbd/cls_rbd_client.h"
 #include "librbd/LibrbdWriteback.h"
+#include "librbd/ObjectMap.h"
 #include "librbd/SnapInfo.h"
 #include "librbd/parent_types.h"
 
@@ -31,6 +36,30 @@ namespace librbd {
 
   class WatchCtx;
 
+  /**
+   * One slice of the image's cache.  Objects are spread over
+   * rbd_cache_shards of these by a hash of their names, and each has its
+   * own ObjectCacher, so I/O to different objects doesn't serialize on
+   * one lock.  The cache size is divided between them; the dirty limits
+   * are checked against all of their dirty bytes together.
+   */
+  struct CacheShard {
+    std::string lock_name;
+    Mutex lock; // used as client_lock for this shard's ObjectCacher
+    LibrbdWriteback *writeback_handler;
+    ObjectCacher *object_cacher;
+    ObjectCacher::ObjectSet *object_set;
+
+    CacheShard(ImageCtx *ictx, const std::string &name, uint64_t max_size,
+	       uint64_t max_dirty, uint64_t target_dirty,
+	       ObjectCacher::DirtyBudget *budget);
+    ~CacheShard();
+
+  private:
+    CacheShard(const CacheShard&);
+    const CacheShard& operator=(const CacheShard&);
+  };
+
   struct ImageCtx {
     CephContext *cct;
     PerfCounters *perfcounter;
@@ -53,18 +82,20 @@ namespace librbd {
     std::string name;
     std::string snap_name;
     IoCtx data_ctx, md_ctx;
+    uint64_t client_id; // our librados instance id, as lockers know us
     WatchCtx *wctx;
     int refresh_seq;    ///< sequence for refresh requests
     int last_refresh;   ///< last completed refresh
 
     /**
      * Lock ordering:
-     * md_lock, cache_lock, snap_lock, parent_lock, refresh_lock
+     * md_lock, CacheShard::lock or write_log_lock, snap_lock,
+     * parent_lock, refresh_lock
+     * (no more than one CacheShard::lock at a time)
      */
     RWLock md_lock; // protects access to the mutable image metadata that
                    // isn't guarded by other locks below
                    // (size, features, image locks, etc)
-    Mutex cache_lock; // used as client_lock for the ObjectCacher
     RWLock snap_lock; // protects snapshot-related member variables:
     RWLock parent_lock; // protects parent_md and parent
     Mutex refresh_lock; // protects refresh_seq and last_refresh
@@ -79,13 +110,26 @@ namespace librbd {
     std::string id; // only used for new-format images
     parent_info parent_md;
     ImageCtx *parent;
+    /// for a parent: one for its child, plus one for each op reading it
+    /// without holding the child's parent_lock (see put_parent())
+    atomic_t parent_ref;
     uint64_t stripe_unit, stripe_count;
 
     ceph_file_layout layout;
 
-    ObjectCacher *object_cacher;
-    LibrbdWriteback *writeback_handler;
-    ObjectCacher::ObjectSet *object_set;
+    std::vector<CacheShard*> cache_shards; // empty without rbd_cache
+    ObjectCacher::DirtyBudget dirty_budget; // shared by cache_shards
+
+    Mutex write_log_lock; // for write_log and its writeback handler
+    LibrbdWriteback *write_log_handler;
+    WriteLog *write_log; // set while a writable image has one open
+
+    ObjectMap object_map; // for snap_id, if the image has one
+
+    Readahead readahead; // only used with the cache
+    Mutex readahead_lock; // protects readahead_ops
+    Cond readahead_cond;
+    unsigned readahead_ops; // in flight, so shutdown can wait for them
 
     /**
      * Either image_name or image_id must be set.
@@ -126,8 +170,14 @@ namespace librbd {
     uint64_t get_parent_snap_id(librados::snap_t in_snap_id) const;
     int get_parent_overlap(librados::snap_t in_snap_id,
 			   uint64_t *overlap) const;
+    void init_cache();
+    bool cache_enabled() const { return !cache_shards.empty(); }
+    CacheShard *get_cache_shard(const object_t &o) const;
     void aio_read_from_cache(object_t o, bufferlist *bl, size_t len,
 			     uint64_t off, Context *onfinish);
+    void readahead_to_cache(uint64_t off, uint64_t len);
+    void finish_readahead();
+    void wait_for_readahead();
     void write_to_cache(object_t o, bufferlist& bl, size_t len, uint64_t off,
 			Context *onfinish);
     int read_from_cache(object_t o, bufferlist *bl, size_t len, uint64_t off);
@@ -137,6 +187,13 @@ namespace librbd {
     void shutdown_cache();
     void invalidate_cache();
     void clear_nonexistence_cache();
+    int get_write_log_owner(std::string *host, uint64_t *log_id);
+    /// -EBUSY if the image has a write log, which only its owner may use
+    int check_write_log_owner();
+    bool want_write_log() const;
+    /// -EBUSY if another process, on any host, has the image's log
+    int open_write_log();
+    void close_write_log();
     int register_watch();
     void unregister_watch();
     size_t parent_io_len(uint64_t offset, size_t length,
@@ -0,0 +1,356 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+#include <errno.h>
+
+#include "common/ceph_context.h"
+#include "common/dout.h"
+#include "common/errno.h"
+#include "cls/rbd/cls_rbd_client.h"
+#include "include/rbd/features.h"
+#include "include/rbd_types.h"
+
+#include "librbd/ImageCtx.h"
+#include "librbd/internal.h"
+
+#include "librbd/ObjectMap.h"
+
+#define dout_subsys ceph_subsys_rbd
+#undef dout_prefix
+#define dout_prefix *_dout << "librbd::ObjectMap: "
+
+using std::string;
+
+using ceph::bufferlist;
+using librados::snap_t;
+
+namespace librbd {
+
+  class ObjectMap::C_UpdateMap : public Context {
+  public:
+    C_UpdateMap(ObjectMap *map) : m_map(map) {}
+    virtual void finish(int r) {
+      m_map->handle_update(r);
+    }
+  private:
+    ObjectMap *m_map;
+  };
+
+  ObjectMap::ObjectMap(ImageCtx *ictx)
+    : m_ictx(ictx),
+      m_finisher(ictx->cct), m_finisher_started(false),
+      m_update_lock("librbd::ObjectMap::m_update_lock"),
+      m_updating(false),
+      m_lock("librbd::ObjectMap::m_lock"),
+      m_snap_id(CEPH_NOSNAP), m_enabled(false)
+  {
+  }
+
+  ObjectMap::~ObjectMap()
+  {
+    assert(!m_updating);
+    if (m_finisher_started)
+      m_finisher.stop();
+  }
+
+  string ObjectMap::object_map_name(const string &image_id, snap_t snap_id)
+  {
+    string oid(RBD_OBJECT_MAP_PREFIX + image_id);
+    if (snap_id != CEPH_NOSNAP) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), ".%016llx", (unsigned long long)snap_id);
+      oid += buf;
+    }
+    return oid;
+  }
+
+  int ObjectMap::load(snap_t snap_id)
+  {
+    CephContext *cct = m_ictx->cct;
+    Mutex::Locker l(m_update_lock);
+    while (m_updating)
+      m_update_cond.Wait(m_update_lock);
+
+    uint64_t features = 0;
+    {
+      RWLock::RLocker l2(m_ictx->snap_lock);
+      if (!m_ictx->old_format)
+	m_ictx->get_features(snap_id, &features);
+    }
+
+    bufferlist bl;
+    int r = 0;
+    bool enabled = false;
+    if (features & RBD_FEATURE_OBJECT_MAP) {
+      string oid = object_map_name(m_ictx->id, snap_id);
+      librados::ObjectReadOperation op;
+      std::map<string, bufferlist> attrs;
+      op.read(0, 0, &bl, NULL);
+      op.getxattrs(&attrs, NULL);
+      r = m_ictx->md_ctx.operate(oid, &op, NULL);
+      if (r == -ENOENT) {
+	lderr(cct) << "object map " << oid << " is missing, ignoring it"
+		   << dendl;
+	r = 0;
+      } else if (r >= 0 && snap_id != CEPH_NOSNAP &&
+		 !attrs.count(RBD_OBJECT_MAP_SEALED)) {
+	ldout(cct, 20) << "object map " << oid << " isn't sealed yet, "
+		       << "ignoring it" << dendl;
+	bl.clear();
+	r = 0;
+      } else if (r < 0) {
+	// keep what we have: forgetting the map would let writes go
+	// out without updating it
+	lderr(cct) << "error reading object map " << oid << ": "
+		   << cpp_strerror(r) << dendl;
+	return r;
+      } else {
+	ldout(cct, 20) << "loaded object map " << oid << " ("
+		       << bl.length() << " bytes)" << dendl;
+	enabled = true;
+	r = 0;
+      }
+    }
+
+    RWLock::WLocker l3(m_lock);
+    m_snap_id = snap_id;
+    m_enabled = enabled;
+    m_map.resize(bl.length());
+    if (bl.length())
+      bl.copy(0, bl.length(), (char *)&m_map[0]);
+    return r;
+  }
+
+  void ObjectMap::unload()
+  {
+    Mutex::Locker l(m_update_lock);
+    while (m_updating)
+      m_update_cond.Wait(m_update_lock);
+    RWLock::WLocker l2(m_lock);
+    m_enabled = false;
+    m_map.clear();
+  }
+
+  bool ObjectMap::enabled() const
+  {
+    RWLock::RLocker l(m_lock);
+    return m_enabled;
+  }
+
+  bool ObjectMap::object_may_exist(uint64_t object_no) const
+  {
+    RWLock::RLocker l(m_lock);
+    return !m_enabled || test(object_no);
+  }
+
+  void ObjectMap::aio_mark_exists(uint64_t object_no, Context *on_marked)
+  {
+    if (!object_may_exist(object_no)) {
+      Mutex::Locker l(m_update_lock);
+      Waiters::iterator p = m_updating_objects.find(object_no);
+      if (p != m_updating_objects.end()) {
+	// already on its way; go after the writes that sent it
+	p->second.push_back(on_marked);
+	return;
+      }
+      bool wanted;
+      {
+	// someone may have beaten us to it
+	RWLock::RLocker l2(m_lock);
+	wanted = m_enabled && !test(object_no);
+	assert(!wanted || m_snap_id == CEPH_NOSNAP);
+      }
+      if (wanted) {
+	m_pending_objects[object_no].push_back(on_marked);
+	if (!m_updating)
+	  send_update();
+	return;
+      }
+    }
+    on_marked->complete(0);
+  }
+
+  void ObjectMap::aio_flush(Context *on_flushed)
+  {
+    {
+      Mutex::Locker l(m_update_lock);
+      if (!m_pending_objects.empty()) {
+	m_pending_flushes.push_back(on_flushed);
+	return;
+      }
+      if (m_updating) {
+	m_updating_flushes.push_back(on_flushed);
+	return;
+      }
+    }
+    on_flushed->complete(0);
+  }
+
+  void ObjectMap::flush()
+  {
+    Mutex mylock("librbd::ObjectMap::flush");
+    Cond cond;
+    bool done;
+    int r;
+    aio_flush(new C_SafeCond(&mylock, &cond, &done, &r));
+    mylock.Lock();
+    while (!done)
+      cond.Wait(mylock);
+    mylock.Unlock();
+  }
+
+  void ObjectMap::send_update()
+  {
+    assert(m_update_lock.is_locked());
+    assert(!m_updating);
+    m_updating = true;
+    m_updating_objects.swap(m_pending_objects);
+    m_updating_flushes.swap(m_pending_flushes);
+    if (!m_finisher_started) {
+      m_finisher.start();
+      m_finisher_started = true;
+    }
+
+    string oid = object_map_name(m_ictx->id, CEPH_NOSNAP);
+    librados::ObjectWriteOperation op;
+    // one call per run of consecutive objects
+    Waiters::iterator p = m_updating_objects.begin();
+    while (p != m_updating_objects.end()) {
+      uint64_t start = p->first;
+      uint64_t end = start + 1;
+      for (++p; p != m_updating_objects.end() && p->first == end; ++p)
+	++end;
+      ldout(m_ictx->cct, 20) << "marking objects " << start << " to " << end
+			     << " in " << oid << dendl;
+      cls_client::object_map_update(&op, start, end, 1);
+    }
+
+    Context *ctx = new C_OnFinisher(new C_UpdateMap(this), &m_finisher);
+    librados::AioCompletion *rados_completion =
+      librados::Rados::aio_create_completion(ctx, NULL, rados_ctx_cb);
+    int r = m_ictx->md_ctx.aio_operate(oid, rados_completion, &op);
+    assert(r == 0);
+    rados_completion->release();
+  }
+
+  void ObjectMap::handle_update(int r)
+  {
+    string oid = object_map_name(m_ictx->id, CEPH_NOSNAP);
+    bool gone = false;
+    if (r == -ENOENT) {
+      // nobody can trust the map any more, including us
+      lderr(m_ictx->cct) << "object map " << oid << " is gone, ignoring it"
+			 << dendl;
+      gone = true;
+      r = 0;
+    } else if (r < 0) {
+      lderr(m_ictx->cct) << "error updating object map " << oid << ": "
+			 << cpp_strerror(r) << dendl;
+    }
+
+    m_update_lock.Lock();
+    // the bits are only set once every write waiting for them is gone,
+    // so later writes to the same objects can't overtake these
+    while (true) {
+      std::list<Context*> ls;
+      for (Waiters::iterator p = m_updating_objects.begin();
+	   p != m_updating_objects.end(); ++p)
+	ls.splice(ls.end(), p->second);
+      if (ls.empty())
+	break;
+      m_update_lock.Unlock();
+      for (std::list<Context*>::iterator p = ls.begin(); p != ls.end(); ++p)
+	(*p)->complete(r);
+      m_update_lock.Lock();
+    }
+
+    if (r == 0) {
+      RWLock::WLocker l(m_lock);
+      if (gone) {
+	m_enabled = false;
+	m_map.clear();
+      } else {
+	for (Waiters::iterator p = m_updating_objects.begin();
+	     p != m_updating_objects.end(); ++p) {
+	  uint64_t b = p->first / 8;
+	  if (b >= m_map.size())
+	    m_map.resize(b + 1);
+	  m_map[b] |= 1 << (p->first % 8);
+	}
+      }
+    }
+    m_updating_objects.clear();
+    std::list<Context*> flushes;
+    flushes.swap(m_updating_flushes);
+    m_updating = false;
+    if (!m_pending_objects.empty())
+      send_update();
+    m_update_cond.Signal();
+    m_update_lock.Unlock();
+
+    for (std::list<Context*>::iterator p = flushes.begin(); p != flushes.end(); ++p)
+      (*p)->complete(0);
+  }
+
+  int ObjectMap::mark_absent(uint64_t start_object_no, uint64_t end_object_no)
+  {
+    if (start_object_no >= end_object_no)
+      return 0;
+
+    Mutex::Locker l(m_update_lock);
+    while (m_updating)
+      m_update_cond.Wait(m_update_lock);
+    {
+      RWLock::RLocker l2(m_lock);
+      if (!m_enabled)
+	return 0;
+      assert(m_snap_id == CEPH_NOSNAP);
+    }
+
+    string oid = object_map_name(m_ictx->id, CEPH_NOSNAP);
+    ldout(m_ictx->cct, 20) << "clearing objects " << start_object_no << " to "
+			   << end_object_no << " in " << oid << dendl;
+    int r = cls_client::object_map_update(&m_ictx->md_ctx, oid,
+					  start_object_no, end_object_no, 0);
+    if (r < 0) {
+      // the bits stay set, which is safe
+      lderr(m_ictx->cct) << "error updating object map " << oid << ": "
+			 << cpp_strerror(r) << dendl;
+      return r;
+    }
+
+    RWLock::WLocker l2(m_lock);
+    for (uint64_t i = start_object_no;
+	 i < end_object_no && i / 8 < m_map.size();
+	 ++i)
+      m_map[i / 8] &= ~(1 << (i % 8));
+    return 0;
+  }
+
+  int ObjectMap::merge_into(snap_t snap_id, bool seal)
+  {
+    bufferlist bl;
+    {
+      RWLock::RLocker l(m_lock);
+      if (!m_enabled)
+	return 0;
+      if (!m_map.empty())
+	bl.append((const char *)&m_map[0], m_map.size());
+    }
+
+    string oid = object_map_name(m_ictx->id, snap_id);
+    librados::ObjectWriteOperation op;
+    cls_client::object_map_merge(&op, bl);
+    if (seal) {
+      ldout(m_ictx->cct, 20) << "sealing object map " << oid << dendl;
+      bufferlist sealed;
+      op.setxattr(RBD_OBJECT_MAP_SEALED, sealed);
+    }
+    int r = m_ictx->md_ctx.operate(oid, &op);
+    if (r < 0 && r != -ENOENT) {
+      lderr(m_ictx->cct) << "error merging object map into " << oid << ": "
+			 << cpp_strerror(r) << dendl;
+      return r;
+    }
+    return 0;
+  }
+}
@@ -0,0 +1,122 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+#ifndef CEPH_LIBRBD_OBJECTMAP_H
+#define CEPH_LIBRBD_OBJECTMAP_H
+
+#include <inttypes.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/Cond.h"
+#include "common/Finisher.h"
+#include "common/Mutex.h"
+#include "common/RWLock.h"
+#include "include/Context.h"
+#include "include/buffer.h"
+#include "include/rados/librados.hpp"
+
+namespace librbd {
+
+  struct ImageCtx;
+
+  /**
+   * Which data objects of an image, or of one of its snapshots, exist.
+   *
+   * Images created with RBD_FEATURE_OBJECT_MAP keep a bitmap object
+   * next to the header, with one bit per data object, and one more per
+   * snapshot.  A set bit means the object may exist; a clear one means
+   * it definitely does not, so reads, diffs and deletes can skip it
+   * without asking the OSDs.  To keep that true without relying on
+   * advisory image locks, a bit is set on the OSD (atomically, by the
+   * rbd class) before the first write to its object is sent, and only
+   * cleared after the object has been removed.  A map that can't be
+   * read is ignored, and every object is then assumed to exist.
+   *
+   * Bits wanted while an update is on its way to the OSD are collected
+   * and sent together in the next one, and the writes waiting for them
+   * are let go from our own finisher thread.
+   */
+  class ObjectMap {
+  public:
+    ObjectMap(ImageCtx *ictx);
+    ~ObjectMap();
+
+    static std::string object_map_name(const std::string &image_id,
+				       librados::snap_t snap_id);
+
+    /**
+     * Read the map of the head (CEPH_NOSNAP) or of a snapshot from the
+     * OSDs, replacing what we have.  A snapshot's map is only used once
+     * it is sealed: writers that were late to see the snapshot may
+     * still be adding to it before that.  Takes snap_lock.
+     *
+     * @returns 0 on success, or if the image has no map or it is
+     * missing, negative error code if it couldn't be read (the old map
+     * is kept then)
+     */
+    int load(librados::snap_t snap_id);
+    /// forget the map; every object may exist again
+    void unload();
+
+    bool enabled() const;
+    bool object_may_exist(uint64_t object_no) const;
+
+    /**
+     * Record on the OSD, then here, that object_no of the head is
+     * about to be written, and complete on_marked with 0 once the write
+     * may be sent, or with a negative error code if it must not.  If
+     * the bit is set already, on_marked is completed before we return.
+     * Otherwise it is completed in the finisher thread, so it may
+     * block, and writes to one object are let go in the order they got
+     * here.
+     */
+    void aio_mark_exists(uint64_t object_no, Context *on_marked);
+    /// complete on_flushed once the writes that got here before are let go
+    void aio_flush(Context *on_flushed);
+    void flush();
+    /// record that objects [start_object_no, end_object_no) are gone
+    int mark_absent(uint64_t start_object_no, uint64_t end_object_no);
+    /**
+     * Set the bits of every object we think exists in a snapshot's map
+     * (or the head's), and seal it if nobody else could be adding to it.
+     */
+    int merge_into(librados::snap_t snap_id, bool seal);
+
+  private:
+    bool test(uint64_t object_no) const {
+      uint64_t b = object_no / 8;
+      return b < m_map.size() && (m_map[b] & (1 << (object_no % 8)));
+    }
+
+    /// writes waiting for the bits of these objects
+    typedef std::map<uint64_t, std::list<Context*> > Waiters;
+
+    class C_UpdateMap;
+    friend class C_UpdateMap;
+
+    void send_update();
+    void handle_update(int r);
+
+    ImageCtx *m_ictx;
+    Finisher m_finisher;  ///< lets the writes go once their bits are set
+    bool m_finisher_started;
+
+    Mutex m_update_lock;  ///< serializes OSD updates with load(); protects:
+    Cond m_update_cond;
+    bool m_updating;  ///< an update is in flight or letting its writes go
+    Waiters m_updating_objects;
+    std::list<Context*> m_updating_flushes;
+    Waiters m_pending_objects;  ///< for the next update
+    std::list<Context*> m_pending_flushes;
+
+    mutable RWLock m_lock;  ///< protects the members below
+    librados::snap_t m_snap_id;
+    bool m_enabled;
+    std::vector<unsigned char> m_map;
+  };
+}
+
+#endif
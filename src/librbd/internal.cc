@@ -6,6 +6,7 @@
 #include "common/ceph_context.h"
 #include "common/dout.h"
 #include "common/errno.h"
+#include "common/Throttle.h"
 #include "cls/lock/cls_lock_client.h"
 #include "include/inttypes.h"
 #include "include/stringify.h"
@@ -15,6 +16,7 @@
 #include "librbd/AioCompletion.h"
 #include "librbd/AioRequest.h"
 #include "librbd/ImageCtx.h"
+#include "librbd/ObjectMap.h"
 
 #include "librbd/internal.h"
 #include "librbd/parent_types.h"
@@ -143,7 +145,7 @@ namespace librbd {
     return 0;
   }
 
-  void trim_image(ImageCtx *ictx, uint64_t newsize, ProgressContext& prog_ctx)
+  int trim_image(ImageCtx *ictx, uint64_t newsize, ProgressContext& prog_ctx)
   {
     CephContext *cct = (CephContext *)ictx->data_ctx.cct();
 
@@ -164,12 +166,35 @@ namespace librbd {
     if (delete_start < num_objects) {
       ldout(cct, 2) << "trim_image objects " << delete_start << " to "
 		    << (num_objects - 1) << dendl;
+      // a fresh copy of the map, in case someone else wrote since we
+      // loaded ours
+      ObjectMap object_map(ictx);
+      object_map.load(CEPH_NOSNAP);
+      SimpleThrottle throttle(max(1, cct->_conf->rbd_concurrent_management_ops),
+			      true);
       for (uint64_t i = delete_start; i < num_objects; ++i) {
-	string oid = ictx->get_object_name(i);
-	ictx->data_ctx.remove(oid);
+	if (object_map.object_may_exist(i)) {
+	  string oid = ictx->get_object_name(i);
+	  Context *ctx = new C_SimpleThrottle(&throttle);
+	  librados::AioCompletion *rados_completion =
+	    Rados::aio_create_completion(ctx, NULL, rados_ctx_cb);
+	  int r = ictx->data_ctx.aio_remove(oid, rados_completion);
+	  rados_completion->release();
+	  if (r < 0) {
+	    // the completion will never fire
+	    ctx->complete(r);
+	    break;
+	  }
+	}
 	prog_ctx.update_progress((i - delete_start) * object_size,
 				 (num_objects - delete_start) * object_size);
       }
+      int r = throttle.wait_for_ret();
+      if (r < 0) {
+	lderr(cct) << "error removing objects: " << cpp_strerror(r) << dendl;
+	return r;
+      }
+      object_map.mark_absent(delete_start, num_objects);
     }
 
     // discard the weird boundary, if any
@@ -188,6 +213,7 @@ namespace librbd {
 	}
       }
     }
+    return 0;
   }
 
   int read_rbd_info(IoCtx& io_ctx, const string& info_oid,
@@ -313,15 +339,60 @@ namespace librbd {
     uint64_t numseg = ictx->get_num_objects();
     uint64_t bsize = ictx->get_object_size();
 
+    // objects that existed at the snapshot are about to come back, so
+    // the head map has to cover them before we start
+    ObjectMap head_map(ictx), snap_map(ictx);
+    int r = head_map.load(CEPH_NOSNAP);
+    if (r < 0)
+      return r;
+    r = snap_map.load(snap_id);
+    if (r < 0)
+      return r;
+    if (head_map.enabled() && numseg) {
+      if (snap_map.enabled()) {
+	r = snap_map.merge_into(CEPH_NOSNAP, false);
+	if (r < 0)
+	  return r;
+      } else {
+	// without a map of the snapshot, any object may come back
+	r = cls_client::object_map_update(&ictx->md_ctx,
+					  ObjectMap::object_map_name(ictx->id,
+								     CEPH_NOSNAP),
+					  0, numseg, 1);
+	if (r < 0 && r != -ENOENT)
+	  return r;
+	head_map.unload();
+      }
+    }
+
+    CephContext *cct = ictx->cct;
+    SimpleThrottle throttle(max(1, cct->_conf->rbd_concurrent_management_ops),
+			    true);
     for (uint64_t i = 0; i < numseg; i++) {
-      int r;
+      // absent from both, so there is nothing to roll back
+      if (!head_map.object_may_exist(i) && !snap_map.object_may_exist(i))
+	continue;
       string oid = ictx->get_object_name(i);
-      r = ictx->data_ctx.selfmanaged_snap_rollback(oid, snap_id);
-      ldout(ictx->cct, 10) << "selfmanaged_snap_rollback on " << oid << " to "
-			   << snap_id << " returned " << r << dendl;
+      ldout(cct, 10) << "selfmanaged_snap_rollback on " << oid << " to "
+		     << snap_id << dendl;
+      librados::ObjectWriteOperation op;
+      op.selfmanaged_snap_rollback(snap_id);
+      Context *ctx = new C_SimpleThrottle(&throttle);
+      librados::AioCompletion *rados_completion =
+	Rados::aio_create_completion(ctx, NULL, rados_ctx_cb);
+      r = ictx->data_ctx.aio_operate(oid, rados_completion, &op);
+      rados_completion->release();
+      if (r < 0) {
+	ctx->complete(r);
+	break;
+      }
       prog_ctx.update_progress(i * bsize, numseg * bsize);
-      if (r < 0 && r != -ENOENT)
-	return r;
+    }
+
+    r = throttle.wait_for_ret();
+    if (r < 0) {
+      lderr(cct) << "error rolling back image: " << cpp_strerror(r) << dendl;
+      return r;
     }
     return 0;
   }
@@ -430,6 +501,17 @@ namespace librbd {
     if (r < 0)
       return r;
 
+    if (ictx->write_log) {
+      // the snapshot must have every write acknowledged so far, and a
+      // flush only makes them safe in the log
+      r = ictx->flush_cache();
+      if (r < 0) {
+	lderr(ictx->cct) << "error writing back the write log: "
+			 << cpp_strerror(r) << dendl;
+	return r;
+      }
+    }
+
     RWLock::RLocker l(ictx->md_lock);
     do {
       r = add_snap(ictx, snap_name);
@@ -510,6 +592,13 @@ namespace librbd {
     if (r < 0)
       return r;
 
+    if (ictx->features & RBD_FEATURE_OBJECT_MAP) {
+      r = ictx->md_ctx.remove(ObjectMap::object_map_name(ictx->id, snap_id));
+      if (r < 0 && r != -ENOENT)
+	lderr(ictx->cct) << "error removing snapshot object map: "
+			 << cpp_strerror(r) << dendl;
+    }
+
     notify_change(ictx->md_ctx, ictx->header_oid, NULL, ictx);
 
     ictx->perfcounter->inc(l_librbd_snap_remove);
@@ -762,6 +851,16 @@ reprotect_and_return_err:
       }
     }
 
+    if (features & RBD_FEATURE_OBJECT_MAP) {
+      // an empty map: no data objects yet
+      r = io_ctx.create(ObjectMap::object_map_name(id, CEPH_NOSNAP), true);
+      if (r < 0) {
+	lderr(cct) << "error creating object map: " << cpp_strerror(r)
+		   << dendl;
+	goto err_remove_header;
+      }
+    }
+
     ldout(cct, 2) << "done." << dendl;
     return 0;
 
@@ -1242,6 +1341,18 @@ reprotect_and_return_err:
     return 0;
   }
 
+  /**
+   * Drop a reference to a parent image, closing it with the last one.
+   * A child drops its own when it detaches the parent; ops that pinned
+   * the parent (parent_ref.inc() under the child's parent_lock) drop
+   * theirs when they are done with it.
+   */
+  void put_parent(ImageCtx *parent)
+  {
+    if (parent->parent_ref.dec() == 0)
+      close_image(parent);
+  }
+
   int get_parent_info(ImageCtx *ictx, string *parent_pool_name,
 		      string *parent_name, string *parent_snap_name)
   {
@@ -1325,8 +1436,13 @@ reprotect_and_return_err:
       unknown_format = false;
       id = ictx->id;
       ictx->md_lock.get_read();
-      trim_image(ictx, 0, prog_ctx);
+      r = trim_image(ictx, 0, prog_ctx);
       ictx->md_lock.put_read();
+      if (r < 0) {
+	lderr(cct) << "error removing image data" << dendl;
+	close_image(ictx);
+	return r;
+      }
 
       ictx->parent_lock.get_read();
       // struct assignment
@@ -1341,6 +1457,15 @@ reprotect_and_return_err:
       }
       close_image(ictx);
 
+      if (!old_format) {
+	r = io_ctx.remove(ObjectMap::object_map_name(id, CEPH_NOSNAP));
+	if (r < 0 && r != -ENOENT) {
+	  lderr(cct) << "error removing object map: " << cpp_strerror(r)
+		     << dendl;
+	  return r;
+	}
+      }
+
       ldout(cct, 2) << "removing header..." << dendl;
       r = io_ctx.remove(header_oid);
       if (r < 0 && r != -ENOENT) {
@@ -1403,7 +1528,9 @@ reprotect_and_return_err:
     } else {
       ldout(cct, 2) << "shrinking image " << ictx->size << " -> " << size
 		    << dendl;
-      trim_image(ictx, size, prog_ctx);
+      int r = trim_image(ictx, size, prog_ctx);
+      if (r < 0)
+	return r;
     }
     ictx->size = size;
 
@@ -1446,7 +1573,7 @@ reprotect_and_return_err:
       return r;
 
     RWLock::WLocker l(ictx->md_lock);
-    if (size < ictx->size && ictx->object_cacher) {
+    if (size < ictx->size && (ictx->cache_enabled() || ictx->write_log)) {
       // need to invalidate since we're deleting objects, and
       // ObjectCacher doesn't track non-existent objects
       ictx->invalidate_cache();
@@ -1519,6 +1646,23 @@ reprotect_and_return_err:
       return r;
     }
 
+    if (ictx->features & RBD_FEATURE_OBJECT_MAP) {
+      // the snapshot gets a copy of the head's map.  writers that
+      // haven't seen the snapshot yet merge what they add to the head
+      // into it when they do (see ictx_refresh), and one holding the
+      // exclusive lock seals it then.  until it is sealed, readers of
+      // the snapshot just don't use a map.
+      bufferlist bl;
+      r = ictx->md_ctx.read(ObjectMap::object_map_name(ictx->id, CEPH_NOSNAP),
+			    bl, 0, 0);
+      if (r >= 0)
+	r = ictx->md_ctx.write_full(ObjectMap::object_map_name(ictx->id,
+							       snap_id), bl);
+      if (r < 0)
+	lderr(ictx->cct) << "error copying object map to snapshot: "
+			 << cpp_strerror(r) << dendl;
+    }
+
     return 0;
   }
 
@@ -1580,7 +1724,7 @@ reprotect_and_return_err:
 	  ictx->parent->id != ictx->get_parent_image_id(ictx->snap_id) ||
 	  ictx->parent->snap_id != ictx->get_parent_snap_id(ictx->snap_id)) {
 	ictx->clear_nonexistence_cache();
-	close_image(ictx->parent);
+	put_parent(ictx->parent);
 	ictx->parent = NULL;
       }
     }
@@ -1597,6 +1741,48 @@ reprotect_and_return_err:
     return 0;
   }
 
+  /// (re)load the image's own object map for the snapshot it is set to
+  static int refresh_object_map(ImageCtx *ictx)
+  {
+    ictx->snap_lock.get_read();
+    snap_t snap_id = ictx->snap_id;
+    ictx->snap_lock.put_read();
+
+    // writers keep the head's map to set bits in; readers have no use for it
+    if (snap_id == CEPH_NOSNAP && ictx->read_only) {
+      ictx->object_map.unload();
+      return 0;
+    }
+    return ictx->object_map.load(snap_id);
+  }
+
+  /**
+   * Whether a clear bit in the object map means the object really
+   * doesn't exist, so there is no need to ask the OSD.  A snapshot's
+   * map is only loaded once it is sealed (see ObjectMap::load()), and
+   * doesn't change after that.  The head's map is only reloaded when
+   * the header is refreshed, which another client's object writes
+   * don't cause, so it is only authoritative while we hold the
+   * exclusive lock.
+   *
+   * Call with md_lock held.
+   */
+  static bool object_map_authoritative(ImageCtx *ictx, snap_t snap_id)
+  {
+    if (snap_id != CEPH_NOSNAP)
+      return true;
+    if (!ictx->exclusive_locked)
+      return false;
+    entity_name_t me = entity_name_t::CLIENT(ictx->client_id);
+    map<rados::cls::lock::locker_id_t,
+	rados::cls::lock::locker_info_t>::const_iterator it;
+    for (it = ictx->lockers.begin(); it != ictx->lockers.end(); ++it) {
+      if (it->first.locker == me)
+	return true;
+    }
+    return false;
+  }
+
   int ictx_refresh(ImageCtx *ictx)
   {
     CephContext *cct = ictx->cct;
@@ -1610,6 +1796,7 @@ reprotect_and_return_err:
 
     ::SnapContext new_snapc;
     bool new_snap = false;
+    vector<snap_t> new_snap_ids;
     vector<string> snap_names;
     vector<uint64_t> snap_sizes;
     vector<uint64_t> snap_features;
@@ -1704,6 +1891,7 @@ reprotect_and_return_err:
 	    find(ictx->snaps.begin(), ictx->snaps.end(), new_snapc.snaps[i].val);
 	  if (it == ictx->snaps.end()) {
 	    new_snap = true;
+	    new_snap_ids.push_back(new_snapc.snaps[i].val);
 	    ldout(cct, 20) << "new snapshot id=" << new_snapc.snaps[i].val
 			   << " name=" << snap_names[i]
 			   << " size=" << snap_sizes[i]
@@ -1749,8 +1937,23 @@ reprotect_and_return_err:
 
     if (new_snap) {
       _flush(ictx);
+
+      // writes we sent before we knew about the new snapshots may have
+      // ended up in them.  with the exclusive lock nobody else writes,
+      // so after that the maps are complete
+      if (ictx->snap_id == CEPH_NOSNAP && !ictx->read_only) {
+	bool seal = object_map_authoritative(ictx, CEPH_NOSNAP);
+	for (vector<snap_t>::iterator p = new_snap_ids.begin();
+	     p != new_snap_ids.end();
+	     ++p)
+	  ictx->object_map.merge_into(*p, seal);
+      }
     }
 
+    int r = refresh_object_map(ictx);
+    if (r < 0)
+      return r;
+
     ictx->refresh_lock.Lock();
     ictx->last_refresh = refresh_seq;
     ictx->refresh_lock.Unlock();
@@ -1816,13 +2019,14 @@ reprotect_and_return_err:
   }
 
   struct CopyProgressCtx {
-    CopyProgressCtx(ProgressContext &p)
-      : destictx(NULL), src_size(0), prog_ctx(p)
+    CopyProgressCtx(ProgressContext &p, SimpleThrottle *t)
+      : destictx(NULL), src_size(0), prog_ctx(p), throttle(t)
     { }
 
     ImageCtx *destictx;
     uint64_t src_size;
     ProgressContext &prog_ctx;
+    SimpleThrottle *throttle;
   };
 
   int do_copy_extent(uint64_t offset, size_t len, const char *buf, void *data)
@@ -1831,7 +2035,14 @@ reprotect_and_return_err:
     cp->prog_ctx.update_progress(offset, cp->src_size);
     int ret = 0;
     if (buf) {
-      ret = write(cp->destictx, offset, len, buf);
+      // aio_write copies buf, so the next read can reuse it right away
+      Context *ctx = new C_SimpleThrottle(cp->throttle);
+      AioCompletion *comp = aio_create_completion_internal(ctx, rbd_ctx_cb);
+      ret = aio_write(cp->destictx, offset, len, buf, comp);
+      comp->release();
+      // only an error from before the write started; comp won't finish
+      if (ret < 0)
+	ctx->complete(ret);
     }
     return ret;
   }
@@ -1873,7 +2084,9 @@ reprotect_and_return_err:
 
   int copy(ImageCtx *src, ImageCtx *dest, ProgressContext &prog_ctx)
   {
-    CopyProgressCtx cp(prog_ctx);
+    SimpleThrottle throttle(max(1, src->cct->_conf->rbd_concurrent_management_ops),
+			    false);
+    CopyProgressCtx cp(prog_ctx, &throttle);
 
     src->md_lock.get_read();
     src->snap_lock.get_read();
@@ -1896,6 +2109,10 @@ reprotect_and_return_err:
     cp.src_size = src_size;
 
     int64_t r = read_iterate(src, 0, src_size, do_copy_extent, &cp);
+    // writes may still be in flight even if the reads failed
+    int ret = throttle.wait_for_ret();
+    if (r >= 0)
+      r = ret;
 
     if (r >= 0) {
       // don't return total bytes read, which may not fit in an int
@@ -1909,20 +2126,26 @@ reprotect_and_return_err:
 
   int _snap_set(ImageCtx *ictx, const char *snap_name)
   {
-    RWLock::WLocker l1(ictx->snap_lock);
-    RWLock::WLocker l2(ictx->parent_lock);
-    int r;
-    if ((snap_name != NULL) && (strlen(snap_name) != 0)) {
-      r = ictx->snap_set(snap_name);
-    } else {
-      ictx->snap_unset();
-      r = 0;
-    }
-    if (r < 0) {
-      return r;
+    snap_t old_snap_id;
+    {
+      RWLock::WLocker l1(ictx->snap_lock);
+      RWLock::WLocker l2(ictx->parent_lock);
+      old_snap_id = ictx->snap_id;
+      int r;
+      if ((snap_name != NULL) && (strlen(snap_name) != 0)) {
+	r = ictx->snap_set(snap_name);
+      } else {
+	ictx->snap_unset();
+	r = 0;
+      }
+      if (r < 0) {
+	return r;
+      }
+      refresh_parent(ictx);
+      if (ictx->snap_id == old_snap_id)
+	return 0;
     }
-    refresh_parent(ictx);
-    return 0;
+    return refresh_object_map(ictx);
   }
 
   int snap_set(ImageCtx *ictx, const char *snap_name)
@@ -1932,7 +2155,7 @@ reprotect_and_return_err:
     // ignore return value, since we may be set to a non-existent
     // snapshot and the user is trying to fix that
     ictx_check(ictx);
-    if (ictx->object_cacher) {
+    if (ictx->cache_enabled() || ictx->write_log) {
       // complete pending writes before we're set to a snapshot and
       // get -EROFS for writes
       RWLock::WLocker l(ictx->md_lock);
@@ -1970,6 +2193,18 @@ reprotect_and_return_err:
     if ((r = _snap_set(ictx, ictx->snap_name.c_str())) < 0)
       goto err_close;
 
+    if (ictx->want_write_log()) {
+      // replays whatever a previous open left behind
+      r = ictx->open_write_log();
+      if (r < 0)
+	goto err_close;
+    } else if (!ictx->read_only && ictx->snap_name.empty()) {
+      // writing around someone's write log could be undone by its replay
+      r = ictx->check_write_log_owner();
+      if (r < 0)
+	goto err_close;
+    }
+
     return 0;
 
   err_close:
@@ -1980,13 +2215,15 @@ reprotect_and_return_err:
   void close_image(ImageCtx *ictx)
   {
     ldout(ictx->cct, 20) << "close_image " << ictx << dendl;
-    if (ictx->object_cacher)
+    if (ictx->cache_enabled())
       ictx->shutdown_cache(); // implicitly flushes
     else
       flush(ictx);
+    // anything the flush failed to write back stays in the log
+    ictx->close_write_log();
 
     if (ictx->parent) {
-      close_image(ictx->parent);
+      put_parent(ictx->parent);
       ictx->parent = NULL;
     }
 
@@ -1997,6 +2234,97 @@ reprotect_and_return_err:
   }
 
   // 'flatten' child image by copying all parent's blocks
+  class C_CopyupDone : public Context {
+  public:
+    C_CopyupDone(CephContext *cct, SimpleThrottle *throttle)
+      : m_cct(cct), m_throttle(throttle) {}
+    virtual void finish(int r) {
+      if (r < 0)
+	lderr(m_cct) << "failed to copy block to child: " << cpp_strerror(r)
+		     << dendl;
+      m_throttle->end_op(r);
+    }
+  private:
+    CephContext *m_cct;
+    SimpleThrottle *m_throttle;
+  };
+
+  /// sends the copyup once the object map has the object
+  class C_CopyupMarked : public Context {
+  public:
+    C_CopyupMarked(ImageCtx *ictx, uint64_t object_no,
+		   SimpleThrottle *throttle, bufferlist &bl)
+      : m_ictx(ictx), m_object_no(object_no), m_throttle(throttle) {
+      m_bl.claim(bl);
+    }
+    virtual void finish(int r) {
+      if (r < 0) {
+	m_throttle->end_op(r);
+	return;
+      }
+
+      // the slot passes on to the copyup; taking another one here could
+      // block the thread that completes our own ops
+      Context *ctx = new C_CopyupDone(m_ictx->cct, m_throttle);
+      librados::ObjectWriteOperation op;
+      op.exec("rbd", "copyup", m_bl);
+      librados::AioCompletion *rados_completion =
+	Rados::aio_create_completion(ctx, NULL, rados_ctx_cb);
+      r = m_ictx->data_ctx.aio_operate(m_ictx->get_object_name(m_object_no),
+				       rados_completion, &op);
+      rados_completion->release();
+      if (r < 0)
+	ctx->complete(r);
+    }
+  private:
+    ImageCtx *m_ictx;
+    uint64_t m_object_no;
+    SimpleThrottle *m_throttle;
+    bufferlist m_bl;
+  };
+
+  /**
+   * Copy one object of a clone up from its parent, once the read of the
+   * parent data completes.  Holds a throttle slot until the copyup is
+   * done.
+   */
+  class C_CopyupObject : public Context {
+  public:
+    C_CopyupObject(ImageCtx *ictx, uint64_t object_no,
+		   SimpleThrottle *throttle)
+      : m_ictx(ictx), m_object_no(object_no), m_throttle(throttle) {
+      m_throttle->start_op();
+    }
+    bufferlist *get_bl() {
+      return &m_bl;
+    }
+    virtual void finish(int r) {
+      if (r < 0) {
+	lderr(m_ictx->cct) << "reading from parent failed: "
+			   << cpp_strerror(r) << dendl;
+	m_throttle->end_op(r);
+	return;
+      }
+
+      // for actual amount read, if data is all zero, don't bother with block
+      // (the read itself skips what the parent's object map says is absent)
+      if (m_bl.is_zero()) {
+	m_throttle->end_op(0);
+	return;
+      }
+
+      // we run in the thread that completes librados ops, so the object
+      // map update can't be waited for here
+      m_ictx->object_map.aio_mark_exists(
+	m_object_no, new C_CopyupMarked(m_ictx, m_object_no, m_throttle, m_bl));
+    }
+  private:
+    ImageCtx *m_ictx;
+    uint64_t m_object_no;
+    SimpleThrottle *m_throttle;
+    bufferlist m_bl;
+  };
+
   int flatten(ImageCtx *ictx, ProgressContext &prog_ctx)
   {
     ldout(ictx->cct, 20) << "flatten" << dendl;
@@ -2042,42 +2370,60 @@ reprotect_and_return_err:
       overlap_objects = overlap_periods * ictx->get_stripe_count();
     }
 
-    char *buf = new char[object_size];
+    // pin the parent so copyups can keep reading from it if a refresh
+    // detaches it from us
+    ImageCtx *parent;
+    {
+      RWLock::RLocker l(ictx->parent_lock);
+      // stop early if the parent went away - it just means
+      // another flatten finished first, so this one is useless.
+      if (!ictx->parent)
+	return 0;
+      parent = ictx->parent;
+      parent->parent_ref.inc();
+    }
 
+    SimpleThrottle throttle(max(1, ictx->cct->_conf->rbd_concurrent_management_ops),
+			    false);
+    bool parent_gone = false;
     for (uint64_t ono = 0; ono < overlap_objects; ono++) {
       prog_ctx.update_progress(ono, overlap_objects);
 
+      {
+	RWLock::RLocker l(ictx->parent_lock);
+	parent_gone = (ictx->parent != parent);
+      }
+      if (parent_gone)
+	break;
+
       // map child object onto the parent
       vector<pair<uint64_t,uint64_t> > objectx;
       Striper::extent_to_file(ictx->cct, &ictx->layout,
-			    ono, 0, object_size,
-			    objectx);
+			      ono, 0, object_size,
+			      objectx);
       uint64_t object_overlap = ictx->prune_parent_extents(objectx, overlap);
       assert(object_overlap <= object_size);
 
-      RWLock::RLocker l(ictx->parent_lock);
-      // stop early if the parent went away - it just means
-      // another flatten finished first, so this one is useless.
-      if (!ictx->parent) {
-	r = 0;
-	goto err;
-      }
-      if ((r = read(ictx->parent, objectx, buf, NULL)) < 0) {
-	lderr(ictx->cct) << "reading from parent failed" << dendl;
-	goto err;
+      C_CopyupObject *ctx = new C_CopyupObject(ictx, ono, &throttle);
+      AioCompletion *comp = aio_create_completion_internal(ctx, rbd_ctx_cb);
+      r = aio_read(parent, objectx, NULL, ctx->get_bl(), comp);
+      comp->release();
+      if (r < 0) {
+	ctx->complete(r);
+	break;
       }
+    }
 
-      // for actual amount read, if data is all zero, don't bother with block
-      if (!buf_is_zero(buf, r)) {
-	bufferlist bl;
-	string oid = ictx->get_object_name(ono);
-	bl.append(buf, r);
-	r = cls_client::copyup(&ictx->data_ctx, oid, bl);
-	if (r < 0) {
-	  lderr(ictx->cct) << "failed to copy block to child" << dendl;
-	  goto err;
-	}
-      }
+    r = throttle.wait_for_ret();
+    put_parent(parent);
+    if (r >= 0 && parent_gone) {
+      ldout(ictx->cct, 10) << "parent went away, another flatten finished"
+			   << dendl;
+      return 0;
+    }
+    if (r < 0) {
+      lderr(ictx->cct) << "failed to copy up objects from parent" << dendl;
+      return r;
     }
 
     // remove parent from this (base) image
@@ -2106,9 +2452,7 @@ reprotect_and_return_err:
 
     ldout(ictx->cct, 20) << "finished flattening" << dendl;
 
-  err:
-    delete[] buf;
-    return r;
+    return 0;
   }
 
   int list_lockers(ImageCtx *ictx,
@@ -2220,6 +2564,14 @@ reprotect_and_return_err:
     ctx->complete(comp->get_return_value());
   }
 
+  struct ReadIterateOp {
+    bufferlist bl;
+    AioCompletion *c;
+    bool done;
+    int ret;
+    ReadIterateOp() : c(NULL), done(false), ret(0) {}
+  };
+
   int64_t read_iterate(ImageCtx *ictx, uint64_t off, uint64_t len,
 		       int (*cb)(uint64_t, size_t, const char *, void *),
 		       void *arg)
@@ -2242,44 +2594,61 @@ reprotect_and_return_err:
     uint64_t period = ictx->get_stripe_period();
     uint64_t left = mylen;
 
-    start_time = ceph_clock_now(ictx->cct);
-    while (left > 0) {
-      uint64_t period_off = off - (off % period);
-      uint64_t read_len = min(period_off + period - off, left);
-
-      bufferlist bl;
-
-      Mutex mylock("IoCtxImpl::write::mylock");
-      Cond cond;
-      bool done;
-      int ret;
+    // keep up to rbd_concurrent_management_ops periods in flight, and
+    // hand them to cb strictly in order.  Memory is bounded by the
+    // window: at most that many periods are buffered at once.
+    int concurrency = max(1, ictx->cct->_conf->rbd_concurrent_management_ops);
+    Mutex mylock("librbd::read_iterate::mylock");
+    Cond cond;
+    deque<ReadIterateOp*> in_flight;
+    int err = 0;
 
-      Context *ctx = new C_SafeCond(&mylock, &cond, &done, &ret);
-      AioCompletion *c = aio_create_completion_internal(ctx, rbd_ctx_cb);
-      r = aio_read(ictx, off, read_len, NULL, &bl, c);
-      if (r < 0) {
-	c->release();
-	delete ctx;
-	return r;
+    start_time = ceph_clock_now(ictx->cct);
+    while (left > 0 || !in_flight.empty()) {
+      while (!err && left > 0 && (int)in_flight.size() < concurrency) {
+	uint64_t period_off = off - (off % period);
+	uint64_t read_len = min(period_off + period - off, left);
+
+	ReadIterateOp *op = new ReadIterateOp;
+	Context *ctx = new C_SafeCond(&mylock, &cond, &op->done, &op->ret);
+	op->c = aio_create_completion_internal(ctx, rbd_ctx_cb);
+	r = aio_read(ictx, off, read_len, NULL, &op->bl, op->c);
+	if (r < 0) {
+	  op->c->release();
+	  delete ctx;
+	  delete op;
+	  err = r;
+	  break;
+	}
+	in_flight.push_back(op);
+	left -= read_len;
+	off += read_len;
       }
+      if (in_flight.empty())
+	break;
 
+      ReadIterateOp *op = in_flight.front();
+      in_flight.pop_front();
       mylock.Lock();
-      while (!done)
+      while (!op->done)
 	cond.Wait(mylock);
       mylock.Unlock();
+      op->c->release();
 
-      c->release();
-      if (ret < 0)
-	return ret;
-
-      r = cb(total_read, ret, bl.c_str(), arg);
-      if (r < 0)
-	return r;
-
-      total_read += ret;
-      left -= ret;
-      off += ret;
+      // after an error, just wait for what is still in flight
+      if (!err && op->ret < 0)
+	err = op->ret;
+      if (!err) {
+	r = cb(total_read, op->ret, op->bl.c_str(), arg);
+	if (r < 0)
+	  err = r;
+	else
+	  total_read += op->ret;
+      }
+      delete op;
     }
+    if (err < 0)
+      return err;
 
     elapsed = ceph_clock_now(ictx->cct) - start_time;
     ictx->perfcounter->tinc(l_librbd_rd_latency, elapsed);
@@ -2300,6 +2669,166 @@ reprotect_and_return_err:
   }
 
 
+  struct DiffObject {
+    uint64_t off;	///< image offset the extents' buffer offsets are from
+    object_t oid;
+    vector<ObjectExtent> extents;
+    librados::ObjectReadOperation op;
+    librados::snap_set_t snap_set;
+    librados::AioCompletion *c;	///< NULL if we know it doesn't exist
+    int r;
+
+    DiffObject(uint64_t o, const object_t& oid)
+      : off(o), oid(oid), c(NULL), r(0) {}
+    ~DiffObject() {
+      if (c)
+	c->release();
+    }
+  };
+
+  /**
+   * Find the image's data objects that exist at the head, if that looks
+   * cheaper than asking each object in the len bytes being diffed
+   *
+   * Listing is only done at CEPH_NOSNAP: the OSD can't list at a snap
+   * while a PG is missing objects.  So it's only useful for a diff from
+   * the beginning of time to the head, where an object that isn't there
+   * now can't have changed; list_snaps on each listed object finds the
+   * rest.
+   *
+   * @param existing [out] names of those objects
+   * @param listed [out] true if existing was filled in
+   */
+  int list_image_objects(ImageCtx *ictx, librados::IoCtx& head_ctx,
+			 snap_t from_snap_id, snap_t end_snap_id, uint64_t len,
+			 set<string> *existing, bool *listed)
+  {
+    *listed = false;
+    if (from_snap_id != 0 || end_snap_id != CEPH_NOSNAP)
+      return 0;
+
+    librados::Rados rados(head_ctx);
+    std::list<string> pools;
+    pools.push_back(head_ctx.get_pool_name());
+    map<string, librados::stats_map> stats;
+    int r = rados.get_pool_stats(pools, stats);
+    if (r < 0)
+      return 0;	// no matter; probe each object instead
+    uint64_t pool_objects = 0;
+    for (librados::stats_map::iterator p = stats[pools.front()].begin();
+	 p != stats[pools.front()].end();
+	 ++p)
+      pool_objects += p->second.num_objects;
+    uint64_t range_objects = len / ictx->get_object_size() + 1;
+    ldout(ictx->cct, 20) << "diff_iterate pool has " << pool_objects
+			 << " objects, range covers " << range_objects << dendl;
+    if (pool_objects > range_objects)
+      return 0;
+
+    librados::IoCtx list_ctx;
+    list_ctx.dup(head_ctx);
+    list_ctx.snap_set_read(CEPH_NOSNAP);
+    try {
+      for (librados::ObjectIterator p = list_ctx.objects_begin();
+	   p != list_ctx.objects_end();
+	   ++p) {
+	if (p->first.compare(0, ictx->object_prefix.length(),
+			     ictx->object_prefix) == 0)
+	  existing->insert(p->first);
+      }
+    } catch (const std::exception& e) {
+      ldout(ictx->cct, 10) << "diff_iterate listing failed: " << e.what()
+			   << dendl;
+      existing->clear();
+      return 0;
+    }
+    ldout(ictx->cct, 10) << "diff_iterate listed " << existing->size()
+			 << " image objects" << dendl;
+    *listed = true;
+    return 0;
+  }
+
+  /// report the changed extents of one object; stops at cb's first error
+  int diff_object(ImageCtx *ictx, DiffObject *d,
+		  snap_t from_snap_id, snap_t end_snap_id,
+		  const interval_set<uint64_t>& parent_diff,
+		  int (*cb)(uint64_t, size_t, int, void *),
+		  void *arg)
+  {
+    ldout(ictx->cct, 20) << "diff_iterate object " << d->oid << dendl;
+
+    uint64_t off = d->off;
+    if (d->r == -ENOENT) {
+      if (from_snap_id == 0 && !parent_diff.empty()) {
+	// report parent diff instead
+	for (vector<ObjectExtent>::iterator q = d->extents.begin(); q != d->extents.end(); ++q) {
+	  for (vector<pair<uint64_t,uint64_t> >::iterator r = q->buffer_extents.begin();
+	       r != q->buffer_extents.end();
+	       ++r) {
+	    interval_set<uint64_t> o;
+	    o.insert(off + r->first, r->second);
+	    o.intersection_of(parent_diff);
+	    ldout(ictx->cct, 20) << " reporting parent overlap " << o << dendl;
+	    for (interval_set<uint64_t>::iterator s = o.begin(); s != o.end(); ++s) {
+	      int r = cb(s.get_start(), s.get_len(), true, arg);
+	      if (r < 0)
+		return r;
+	    }
+	  }
+	}
+      }
+      return 0;
+    }
+    if (d->r < 0)
+      return d->r;
+
+    // calc diff from from_snap_id -> to_snap_id
+    interval_set<uint64_t> diff;
+    bool end_exists;
+    calc_snap_set_diff(ictx->cct, d->snap_set,
+		       from_snap_id,
+		       end_snap_id,
+		       &diff, &end_exists);
+    ldout(ictx->cct, 20) << "  diff " << diff << " end_exists=" << end_exists << dendl;
+    if (diff.empty())
+      return 0;
+
+    for (vector<ObjectExtent>::iterator q = d->extents.begin(); q != d->extents.end(); ++q) {
+      ldout(ictx->cct, 20) << "diff_iterate object " << d->oid
+			   << " extent " << q->offset << "~" << q->length
+			   << " from " << q->buffer_extents
+			   << dendl;
+      uint64_t opos = q->offset;
+      for (vector<pair<uint64_t,uint64_t> >::iterator r = q->buffer_extents.begin();
+	   r != q->buffer_extents.end();
+	   ++r) {
+	interval_set<uint64_t> overlap;  // object extents
+	overlap.insert(opos, r->second);
+	overlap.intersection_of(diff);
+	ldout(ictx->cct, 20) << " opos " << opos
+			     << " buf " << r->first << "~" << r->second
+			     << " overlap " << overlap
+			     << dendl;
+	for (interval_set<uint64_t>::iterator s = overlap.begin();
+	     s != overlap.end();
+	     ++s) {
+	  uint64_t su_off = s.get_start() - opos;
+	  uint64_t logical_off = off + r->first + su_off;
+	  ldout(ictx->cct, 20) << "   overlap extent " << s.get_start() << "~" << s.get_len()
+			       << " logical "
+			       << logical_off << "~" << s.get_len()
+			       << dendl;
+	  int cr = cb(logical_off, s.get_len(), end_exists, arg);
+	  if (cr < 0)
+	    return cr;
+	}
+	opos += r->second;
+      }
+      assert(opos == q->offset + q->length);
+    }
+    return 0;
+  }
+
   int diff_iterate(ImageCtx *ictx, const char *fromsnapname,
 		   uint64_t off, uint64_t len,
 		   int (*cb)(uint64_t, size_t, int, void *),
@@ -2372,97 +2901,96 @@ reprotect_and_return_err:
 	return r;
     }
 
+    // objects absent from the object maps at both ends can't have
+    // changed.  without maps, a full diff of the head can list the pool
+    // instead when it holds no more objects than the range covers: that
+    // is cheaper than probing every object, most of which don't exist
+    // in a sparse image
+    ObjectMap end_map(ictx), from_map(ictx);
+    bool use_maps = false;
+    r = end_map.load(end_snap_id);
+    if (r == 0 && from_snap_id)
+      r = from_map.load(from_snap_id);
+    if (r == 0 && end_map.enabled() &&
+	(from_snap_id == 0 || from_map.enabled())) {
+      ldout(ictx->cct, 10) << "diff_iterate using object maps" << dendl;
+      use_maps = true;
+    }
+
+    set<string> existing;
+    bool use_existing = false;
+    if (!use_maps) {
+      r = list_image_objects(ictx, head_ctx, from_snap_id, end_snap_id, len,
+			     &existing, &use_existing);
+      if (r < 0)
+	return r;
+    }
+
+    // list_snaps for up to rbd_concurrent_management_ops objects at a
+    // time; results are consumed in offset order
+    int concurrency = max(1, ictx->cct->_conf->rbd_concurrent_management_ops);
     uint64_t period = ictx->get_stripe_period();
     uint64_t left = len;
-
-    while (left > 0) {
-      uint64_t period_off = off - (off % period);
-      uint64_t read_len = min(period_off + period - off, left);
-
-      // map to extents
-      map<object_t,vector<ObjectExtent> > object_extents;
-      Striper::file_to_extents(ictx->cct, ictx->format_string, &ictx->layout,
-			       off, read_len, object_extents, 0);
-
-      // get snap info for each object
-      for (map<object_t,vector<ObjectExtent> >::iterator p = object_extents.begin();
-	   p != object_extents.end();
-	   ++p) {
-	ldout(ictx->cct, 20) << "diff_iterate object " << p->first << dendl;
-
-	librados::snap_set_t snap_set;
-	int r = head_ctx.list_snaps(p->first.name, &snap_set);
-	if (r == -ENOENT) {
-	  if (from_snap_id == 0 && !parent_diff.empty()) {
-	    // report parent diff instead
-	    for (vector<ObjectExtent>::iterator q = p->second.begin(); q != p->second.end(); ++q) {
-	      for (vector<pair<uint64_t,uint64_t> >::iterator r = q->buffer_extents.begin();
-		   r != q->buffer_extents.end();
-		   ++r) {
-		interval_set<uint64_t> o;
-		o.insert(off + r->first, r->second);
-		o.intersection_of(parent_diff);
-		ldout(ictx->cct, 20) << " reporting parent overlap " << o << dendl;
-		for (interval_set<uint64_t>::iterator s = o.begin(); s != o.end(); ++s) {
-		  cb(s.get_start(), s.get_len(), true, arg);
-		}
-	      }
+    deque<DiffObject*> queue;
+    int err = 0;
+
+    while (left > 0 || !queue.empty()) {
+      while (!err && left > 0 && (int)queue.size() < concurrency) {
+	uint64_t period_off = off - (off % period);
+	uint64_t read_len = min(period_off + period - off, left);
+
+	// map to extents
+	map<object_t,vector<ObjectExtent> > object_extents;
+	Striper::file_to_extents(ictx->cct, ictx->format_string, &ictx->layout,
+				 off, read_len, object_extents, 0);
+
+	for (map<object_t,vector<ObjectExtent> >::iterator p = object_extents.begin();
+	     p != object_extents.end();
+	     ++p) {
+	  DiffObject *d = new DiffObject(off, p->first);
+	  d->extents.swap(p->second);
+	  uint64_t object_no = d->extents.front().objectno;
+	  if ((use_maps && !end_map.object_may_exist(object_no) &&
+	       (from_snap_id == 0 || !from_map.object_may_exist(object_no))) ||
+	      (use_existing && !existing.count(p->first.name))) {
+	    d->r = -ENOENT;
+	  } else {
+	    d->c = librados::Rados::aio_create_completion();
+	    d->op.list_snaps(&d->snap_set, NULL);
+	    r = head_ctx.aio_operate(p->first.name, d->c, &d->op, NULL);
+	    if (r < 0) {
+	      // never sent, so don't wait for it
+	      d->c->release();
+	      d->c = NULL;
+	      d->r = r;
 	    }
 	  }
-	  continue;
+	  queue.push_back(d);
 	}
-	if (r < 0)
-	  return r;
-
-	// calc diff from from_snap_id -> to_snap_id
-	interval_set<uint64_t> diff;
-	bool end_exists;
-	calc_snap_set_diff(ictx->cct, snap_set,
-			   from_snap_id,
-			   end_snap_id,
-			   &diff, &end_exists);
-	ldout(ictx->cct, 20) << "  diff " << diff << " end_exists=" << end_exists << dendl;
-	if (diff.empty())
-	  continue;
 
-	for (vector<ObjectExtent>::iterator q = p->second.begin(); q != p->second.end(); ++q) {
-	  ldout(ictx->cct, 20) << "diff_iterate object " << p->first
-			       << " extent " << q->offset << "~" << q->length
-			       << " from " << q->buffer_extents
-			       << dendl;
-	  uint64_t opos = q->offset;
-	  for (vector<pair<uint64_t,uint64_t> >::iterator r = q->buffer_extents.begin();
-	       r != q->buffer_extents.end();
-	       ++r) {
-	    interval_set<uint64_t> overlap;  // object extents
-	    overlap.insert(opos, r->second);
-	    overlap.intersection_of(diff);
-	    ldout(ictx->cct, 20) << " opos " << opos
-				 << " buf " << r->first << "~" << r->second
-				 << " overlap " << overlap
-				 << dendl;
-	    for (interval_set<uint64_t>::iterator s = overlap.begin();
-		 s != overlap.end();
-		 ++s) {
-	      uint64_t su_off = s.get_start() - opos;
-	      uint64_t logical_off = off + r->first + su_off;
-	      ldout(ictx->cct, 20) << "   overlap extent " << s.get_start() << "~" << s.get_len()
-				   << " logical "
-				   << logical_off << "~" << s.get_len()
-				   << dendl;
-	      cb(logical_off, s.get_len(), end_exists, arg);
-	    }
-	    opos += r->second;
-	  }
-	  assert(opos == q->offset + q->length);
-	}
+	left -= read_len;
+	off += read_len;
       }
-
-      left -= read_len;
-      off += read_len;
+      if (queue.empty())
+	break;
+
+      DiffObject *d = queue.front();
+      queue.pop_front();
+      if (d->c) {
+	d->c->wait_for_complete();
+	d->r = d->c->get_return_value();
+      }
+      // after an error, just wait for what is still in flight
+      if (!err) {
+	r = diff_object(ictx, d, from_snap_id, end_snap_id, parent_diff,
+			cb, arg);
+	if (r < 0)
+	  err = r;
+      }
+      delete d;
     }
 
-    return 0;
+    return err;
   }
 
   int simple_read_cb(uint64_t ofs, size_t len, const char *buf, void *arg)
@@ -2688,6 +3216,30 @@ reprotect_and_return_err:
     return 0;
   }
 
+  /// flushes the writes sent so far wherever they went
+  class C_FlushWrites : public Context {
+  public:
+    C_FlushWrites(ImageCtx *ictx, Context *on_safe)
+      : m_ictx(ictx), m_on_safe(on_safe) {}
+    virtual void finish(int r) {
+      if (m_ictx->write_log) {
+	// writes are safe once they are in the log
+	m_ictx->write_log->sync(m_on_safe);
+      } else if (m_ictx->cache_enabled()) {
+	m_ictx->flush_cache_aio(m_on_safe);
+      } else {
+	librados::AioCompletion *rados_completion =
+	  librados::Rados::aio_create_completion(m_on_safe, NULL,
+						 rados_ctx_cb);
+	m_ictx->data_ctx.aio_flush_async(rados_completion);
+	rados_completion->release();
+      }
+    }
+  private:
+    ImageCtx *m_ictx;
+    Context *m_on_safe;
+  };
+
   int aio_flush(ImageCtx *ictx, AioCompletion *c)
   {
     CephContext *cct = ictx->cct;
@@ -2703,14 +3255,8 @@ reprotect_and_return_err:
     c->add_request();
     c->init_time(ictx, AIO_TYPE_FLUSH);
     C_AioWrite *req_comp = new C_AioWrite(cct, c);
-    if (ictx->object_cacher) {
-      ictx->flush_cache_aio(req_comp);
-    } else {
-      librados::AioCompletion *rados_completion =
-	librados::Rados::aio_create_completion(req_comp, NULL, rados_ctx_cb);
-      ictx->data_ctx.aio_flush_async(rados_completion);
-      rados_completion->release();
-    }
+    // writes still waiting for the object map have to be sent first
+    ictx->object_map.aio_flush(new C_FlushWrites(ictx, req_comp));
     c->finish_adding_requests(cct);
     c->put();
     ictx->perfcounter->inc(l_librbd_aio_flush);
@@ -2736,7 +3282,8 @@ reprotect_and_return_err:
     CephContext *cct = ictx->cct;
     int r;
     // flush any outstanding writes
-    if (ictx->object_cacher) {
+    ictx->object_map.flush();
+    if (ictx->cache_enabled() || ictx->write_log) {
       r = ictx->flush_cache();
     } else {
       r = ictx->data_ctx.aio_flush();
@@ -2748,6 +3295,66 @@ reprotect_and_return_err:
     return r;
   }
 
+  /// sends one object extent of an aio_write once the object map has it
+  class C_MarkedWrite : public Context {
+  public:
+    C_MarkedWrite(ImageCtx *ictx, const ObjectExtent &extent, bufferlist &bl,
+		  const ::SnapContext &snapc, snapid_t snap_id, uint64_t overlap,
+		  bool may_exist, C_AioWrite *req_comp)
+      : m_ictx(ictx), m_extent(extent), m_snapc(snapc), m_snap_id(snap_id),
+	m_overlap(overlap), m_may_exist(may_exist), m_req_comp(req_comp) {
+      m_bl.claim(bl);
+    }
+    virtual void finish(int r) {
+      if (r < 0) {
+	m_req_comp->complete(r);
+	return;
+      }
+
+      if (m_ictx->write_log) {
+	m_ictx->write_log->write(m_extent.oid,
+				 object_locator_t(m_ictx->data_ctx.get_id()),
+				 m_extent.offset, m_bl, m_snapc, m_req_comp);
+	return;
+      }
+      if (m_ictx->cache_enabled()) {
+	m_ictx->write_to_cache(m_extent.oid, m_bl, m_extent.length,
+			       m_extent.offset, m_req_comp);
+	return;
+      }
+
+      // reverse map this object extent onto the parent
+      vector<pair<uint64_t,uint64_t> > objectx;
+      Striper::extent_to_file(m_ictx->cct, &m_ictx->layout,
+			      m_extent.objectno, 0,
+			      m_ictx->layout.fl_object_size, objectx);
+      uint64_t object_overlap = m_ictx->prune_parent_extents(objectx,
+							      m_overlap);
+
+      AioWrite *req = new AioWrite(m_ictx, m_extent.oid.name,
+				   m_extent.objectno, m_extent.offset,
+				   objectx, object_overlap,
+				   m_bl, m_snapc, m_snap_id, m_req_comp);
+      if (!m_may_exist && req->has_parent()) {
+	// no need for the guarded write to tell us to copy up
+	req->complete(-ENOENT);
+      } else {
+	r = req->send();
+	if (r < 0)
+	  req->complete(r);
+      }
+    }
+  private:
+    ImageCtx *m_ictx;
+    ObjectExtent m_extent;
+    bufferlist m_bl;
+    ::SnapContext m_snapc;
+    snapid_t m_snap_id;
+    uint64_t m_overlap;
+    bool m_may_exist;
+    C_AioWrite *m_req_comp;
+  };
+
   int aio_write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf,
 		AioCompletion *c)
   {
@@ -2799,36 +3406,21 @@ reprotect_and_return_err:
 	bl.append(buf + q->first, q->second);
       }
 
+      // the object map has to know about the object before it exists
+      bool may_exist = ictx->object_map.object_may_exist(p->objectno);
       C_AioWrite *req_comp = new C_AioWrite(cct, c);
-      if (ictx->object_cacher) {
-	c->add_request();
-	ictx->write_to_cache(p->oid, bl, p->length, p->offset, req_comp);
-      } else {
-	// reverse map this object extent onto the parent
-	vector<pair<uint64_t,uint64_t> > objectx;
-	Striper::extent_to_file(ictx->cct, &ictx->layout,
-			      p->objectno, 0, ictx->layout.fl_object_size,
-			      objectx);
-	uint64_t object_overlap = ictx->prune_parent_extents(objectx, overlap);
-
-	AioWrite *req = new AioWrite(ictx, p->oid.name, p->objectno, p->offset,
-				     objectx, object_overlap,
-				     bl, snapc, snap_id, req_comp);
-	c->add_request();
-	r = req->send();
-	if (r < 0)
-	  goto done;
-      }
+      c->add_request();
+      ictx->object_map.aio_mark_exists(
+	p->objectno, new C_MarkedWrite(ictx, *p, bl, snapc, snap_id, overlap,
+				       may_exist, req_comp));
     }
-  done:
     c->finish_adding_requests(ictx->cct);
     c->put();
 
     ictx->perfcounter->inc(l_librbd_aio_wr);
     ictx->perfcounter->inc(l_librbd_aio_wr_bytes, mylen);
 
-    /* FIXME: cleanup all the allocated stuff */
-    return r;
+    return 0;
   }
 
   int aio_discard(ImageCtx *ictx, uint64_t off, uint64_t len, AioCompletion *c)
@@ -2861,6 +3453,10 @@ reprotect_and_return_err:
     if (snap_id != CEPH_NOSNAP || ictx->read_only)
       return -EROFS;
 
+    ictx->md_lock.get_read();
+    bool trust_object_map = object_map_authoritative(ictx, snap_id);
+    ictx->md_lock.put_read();
+
     // map
     vector<ObjectExtent> extents;
     Striper::file_to_extents(ictx->cct, ictx->format_string, &ictx->layout, off, len, extents);
@@ -2870,9 +3466,6 @@ reprotect_and_return_err:
     for (vector<ObjectExtent>::iterator p = extents.begin(); p != extents.end(); ++p) {
       ldout(cct, 20) << " oid " << p->oid << " " << p->offset << "~" << p->length
 		     << " from " << p->buffer_extents << dendl;
-      C_AioWrite *req_comp = new C_AioWrite(cct, c);
-      AbstractWrite *req;
-      c->add_request();
 
       // reverse map this object extent onto the parent
       vector<pair<uint64_t,uint64_t> > objectx;
@@ -2884,6 +3477,15 @@ reprotect_and_return_err:
 	object_overlap = ictx->prune_parent_extents(objectx, overlap);
       }
 
+      bool may_exist = ictx->object_map.object_may_exist(p->objectno);
+      // nothing there to discard, unless it comes from the parent
+      if (!may_exist && !object_overlap && trust_object_map)
+	continue;
+
+      C_AioWrite *req_comp = new C_AioWrite(cct, c);
+      AbstractWrite *req;
+      c->add_request();
+
       if (p->offset == 0 && p->length == ictx->layout.fl_object_size) {
 	req = new AioRemove(ictx, p->oid.name, p->objectno, objectx, object_overlap,
 			    snapc, snap_id, req_comp);
@@ -2896,15 +3498,27 @@ reprotect_and_return_err:
 			  snapc, snap_id, req_comp);
       }
 
-      r = req->send();
-      if (r < 0)
-	goto done;
+      Context *on_ready = new C_SendWrite(req);
+      if (!may_exist)
+	on_ready = new C_MarkExists(ictx, p->objectno, on_ready);
+      if (ictx->write_log) {
+	// logged writes must not be written back on top of the discard
+	ictx->write_log->wait_for_writeback(p->oid, p->offset, p->length,
+					    on_ready);
+      } else {
+	on_ready->complete(0);
+      }
     }
-    r = 0;
-  done:
-    if (ictx->object_cacher) {
-      Mutex::Locker l(ictx->cache_lock);
-      ictx->object_cacher->discard_set(ictx->object_set, extents);
+    if (ictx->cache_enabled()) {
+      map<CacheShard*, vector<ObjectExtent> > by_shard;
+      for (vector<ObjectExtent>::iterator p = extents.begin();
+	   p != extents.end(); ++p)
+	by_shard[ictx->get_cache_shard(p->oid)].push_back(*p);
+      for (map<CacheShard*, vector<ObjectExtent> >::iterator p =
+	     by_shard.begin(); p != by_shard.end(); ++p) {
+	Mutex::Locker l(p->first->lock);
+	p->first->object_cacher->discard_set(p->first->object_set, p->second);
+      }
     }
 
     c->finish_adding_requests(ictx->cct);
@@ -2913,8 +3527,7 @@ reprotect_and_return_err:
     ictx->perfcounter->inc(l_librbd_aio_discard);
     ictx->perfcounter->inc(l_librbd_aio_discard_bytes, len);
 
-    /* FIXME: cleanup all the allocated stuff */
-    return r;
+    return 0;
   }
 
   void rbd_req_cb(completion_t cb, void *arg)
@@ -2942,12 +3555,17 @@ reprotect_and_return_err:
     if (r < 0)
       return r;
 
+    ictx->md_lock.get_read();
     ictx->snap_lock.get_read();
     snap_t snap_id = ictx->snap_id;
+    uint64_t image_size = ictx->get_image_size(snap_id);
     ictx->snap_lock.put_read();
+    bool trust_object_map = object_map_authoritative(ictx, snap_id);
+    ictx->md_lock.put_read();
 
     // map
     map<object_t,vector<ObjectExtent> > object_extents;
+    Readahead::extent_t readahead_extent(0, 0);
 
     uint64_t buffer_ofs = 0;
     for (vector<pair<uint64_t,uint64_t> >::const_iterator p = image_extents.begin();
@@ -2958,13 +3576,23 @@ reprotect_and_return_err:
       if (r < 0)
 	return r;
 
+      if (ictx->cache_enabled()) {
+	Readahead::read_type_t type;
+	Readahead::extent_t e = ictx->readahead.update(p->first, len,
+						       image_size, &type);
+	if (type == Readahead::READ_SEQ_HIT)
+	  ictx->perfcounter->inc(l_librbd_readahead_hit);
+	else if (type == Readahead::READ_SEQ_MISS)
+	  ictx->perfcounter->inc(l_librbd_readahead_miss);
+	if (e.second)
+	  readahead_extent = e;
+      }
+
       Striper::file_to_extents(ictx->cct, ictx->format_string, &ictx->layout,
 			       p->first, len, object_extents, buffer_ofs);
       buffer_ofs += len;
     }
 
-    int64_t ret;
-
     c->read_buf = buf;
     c->read_buf_len = buffer_ofs;
     c->read_bl = pbl;
@@ -2984,7 +3612,21 @@ reprotect_and_return_err:
 	req_comp->set_req(req);
 	c->add_request();
 
-	if (ictx->object_cacher) {
+	if (trust_object_map &&
+	    !ictx->object_map.object_may_exist(q->objectno)) {
+	  // read zeros, or go straight to the parent
+	  req->complete(-ENOENT);
+	} else if (ictx->write_log && snap_id == CEPH_NOSNAP) {
+	  // what the log doesn't have all of is read from the OSDs, with
+	  // the logged parts laid over it
+	  r = ictx->write_log->read(q->oid, q->offset, q->length, &req->data(),
+				    &req->m_logged);
+	  if (r == 0)
+	    r = req->send();
+	  if (r != 0)
+	    req->complete(r);
+	  r = 0;  // any error is reported through req
+	} else if (ictx->cache_enabled()) {
 	  C_CacheRead *cache_comp = new C_CacheRead(req_comp, req);
 	  ictx->aio_read_from_cache(q->oid, &req->data(),
 				    q->length, q->offset,
@@ -2994,21 +3636,27 @@ reprotect_and_return_err:
 	  if (r < 0 && r == -ENOENT)
 	    r = 0;
 	  if (r < 0) {
-	    ret = r;
+	    req->complete(r);
 	    goto done;
 	  }
 	}
       }
     }
-    ret = buffer_ofs;
+
+    // after the reads we were asked for, so they go out first
+    if (readahead_extent.second)
+      ictx->readahead_to_cache(readahead_extent.first,
+			       readahead_extent.second);
   done:
+    if (r < 0)
+      c->set_error(r);
     c->finish_adding_requests(ictx->cct);
     c->put();
 
     ictx->perfcounter->inc(l_librbd_aio_rd);
     ictx->perfcounter->inc(l_librbd_aio_rd_bytes, buffer_ofs);
 
-    return ret;
+    return buffer_ofs;
   }
 
   AioCompletion *aio_create_completion() {
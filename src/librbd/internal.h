@@ -40,6 +40,11 @@ enum {
   l_librbd_aio_flush,
   l_librbd_aio_flush_latency,
 
+  l_librbd_readahead,            // readahead ops issued
+  l_librbd_readahead_bytes,      // bytes prefetched
+  l_librbd_readahead_hit,        // sequential reads already prefetched
+  l_librbd_readahead_miss,       // sequential reads that were not
+
   l_librbd_snap_create,
   l_librbd_snap_remove,
   l_librbd_snap_rollback,
@@ -121,6 +126,7 @@ namespace librbd {
   int copy(ImageCtx *src, ImageCtx *dest, ProgressContext &prog_ctx);
 
   int open_parent(ImageCtx *ictx);
+  void put_parent(ImageCtx *parent);
   int open_image(ImageCtx *ictx);
   void close_image(ImageCtx *ictx);
 
@@ -141,7 +147,7 @@ namespace librbd {
   int break_lock(ImageCtx *ictx, const std::string& client,
 		 const std::string& cookie);
 
-  void trim_image(ImageCtx *ictx, uint64_t newsize, ProgressContext& prog_ctx);
+  int trim_image(ImageCtx *ictx, uint64_t newsize, ProgressContext& prog_ctx);
   int read_rbd_info(librados::IoCtx& io_ctx, const std::string& info_oid,
 		    struct rbd_info *info);
 
@@ -179,6 +185,10 @@ namespace librbd {
 	       char *buf, bufferlist *pbl);
   ssize_t write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf);
   int discard(ImageCtx *ictx, uint64_t off, uint64_t len);
+  /**
+   * The aio functions either fail without touching c, or return >= 0
+   * and report any later error when c completes.
+   */
   int aio_write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf,
 		AioCompletion *c);
   int aio_discard(ImageCtx *ictx, uint64_t off, uint64_t len, AioCompletion *c);
@@ -207,6 +217,8 @@ namespace librbd {
   int simple_read_cb(uint64_t ofs, size_t len, const char *buf, void *arg);
   void rados_req_cb(rados_completion_t cb, void *arg);
   void rbd_req_cb(completion_t cb, void *arg);
+  void rados_ctx_cb(rados_completion_t cb, void *arg);
+  void rbd_ctx_cb(completion_t cb, void *arg);
 }
 
 #endif
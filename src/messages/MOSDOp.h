@@ -17,6 +17,7 @@
 #define CEPH_MOSDOP_H
 
 #include "msg/Message.h"
+#include "common/ObjectPool.h"
 #include "osd/osd_types.h"
 #include "include/ceph_features.h"
 
@@ -105,6 +106,16 @@ private:
   ~MOSDOp() {}
 
 public:
+  // one per client op: built on the submitting thread, freed on the
+  // messenger's once sent; see ObjectPool
+  static ObjectPool pool;
+  static void *operator new(size_t num_bytes) {
+    return pool.alloc(num_bytes);
+  }
+  void operator delete(void *p, size_t num_bytes) {
+    pool.free(p, num_bytes);
+  }
+
   void set_version(eversion_t v) { reassert_version = v; }
   void set_mtime(utime_t mt) { mtime = mt; }
 
@@ -17,6 +17,7 @@
 #define CEPH_MOSDOPREPLY_H
 
 #include "msg/Message.h"
+#include "common/ObjectPool.h"
 
 #include "MOSDOp.h"
 #include "os/ObjectStore.h"
@@ -110,6 +111,15 @@ private:
   ~MOSDOpReply() {}
 
 public:
+  // one per client op, on both ends; see ObjectPool
+  static ObjectPool pool;
+  static void *operator new(size_t num_bytes) {
+    return pool.alloc(num_bytes);
+  }
+  void operator delete(void *p, size_t num_bytes) {
+    pool.free(p, num_bytes);
+  }
+
   virtual void encode_payload(uint64_t features) {
 
     OSDOp::merge_osd_op_vector_out_data(ops, data);
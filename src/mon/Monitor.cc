@@ -516,6 +516,8 @@ void Monitor::init_paxos()
 
   // update paxos
   for (int i = 0; i < PAXOS_NUM; ++i) {
+    // the store may have been rewritten underneath us (e.g., by a sync)
+    paxos_service[i]->invalidate_cache();
     if (paxos->is_consistent()) {
       paxos_service[i]->update_from_paxos();
     }
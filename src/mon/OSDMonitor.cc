@@ -1501,6 +1501,31 @@ MOSDMap *OSDMonitor::build_incremental(epoch_t from, epoch_t to)
   return m;
 }
 
+/**
+ * Build (or fetch from the cache) the incremental message for [from, to]
+ * as it will be encoded for con.  Without a connection we can't know the
+ * peer's features, so we skip the cache.
+ */
+MOSDMap *OSDMonitor::get_incremental_msg(epoch_t from, epoch_t to,
+					 Connection *con)
+{
+  if (!con)
+    return build_incremental(from, to);
+
+  uint64_t features = con->get_features();
+  MOSDMap *m = msg_cache.get(mon->monmap->fsid, from, to,
+			     get_first_committed(), osdmap.get_epoch(),
+			     features);
+  if (m) {
+    dout(20) << "get_incremental_msg [" << from << ".." << to << "]"
+	     << " cached, " << m->get_payload().length() << " bytes" << dendl;
+    return m;
+  }
+  m = build_incremental(from, to);
+  msg_cache.add(m, from, to, features);
+  return m;
+}
+
 void OSDMonitor::send_full(PaxosServiceMessage *m)
 {
   dout(5) << "send_full to " << m->get_orig_source_inst() << dendl;
@@ -1556,17 +1581,20 @@ void OSDMonitor::send_incremental(PaxosServiceMessage *req, epoch_t first)
   // send some maps.  it may not be all of them, but it will get them
   // started.
   epoch_t last = MIN(first + g_conf->osd_map_message_max, osdmap.get_epoch());
-  MOSDMap *m = build_incremental(first, last);
-  m->oldest_map = get_first_committed();
-  m->newest_map = osdmap.get_epoch();
+  MonSession *session = req->get_session();
+  MOSDMap *m = get_incremental_msg(first, last,
+				   (session && !session->proxy_con) ?
+				   session->con : NULL);
   mon->send_reply(req, m);
 
   if (osd >= 0)
     osd_epoch[osd] = last;
 }
 
-void OSDMonitor::send_incremental(epoch_t first, entity_inst_t& dest, bool onetime)
+void OSDMonitor::send_incremental(epoch_t first, MonSession *session,
+				  bool onetime)
 {
+  entity_inst_t& dest = session->inst;
   dout(5) << "send_incremental [" << first << ".." << osdmap.get_epoch() << "]"
 	  << " to " << dest << dendl;
 
@@ -1590,7 +1618,8 @@ void OSDMonitor::send_incremental(epoch_t first, entity_inst_t& dest, bool oneti
 
   while (first <= osdmap.get_epoch()) {
     epoch_t last = MIN(first + g_conf->osd_map_message_max, osdmap.get_epoch());
-    MOSDMap *m = build_incremental(first, last);
+    MOSDMap *m = get_incremental_msg(first, last,
+				     session->proxy_con ? NULL : session->con);
     mon->messenger->send_message(m, dest);
     first = last + 1;
     if (onetime)
@@ -1626,7 +1655,7 @@ void OSDMonitor::check_sub(Subscription *sub)
 {
   if (sub->next <= osdmap.get_epoch()) {
     if (sub->next >= 1)
-      send_incremental(sub->next, sub->session->inst, sub->incremental_onetime);
+      send_incremental(sub->next, sub->session, sub->incremental_onetime);
     else
       mon->messenger->send_message(build_latest_full(),
 				   sub->session->inst);
@@ -1966,7 +1995,19 @@ bool OSDMonitor::preprocess_command(MMonCommand *m)
 	}
       }
       if (p) {
-	if (cmd == "dump") {
+	// replies for the current map only change with the epoch
+	bool cacheable = (p == &osdmap &&
+			  (cmd == "dump" || cmd == "tree" || cmd == "getmap"));
+	bool cached = false;
+	string cache_key = cmd + " " + format;
+	if (cacheable && get_cached_reply(cache_key, rdata)) {
+	  cached = true;
+	  r = 0;
+	  if (cmd == "dump" && format != "json")
+	    ss << " ";
+	  else if (cmd == "getmap")
+	    ss << "got osdmap epoch " << p->get_epoch();
+	} else if (cmd == "dump") {
 	  stringstream ds;
 	  if (format == "json") {
 	    p->dump_json(ds);
@@ -2042,6 +2083,8 @@ bool OSDMonitor::preprocess_command(MMonCommand *m)
 	  ss << "got crush map from osdmap epoch " << p->get_epoch();
 	  r = 0;
 	}
+	if (cacheable && !cached && r == 0)
+	  cache_reply(cache_key, rdata);
 	if (p != &osdmap)
 	  delete p;
       }
@@ -26,6 +26,7 @@ using namespace std;
 #include "msg/Messenger.h"
 
 #include "osd/OSDMap.h"
+#include "osd/OSDMapMessageCache.h"
 
 #include "PaxosService.h"
 #include "Session.h"
@@ -137,6 +138,9 @@ private:
   int thrash_last_up_osd;
   bool thrash();
 
+  // encoded MOSDMap messages, shared by all subscribers
+  OSDMapMessageCache msg_cache;
+
   bool _have_pending_crush();
   CrushWrapper &_get_stable_crush();
   void _get_pending_crush(CrushWrapper& newcrush);
@@ -174,9 +178,10 @@ private:
   void send_to_waiting();     // send current map to waiters.
   MOSDMap *build_latest_full();
   MOSDMap *build_incremental(epoch_t first, epoch_t last);
+  MOSDMap *get_incremental_msg(epoch_t first, epoch_t last, Connection *con);
   void send_full(PaxosServiceMessage *m);
   void send_incremental(PaxosServiceMessage *m, epoch_t first);
-  void send_incremental(epoch_t first, entity_inst_t& dest, bool onetime);
+  void send_incremental(epoch_t first, MonSession *session, bool onetime);
 
   void remove_redundant_pg_temp();
   void remove_down_pg_temp();
@@ -290,7 +295,8 @@ private:
  public:
   OSDMonitor(Monitor *mn, Paxos *p, string service_name)
   : PaxosService(mn, p, service_name),
-    thrash_map(0), thrash_last_up_osd(-1) { }
+    thrash_map(0), thrash_last_up_osd(-1),
+    msg_cache(g_ceph_context, "mon", g_conf->osd_map_message_cache_size) { }
 
   void tick();  // check state, take actions
 
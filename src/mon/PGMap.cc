@@ -294,6 +294,13 @@ void PGMap::calc_stats()
   pg_pool_sum.clear();
   pg_sum = pool_stat_t();
   osd_sum = osd_stat_t();
+  creating_pgs.clear();
+  creating_pgs_by_osd.clear();
+  pg_by_osd.clear();
+  num_pg_by_last_epoch_clean.clear();
+  stuck_inactive.clear();
+  stuck_unclean.clear();
+  stuck_stale.clear();
 
   for (hash_map<pg_t,pg_stat_t>::iterator p = pg_stat.begin();
        p != pg_stat.end();
@@ -319,6 +326,10 @@ void PGMap::stat_pg_add(const pg_t &pgid, const pg_stat_t &s)
     if (s.acting.size())
       creating_pgs_by_osd[s.acting[0]].insert(pgid);
   }
+  if (s.acting.size())
+    pg_by_osd[s.acting[0]].insert(pgid);
+  num_pg_by_last_epoch_clean[s.last_epoch_clean]++;
+  stuck_index_update(pgid, s, true);
 }
 
 void PGMap::stat_pg_sub(const pg_t &pgid, const pg_stat_t &s)
@@ -341,6 +352,40 @@ void PGMap::stat_pg_sub(const pg_t &pgid, const pg_stat_t &s)
         creating_pgs_by_osd.erase(s.acting[0]);
     }
   }
+  if (s.acting.size()) {
+    hash_map<int,set<pg_t> >::iterator p = pg_by_osd.find(s.acting[0]);
+    if (p != pg_by_osd.end()) {
+      p->second.erase(pgid);
+      if (p->second.empty())
+	pg_by_osd.erase(p);
+    }
+  }
+  map<epoch_t,int>::iterator q = num_pg_by_last_epoch_clean.find(s.last_epoch_clean);
+  if (q != num_pg_by_last_epoch_clean.end() && --q->second == 0)
+    num_pg_by_last_epoch_clean.erase(q);
+  stuck_index_update(pgid, s, false);
+}
+
+void PGMap::stuck_index_update(const pg_t &pgid, const pg_stat_t &s, bool add)
+{
+  if ((s.state & PG_STATE_ACTIVE) == 0) {
+    if (add)
+      stuck_inactive.insert(make_pair(s.last_active, pgid));
+    else
+      stuck_inactive.erase(make_pair(s.last_active, pgid));
+  }
+  if ((s.state & PG_STATE_CLEAN) == 0) {
+    if (add)
+      stuck_unclean.insert(make_pair(s.last_clean, pgid));
+    else
+      stuck_unclean.erase(make_pair(s.last_clean, pgid));
+  }
+  if (s.state & PG_STATE_STALE) {
+    if (add)
+      stuck_stale.insert(make_pair(s.last_unstale, pgid));
+    else
+      stuck_stale.erase(make_pair(s.last_unstale, pgid));
+  }
 }
 
 void PGMap::stat_osd_add(const osd_stat_t &s)
@@ -357,15 +402,9 @@ void PGMap::stat_osd_sub(const osd_stat_t &s)
 
 epoch_t PGMap::calc_min_last_epoch_clean() const
 {
-  if (pg_stat.empty())
+  if (num_pg_by_last_epoch_clean.empty())
     return 0;
-  hash_map<pg_t,pg_stat_t>::const_iterator p = pg_stat.begin();
-  epoch_t min = p->second.last_epoch_clean;
-  for (++p; p != pg_stat.end(); ++p) {
-    if (p->second.last_epoch_clean < min)
-      min = p->second.last_epoch_clean;
-  }
-  return min;
+  return num_pg_by_last_epoch_clean.begin()->first;
 }
 
 void PGMap::encode(bufferlist &bl, uint64_t features) const
@@ -577,33 +616,27 @@ void PGMap::dump(ostream& ss) const
 void PGMap::get_stuck_stats(PGMap::StuckPG type, utime_t cutoff,
 			    hash_map<pg_t, pg_stat_t>& stuck_pgs) const
 {
-  for (hash_map<pg_t, pg_stat_t>::const_iterator i = pg_stat.begin();
-       i != pg_stat.end();
+  const stuck_index_t *index;
+  switch (type) {
+  case STUCK_INACTIVE:
+    index = &stuck_inactive;
+    break;
+  case STUCK_UNCLEAN:
+    index = &stuck_unclean;
+    break;
+  case STUCK_STALE:
+    index = &stuck_stale;
+    break;
+  default:
+    assert(0 == "invalid type");
+  }
+
+  for (stuck_index_t::const_iterator i = index->begin();
+       i != index->end() && i->first < cutoff;
        ++i) {
-    utime_t val;
-    switch (type) {
-    case STUCK_INACTIVE:
-      if (i->second.state & PG_STATE_ACTIVE)
-	continue;
-      val = i->second.last_active;
-      break;
-    case STUCK_UNCLEAN:
-      if (i->second.state & PG_STATE_CLEAN)
-	continue;
-      val = i->second.last_clean;
-      break;
-    case STUCK_STALE:
-      if ((i->second.state & PG_STATE_STALE) == 0)
-	continue;
-      val = i->second.last_unstale;
-      break;
-    default:
-      assert(0 == "invalid type");
-    }
-
-    if (val < cutoff) {
-      stuck_pgs[i->first] = i->second;
-    }
+    hash_map<pg_t, pg_stat_t>::const_iterator p = pg_stat.find(i->second);
+    assert(p != pg_stat.end());
+    stuck_pgs[i->second] = p->second;
   }
 }
 
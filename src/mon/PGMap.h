@@ -81,6 +81,16 @@ public:
   set<pg_t> creating_pgs;   // lru: front = new additions, back = recently pinged
   map<int,set<pg_t> > creating_pgs_by_osd;
 
+  // indexes (soft state), maintained by stat_pg_add()/stat_pg_sub() so that
+  // a stats report costs O(changed pgs) and queries need not walk pg_stat.
+  hash_map<int,set<pg_t> > pg_by_osd;   // primary osd -> pgs
+  map<epoch_t,int> num_pg_by_last_epoch_clean;
+
+  // pgs that are not active/clean/unstale, ordered by the time they were
+  // last in that state; the stuck ones are a prefix of each set.
+  typedef set<pair<utime_t,pg_t> > stuck_index_t;
+  stuck_index_t stuck_inactive, stuck_unclean, stuck_stale;
+
   enum StuckPG {
     STUCK_INACTIVE,
     STUCK_UNCLEAN,
@@ -104,6 +114,7 @@ public:
   void stat_pg_sub(const pg_t &pgid, const pg_stat_t &s);
   void stat_osd_add(const osd_stat_t &s);
   void stat_osd_sub(const osd_stat_t &s);
+  void stuck_index_update(const pg_t &pgid, const pg_stat_t &s, bool add);
   
   void encode(bufferlist &bl, uint64_t features=-1) const;
   void decode(bufferlist::iterator &bl);
@@ -802,6 +802,9 @@ void PGMonitor::map_pg_creates()
 {
   dout(10) << "map_pg_creates to " << pg_map.creating_pgs.size() << " pgs" << dendl;
 
+  // we are about to change pg_map without a new version
+  invalidate_cache();
+
   for (set<pg_t>::iterator p = pg_map.creating_pgs.begin();
        p != pg_map.creating_pgs.end();
        ++p) {
@@ -817,8 +820,13 @@ void PGMonitor::map_pg_creates()
       pg_map.creating_pgs_by_osd[s.acting[0]].erase(pgid);
       if (pg_map.creating_pgs_by_osd[s.acting[0]].size() == 0)
         pg_map.creating_pgs_by_osd.erase(s.acting[0]);
+      pg_map.pg_by_osd[s.acting[0]].erase(pgid);
+      if (pg_map.pg_by_osd[s.acting[0]].empty())
+	pg_map.pg_by_osd.erase(s.acting[0]);
     }
     s.acting = acting;
+    if (acting.size())
+      pg_map.pg_by_osd[acting[0]].insert(pgid);
 
     // don't send creates for localized pgs
     if (pgid.preferred() >= 0)
@@ -894,12 +902,19 @@ bool PGMonitor::check_down_pgs()
   OSDMap *osdmap = &mon->osdmon()->osdmap;
   bool ret = false;
 
-  for (hash_map<pg_t,pg_stat_t>::iterator p = pg_map.pg_stat.begin();
-       p != pg_map.pg_stat.end();
-       ++p) {
-    if ((p->second.state & PG_STATE_STALE) == 0 &&
-	p->second.acting.size() &&
-	osdmap->is_down(p->second.acting[0])) {
+  // only look at pgs whose primary is down
+  for (hash_map<int,set<pg_t> >::iterator o = pg_map.pg_by_osd.begin();
+       o != pg_map.pg_by_osd.end();
+       ++o) {
+    if (!osdmap->is_down(o->first))
+      continue;
+    for (set<pg_t>::iterator i = o->second.begin();
+	 i != o->second.end();
+	 ++i) {
+      hash_map<pg_t,pg_stat_t>::iterator p = pg_map.pg_stat.find(*i);
+      assert(p != pg_map.pg_stat.end());
+      if (p->second.state & PG_STATE_STALE)
+	continue;
       dout(10) << " marking pg " << p->first << " stale with acting " << p->second.acting << dendl;
 
       map<pg_t,pg_stat_t>::iterator q = pending_inc.pg_stat_updates.find(p->first);
@@ -1132,7 +1147,11 @@ bool PGMonitor::preprocess_command(MMonCommand *m)
       }
       Formatter *f = 0;
       r = 0;
-      if (format == "json")
+      string cache_key = "dump " + what + " " + format;
+      bool cached = get_cached_reply(cache_key, rdata);
+      if (cached)
+	ss << "dumped " << what << " in format " << format;
+      else if (format == "json")
 	f = new JSONFormatter(true);
       else if (format == "plain")
 	f = 0; //new PlainFormatter();
@@ -1141,7 +1160,7 @@ bool PGMonitor::preprocess_command(MMonCommand *m)
 	ss << "unknown format '" << format << "'";
       }
 
-      if (r == 0) {
+      if (r == 0 && !cached) {
 	stringstream ds;
 	if (f) {
 	  if (what == "all") {
@@ -1170,6 +1189,7 @@ bool PGMonitor::preprocess_command(MMonCommand *m)
 	}
 	if (r == 0) {
 	  rdata.append(ds);
+	  cache_reply(cache_key, rdata);
 	  ss << "dumped " << what << " in format " << format;
 	}
 	r = 0;
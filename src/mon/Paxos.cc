@@ -796,14 +796,25 @@ void Paxos::finish_queued_proposal()
     dout(10) << __func__ << " we must have received a stay message and we're "
              << "trying to finish before time. "
 	     << "Instead, propose it (if we are active)!" << dendl;
-  } else {
+    return;
+  }
+
+  // all the proposals folded into the last round were committed together.
+  // dequeue them all before completing any, as a completion may queue (and
+  // start proposing) a new value.
+  list<Context*> ls;
+  while (!proposals.empty()) {
+    proposal = static_cast<C_Proposal*>(proposals.front());
+    if (!proposal->proposed)
+      break;
     dout(10) << __func__ << " proposal took "
 	     << (ceph_clock_now(NULL) - proposal->proposal_time)
 	     << " to finish" << dendl;
 
     proposals.pop_front();
-    proposal->complete(0);
+    ls.push_back(proposal);
   }
+  finish_contexts(g_ceph_context, ls);
 }
 
 void Paxos::finish_proposal()
@@ -1262,15 +1273,40 @@ void Paxos::propose_queued()
   assert(!proposal->proposed);
 
   cancel_events();
-  dout(10) << __func__ << " " << (last_committed + 1)
-	  << " " << proposal->bl.length() << " bytes" << dendl;
   proposal->proposed = true;
 
+  // fold as many of the other queued proposals as we are allowed to into
+  // this round; they are independent transactions (each service writes
+  // under its own prefix) and are applied in queue order.
+  unsigned num = 1;
+  MonitorDBStore::Transaction t;
+  list<Context*>::iterator p = proposals.begin();
+  for (++p;
+       p != proposals.end() &&
+	 (g_conf->paxos_max_batch_proposals <= 0 ||
+	  num < (unsigned)g_conf->paxos_max_batch_proposals);
+       ++p, ++num) {
+    C_Proposal *other = static_cast<C_Proposal*>(*p);
+    if (num == 1)
+      t.append_from_encoded(proposal->bl);
+    t.append_from_encoded(other->bl);
+    other->proposed = true;
+  }
+
+  bufferlist bl;
+  if (num == 1)
+    bl = proposal->bl;
+  else
+    t.encode(bl);
+
+  dout(10) << __func__ << " " << (last_committed + 1)
+	  << " " << num << " proposals, " << bl.length() << " bytes" << dendl;
+
   dout(30) << __func__ << " ";
   list_proposals(*_dout);
   *_dout << dendl;
 
-  begin(proposal->bl);
+  begin(bl);
 }
 
 void Paxos::queue_proposal(bufferlist& bl, Context *onfinished)
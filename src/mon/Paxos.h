@@ -992,6 +992,10 @@ private:
   void queue_proposal(bufferlist& bl, Context *onfinished);
   /**
    * Begin proposing the Proposal at the front of the proposals queue.
+   *
+   * Any other queued proposals, up to paxos_max_batch_proposals in total,
+   * are folded into the same value so that they are committed in a single
+   * round.
    */
   void propose_queued();
   void finish_queued_proposal();
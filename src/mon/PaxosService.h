@@ -84,6 +84,38 @@ class PaxosService {
    */
   version_t trim_version;
 
+  /**
+   * Our first and last committed versions, as last read from the store.
+   *
+   * They only ever change through a Paxos commit, so they remain valid for
+   * as long as Paxos stays at cached_paxos_version.  This spares us a store
+   * lookup on every dispatch (update_from_paxos() and friends).
+   */
+  version_t cached_first_committed;
+  version_t cached_last_committed;
+  version_t cached_paxos_version;
+  bool cached_versions_valid;
+
+  /**
+   * Pre-encoded replies to read-only commands, valid for the version in
+   * cached_replies_version only.  The bufferlists handed out share their
+   * buffers with the cache, so serving a hit copies no data.
+   */
+  map<string,bufferlist> cached_replies;
+  version_t cached_replies_version;
+
+  void refresh_cached_versions() {
+    if (cached_versions_valid &&
+	cached_paxos_version == paxos->get_version())
+      return;
+    cached_first_committed =
+      mon->store->get(get_service_name(), first_committed_name);
+    cached_last_committed =
+      mon->store->get(get_service_name(), last_committed_name);
+    cached_paxos_version = paxos->get_version();
+    cached_versions_valid = true;
+  }
+
 protected:
   /**
    * @defgroup PaxosService_h_callbacks Callback classes
@@ -192,6 +224,9 @@ public:
     : mon(mn), paxos(p), service_name(name),
       service_version(0), proposal_timer(0), have_pending(false),
       trim_version(0),
+      cached_first_committed(0), cached_last_committed(0),
+      cached_paxos_version(0), cached_versions_valid(false),
+      cached_replies_version(0),
       last_committed_name("last_committed"),
       first_committed_name("first_committed"),
       last_accepted_name("last_accepted"),
@@ -237,6 +272,49 @@ public:
    */
   void shutdown();
 
+  /**
+   * Drop our cached versions and replies, e.g., because the store was
+   * modified behind Paxos' back (sync) or because the in-memory state
+   * replies are generated from changed without a new version.
+   */
+  void invalidate_cache() {
+    cached_versions_valid = false;
+    cached_replies.clear();
+  }
+
+  /**
+   * Get a cached reply to a read-only command
+   *
+   * @param key Identifies the command (and its output format)
+   * @param bl The bufferlist to be populated
+   * @returns true if a reply for our current version was cached
+   */
+  bool get_cached_reply(const string& key, bufferlist& bl) {
+    if (cached_replies_version != get_last_committed()) {
+      cached_replies.clear();
+      return false;
+    }
+    map<string,bufferlist>::iterator p = cached_replies.find(key);
+    if (p == cached_replies.end())
+      return false;
+    bl = p->second;
+    return true;
+  }
+  /**
+   * Cache the reply to a read-only command for our current version
+   *
+   * @param key Identifies the command (and its output format)
+   * @param bl The reply's data
+   */
+  void cache_reply(const string& key, const bufferlist& bl) {
+    version_t v = get_last_committed();
+    if (cached_replies_version != v) {
+      cached_replies.clear();
+      cached_replies_version = v;
+    }
+    cached_replies[key] = bl;
+  }
+
 private:
   /**
    * Update our state by updating it from Paxos, and then creating a new
@@ -878,7 +956,8 @@ public:
    * @returns Our first committed version (that is available)
    */
   version_t get_first_committed() {
-    return mon->store->get(get_service_name(), first_committed_name);
+    refresh_cached_versions();
+    return cached_first_committed;
   }
   /**
    * Get the last committed version
@@ -886,7 +965,8 @@ public:
    * @returns Our last committed version
    */
   version_t get_last_committed() {
-    return mon->store->get(get_service_name(), last_committed_name);
+    refresh_cached_versions();
+    return cached_last_committed;
   }
   /**
    * Get our current version
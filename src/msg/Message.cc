@@ -156,6 +156,9 @@ using namespace std;
 
 #define dout_subsys ceph_subsys_ms
 
+ObjectPool MOSDOp::pool(sizeof(MOSDOp));
+ObjectPool MOSDOpReply::pool(sizeof(MOSDOpReply));
+
 void Message::encode(uint64_t features, bool datacrc)
 {
   // encode and copy out of *m
@@ -17,6 +17,7 @@
 
 #include "common/debug.h"
 #include "common/config.h"
+#include "common/perf_counters.h"
 #include "include/assert.h"
 
 #define dout_subsys ceph_subsys_filestore
@@ -75,6 +76,31 @@ static bool append_unescaped(string::const_iterator begin,
   return true;
 }
 
+DBObjectMap::DBObjectMap(KeyValueDB *db)
+  : db(db),
+    header_lock("DBOBjectMap"),
+    logger(NULL),
+    map_header_cache(g_conf->filestore_omap_header_cache_size),
+    parent_cache(g_conf->filestore_omap_header_cache_size),
+    batch_lock("DBObjectMap::batch_lock")
+{
+  PerfCountersBuilder plb(g_ceph_context, "dbobjectmap",
+			  l_dbom_first, l_dbom_last);
+  plb.add_u64_counter(l_dbom_map_header_hit, "map_header_cache_hit");
+  plb.add_u64_counter(l_dbom_map_header_miss, "map_header_cache_miss");
+  plb.add_u64_counter(l_dbom_parent_hit, "parent_cache_hit");
+  plb.add_u64_counter(l_dbom_parent_miss, "parent_cache_miss");
+  logger = plb.create_perf_counters();
+  g_ceph_context->get_perfcounters_collection()->add(logger);
+}
+
+DBObjectMap::~DBObjectMap()
+{
+  assert(batches.empty());
+  g_ceph_context->get_perfcounters_collection()->remove(logger);
+  delete logger;
+}
+
 bool DBObjectMap::check(std::ostream &out)
 {
   bool retval = true;
@@ -313,7 +339,10 @@ int DBObjectMap::DBObjectMapIteratorImpl::init()
 ObjectMap::ObjectMapIterator DBObjectMap::get_iterator(
   const hobject_t &hoid)
 {
-  Header header = lookup_map_header(hoid);
+  // a failure here will show up again in the iterator's status()
+  flush_batch();
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_map_header(hl, hoid);
   if (!header)
     return ObjectMapIterator(new EmptyIteratorImpl());
   return _get_iterator(header);
@@ -500,8 +529,10 @@ int DBObjectMap::set_keys(const hobject_t &hoid,
 			  const map<string, bufferlist> &set,
 			  const SequencerPosition *spos)
 {
-  KeyValueDB::Transaction t = db->get_transaction();
-  Header header = lookup_create_map_header(hoid, t);
+  Batch *b = get_batch();
+  KeyValueDB::Transaction t = b ? b->t : db->get_transaction();
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_create_map_header(hl, hoid, t, b);
   if (!header)
     return -EINVAL;
   if (check_spos(hoid, header, spos))
@@ -509,21 +540,23 @@ int DBObjectMap::set_keys(const hobject_t &hoid,
 
   t->set(user_prefix(header), set);
 
-  return db->submit_transaction(t);
+  return submit_transaction(b, t);
 }
 
 int DBObjectMap::set_header(const hobject_t &hoid,
 			    const bufferlist &bl,
 			    const SequencerPosition *spos)
 {
-  KeyValueDB::Transaction t = db->get_transaction();
-  Header header = lookup_create_map_header(hoid, t);
+  Batch *b = get_batch();
+  KeyValueDB::Transaction t = b ? b->t : db->get_transaction();
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_create_map_header(hl, hoid, t, b);
   if (!header)
     return -EINVAL;
   if (check_spos(hoid, header, spos))
     return 0;
   _set_header(header, bl, t);
-  return db->submit_transaction(t);
+  return submit_transaction(b, t);
 }
 
 void DBObjectMap::_set_header(Header header, const bufferlist &bl,
@@ -537,7 +570,11 @@ void DBObjectMap::_set_header(Header header, const bufferlist &bl,
 int DBObjectMap::get_header(const hobject_t &hoid,
 			    bufferlist *bl)
 {
-  Header header = lookup_map_header(hoid);
+  int r = flush_batch();
+  if (r < 0)
+    return r;
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_map_header(hl, hoid);
   if (!header) {
     return 0;
   }
@@ -571,8 +608,12 @@ int DBObjectMap::_get_header(Header header,
 int DBObjectMap::clear(const hobject_t &hoid,
 		       const SequencerPosition *spos)
 {
+  int r = flush_batch();
+  if (r < 0)
+    return r;
   KeyValueDB::Transaction t = db->get_transaction();
-  Header header = lookup_map_header(hoid);
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_map_header(hl, hoid);
   if (!header)
     return -ENOENT;
   if (check_spos(hoid, header, spos))
@@ -580,7 +621,7 @@ int DBObjectMap::clear(const hobject_t &hoid,
   remove_map_header(hoid, header, t);
   assert(header->num_children > 0);
   header->num_children--;
-  int r = _clear(header, t);
+  r = _clear(header, t);
   if (r < 0)
     return r;
   return db->submit_transaction(t);
@@ -693,17 +734,28 @@ int DBObjectMap::rm_keys(const hobject_t &hoid,
 			 const set<string> &to_clear,
 			 const SequencerPosition *spos)
 {
-  Header header = lookup_map_header(hoid);
+  Batch *b = get_batch();
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_map_header(hl, hoid);
   if (!header)
     return -ENOENT;
-  KeyValueDB::Transaction t = db->get_transaction();
   if (check_spos(hoid, header, spos))
     return 0;
-  t->rmkeys(user_prefix(header), to_clear);
   if (!header->parent) {
-    return db->submit_transaction(t);
+    KeyValueDB::Transaction t = b ? b->t : db->get_transaction();
+    t->rmkeys(user_prefix(header), to_clear);
+    return submit_transaction(b, t);
   }
 
+  // copying up reads keys from the store, which must be current
+  if (b) {
+    int r = flush_batch();
+    if (r < 0)
+      return r;
+  }
+  KeyValueDB::Transaction t = db->get_transaction();
+  t->rmkeys(user_prefix(header), to_clear);
+
   // Copy up keys from parent around to_clear
   int keep_parent;
   {
@@ -768,7 +820,11 @@ int DBObjectMap::get(const hobject_t &hoid,
 		     bufferlist *_header,
 		     map<string, bufferlist> *out)
 {
-  Header header = lookup_map_header(hoid);
+  int r = flush_batch();
+  if (r < 0)
+    return r;
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_map_header(hl, hoid);
   if (!header)
     return -ENOENT;
   _get_header(header, _header);
@@ -784,11 +840,15 @@ int DBObjectMap::get(const hobject_t &hoid,
 int DBObjectMap::get_keys(const hobject_t &hoid,
 			  set<string> *keys)
 {
-  Header header = lookup_map_header(hoid);
+  int r = flush_batch();
+  if (r < 0)
+    return r;
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_map_header(hl, hoid);
   if (!header)
     return -ENOENT;
-  ObjectMapIterator iter = get_iterator(hoid);
-  for (; iter->valid(); iter->next()) {
+  ObjectMapIterator iter = _get_iterator(header);
+  for (iter->seek_to_first(); iter->valid(); iter->next()) {
     if (iter->status())
       return iter->status();
     keys->insert(iter->key());
@@ -822,7 +882,11 @@ int DBObjectMap::get_values(const hobject_t &hoid,
 			    const set<string> &keys,
 			    map<string, bufferlist> *out)
 {
-  Header header = lookup_map_header(hoid);
+  int r = flush_batch();
+  if (r < 0)
+    return r;
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_map_header(hl, hoid);
   if (!header)
     return -ENOENT;
   return scan(header, keys, 0, out);
@@ -832,7 +896,11 @@ int DBObjectMap::check_keys(const hobject_t &hoid,
 			    const set<string> &keys,
 			    set<string> *out)
 {
-  Header header = lookup_map_header(hoid);
+  int r = flush_batch();
+  if (r < 0)
+    return r;
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_map_header(hl, hoid);
   if (!header)
     return -ENOENT;
   return scan(header, keys, out, 0);
@@ -842,7 +910,11 @@ int DBObjectMap::get_xattrs(const hobject_t &hoid,
 			    const set<string> &to_get,
 			    map<string, bufferlist> *out)
 {
-  Header header = lookup_map_header(hoid);
+  int r = flush_batch();
+  if (r < 0)
+    return r;
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_map_header(hl, hoid);
   if (!header)
     return -ENOENT;
   return db->get(xattr_prefix(header), to_get, out);
@@ -851,7 +923,11 @@ int DBObjectMap::get_xattrs(const hobject_t &hoid,
 int DBObjectMap::get_all_xattrs(const hobject_t &hoid,
 				set<string> *out)
 {
-  Header header = lookup_map_header(hoid);
+  int r = flush_batch();
+  if (r < 0)
+    return r;
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_map_header(hl, hoid);
   if (!header)
     return -ENOENT;
   KeyValueDB::Iterator iter = db->get_iterator(xattr_prefix(header));
@@ -866,28 +942,32 @@ int DBObjectMap::set_xattrs(const hobject_t &hoid,
 			    const map<string, bufferlist> &to_set,
 			    const SequencerPosition *spos)
 {
-  KeyValueDB::Transaction t = db->get_transaction();
-  Header header = lookup_create_map_header(hoid, t);
+  Batch *b = get_batch();
+  KeyValueDB::Transaction t = b ? b->t : db->get_transaction();
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_create_map_header(hl, hoid, t, b);
   if (!header)
     return -EINVAL;
   if (check_spos(hoid, header, spos))
     return 0;
   t->set(xattr_prefix(header), to_set);
-  return db->submit_transaction(t);
+  return submit_transaction(b, t);
 }
 
 int DBObjectMap::remove_xattrs(const hobject_t &hoid,
 			       const set<string> &to_remove,
 			       const SequencerPosition *spos)
 {
-  KeyValueDB::Transaction t = db->get_transaction();
-  Header header = lookup_map_header(hoid);
+  Batch *b = get_batch();
+  KeyValueDB::Transaction t = b ? b->t : db->get_transaction();
+  MapHeaderLock hl(this, hoid);
+  Header header = lookup_map_header(hl, hoid);
   if (!header)
     return -ENOENT;
   if (check_spos(hoid, header, spos))
     return 0;
   t->rmkeys(xattr_prefix(header), to_remove);
-  return db->submit_transaction(t);
+  return submit_transaction(b, t);
 }
 
 int DBObjectMap::clone(const hobject_t &hoid,
@@ -897,9 +977,25 @@ int DBObjectMap::clone(const hobject_t &hoid,
   if (hoid == target)
     return 0;
 
+  int r = flush_batch();
+  if (r < 0)
+    return r;
+
+  // lock both objects, in a consistent order
+  MapHeaderLock _l1(this, MIN(hoid, target));
+  MapHeaderLock _l2(this, MAX(hoid, target));
+  MapHeaderLock *lsource, *ltarget;
+  if (hoid < target) {
+    lsource = &_l1;
+    ltarget = &_l2;
+  } else {
+    lsource = &_l2;
+    ltarget = &_l1;
+  }
+
   KeyValueDB::Transaction t = db->get_transaction();
   {
-    Header destination = lookup_map_header(target);
+    Header destination = lookup_map_header(*ltarget, target);
     if (destination) {
       remove_map_header(target, destination, t);
       if (check_spos(target, destination, spos))
@@ -909,7 +1005,7 @@ int DBObjectMap::clone(const hobject_t &hoid,
     }
   }
 
-  Header parent = lookup_map_header(hoid);
+  Header parent = lookup_map_header(*lsource, hoid);
   if (!parent)
     return db->submit_transaction(t);
 
@@ -1042,11 +1138,15 @@ int DBObjectMap::init(bool do_upgrade)
 
 int DBObjectMap::sync(const hobject_t *hoid,
 		      const SequencerPosition *spos) {
+  int r = flush_batch();
+  if (r < 0)
+    return r;
   KeyValueDB::Transaction t = db->get_transaction();
   write_state(t);
   if (hoid) {
     assert(spos);
-    Header header = lookup_map_header(*hoid);
+    MapHeaderLock hl(this, *hoid);
+    Header header = lookup_map_header(hl, *hoid);
     if (header) {
       dout(10) << "hoid: " << *hoid << " setting spos to "
 	       << *spos << dendl;
@@ -1057,6 +1157,51 @@ int DBObjectMap::sync(const hobject_t *hoid,
   return db->submit_transaction_sync(t);
 }
 
+DBObjectMap::Batch *DBObjectMap::get_batch()
+{
+  if (!num_batches.read())
+    return NULL;
+  Mutex::Locker l(batch_lock);
+  map<pthread_t, Batch*>::iterator p = batches.find(pthread_self());
+  if (p == batches.end())
+    return NULL;
+  return p->second;
+}
+
+int DBObjectMap::flush_batch()
+{
+  Batch *b = get_batch();
+  if (!b || !b->ops)
+    return 0;
+  dout(20) << "flush_batch: " << b->ops << " ops" << dendl;
+  int r = db->submit_transaction(b->t);
+  b->t = db->get_transaction();
+  b->ops = 0;
+  return r;
+}
+
+void DBObjectMap::start_batch()
+{
+  Batch *b = new Batch;
+  b->t = db->get_transaction();
+  Mutex::Locker l(batch_lock);
+  bool inserted = batches.insert(make_pair(pthread_self(), b)).second;
+  assert(inserted);
+  num_batches.inc();
+}
+
+int DBObjectMap::end_batch()
+{
+  int r = flush_batch();
+  Mutex::Locker l(batch_lock);
+  map<pthread_t, Batch*>::iterator p = batches.find(pthread_self());
+  assert(p != batches.end());
+  delete p->second;
+  batches.erase(p);
+  num_batches.dec();
+  return r;
+}
+
 int DBObjectMap::write_state(KeyValueDB::Transaction _t) {
   dout(20) << "dbobjectmap: seq is " << state.seq << dendl;
   KeyValueDB::Transaction t = _t ? _t : db->get_transaction();
@@ -1069,10 +1214,18 @@ int DBObjectMap::write_state(KeyValueDB::Transaction _t) {
 }
 
 
-DBObjectMap::Header DBObjectMap::_lookup_map_header(const hobject_t &hoid)
+DBObjectMap::Header DBObjectMap::lookup_map_header(
+  const MapHeaderLock &hl,
+  const hobject_t &hoid)
 {
-  while (map_header_in_use.count(hoid))
-    header_cond.Wait(header_lock);
+  assert(hl.get_locked() == hoid);
+
+  Header ret(new _Header());
+  if (map_header_cache.lookup(hoid, ret.get())) {
+    logger->inc(l_dbom_map_header_hit);
+    return ret;
+  }
+  logger->inc(l_dbom_map_header_miss);
 
   map<string, bufferlist> out;
   set<string> to_get;
@@ -1083,9 +1236,9 @@ DBObjectMap::Header DBObjectMap::_lookup_map_header(const hobject_t &hoid)
   if (out.empty())
     return Header();
   
-  Header ret(new _Header(), RemoveMapHeaderOnDelete(this, hoid));
   bufferlist::iterator iter = out.begin()->second.begin();
   ret->decode(iter);
+  map_header_cache.add(hoid, *ret);
   return ret;
 }
 
@@ -1101,7 +1254,7 @@ DBObjectMap::Header DBObjectMap::_generate_new_header(const hobject_t &hoid,
   header->num_children = 1;
   header->hoid = hoid;
   assert(!in_use.count(header->seq));
-  in_use.insert(header->seq);
+  _mark_in_use(in_use, header->seq);
 
   write_state();
   return header;
@@ -1109,44 +1262,61 @@ DBObjectMap::Header DBObjectMap::_generate_new_header(const hobject_t &hoid,
 
 DBObjectMap::Header DBObjectMap::lookup_parent(Header input)
 {
-  Mutex::Locker l(header_lock);
-  while (in_use.count(input->parent))
-    header_cond.Wait(header_lock);
-  map<string, bufferlist> out;
-  set<string> keys;
-  keys.insert(HEADER_KEY);
+  {
+    Mutex::Locker l(header_lock);
+    _mark_in_use(in_use, input->parent);
+  }
+  Header header = Header(new _Header(), RemoveOnDelete(this));
+  header->seq = input->parent;
 
   dout(20) << "lookup_parent: parent " << input->parent
        << " for seq " << input->seq << dendl;
-  int r = db->get(sys_parent_prefix(input), keys, &out);
-  if (r < 0) {
-    assert(0);
-    return Header();
-  }
-  if (out.empty()) {
-    assert(0);
-    return Header();
-  }
+  if (parent_cache.lookup(input->parent, header.get())) {
+    logger->inc(l_dbom_parent_hit);
+  } else {
+    logger->inc(l_dbom_parent_miss);
+    map<string, bufferlist> out;
+    set<string> keys;
+    keys.insert(HEADER_KEY);
+    int r = db->get(sys_parent_prefix(input), keys, &out);
+    if (r < 0) {
+      assert(0);
+      return Header();
+    }
+    if (out.empty()) {
+      assert(0);
+      return Header();
+    }
 
-  Header header = Header(new _Header(), RemoveOnDelete(this));
-  header->seq = input->parent;
-  bufferlist::iterator iter = out.begin()->second.begin();
-  header->decode(iter);
+    bufferlist::iterator iter = out.begin()->second.begin();
+    header->decode(iter);
+    parent_cache.add(input->parent, *header);
+  }
   dout(20) << "lookup_parent: parent seq is " << header->seq << " with parent "
        << header->parent << dendl;
-  in_use.insert(header->seq);
   return header;
 }
 
 DBObjectMap::Header DBObjectMap::lookup_create_map_header(
+  const MapHeaderLock &hl,
   const hobject_t &hoid,
-  KeyValueDB::Transaction t)
+  KeyValueDB::Transaction t,
+  Batch *b)
 {
-  Mutex::Locker l(header_lock);
-  Header header = _lookup_map_header(hoid);
+  Header header = lookup_map_header(hl, hoid);
   if (!header) {
-    header = _generate_new_header(hoid, Header());
-    set_map_header(hoid, *header, t);
+    header = generate_new_header(hoid, Header());
+    if (!b) {
+      set_map_header(hoid, *header, t);
+      return header;
+    }
+    // Another thread must find this header as soon as we drop hl, or it
+    // would create one of its own and orphan whatever we put under ours,
+    // so it does not wait for the batch.
+    KeyValueDB::Transaction ht = db->get_transaction();
+    set_map_header(hoid, *header, ht);
+    if (db->submit_transaction(ht) < 0)
+      return Header();
   }
   return header;
 }
@@ -1154,6 +1324,7 @@ DBObjectMap::Header DBObjectMap::lookup_create_map_header(
 void DBObjectMap::clear_header(Header header, KeyValueDB::Transaction t)
 {
   dout(20) << "clear_header: clearing seq " << header->seq << dendl;
+  parent_cache.clear(header->seq);
   t->rmkeys_by_prefix(user_prefix(header));
   t->rmkeys_by_prefix(sys_prefix(header));
   t->rmkeys_by_prefix(complete_prefix(header));
@@ -1166,6 +1337,7 @@ void DBObjectMap::clear_header(Header header, KeyValueDB::Transaction t)
 void DBObjectMap::set_header(Header header, KeyValueDB::Transaction t)
 {
   dout(20) << "set_header: setting seq " << header->seq << dendl;
+  parent_cache.clear(header->seq);
   map<string, bufferlist> to_write;
   header->encode(to_write[HEADER_KEY]);
   t->set(sys_prefix(header), to_write);
@@ -1177,6 +1349,7 @@ void DBObjectMap::remove_map_header(const hobject_t &hoid,
 {
   dout(20) << "remove_map_header: removing " << header->seq
 	   << " hoid " << hoid << dendl;
+  map_header_cache.clear(hoid);
   set<string> to_remove;
   to_remove.insert(map_header_key(hoid));
   t->rmkeys(HOBJECT_TO_SEQ, to_remove);
@@ -1188,6 +1361,7 @@ void DBObjectMap::set_map_header(const hobject_t &hoid, _Header header,
   dout(20) << "set_map_header: setting " << header.seq
 	   << " hoid " << hoid << " parent seq "
 	   << header.parent << dendl;
+  map_header_cache.clear(hoid);
   map<string, bufferlist> to_set;
   header.encode(to_set[map_header_key(hoid)]);
   t->set(HOBJECT_TO_SEQ, to_set);
@@ -16,6 +16,19 @@
 #include "osd/osd_types.h"
 #include "common/Mutex.h"
 #include "common/Cond.h"
+#include "common/simple_cache.hpp"
+#include "include/atomic.h"
+
+class PerfCounters;
+
+enum {
+  l_dbom_first = 84500,
+  l_dbom_map_header_hit,
+  l_dbom_map_header_miss,
+  l_dbom_parent_hit,
+  l_dbom_parent_miss,
+  l_dbom_last,
+};
 
 /**
  * DBObjectMap: Implements ObjectMap in terms of KeyValueDB
@@ -56,21 +69,39 @@ public:
   boost::scoped_ptr<KeyValueDB> db;
 
   /**
-   * Serializes access to next_seq as well as the in_use set
+   * Serializes access to next_seq as well as the in_use and
+   * map_header_in_use sets
    */
   Mutex header_lock;
-  Cond header_cond;
-  Cond map_header_cond;
+
+  /**
+   * Marks a header (or map header) as in use.  Threads waiting for a
+   * particular key wait on its own Cond, so releasing one header only
+   * wakes the threads interested in it.
+   */
+  struct InUse {
+    Cond cond;
+    int waiters;
+    bool released;
+    InUse() : waiters(0), released(false) {}
+  };
 
   /**
    * Set of headers currently in use
    */
-  set<uint64_t> in_use;
-  set<hobject_t> map_header_in_use;
+  map<uint64_t, InUse*> in_use;
+
+  /**
+   * Set of objects whose map header is currently being looked up or
+   * modified @see MapHeaderLock
+   */
+  map<hobject_t, InUse*> map_header_in_use;
+
+  /// map header and parent cache hit/miss counters
+  PerfCounters *logger;
 
-  DBObjectMap(KeyValueDB *db) : db(db),
-				header_lock("DBOBjectMap")
-    {}
+  DBObjectMap(KeyValueDB *db);
+  ~DBObjectMap();
 
   int set_keys(
     const hobject_t &hoid,
@@ -164,6 +195,14 @@ public:
   /// Ensure that all previous operations are durable
   int sync(const hobject_t *hoid=0, const SequencerPosition *spos=0);
 
+  /**
+   * Batch the calling thread's set_keys, set_header, set_xattrs,
+   * remove_xattrs and (parentless) rm_keys into one KeyValueDB
+   * transaction.  Everything else applies the batch first.
+   */
+  void start_batch();
+  int end_batch();
+
   /// Util, list all objects, there must be no other concurrent access
   int list_objects(vector<hobject_t> *objs ///< [out] objects
     );
@@ -277,6 +316,40 @@ private:
   /// Implicit lock on Header->seq
   typedef std::tr1::shared_ptr<_Header> Header;
 
+  /**
+   * Decoded map headers and parent headers, so that we don't go to the
+   * KeyValueDB for every operation.  Map headers are only filled and
+   * updated under the object's MapHeaderLock, parent headers while the
+   * seq is in use.
+   */
+  SimpleLRU<hobject_t, _Header> map_header_cache;
+  SimpleLRU<uint64_t, _Header> parent_cache;
+
+  /// Mutations held back for one thread @see start_batch
+  struct Batch {
+    KeyValueDB::Transaction t;
+    unsigned ops; ///< mutations in t
+    Batch() : ops(0) {}
+  };
+  Mutex batch_lock;                ///< protects batches
+  map<pthread_t, Batch*> batches;  ///< open batches by thread
+  atomic_t num_batches;            ///< lets get_batch() skip batch_lock
+
+  /// @return the calling thread's open batch, or NULL
+  Batch *get_batch();
+
+  /// Apply the calling thread's held back mutations, if any
+  int flush_batch();
+
+  /// Submit t unless it is b's transaction, in which case just count it
+  int submit_transaction(Batch *b, KeyValueDB::Transaction t) {
+    if (b) {
+      b->ops++;
+      return 0;
+    }
+    return db->submit_transaction(t);
+  }
+
   string map_header_key(const hobject_t &hoid);
   string header_key(uint64_t seq);
   string complete_prefix(Header header);
@@ -382,9 +455,72 @@ private:
 		  Header header,
 		  const SequencerPosition *spos);
 
-  /// Lookup or create header for c hoid
-  Header lookup_create_map_header(const hobject_t &hoid,
-				  KeyValueDB::Transaction t);
+  /**
+   * Serializes operations on the map header of hoid for as long as it
+   * is in scope.  Every public entry point that looks up a map header
+   * holds one, which keeps map_header_cache coherent with the store.
+   */
+  class MapHeaderLock {
+    DBObjectMap *db;
+    hobject_t hoid;
+  public:
+    MapHeaderLock(DBObjectMap *db, const hobject_t &hoid) :
+      db(db), hoid(hoid) {
+      Mutex::Locker l(db->header_lock);
+      db->_mark_in_use(db->map_header_in_use, hoid);
+    }
+    ~MapHeaderLock() {
+      Mutex::Locker l(db->header_lock);
+      db->_clear_in_use(db->map_header_in_use, hoid);
+    }
+    const hobject_t &get_locked() const {
+      return hoid;
+    }
+  };
+  friend class MapHeaderLock;
+
+  /// Wait until key is not in use in m, then mark it in use
+  template <typename K>
+  void _mark_in_use(map<K, InUse*> &m, const K &key) {
+    assert(header_lock.is_locked());
+    typename map<K, InUse*>::iterator p;
+    while ((p = m.find(key)) != m.end()) {
+      InUse *u = p->second;
+      u->waiters++;
+      while (!u->released)
+	u->cond.Wait(header_lock);
+      if (--u->waiters == 0)
+	delete u;
+    }
+    m.insert(make_pair(key, new InUse));
+  }
+
+  /// Release key in m, waking only the threads waiting for it
+  template <typename K>
+  void _clear_in_use(map<K, InUse*> &m, const K &key) {
+    assert(header_lock.is_locked());
+    typename map<K, InUse*>::iterator p = m.find(key);
+    assert(p != m.end());
+    InUse *u = p->second;
+    m.erase(p);
+    if (u->waiters) {
+      u->released = true;
+      u->cond.SignalAll();
+    } else {
+      delete u;
+    }
+  }
+
+  /**
+   * Lookup or create header for c hoid, b is t's batch if any
+   *
+   * A new header is written to the db right away even with a batch, so
+   * that no other thread can miss it and create a second one.
+   */
+  Header lookup_create_map_header(const MapHeaderLock &hl,
+				  const hobject_t &hoid,
+				  KeyValueDB::Transaction t,
+				  Batch *b = 0);
 
   /**
    * Generate new header for c hoid with new seq number
@@ -398,11 +534,7 @@ private:
   }
 
   /// Lookup leaf header for c hoid
-  Header _lookup_map_header(const hobject_t &hoid);
-  Header lookup_map_header(const hobject_t &hoid) {
-    Mutex::Locker l(header_lock);
-    return _lookup_map_header(hoid);
-  }
+  Header lookup_map_header(const MapHeaderLock &hl, const hobject_t &hoid);
 
   /// Lookup header node for input
   Header lookup_parent(Header input);
@@ -441,24 +573,6 @@ private:
   void _set_header(Header header, const bufferlist &bl,
 		   KeyValueDB::Transaction t);
 
-  /** 
-   * Removes map header lock once Header is out of scope
-   * @see lookup_map_header
-   */
-  class RemoveMapHeaderOnDelete {
-  public:
-    DBObjectMap *db;
-    hobject_t obj;
-    RemoveMapHeaderOnDelete(DBObjectMap *db, const hobject_t &obj) :
-      db(db), obj(obj) {}
-    void operator() (_Header *header) {
-      Mutex::Locker l(db->header_lock);
-      db->map_header_in_use.erase(obj);
-      db->map_header_cond.Signal();
-      delete header;
-    }
-  };
-
   /** 
    * Removes header seq lock once Header is out of scope
    * @see lookup_parent
@@ -471,8 +585,7 @@ private:
       db(db) {}
     void operator() (_Header *header) {
       Mutex::Locker l(db->header_lock);
-      db->in_use.erase(header->seq);
-      db->header_cond.Signal();
+      db->_clear_in_use(db->in_use, header->seq);
       delete header;
     }
   };
@@ -0,0 +1,208 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_FDCACHE_H
+#define CEPH_FDCACHE_H
+
+#include <list>
+#include <map>
+#include <vector>
+#include <tr1/memory>
+#include <unistd.h>
+
+#include "common/Mutex.h"
+#include "include/compat.h"
+#include "os/hobject.h"
+#include "osd/osd_types.h"
+
+/**
+ * Cache of open object fds, keyed by (collection, object).
+ *
+ * The cache is split into shards by object hash so that the op threads
+ * don't all serialize on one lock.  Each shard is a plain LRU holding a
+ * reference to its fds; users hold their own FDRef, so an fd evicted or
+ * invalidated while in use is only closed once the last user drops it.
+ *
+ * Every invalidation bumps the shard's generation.  An fd opened by a
+ * caller that sampled the generation before an invalidation raced with
+ * it is handed back to the caller but not cached.
+ */
+class FDCache {
+public:
+  /// an open fd, closed when the last reference goes away
+  class FD {
+  public:
+    const int fd;
+    FD(int _fd) : fd(_fd) {
+      assert(_fd >= 0);
+    }
+    int operator*() const {
+      return fd;
+    }
+    ~FD() {
+      TEMP_FAILURE_RETRY(::close(fd));
+    }
+  };
+  typedef std::tr1::shared_ptr<FD> FDRef;
+
+private:
+  typedef pair<coll_t, hobject_t> key_t;
+  typedef list<pair<key_t, FDRef> > lru_t;
+
+  struct Shard {
+    Mutex lock;
+    size_t max_size;
+    uint64_t gen;
+    map<key_t, lru_t::iterator> contents;
+    lru_t lru;
+
+    Shard() : lock("FDCache::Shard::lock"), max_size(0), gen(0) {}
+
+    void trim(list<FDRef> *to_release) {
+      while (lru.size() > max_size) {
+	to_release->push_back(lru.back().second);
+	contents.erase(lru.back().first);
+	lru.pop_back();
+      }
+    }
+  };
+  vector<Shard*> shards;
+
+  Shard *get_shard(const hobject_t &hoid) {
+    return shards[hoid.hash % shards.size()];
+  }
+
+public:
+  FDCache(size_t size, size_t num_shards) {
+    if (num_shards < 1)
+      num_shards = 1;
+    for (size_t i = 0; i < num_shards; ++i)
+      shards.push_back(new Shard);
+    set_size(size);
+  }
+  ~FDCache() {
+    for (vector<Shard*>::iterator i = shards.begin(); i != shards.end(); ++i)
+      delete *i;
+  }
+
+  /// total number of fds to keep open; 0 disables the cache
+  void set_size(size_t size) {
+    size_t per_shard = size / shards.size();
+    if (size && !per_shard)
+      per_shard = 1;
+    for (vector<Shard*>::iterator i = shards.begin(); i != shards.end(); ++i) {
+      list<FDRef> to_release;
+      Mutex::Locker l((*i)->lock);
+      (*i)->max_size = per_shard;
+      (*i)->trim(&to_release);
+    }
+  }
+
+  /// current invalidation generation for (cid, hoid); see add()
+  uint64_t get_gen(const coll_t &cid, const hobject_t &hoid) {
+    Shard *s = get_shard(hoid);
+    Mutex::Locker l(s->lock);
+    return s->gen;
+  }
+
+  /// @return the cached fd, or a null FDRef on a miss
+  FDRef lookup(const coll_t &cid, const hobject_t &hoid) {
+    Shard *s = get_shard(hoid);
+    Mutex::Locker l(s->lock);
+    map<key_t, lru_t::iterator>::iterator p =
+      s->contents.find(make_pair(cid, hoid));
+    if (p == s->contents.end())
+      return FDRef();
+    s->lru.splice(s->lru.begin(), s->lru, p->second);
+    return p->second->second;
+  }
+
+  /**
+   * Take ownership of fd for (cid, hoid).
+   *
+   * If the shard was invalidated since gen was sampled, the fd is not
+   * cached.  If another thread cached an fd first, that one is returned
+   * and ours is closed.
+   */
+  FDRef add(const coll_t &cid, const hobject_t &hoid, int fd, uint64_t gen) {
+    FDRef ref(new FD(fd));
+    list<FDRef> to_release;
+    Shard *s = get_shard(hoid);
+    Mutex::Locker l(s->lock);
+    if (s->gen != gen || !s->max_size)
+      return ref;
+    key_t key = make_pair(cid, hoid);
+    map<key_t, lru_t::iterator>::iterator p = s->contents.find(key);
+    if (p != s->contents.end()) {
+      s->lru.splice(s->lru.begin(), s->lru, p->second);
+      to_release.push_back(ref);
+      return p->second->second;
+    }
+    s->lru.push_front(make_pair(key, ref));
+    s->contents[key] = s->lru.begin();
+    s->trim(&to_release);
+    return ref;
+  }
+
+  /// forget any fd for (cid, hoid)
+  void clear(const coll_t &cid, const hobject_t &hoid) {
+    list<FDRef> to_release;
+    Shard *s = get_shard(hoid);
+    Mutex::Locker l(s->lock);
+    s->gen++;
+    map<key_t, lru_t::iterator>::iterator p =
+      s->contents.find(make_pair(cid, hoid));
+    if (p == s->contents.end())
+      return;
+    to_release.push_back(p->second->second);
+    s->lru.erase(p->second);
+    s->contents.erase(p);
+  }
+
+  /// forget every fd in collection cid
+  void clear_collection(const coll_t &cid) {
+    for (vector<Shard*>::iterator i = shards.begin(); i != shards.end(); ++i) {
+      list<FDRef> to_release;
+      Shard *s = *i;
+      Mutex::Locker l(s->lock);
+      s->gen++;
+      for (lru_t::iterator p = s->lru.begin(); p != s->lru.end(); ) {
+	if (p->first.first == cid) {
+	  to_release.push_back(p->second);
+	  s->contents.erase(p->first);
+	  s->lru.erase(p++);
+	} else {
+	  ++p;
+	}
+      }
+    }
+  }
+
+  /// forget everything
+  void clear() {
+    for (vector<Shard*>::iterator i = shards.begin(); i != shards.end(); ++i) {
+      list<FDRef> to_release;
+      Shard *s = *i;
+      Mutex::Locker l(s->lock);
+      s->gen++;
+      for (lru_t::iterator p = s->lru.begin(); p != s->lru.end(); ++p)
+	to_release.push_back(p->second);
+      s->contents.clear();
+      s->lru.clear();
+    }
+  }
+};
+typedef FDCache::FDRef FDRef;
+
+#endif
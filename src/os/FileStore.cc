@@ -65,6 +65,7 @@
 #include "common/run_cmd.h"
 #include "common/safe_io.h"
 #include "common/perf_counters.h"
+#include "common/admin_socket.h"
 #include "common/sync_filesystem.h"
 #include "common/fd.h"
 #include "HashIndex.h"
@@ -173,39 +174,53 @@ int FileStore::lfn_find(coll_t cid, const hobject_t& oid, IndexedPath *path)
 
 int FileStore::lfn_truncate(coll_t cid, const hobject_t& oid, off_t length)
 {
-  IndexedPath path;
-  int r = lfn_find(cid, oid, &path);
+  FDRef fd;
+  int r = lfn_open(cid, oid, false, &fd);
   if (r < 0)
     return r;
-  r = ::truncate(path->path(), length);
+  r = ::ftruncate(**fd, length);
   if (r < 0)
     r = -errno;
+  lfn_close(fd);
   assert(!m_filestore_fail_eio || r != -EIO);
   return r;
 }
 
 int FileStore::lfn_stat(coll_t cid, const hobject_t& oid, struct stat *buf)
 {
-  IndexedPath path;
-  int r = lfn_find(cid, oid, &path);
+  FDRef fd;
+  int r = lfn_open(cid, oid, false, &fd);
   if (r < 0)
     return r;
-  r = ::stat(path->path(), buf);
+  r = ::fstat(**fd, buf);
   if (r < 0)
     r = -errno;
+  lfn_close(fd);
   return r;
 }
 
-int FileStore::lfn_open(coll_t cid, const hobject_t& oid, int flags, mode_t mode,
-			IndexedPath *path,
-			Index *index) 
+int FileStore::lfn_open(coll_t cid, const hobject_t& oid, bool create,
+			FDRef *outfd, Index *index)
 {
+  assert(outfd);
+  *outfd = fdcache.lookup(cid, oid);
+  if (*outfd) {
+    logger->inc(l_os_fd_cache_hit);
+    return 0;
+  }
+  logger->inc(l_os_fd_cache_miss);
+
+  // sample before the index lookup; an unlink racing with us will bump
+  // it and keep a stale fd out of the cache
+  uint64_t gen = fdcache.get_gen(cid, oid);
+
   Index index2;
-  IndexedPath path2;
-  if (!path)
-    path = &path2;
+  IndexedPath path;
   int fd, exist;
   int r = 0;
+  int flags = O_RDWR;
+  if (create)
+    flags |= O_CREAT;
   if (!index) {
     index = &index2;
   }
@@ -217,56 +232,104 @@ int FileStore::lfn_open(coll_t cid, const hobject_t& oid, int flags, mode_t mode
 	 << ": " << cpp_strerror(-r) << dendl;
     goto fail;
   }
-  r = (*index)->lookup(oid, path, &exist);
+  r = (*index)->lookup(oid, &path, &exist);
   if (r < 0) {
     derr << "could not find " << oid << " in index: "
 	 << cpp_strerror(-r) << dendl;
     goto fail;
   }
 
-  r = ::open((*path)->path(), flags, mode);
+  r = ::open(path->path(), flags, 0644);
   if (r < 0) {
     r = -errno;
-    dout(10) << "error opening file " << (*path)->path() << " with flags="
-	     << flags << " and mode=" << mode << ": " << cpp_strerror(-r) << dendl;
+    dout(10) << "error opening file " << path->path() << " with flags="
+	     << flags << ": " << cpp_strerror(-r) << dendl;
     goto fail;
   }
   fd = r;
 
-  if ((flags & O_CREAT) && (!exist)) {
-    r = (*index)->created(oid, (*path)->path());
+  if (create && (!exist)) {
+    r = (*index)->created(oid, path->path());
     if (r < 0) {
       TEMP_FAILURE_RETRY(::close(fd));
-      derr << "error creating " << oid << " (" << (*path)->path()
+      derr << "error creating " << oid << " (" << path->path()
 	   << ") in index: " << cpp_strerror(-r) << dendl;
       goto fail;
     }
   }
-  return fd;
+  *outfd = fdcache.add(cid, oid, fd, gen);
+  return 0;
 
  fail:
   assert(!m_filestore_fail_eio || r != -EIO);
   return r;
 }
 
-int FileStore::lfn_open(coll_t cid, const hobject_t& oid, int flags, mode_t mode, IndexedPath *path)
+int FileStore::lfn_open_direct(coll_t cid, const hobject_t& oid,
+			       FDRef *outfd)
 {
-  return lfn_open(cid, oid, flags, mode, path, 0);
-}
+  *outfd = direct_fdcache.lookup(cid, oid);
+  if (*outfd)
+    return 0;
 
-int FileStore::lfn_open(coll_t cid, const hobject_t& oid, int flags, mode_t mode)
-{
-  return lfn_open(cid, oid, flags, mode, 0, 0);
+  // as in lfn_open: sample before the index lookup
+  uint64_t gen = direct_fdcache.get_gen(cid, oid);
+  IndexedPath path;
+  int r = lfn_find(cid, oid, &path);
+  if (r < 0)
+    return r;
+  int fd = ::open(path->path(), O_RDONLY|O_DIRECT);
+  if (fd < 0) {
+    r = -errno;
+    if (r == -EINVAL) {
+      dout(0) << "read_direct: O_DIRECT not supported by the underlying fs, "
+	      << "disabling filestore_read_direct" << dendl;
+      m_filestore_read_direct.set(0);
+      return -EOPNOTSUPP;
+    }
+    return r;
+  }
+  *outfd = direct_fdcache.add(cid, oid, fd, gen);
+  return 0;
 }
 
-int FileStore::lfn_open(coll_t cid, const hobject_t& oid, int flags)
+int FileStore::lfn_read_direct(coll_t cid, const hobject_t& oid,
+			       uint64_t offset, size_t len, char *buf)
 {
-  return lfn_open(cid, oid, flags, 0);
+  FDRef fd;
+  int r = lfn_open_direct(cid, oid, &fd);
+  if (r < 0)
+    return r;
+
+  // not safe_pread: a short read at eof leaves us unaligned, and a
+  // second O_DIRECT pread from there would fail with EINVAL
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = ::pread(**fd, buf + got, len - got, offset + got);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      r = -errno;
+      break;
+    }
+    if (n == 0)
+      break;
+    got += n;
+    if (got & ~CEPH_PAGE_MASK)
+      break;
+  }
+  if (r < 0) {
+    dout(10) << "read_direct " << cid << "/" << oid << " " << offset << "~" << len
+	     << ": " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  return got;
 }
 
-void FileStore::lfn_close(int fd)
+void FileStore::lfn_close(FDRef fd)
 {
-  TEMP_FAILURE_RETRY(::close(fd));
+  // nothing to do; the fd is closed once the cache and every user have
+  // dropped their FDRef
 }
 
 int FileStore::lfn_link(coll_t c, coll_t cid, const hobject_t& o) 
@@ -363,7 +426,11 @@ int FileStore::lfn_unlink(coll_t cid, const hobject_t& o,
 	object_map->sync(&o, &spos);
     }
   }
-  return index->unlink(o);
+  r = index->unlink(o);
+  // after the unlink, so that a racing lfn_open can't re-add it
+  fdcache.clear(cid, o);
+  direct_fdcache.clear(cid, o);
+  return r;
 }
 
 FileStore::FileStore(const std::string &base, const std::string &jdev, const char *name, bool do_update) :
@@ -381,6 +448,12 @@ FileStore::FileStore(const std::string &base, const std::string &jdev, const cha
   fsid_fd(-1), op_fd(-1),
   basedir_fd(-1), current_fd(-1),
   index_manager(do_update),
+  fdcache(g_conf->filestore_fd_cache_size, g_conf->filestore_fd_cache_shards),
+  direct_fdcache(g_conf->filestore_direct_fd_cache_size,
+		 g_conf->filestore_fd_cache_shards),
+  read_pool(g_conf->filestore_read_pool_bytes, g_conf->filestore_read_pool_max),
+  wbthrottle(g_ceph_context),
+  asok_hook(NULL),
   ondisk_finisher(g_ceph_context),
   lock("FileStore::lock"),
   force_sync(false), sync_epoch(0),
@@ -428,6 +501,7 @@ FileStore::FileStore(const std::string &base, const std::string &jdev, const cha
   m_filestore_dump_fmt(true)
 {
   m_filestore_kill_at.set(g_conf->filestore_kill_at);
+  m_filestore_read_direct.set(g_conf->filestore_read_direct);
 
   ostringstream oss;
   oss << basedir << "/current";
@@ -466,8 +540,21 @@ FileStore::FileStore(const std::string &base, const std::string &jdev, const cha
   plb.add_time_avg(l_os_commit_len, "commitcycle_interval");
   plb.add_time_avg(l_os_commit_lat, "commitcycle_latency");
   plb.add_u64_counter(l_os_j_full, "journal_full");
+  plb.add_u64_counter(l_os_fd_cache_hit, "fd_cache_hit");
+  plb.add_u64_counter(l_os_fd_cache_miss, "fd_cache_miss");
+  plb.add_u64(l_os_split_queue, "split_queue");
+  plb.add_u64_counter(l_os_splits, "splits");
+  plb.add_time_avg(l_os_split_lat, "split_latency");
+  plb.add_u64_counter(l_os_read_zc_bytes, "read_zero_copy_bytes");
+  plb.add_u64(l_os_wb_dirty, "wb_dirty_bytes");
+  plb.add_u64(l_os_wb_limit, "wb_dirty_limit");
+  plb.add_u64(l_os_wb_bw, "wb_bandwidth");
+  plb.add_u64_counter(l_os_wb_early_flush, "wb_early_flushes");
+  plb.add_u64_counter(l_os_wb_forced_sync, "wb_forced_syncs");
+  plb.add_time_avg(l_os_wb_delay, "wb_throttle_delay");
 
   logger = plb.create_perf_counters();
+  wbthrottle.set_logger(logger);
 }
 
 FileStore::~FileStore()
@@ -1392,6 +1479,64 @@ int FileStore::write_op_seq(int fd, uint64_t seq)
   return ret;
 }
 
+class FileStoreSocketHook : public AdminSocketHook {
+  FileStore *store;
+public:
+  FileStoreSocketHook(FileStore *s) : store(s) {}
+  bool call(std::string command, std::string args, bufferlist& out) {
+    stringstream ss;
+    bool r = store->asok_command(command, args, ss);
+    out.append(ss);
+    return r;
+  }
+};
+
+bool FileStore::asok_command(string command, string args, ostream& ss)
+{
+  JSONFormatter f(true);
+  if (command == "dump_writeback_throttle") {
+    wbthrottle.dump(&f);
+  } else if (command == "dump_journal_replay") {
+    dump_replay_status(&f);
+  } else {
+    assert(0 == "broken asok registration");
+  }
+  f.flush(ss);
+  return true;
+}
+
+void FileStore::asok_register()
+{
+  AdminSocket *admin_socket = g_ceph_context->get_admin_socket();
+  asok_hook = new FileStoreSocketHook(this);
+  int r = admin_socket->register_command(
+    "dump_writeback_throttle", asok_hook,
+    "dump filestore writeback throttle state");
+  if (r < 0) {
+    // another FileStore in this process got there first
+    dout(0) << "unable to register admin socket commands: "
+	    << cpp_strerror(r) << dendl;
+    delete asok_hook;
+    asok_hook = NULL;
+    return;
+  }
+  r = admin_socket->register_command(
+    "dump_journal_replay", asok_hook,
+    "show journal replay progress and throughput");
+  assert(r == 0);
+}
+
+void FileStore::asok_unregister()
+{
+  if (!asok_hook)
+    return;
+  AdminSocket *admin_socket = g_ceph_context->get_admin_socket();
+  admin_socket->unregister_command("dump_writeback_throttle");
+  admin_socket->unregister_command("dump_journal_replay");
+  delete asok_hook;
+  asok_hook = NULL;
+}
+
 int FileStore::mount() 
 {
   int ret;
@@ -1400,6 +1545,9 @@ int FileStore::mount()
   set<string> cluster_snaps;
 
   dout(5) << "basedir " << basedir << " journal " << journalpath << dendl;
+
+  fdcache.clear();
+  direct_fdcache.clear();
   
   // make sure global base dir exists
   if (::access(basedir.c_str(), R_OK | W_OK)) {
@@ -1746,6 +1894,9 @@ int FileStore::mount()
     }
   }
 
+  // registered before replay so that its progress can be watched
+  asok_register();
+
   sync_thread.create();
 
   ret = journal_replay(initial_op_seq);
@@ -1779,6 +1930,7 @@ int FileStore::mount()
 
   op_tp.start();
   flusher_thread.create();
+  index_manager.start_split_thread(logger);
   op_finisher.start();
   ondisk_finisher.start();
 
@@ -1792,6 +1944,7 @@ int FileStore::mount()
   return 0;
 
 close_current_fd:
+  asok_unregister();
   TEMP_FAILURE_RETRY(::close(current_fd));
   current_fd = -1;
 close_basedir_fd:
@@ -1811,6 +1964,8 @@ int FileStore::umount()
   
   g_ceph_context->_conf->remove_observer(this);
 
+  asok_unregister();
+
   start_sync();
 
   lock.Lock();
@@ -1821,6 +1976,7 @@ int FileStore::umount()
   sync_thread.join();
   op_tp.stop();
   flusher_thread.join();
+  index_manager.stop_split_thread();
 
   journal_stop();
 
@@ -1845,6 +2001,10 @@ int FileStore::umount()
     TEMP_FAILURE_RETRY(::close(basedir_fd));
     basedir_fd = -1;
   }
+  fdcache.clear();
+  direct_fdcache.clear();
+  read_pool.clear();
+  index_manager.forget_layouts();
   object_map.reset();
 
   {
@@ -1924,6 +2084,8 @@ void FileStore::queue_op(OpSequencer *osr, Op *o)
 void FileStore::op_queue_reserve_throttle(Op *o)
 {
   // Do not call while holding the journal lock!
+  wbthrottle.throttle();
+
   uint64_t max_ops = m_filestore_queue_max_ops;
   uint64_t max_bytes = m_filestore_queue_max_bytes;
 
@@ -2144,6 +2306,11 @@ int FileStore::_do_transactions(
     ops += (*p)->get_num_ops();
   }
 
+  // apply the omap mutations of all of tls with one db transaction
+  bool batch_omap = g_conf->filestore_omap_batch;
+  if (batch_omap)
+    object_map->start_batch();
+
   int trans_num = 0;
   for (list<Transaction*>::iterator p = tls.begin();
        p != tls.end();
@@ -2154,6 +2321,16 @@ int FileStore::_do_transactions(
     if (handle)
       handle->reset_tp_timeout();
   }
+
+  if (batch_omap) {
+    int br = object_map->end_batch();
+    if (br < 0) {
+      derr << "_do_transactions omap batch failed: " << cpp_strerror(br) << dendl;
+      assert(!m_filestore_fail_eio || br != -EIO);
+      if (r >= 0)
+	r = br;
+    }
+  }
   
   return r;
 }
@@ -2261,12 +2438,13 @@ int FileStore::_check_replay_guard(coll_t cid, hobject_t oid, const SequencerPos
   if (!replaying || btrfs_stable_commits)
     return 1;
 
-  int fd = lfn_open(cid, oid, 0);
-  if (fd < 0) {
+  FDRef fd;
+  int r = lfn_open(cid, oid, false, &fd);
+  if (r < 0) {
     dout(10) << "_check_replay_guard " << cid << " " << oid << " dne" << dendl;
     return 1;  // if file does not exist, there is no guard, and we can replay.
   }
-  int ret = _check_replay_guard(fd, spos);
+  int ret = _check_replay_guard(**fd, spos);
   lfn_close(fd);
   return ret;
 }
@@ -2760,22 +2938,39 @@ int FileStore::read(
 
   dout(15) << "read " << cid << "/" << oid << " " << offset << "~" << len << dendl;
 
-  int fd = lfn_open(cid, oid, O_RDONLY);
-  if (fd < 0) {
-    dout(10) << "FileStore::read(" << cid << "/" << oid << ") open error: " << cpp_strerror(fd) << dendl;
-    return fd;
+  FDRef fd;
+  int r = lfn_open(cid, oid, false, &fd);
+  if (r < 0) {
+    dout(10) << "FileStore::read(" << cid << "/" << oid << ") open error: " << cpp_strerror(r) << dendl;
+    return r;
   }
 
   if (len == 0) {
     struct stat st;
     memset(&st, 0, sizeof(struct stat));
-    int r = ::fstat(fd, &st);
+    int r = ::fstat(**fd, &st);
     assert(r == 0);
     len = st.st_size;
   }
 
-  bufferptr bptr(len);  // prealloc space for entire read
-  got = safe_pread(fd, bptr.c_str(), len, offset);
+  // large reads go into pooled page-aligned buffers that the reply can
+  // carry to the messenger as is.  only those read with O_DIRECT skip
+  // the copy out of the page cache as well
+  bool pooled = false;
+  bufferptr bptr;
+  if (read_pool.enabled() && len >= (size_t)g_conf->filestore_read_pool_min)
+    bptr = read_pool.get(len, &pooled);
+  else
+    bptr = bufferptr(len);  // prealloc space for entire read
+  got = -EOPNOTSUPP;
+  if (pooled && m_filestore_read_direct.read() &&
+      (offset & ~CEPH_PAGE_MASK) == 0 && (len & ~CEPH_PAGE_MASK) == 0) {
+    got = lfn_read_direct(cid, oid, offset, len, bptr.c_str());
+    if (got >= 0)
+      logger->inc(l_os_read_zc_bytes, got);
+  }
+  if (got == -EOPNOTSUPP)
+    got = safe_pread(**fd, bptr.c_str(), len, offset);
   if (got < 0) {
     dout(10) << "FileStore::read(" << cid << "/" << oid << ") pread error: " << cpp_strerror(got) << dendl;
     lfn_close(fd);
@@ -2813,15 +3008,14 @@ int FileStore::fiemap(coll_t cid, const hobject_t& oid,
 
   dout(15) << "fiemap " << cid << "/" << oid << " " << offset << "~" << len << dendl;
 
-  int r;
-  int fd = lfn_open(cid, oid, O_RDONLY);
-  if (fd < 0) {
-    r = fd;
+  FDRef fd;
+  int r = lfn_open(cid, oid, false, &fd);
+  if (r < 0) {
     dout(10) << "read couldn't open " << cid << "/" << oid << ": " << cpp_strerror(r) << dendl;
   } else {
     uint64_t i;
 
-    r = do_fiemap(fd, offset, len, &fiemap);
+    r = do_fiemap(**fd, offset, len, &fiemap);
     if (r < 0)
       goto done;
 
@@ -2863,10 +3057,10 @@ int FileStore::fiemap(coll_t cid, const hobject_t& oid,
   }
 
 done:
-  if (fd >= 0)
+  if (r >= 0) {
     lfn_close(fd);
-  if (r >= 0)
     ::encode(exomap, bl);
+  }
 
   dout(10) << "fiemap " << cid << "/" << oid << " " << offset << "~" << len << " = " << r << " num_extents=" << exomap.size() << " " << exomap << dendl;
   free(fiemap);
@@ -2897,14 +3091,10 @@ int FileStore::_touch(coll_t cid, const hobject_t& oid)
 {
   dout(15) << "touch " << cid << "/" << oid << dendl;
 
-  int flags = O_WRONLY|O_CREAT;
-  int fd = lfn_open(cid, oid, flags, 0644);
-  int r;
-  if (fd >= 0) {
+  FDRef fd;
+  int r = lfn_open(cid, oid, true, &fd);
+  if (r == 0)
     lfn_close(fd);
-    r = 0;
-  } else
-    r = fd;
   dout(10) << "touch " << cid << "/" << oid << " = " << r << dendl;
   return r;
 }
@@ -2916,62 +3106,61 @@ int FileStore::_write(coll_t cid, const hobject_t& oid,
   dout(15) << "write " << cid << "/" << oid << " " << offset << "~" << len << dendl;
   int r;
 
-  int64_t actual;
+  uint64_t pos;
 
-  int flags = O_WRONLY|O_CREAT;
-  int fd = lfn_open(cid, oid, flags, 0644);
-  if (fd < 0) {
-    r = fd;
-    dout(0) << "write couldn't open " << cid << "/" << oid << " flags " << flags << ": "
+  FDRef fd;
+  r = lfn_open(cid, oid, true, &fd);
+  if (r < 0) {
+    dout(0) << "write couldn't open " << cid << "/" << oid << ": "
 	    << cpp_strerror(r) << dendl;
     goto out;
   }
-    
-  // seek
-  actual = ::lseek64(fd, offset, SEEK_SET);
-  if (actual < 0) {
-    r = -errno;
-    dout(0) << "write lseek64 to " << offset << " failed: " << cpp_strerror(r) << dendl;
-    lfn_close(fd);
-    goto out;
-  }
-  if (actual != (int64_t)offset) {
-    dout(0) << "write lseek64 to " << offset << " gave bad offset " << actual << dendl;
-    r = -EIO;
-    lfn_close(fd);
-    goto out;
-  }
 
-  // write
-  r = bl.write_fd(fd);
+  // write.  the fd is shared through the fdcache, so don't move its
+  // offset under another thread
+  r = 0;
+  pos = offset;
+  for (list<bufferptr>::const_iterator p = bl.buffers().begin();
+       p != bl.buffers().end(); ++p) {
+    if (p->length() == 0)
+      continue;
+    r = safe_pwrite(**fd, p->c_str(), p->length(), pos);
+    if (r < 0) {
+      dout(0) << "write pwrite to " << pos << " failed: " << cpp_strerror(r) << dendl;
+      break;
+    }
+    pos += p->length();
+  }
   if (r == 0)
     r = bl.length();
 
   // flush?
   {
-    bool should_flush = (ssize_t)len >= m_filestore_flush_min;
+    bool force_sync;
+    bool should_flush = wbthrottle.wrote(len, &force_sync) ||
+      (ssize_t)len >= m_filestore_flush_min;
+    if (force_sync)
+      start_sync();
     bool local_flush = false;
 #ifdef HAVE_SYNC_FILE_RANGE
     bool async_done = false;
     if (!should_flush ||
 	!m_filestore_flusher ||
-       !(async_done = queue_flusher(fd, offset, len, replica))) {
+       !(async_done = queue_flusher(**fd, offset, len, replica))) {
       if (should_flush && m_filestore_sync_flush) {
-	::sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE);
+	::sync_file_range(**fd, offset, len, SYNC_FILE_RANGE_WRITE);
 	local_flush = true;
       }
     }
-    //Both lfn_close() and possible posix_fadvise() done by flusher
-    if (async_done) fd = -1;
 #else
     // no sync_file_range; (maybe) flush inline and close.
     if (should_flush && m_filestore_sync_flush) {
-      ::fdatasync(fd);
+      ::fdatasync(**fd);
       local_flush = true;
     }
 #endif
     if (local_flush && replica && m_filestore_replica_fadvise) {
-      int fa_r = posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+      int fa_r = posix_fadvise(**fd, offset, len, POSIX_FADV_DONTNEED);
       if (fa_r) {
 	dout(0) << "posic_fadvise failed: " << cpp_strerror(fa_r) << dendl;
       } else {
@@ -2979,7 +3168,7 @@ int FileStore::_write(coll_t cid, const hobject_t& oid,
       }
     }
   }
-  if (fd >= 0) lfn_close(fd);
+  lfn_close(fd);
 
  out:
   dout(10) << "write " << cid << "/" << oid << " " << offset << "~" << len << " = " << r << dendl;
@@ -2994,14 +3183,14 @@ int FileStore::_zero(coll_t cid, const hobject_t& oid, uint64_t offset, size_t l
 #ifdef CEPH_HAVE_FALLOCATE
 # if !defined(DARWIN) && !defined(__FreeBSD__)
   // first try to punch a hole.
-  int fd = lfn_open(cid, oid, O_RDONLY);
-  if (fd < 0) {
-    ret = -errno;
+  FDRef fd;
+  ret = lfn_open(cid, oid, false, &fd);
+  if (ret < 0) {
     goto out;
   }
 
   // first try fallocate
-  ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE, offset, len);
+  ret = fallocate(**fd, FALLOC_FL_PUNCH_HOLE, offset, len);
   if (ret < 0)
     ret = -errno;
   lfn_close(fd);
@@ -3037,23 +3226,26 @@ int FileStore::_clone(coll_t cid, const hobject_t& oldoid, const hobject_t& newo
   if (_check_replay_guard(cid, newoid, spos) < 0)
     return 0;
 
-  int o, n, r;
+  FDRef o, n;
+  int r;
   {
     Index index;
-    IndexedPath from, to;
-    o = lfn_open(cid, oldoid, O_RDONLY, 0, &from, &index);
-    if (o < 0) {
-      r = o;
+    r = lfn_open(cid, oldoid, false, &o, &index);
+    if (r < 0) {
       goto out2;
     }
-    n = lfn_open(cid, newoid, O_CREAT|O_TRUNC|O_WRONLY, 0644, &to, &index);
-    if (n < 0) {
-      r = n;
+    r = lfn_open(cid, newoid, true, &n, &index);
+    if (r < 0) {
       goto out;
     }
+    r = ::ftruncate(**n, 0);
+    if (r < 0) {
+      r = -errno;
+      goto out3;
+    }
     struct stat st;
-    ::fstat(o, &st);
-    r = _do_clone_range(o, n, 0, st.st_size, 0);
+    ::fstat(**o, &st);
+    r = _do_clone_range(**o, **n, 0, st.st_size, 0);
     if (r < 0) {
       r = -errno;
       goto out3;
@@ -3066,17 +3258,17 @@ int FileStore::_clone(coll_t cid, const hobject_t& oldoid, const hobject_t& newo
 
   {
     map<string, bufferptr> aset;
-    r = _fgetattrs(o, aset, false);
+    r = _fgetattrs(**o, aset, false);
     if (r < 0)
       goto out3;
 
-    r = _fsetattrs(n, aset);
+    r = _fsetattrs(**n, aset);
     if (r < 0)
       goto out3;
   }
 
   // clone is non-idempotent; record our work.
-  _set_replay_guard(n, spos, &newoid);
+  _set_replay_guard(**n, spos, &newoid);
 
  out3:
   lfn_close(n);
@@ -3246,21 +3438,19 @@ int FileStore::_clone_range(coll_t cid, const hobject_t& oldoid, const hobject_t
     return 0;
 
   int r;
-  int o, n;
-  o = lfn_open(cid, oldoid, O_RDONLY);
-  if (o < 0) {
-    r = o;
+  FDRef o, n;
+  r = lfn_open(cid, oldoid, false, &o);
+  if (r < 0) {
     goto out2;
   }
-  n = lfn_open(cid, newoid, O_CREAT|O_WRONLY, 0644);
-  if (n < 0) {
-    r = n;
+  r = lfn_open(cid, newoid, true, &n);
+  if (r < 0) {
     goto out;
   }
-  r = _do_clone_range(o, n, srcoff, len, dstoff);
+  r = _do_clone_range(**o, **n, srcoff, len, dstoff);
 
   // clone is non-idempotent; record our work.
-  _set_replay_guard(n, spos, &newoid);
+  _set_replay_guard(**n, spos, &newoid);
 
   lfn_close(n);
  out:
@@ -3277,8 +3467,9 @@ bool FileStore::queue_flusher(int fd, uint64_t off, uint64_t len, bool replica)
   bool queued;
   lock.Lock();
   if (flusher_queue_len < m_filestore_flusher_max_fds) {
+    // the caller's fd may live on in the fd cache; the flusher gets its own
     flusher_queue.push_back(sync_epoch);
-    flusher_queue.push_back(fd);
+    flusher_queue.push_back(::dup(fd));
     flusher_queue.push_back(off);
     flusher_queue.push_back(len);
     flusher_queue.push_back(replica);
@@ -3337,7 +3528,7 @@ void FileStore::flusher_entry()
 	} else 
 	  dout(10) << "flusher_entry JUST closing " << fd << " (stop=" << stop << ", ep=" << ep
 		   << ", sync_epoch=" << sync_epoch << ")" << dendl;
-	lfn_close(fd);
+	TEMP_FAILURE_RETRY(::close(fd));
       }
       lock.Lock();
       flusher_queue_len -= num;   // they're definitely closed, forget
@@ -3428,6 +3619,7 @@ void FileStore::sync_entry()
 
       // make flusher stop flushing previously queued stuff
       sync_epoch++;
+      wbthrottle.commit_start();
 
       dout(15) << "sync_entry committing " << cp << " sync_epoch " << sync_epoch << dendl;
       stringstream errstream;
@@ -3540,6 +3732,7 @@ void FileStore::sync_entry()
       utime_t lat = done - start;
       utime_t dur = done - startwait;
       dout(10) << "sync_entry commit took " << lat << ", interval was " << dur << dendl;
+      wbthrottle.commit_finish(lat);
 
       logger->inc(l_os_commit);
       logger->tinc(l_os_commit_lat, lat);
@@ -3854,15 +4047,14 @@ bool FileStore::debug_mdata_eio(const hobject_t &oid) {
 int FileStore::getattr(coll_t cid, const hobject_t& oid, const char *name, bufferptr &bp)
 {
   dout(15) << "getattr " << cid << "/" << oid << " '" << name << "'" << dendl;
-  int r;
-  int fd = lfn_open(cid, oid, 0);
-  if (fd < 0) {
-    r = -errno;
+  FDRef fd;
+  int r = lfn_open(cid, oid, false, &fd);
+  if (r < 0) {
     goto out;
   }
   char n[CHAIN_XATTR_MAX_NAME_LEN];
   get_attrname(name, n, CHAIN_XATTR_MAX_NAME_LEN);
-  r = _fgetattr(fd, n, bp);
+  r = _fgetattr(**fd, n, bp);
   lfn_close(fd);
   if (r == -ENODATA && g_conf->filestore_xattr_use_omap) {
     map<string, bufferlist> got;
@@ -3901,13 +4093,12 @@ int FileStore::getattr(coll_t cid, const hobject_t& oid, const char *name, buffe
 int FileStore::getattrs(coll_t cid, const hobject_t& oid, map<string,bufferptr>& aset, bool user_only) 
 {
   dout(15) << "getattrs " << cid << "/" << oid << dendl;
-  int r;
-  int fd = lfn_open(cid, oid, 0);
-  if (fd < 0) {
-    r = -errno;
+  FDRef fd;
+  int r = lfn_open(cid, oid, false, &fd);
+  if (r < 0) {
     goto out;
   }
-  r = _fgetattrs(fd, aset, user_only);
+  r = _fgetattrs(**fd, aset, user_only);
   lfn_close(fd);
   if (g_conf->filestore_xattr_use_omap) {
     set<string> omap_attrs;
@@ -3966,13 +4157,13 @@ int FileStore::_setattrs(coll_t cid, const hobject_t& oid, map<string,bufferptr>
   map<string, bufferptr> inline_set;
   map<string, bufferptr> inline_to_set;
   int r = 0;
-  int fd = lfn_open(cid, oid, 0);
-  if (fd < 0) {
-    r = -errno;
+  FDRef fd;
+  r = lfn_open(cid, oid, false, &fd);
+  if (r < 0) {
     goto out;
   }
   if (g_conf->filestore_xattr_use_omap) {
-    r = _fgetattrs(fd, inline_set, false);
+    r = _fgetattrs(**fd, inline_set, false);
     assert(!m_filestore_fail_eio || r != -EIO);
   }
   dout(15) << "setattrs " << cid << "/" << oid << dendl;
@@ -3986,7 +4177,7 @@ int FileStore::_setattrs(coll_t cid, const hobject_t& oid, map<string,bufferptr>
       if (p->second.length() > g_conf->filestore_max_inline_xattr_size) {
 	if (inline_set.count(p->first)) {
 	  inline_set.erase(p->first);
-	  r = chain_fremovexattr(fd, n);
+	  r = chain_fremovexattr(**fd, n);
 	  if (r < 0)
 	    goto out_close;
 	}
@@ -3998,7 +4189,7 @@ int FileStore::_setattrs(coll_t cid, const hobject_t& oid, map<string,bufferptr>
 	  inline_set.size() >= g_conf->filestore_max_inline_xattrs) {
 	if (inline_set.count(p->first)) {
 	  inline_set.erase(p->first);
-	  r = chain_fremovexattr(fd, n);
+	  r = chain_fremovexattr(**fd, n);
 	  if (r < 0)
 	    goto out_close;
 	}
@@ -4013,7 +4204,7 @@ int FileStore::_setattrs(coll_t cid, const hobject_t& oid, map<string,bufferptr>
 
   }
 
-  r = _fsetattrs(fd, inline_to_set);
+  r = _fsetattrs(**fd, inline_to_set);
   if (r < 0)
     return r;
 
@@ -4049,14 +4240,14 @@ int FileStore::_rmattr(coll_t cid, const hobject_t& oid, const char *name,
 {
   dout(15) << "rmattr " << cid << "/" << oid << " '" << name << "'" << dendl;
   int r = 0;
-  int fd = lfn_open(cid, oid, 0);
-  if (fd < 0) {
-    r = -errno;
+  FDRef fd;
+  r = lfn_open(cid, oid, false, &fd);
+  if (r < 0) {
     goto out;
   }
   char n[CHAIN_XATTR_MAX_NAME_LEN];
   get_attrname(name, n, CHAIN_XATTR_MAX_NAME_LEN);
-  r = chain_fremovexattr(fd, n);
+  r = chain_fremovexattr(**fd, n);
   if (r == -ENODATA && g_conf->filestore_xattr_use_omap) {
     Index index;
     r = get_index(cid, &index);
@@ -4087,17 +4278,17 @@ int FileStore::_rmattrs(coll_t cid, const hobject_t& oid,
 
   map<string,bufferptr> aset;
   int r = 0;
-  int fd = lfn_open(cid, oid, 0);
-  if (fd < 0) {
-    r = -errno;
+  FDRef fd;
+  r = lfn_open(cid, oid, false, &fd);
+  if (r < 0) {
     goto out;
   }
-  r = _fgetattrs(fd, aset, false);
+  r = _fgetattrs(**fd, aset, false);
   if (r >= 0) {
     for (map<string,bufferptr>::iterator p = aset.begin(); p != aset.end(); ++p) {
       char n[CHAIN_XATTR_MAX_NAME_LEN];
       get_attrname(p->first.c_str(), n, CHAIN_XATTR_MAX_NAME_LEN);
-      r = chain_fremovexattr(fd, n);
+      r = chain_fremovexattr(**fd, n);
       if (r < 0)
 	break;
     }
@@ -4323,6 +4514,11 @@ int FileStore::_collection_rename(const coll_t &cid, const coll_t &ncid,
 	     << ": ret = " << ret << dendl;
     return ret;
   }
+  // cached fds and index layouts are keyed by collection name
+  fdcache.clear_collection(cid);
+  direct_fdcache.clear_collection(cid);
+  index_manager.forget_layout(cid);
+  index_manager.forget_layout(ncid);
 
   if (ret >= 0) {
     int fd = ::open(new_coll, O_RDONLY);
@@ -4664,6 +4860,9 @@ int FileStore::_destroy_collection(coll_t c)
   int r = ::rmdir(fn);
   if (r < 0)
     r = -errno;
+  fdcache.clear_collection(c);
+  direct_fdcache.clear_collection(c);
+  index_manager.forget_layout(c);
   dout(10) << "_destroy_collection " << fn << " = " << r << dendl;
   return r;
 }
@@ -4686,8 +4885,9 @@ int FileStore::_collection_add(coll_t c, coll_t oldcid, const hobject_t& o,
 
   // open guard on object so we don't any previous operations on the
   // new name that will modify the source inode.
-  int fd = lfn_open(oldcid, o, 0);
-  if (fd < 0) {
+  FDRef fd;
+  int r = lfn_open(oldcid, o, false, &fd);
+  if (r < 0) {
     // the source collection/object does not exist. If we are replaying, we
     // should be safe, so just return 0 and move on.
     assert(replaying);
@@ -4695,12 +4895,11 @@ int FileStore::_collection_add(coll_t c, coll_t oldcid, const hobject_t& o,
         << oldcid << "/" << o << " (dne, continue replay) " << dendl;
     return 0;
   }
-  assert(fd >= 0);
   if (dstcmp > 0) {      // if dstcmp == 0 the guard already says "in-progress"
-    _set_replay_guard(fd, spos, &o, true);
+    _set_replay_guard(**fd, spos, &o, true);
   }
 
-  int r = lfn_link(oldcid, c, o);
+  r = lfn_link(oldcid, c, o);
   if (replaying && !btrfs_stable_commits &&
       r == -EEXIST)    // crashed between link() and set_replay_guard()
     r = 0;
@@ -4709,7 +4908,7 @@ int FileStore::_collection_add(coll_t c, coll_t oldcid, const hobject_t& o,
 
   // close guard on object so we don't do this again
   if (r == 0) {
-    _close_replay_guard(fd, spos);
+    _close_replay_guard(**fd, spos);
   }
   lfn_close(fd);
 
@@ -4823,6 +5022,10 @@ int FileStore::_split_collection(coll_t cid,
     if (!r)
       r = from->split(rem, bits, to);
 
+    // objects that moved to dest must not be found under cid
+    fdcache.clear_collection(cid);
+    direct_fdcache.clear_collection(cid);
+
     _close_replay_guard(cid, spos);
     _close_replay_guard(dest, spos);
   }
@@ -4904,6 +5107,9 @@ int FileStore::_split_collection_create(coll_t cid,
   if (!r) 
     r = from->split(rem, bits, to);
 
+  fdcache.clear_collection(cid);
+  direct_fdcache.clear_collection(cid);
+
   _close_replay_guard(cid, spos);
   _close_replay_guard(dest, spos);
   return r;
@@ -4926,6 +5132,10 @@ const char** FileStore::get_tracked_conf_keys() const
     "filestore_kill_at",
     "filestore_fail_eio",
     "filestore_replica_fadvise",
+    "filestore_fd_cache_size",
+    "filestore_read_pool_bytes",
+    "filestore_read_direct",
+    "filestore_direct_fd_cache_size",
     NULL
   };
   return KEYS;
@@ -4961,6 +5171,18 @@ void FileStore::handle_conf_change(const struct md_config_t *conf,
     m_filestore_fail_eio = conf->filestore_fail_eio;
     m_filestore_replica_fadvise = conf->filestore_replica_fadvise;
   }
+  if (changed.count("filestore_fd_cache_size")) {
+    fdcache.set_size(conf->filestore_fd_cache_size);
+  }
+  if (changed.count("filestore_direct_fd_cache_size")) {
+    direct_fdcache.set_size(conf->filestore_direct_fd_cache_size);
+  }
+  if (changed.count("filestore_read_pool_bytes")) {
+    read_pool.set_max_bytes(conf->filestore_read_pool_bytes);
+  }
+  if (changed.count("filestore_read_direct")) {
+    m_filestore_read_direct.set(conf->filestore_read_direct);
+  }
   if (changed.count("filestore_commit_timeout")) {
     Mutex::Locker l(sync_entry_timeo_lock);
     m_filestore_commit_timeout = conf->filestore_commit_timeout;
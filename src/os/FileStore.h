@@ -39,6 +39,9 @@ using namespace __gnu_cxx;
 #include "HashIndex.h"
 #include "IndexManager.h"
 #include "ObjectMap.h"
+#include "FDCache.h"
+#include "ReadBufferPool.h"
+#include "WritebackThrottle.h"
 #include "SequencerPosition.h"
 
 #include "include/uuid.h"
@@ -49,6 +52,8 @@ using namespace __gnu_cxx;
 # define FALLOC_FL_PUNCH_HOLE 0x2
 #endif
 
+class AdminSocketHook;
+
 class FileStore : public JournalingObjectStore,
                   public md_config_obs_t
 {
@@ -82,6 +87,19 @@ private:
   int get_index(coll_t c, Index *index);
   int init_index(coll_t c);
 
+  // Open object fds @see lfn_open
+  FDCache fdcache;
+  // O_DIRECT fds for page-aligned pooled reads, with their own budget
+  // @see lfn_open_direct
+  FDCache direct_fdcache;
+
+  // Page-aligned buffers for large reads @see read
+  ReadBufferPool read_pool;
+
+  // Dirty data vs. sync bandwidth @see _write, sync_entry
+  WritebackThrottle wbthrottle;
+  AdminSocketHook *asok_hook;
+
   // ObjectMap
   boost::scoped_ptr<ObjectMap> object_map;
   
@@ -274,13 +292,15 @@ public:
   int lfn_find(coll_t cid, const hobject_t& oid, IndexedPath *path);
   int lfn_truncate(coll_t cid, const hobject_t& oid, off_t length);
   int lfn_stat(coll_t cid, const hobject_t& oid, struct stat *buf);
-  int lfn_open(coll_t cid, const hobject_t& oid, int flags, mode_t mode,
-	       IndexedPath *path);
-  int lfn_open(coll_t cid, const hobject_t& oid, int flags, mode_t mode,
-	       IndexedPath *path, Index *index);
-  int lfn_open(coll_t cid, const hobject_t& oid, int flags, mode_t mode);
-  int lfn_open(coll_t cid, const hobject_t& oid, int flags);
-  void lfn_close(int fd);
+  int lfn_open(coll_t cid, const hobject_t& oid, bool create, FDRef *outfd,
+	       Index *index = 0);
+  void lfn_close(FDRef fd);
+  bool asok_command(string command, string args, ostream& ss);
+  void asok_register();
+  void asok_unregister();
+  int lfn_open_direct(coll_t cid, const hobject_t& oid, FDRef *outfd);
+  int lfn_read_direct(coll_t cid, const hobject_t& oid, uint64_t offset,
+		      size_t len, char *buf);
   int lfn_link(coll_t c, coll_t cid, const hobject_t& o) ;
   int lfn_unlink(coll_t cid, const hobject_t& o, const SequencerPosition &spos);
 
@@ -535,6 +555,7 @@ private:
   std::ofstream m_filestore_dump;
   JSONFormatter m_filestore_dump_fmt;
   atomic_t m_filestore_kill_at;
+  atomic_t m_filestore_read_direct;
 };
 
 ostream& operator<<(ostream& out, const FileStore::OpSequencer& s);
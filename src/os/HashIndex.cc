@@ -24,8 +24,11 @@
 
 const string HashIndex::SUBDIR_ATTR = "contents";
 const string HashIndex::IN_PROGRESS_OP_TAG = "in_progress_op";
+const string HashIndex::PRE_SPLIT_ATTR = "pre_split";
 
 int HashIndex::cleanup() {
+  // we may be recovering from an interrupted split or merge
+  layout_clear();
   bufferlist bl;
   int r = get_attr_path(vector<string>(), IN_PROGRESS_OP_TAG, bl);
   if (r < 0) {
@@ -226,14 +229,184 @@ int HashIndex::_split(
   uint32_t bits,
   std::tr1::shared_ptr<CollectionIndex> dest) {
   assert(collection_version() == dest->collection_version());
+  HashIndex &to = *static_cast<HashIndex*>(dest.get());
   unsigned mkdirred = 0;
-  return col_split_level(
+  int r = col_split_level(
     *this,
-    *static_cast<HashIndex*>(dest.get()),
+    to,
     vector<string>(),
     bits,
     match,
     &mkdirred);
+  layout_clear();
+  to.layout_clear();
+  return r;
+}
+
+int HashIndex::split_dir(const vector<string> &path, bool started,
+			 uint64_t *moved, bool *done) {
+  *moved = 0;
+  *done = true;
+  WRAP_RETRY(
+  subdir_info_s info;
+  r = get_info(path, &info);
+  if (r < 0) {
+    // merged away or the collection is gone
+    if (r == -ENOENT)
+      r = 0;
+    goto out;
+  }
+  // once started, finish even if removes brought it under the threshold
+  if (!started && !must_split(info)) {
+    r = 0;
+    goto out;
+  }
+  r = split_one_subdir(path, info, moved, done);
+  );
+}
+
+int HashIndex::split_one_subdir(const vector<string> &path,
+				subdir_info_s info,
+				uint64_t *moved, bool *done) {
+  int level = info.hash_level;
+  map<string, hobject_t> objects;
+  int r = list_objects(path, 0, 0, &objects);
+  if (r < 0)
+    return r;
+  set<string> subdirs;
+  r = list_subdirs(path, &subdirs);
+  if (r < 0)
+    return r;
+  map<string, map<string, hobject_t> > mapped;
+  for (map<string, hobject_t>::iterator i = objects.begin();
+       i != objects.end();
+       ++i) {
+    vector<string> new_path;
+    get_path_components(i->second, &new_path);
+    mapped[new_path[level]][i->first] = i->second;
+  }
+
+  // lookups already go into the subdirs that exist, so only objects
+  // for new ones are left here; those too small to bother with stay,
+  // as they would with complete_split
+  vector<string> todo;
+  for (map<string, map<string, hobject_t> >::iterator i = mapped.begin();
+       i != mapped.end();
+       ++i) {
+    if (subdirs.count(i->first))
+      continue;
+    subdir_info_s info_new;
+    info_new.objs = i->second.size();
+    info_new.hash_level = level + 1;
+    if (!must_merge(info_new))
+      todo.push_back(i->first);
+  }
+  if (todo.empty())
+    return 0;
+  *done = todo.size() == 1;
+
+  map<string, hobject_t> &to_move = mapped[todo.front()];
+  vector<string> dst = path;
+  dst.push_back(todo.front());
+  r = start_split(path);
+  if (r < 0)
+    return r;
+  layout_invalidate(path);
+  r = create_path(dst);
+  if (r < 0)
+    return r;
+  for (map<string, hobject_t>::iterator j = to_move.begin();
+       j != to_move.end();
+       ++j) {
+    objects.erase(j->first);
+    r = link_object(path, dst, j->second, j->first);
+    if (r < 0)
+      return r;
+  }
+  r = fsync_dir(dst);
+  if (r < 0)
+    return r;
+
+  // Presence of info must imply that all objects have been copied
+  subdir_info_s info_new;
+  info_new.objs = to_move.size();
+  info_new.subdirs = 0;
+  info_new.hash_level = level + 1;
+  r = set_info(dst, info_new);
+  if (r < 0)
+    return r;
+  r = fsync_dir(dst);
+  if (r < 0)
+    return r;
+
+  r = remove_objects(path, to_move, &objects);
+  if (r < 0)
+    return r;
+  info.objs = objects.size();
+  info.subdirs += 1;
+  r = set_info(path, info);
+  if (r < 0)
+    return r;
+  r = fsync_dir(path);
+  if (r < 0)
+    return r;
+  *moved = to_move.size();
+  return end_split_or_merge(path);
+}
+
+int HashIndex::pre_split(uint64_t expected_objs) {
+  uint64_t leaf_objs = (uint64_t)merge_threshold * 16 * split_multiplier;
+  int levels = 0;
+  while (levels < MAX_HASH_LEVEL && expected_objs > leaf_objs) {
+    expected_objs /= 16;
+    ++levels;
+  }
+  if (!levels)
+    return 0;
+  // recorded first, so that nothing merges the levels while we build them
+  bufferlist bl;
+  ::encode((uint32_t)levels, bl);
+  int r = add_attr_path(vector<string>(), PRE_SPLIT_ATTR, bl);
+  if (r < 0)
+    return r;
+  pre_split_levels = levels;
+  layout_clear();
+  return pre_split_level(vector<string>(), levels);
+}
+
+int HashIndex::get_pre_split_levels() {
+  if (pre_split_levels >= 0)
+    return pre_split_levels;
+  bufferlist bl;
+  int r = get_attr_path(vector<string>(), PRE_SPLIT_ATTR, bl);
+  if (r < 0) {
+    // never pre-split
+    pre_split_levels = 0;
+    return 0;
+  }
+  uint32_t levels;
+  bufferlist::iterator p = bl.begin();
+  ::decode(levels, p);
+  pre_split_levels = levels;
+  return pre_split_levels;
+}
+
+int HashIndex::pre_split_level(const vector<string> &path, int levels) {
+  if (levels > 0) {
+    vector<string> child(path);
+    child.push_back("");
+    for (int i = 0; i < 16; ++i) {
+      child.back() = string(1, "0123456789ABCDEF"[i]);
+      int r = create_path(child);
+      if (r < 0 && r != -EEXIST)
+	return r;
+      r = pre_split_level(child, levels - 1);
+      if (r < 0)
+	return r;
+    }
+  }
+  // recount from disk so that redoing this on replay is harmless
+  return reset_attr(path);
 }
 
 int HashIndex::_init() {
@@ -257,6 +430,11 @@ int HashIndex::_created(const vector<string> &path,
     return r;
 
   if (must_split(info)) {
+    double fill = (double)info.objs /
+      ((double)merge_threshold * 16 * split_multiplier);
+    if (split_queue &&
+	split_queue->queue_split(coll(), get_base_path(), path, fill))
+      return 0;
     int r = initiate_split(path, info);
     if (r < 0)
       return r;
@@ -299,6 +477,19 @@ int HashIndex::_lookup(const hobject_t &hoid,
   get_path_components(hoid, &path_comp);
   vector<string>::iterator next = path_comp.begin();
   int r, exists;
+  if (layout) {
+    // walk the cached subdir listings instead of probing each level
+    while (next != path_comp.end()) {
+      const set<string> *subdirs;
+      r = get_subdirs(*path, &subdirs);
+      if (r < 0)
+	return r;
+      if (!subdirs->count(*next))
+	break;
+      path->push_back(*(next++));
+    }
+    return get_mangled_name(*path, hoid, mangled_name, exists_out);
+  }
   while (1) {
     r = path_exists(*path, &exists);
     if (r < 0)
@@ -337,7 +528,9 @@ int HashIndex::_collection_list_partial(const hobject_t &start,
 }
 
 int HashIndex::prep_delete() {
-  return recursive_remove(vector<string>());
+  int r = recursive_remove(vector<string>());
+  layout_clear();
+  return r;
 }
 
 int HashIndex::recursive_remove(const vector<string> &path) {
@@ -398,7 +591,61 @@ int HashIndex::end_split_or_merge(const vector<string> &path) {
   return remove_attr_path(vector<string>(), IN_PROGRESS_OP_TAG);
 }
 
+HashIndex::Layout::Dir &HashIndex::layout_dir(const vector<string> &path) {
+  assert(layout);
+  string key;
+  for (vector<string>::const_iterator i = path.begin(); i != path.end(); ++i)
+    key.append(*i);
+  return layout->dirs[key];
+}
+
+void HashIndex::layout_invalidate(const vector<string> &path) {
+  if (!layout)
+    return;
+  string prefix;
+  for (vector<string>::const_iterator i = path.begin(); i != path.end(); ++i)
+    prefix.append(*i);
+  map<string, Layout::Dir>::iterator i = layout->dirs.lower_bound(prefix);
+  while (i != layout->dirs.end() &&
+	 i->first.compare(0, prefix.size(), prefix) == 0)
+    layout->dirs.erase(i++);
+  if (!path.empty()) {
+    vector<string> parent(path.begin(), path.end() - 1);
+    Layout::Dir &d = layout_dir(parent);
+    d.have_subdirs = false;
+    d.subdirs.clear();
+  }
+}
+
+void HashIndex::layout_clear() {
+  if (layout)
+    layout->dirs.clear();
+}
+
+int HashIndex::get_subdirs(const vector<string> &path,
+			   const set<string> **subdirs) {
+  assert(layout);
+  Layout::Dir &d = layout_dir(path);
+  if (!d.have_subdirs) {
+    int r = list_subdirs(path, &d.subdirs);
+    if (r < 0) {
+      d.subdirs.clear();
+      return r;
+    }
+    d.have_subdirs = true;
+  }
+  *subdirs = &d.subdirs;
+  return 0;
+}
+
 int HashIndex::get_info(const vector<string> &path, subdir_info_s *info) {
+  if (layout) {
+    Layout::Dir &d = layout_dir(path);
+    if (d.have_info) {
+      *info = d.info;
+      return 0;
+    }
+  }
   bufferlist buf;
   int r = get_attr_path(path, SUBDIR_ATTR, buf);
   if (r < 0)
@@ -406,6 +653,11 @@ int HashIndex::get_info(const vector<string> &path, subdir_info_s *info) {
   bufferlist::iterator bufiter = buf.begin();
   info->decode(bufiter);
   assert(path.size() == (unsigned)info->hash_level);
+  if (layout) {
+    Layout::Dir &d = layout_dir(path);
+    d.info = *info;
+    d.have_info = true;
+  }
   return 0;
 }
 
@@ -413,11 +665,17 @@ int HashIndex::set_info(const vector<string> &path, const subdir_info_s &info) {
   bufferlist buf;
   assert(path.size() == (unsigned)info.hash_level);
   info.encode(buf);
-  return add_attr_path(path, SUBDIR_ATTR, buf);
+  int r = add_attr_path(path, SUBDIR_ATTR, buf);
+  if (layout) {
+    Layout::Dir &d = layout_dir(path);
+    d.info = info;
+    d.have_info = (r == 0);
+  }
+  return r;
 }
 
 bool HashIndex::must_merge(const subdir_info_s &info) {
-  return (info.hash_level > 0 &&
+  return (info.hash_level > (unsigned)get_pre_split_levels() &&
 	  info.objs < (unsigned)merge_threshold &&
 	  info.subdirs == 0);
 }
@@ -462,6 +720,7 @@ int HashIndex::complete_merge(const vector<string> &path, subdir_info_s info) {
     if (r < 0)
       return r;
     r = remove_path(path);
+    layout_invalidate(path);
     if (r < 0)
       return r;
   }
@@ -489,6 +748,8 @@ int HashIndex::complete_split(const vector<string> &path, subdir_info_s info) {
   map<string, hobject_t> objects;
   vector<string> dst = path;
   int r;
+  // subdirs are about to appear under path
+  layout_invalidate(path);
   dst.push_back("");
   r = list_objects(path, 0, 0, &objects);
   if (r < 0)
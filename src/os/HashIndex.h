@@ -45,6 +45,15 @@
  * Subdirectories are created when the number of objects in a directory
  * exceed 32*merge_threshhold.  The number of objects in a directory 
  * is encoded as subdir_info_s in an xattr on the directory.
+ *
+ * If given a Layout, the subdir listings and subdir_info_s of the
+ * directories visited are remembered there, so that lookups and
+ * object creation/removal don't have to probe the filesystem for the
+ * subdir tree on every operation.  @see Layout
+ *
+ * If given a SplitQueue, subdirs that grow past the split threshold are
+ * handed to it to be split later via split_dir() instead of being split
+ * inline by the op that crossed the threshold.  @see SplitQueue
  */
 class HashIndex : public LFNIndex {
 private:
@@ -52,6 +61,8 @@ private:
   static const string SUBDIR_ATTR;
   /// Attribute name for storing in progress op tag
   static const string IN_PROGRESS_OP_TAG;
+  /// Attribute name for storing the levels made by pre_split()
+  static const string PRE_SPLIT_ATTR;
   /// Size (bits) in object hash
   static const int PATH_HASH_LEN = 32;
   /// Max length of hashed path
@@ -130,6 +141,52 @@ private:
     
     
 public:
+  /**
+   * In-memory copy of a collection's subdir tree.
+   *
+   * A HashIndex only lives for the duration of a single FileStore
+   * operation, so the Layout is kept by the IndexManager and handed to
+   * each HashIndex built for the collection.  The IndexManager never
+   * allows two HashIndex instances for a collection at the same time,
+   * so the Layout needs no locking of its own.
+   *
+   * Entries are filled in lazily as directories are visited.  Object
+   * counts are written through by set_info(); splits, merges and
+   * collection splits drop the entries for the subtree they touched.
+   */
+  struct Layout {
+    struct Dir {
+      bool have_info;
+      subdir_info_s info;   ///< valid if have_info
+      bool have_subdirs;
+      set<string> subdirs;  ///< valid if have_subdirs
+      Dir() : have_info(false), have_subdirs(false) {}
+    };
+    /// Dirs by concatenated path components, "" is the collection root
+    map<string, Dir> dirs;
+  };
+  typedef std::tr1::shared_ptr<Layout> LayoutRef;
+
+  /// Schedules subdir splits outside of the op path @see split_dir
+  class SplitQueue {
+  public:
+    /**
+     * Queue a split of path, called with the index held
+     *
+     * @param c [in] collection
+     * @param base_path [in] path to the collection root
+     * @param path [in] subdir to split
+     * @param fill [in] objects in path relative to the split threshold
+     * @return false if the caller should split inline instead
+     */
+    virtual bool queue_split(
+      coll_t c,
+      const string &base_path,
+      const vector<string> &path,
+      double fill) = 0;
+    virtual ~SplitQueue() {}
+  };
+
   /// Constructor.
   HashIndex(
     coll_t collection,     ///< [in] Collection
@@ -137,10 +194,15 @@ public:
     int merge_at,          ///< [in] Merge threshhold.
     int split_multiple,	   ///< [in] Split threshhold.
     uint32_t index_version,///< [in] Index version
-    double retry_probability=0) ///< [in] retry probability
+    double retry_probability=0, ///< [in] retry probability
+    LayoutRef layout=LayoutRef(), ///< [in] cached layout, may be null
+    SplitQueue *split_queue=0)    ///< [in] deferred splits, may be null
     : LFNIndex(collection, base_path, index_version, retry_probability),
       merge_threshold(merge_at),
-      split_multiplier(split_multiple) {}
+      split_multiplier(split_multiple),
+      layout(layout),
+      split_queue(split_queue),
+      pre_split_levels(-1) {}
 
   /// @see CollectionIndex
   uint32_t collection_version() { return index_version; }
@@ -157,6 +219,26 @@ public:
     uint32_t bits,
     std::tr1::shared_ptr<CollectionIndex> dest
     );
+
+  /**
+   * Move one new subdir's worth of objects out of path, if it (still)
+   * needs splitting, @see SplitQueue
+   *
+   * Each call leaves path in the same state an inline split that
+   * skipped the remaining subdirs would, so the index can be given up
+   * between calls.
+   */
+  int split_dir(
+    const vector<string> &path, ///< [in] subdir to split
+    bool started,               ///< [in] an earlier call moved some already
+    uint64_t *moved,            ///< [out] objects moved, 0 if none
+    bool *done                  ///< [out] nothing is left to move
+    ); ///< @return Error Code, 0 on success
+
+  /// Create enough hash levels up front to hold expected_objs objects
+  int pre_split(
+    uint64_t expected_objs ///< [in] expected number of objects
+    ); ///< @return Error Code, 0 on success
 	
 protected:
   int _init();
@@ -189,6 +271,22 @@ protected:
     hobject_t *next
     );
 private:
+  /// Cached subdir tree, null if not caching @see Layout
+  LayoutRef layout;
+  /// Where to send splits, null to split inline @see SplitQueue
+  SplitQueue *split_queue;
+  /// Hash levels made by pre_split(), -1 until read @see get_pre_split_levels
+  int pre_split_levels;
+
+  /// Hash levels pre_split() made, which are never merged away
+  int get_pre_split_levels(); ///< @return levels, 0 if none
+
+  /// Create levels hash levels of subdirs below path @see pre_split
+  int pre_split_level(
+    const vector<string> &path, ///< [in] path to populate
+    int levels                  ///< [in] levels to create below path
+    ); ///< @return Error Code, 0 on success
+
   /// Recursively remove path and its subdirs
   int recursive_remove(
     const vector<string> &path ///< [in] path to remove
@@ -209,6 +307,25 @@ private:
   int end_split_or_merge(
     const vector<string> &path ///< [in] path to split or merged
     ); ///< @return Error Code, 0 on success
+  /// Get the cached state for path, creating an empty entry if needed
+  Layout::Dir &layout_dir(
+    const vector<string> &path ///< [in] path of the dir
+    );
+
+  /// Forget cached state for path, its descendants and its parent's listing
+  void layout_invalidate(
+    const vector<string> &path ///< [in] path that was split or removed
+    );
+
+  /// Forget the whole cached layout
+  void layout_clear();
+
+  /// Gets the subdirs of path, from the layout cache if possible
+  int get_subdirs(
+    const vector<string> &path, ///< [in] path to list
+    const set<string> **subdirs ///< [out] subdirs, valid until next change
+    ); ///< @return Error Code, 0 on success
+
   /// Gets info from the xattr on the subdir represented by path
   int get_info(
     const vector<string> &path, ///< [in] Path from which to read attribute.
@@ -254,6 +371,14 @@ private:
     subdir_info_s info		///< [in] Info attached to path
     ); /// @return Error Code, 0 on success
 
+  /// Moves the objects of one subdir that doesn't exist yet, @see split_dir
+  int split_one_subdir(
+    const vector<string> &path, ///< [in] Subdir to split
+    subdir_info_s info,         ///< [in] Info attached to path
+    uint64_t *moved,            ///< [out] objects moved
+    bool *done                  ///< [out] no other subdir is left to create
+    ); /// @return Error Code, 0 on success
+
   /// Completes Split
   int complete_split(
     const vector<string> &path, ///< [in] Subdir to split
@@ -23,9 +23,12 @@
 
 #include "common/Mutex.h"
 #include "common/Cond.h"
+#include "common/Clock.h"
 #include "common/config.h"
 #include "common/debug.h"
+#include "common/errno.h"
 #include "include/buffer.h"
+#include "os/ObjectStore.h"
 
 #include "IndexManager.h"
 #include "FlatIndex.h"
@@ -34,6 +37,10 @@
 
 #include "chain_xattr.h"
 
+#define dout_subsys ceph_subsys_filestore
+#undef dout_prefix
+#define dout_prefix *_dout << "IndexManager "
+
 static int set_version(const char *path, uint32_t version) {
   bufferlist bl;
   ::encode(version, bl);
@@ -68,8 +75,29 @@ void IndexManager::put_index(coll_t c) {
   cond.Signal();
 }
 
+HashIndex::LayoutRef IndexManager::get_layout(coll_t c) {
+  assert(lock.is_locked());
+  if (!g_conf->filestore_index_cache_layout)
+    return HashIndex::LayoutRef();
+  HashIndex::LayoutRef &layout = layouts[c];
+  if (!layout)
+    layout.reset(new HashIndex::Layout);
+  return layout;
+}
+
+void IndexManager::forget_layout(coll_t c) {
+  Mutex::Locker l(lock);
+  layouts.erase(c);
+}
+
+void IndexManager::forget_layouts() {
+  Mutex::Locker l(lock);
+  layouts.clear();
+}
+
 int IndexManager::init_index(coll_t c, const char *path, uint32_t version) {
   Mutex::Locker l(lock);
+  layouts.erase(c);
   int r = set_version(path, version);
   if (r < 0)
     return r;
@@ -77,7 +105,12 @@ int IndexManager::init_index(coll_t c, const char *path, uint32_t version) {
 		  g_conf->filestore_split_multiple,
 		  CollectionIndex::HASH_INDEX_TAG_2,
 		  g_conf->filestore_index_retry_probability);
-  return index.init();
+  r = index.init();
+  if (r < 0)
+    return r;
+  if (g_conf->filestore_pre_split_objects)
+    r = index.pre_split(g_conf->filestore_pre_split_objects);
+  return r;
 }
 
 int IndexManager::build_index(coll_t c, const char *path, Index *index) {
@@ -100,7 +133,8 @@ int IndexManager::build_index(coll_t c, const char *path, Index *index) {
     case CollectionIndex::HOBJECT_WITH_POOL: {
       // Must be a HashIndex
       *index = Index(new HashIndex(c, path, g_conf->filestore_merge_threshold,
-				   g_conf->filestore_split_multiple, version), 
+				   g_conf->filestore_split_multiple, version,
+				   0, get_layout(c), this),
 		     RemoveOnDelete(c, this));
       return 0;
     }
@@ -112,7 +146,8 @@ int IndexManager::build_index(coll_t c, const char *path, Index *index) {
     *index = Index(new HashIndex(c, path, g_conf->filestore_merge_threshold,
 				 g_conf->filestore_split_multiple,
 				 CollectionIndex::HOBJECT_WITH_POOL,
-				 g_conf->filestore_index_retry_probability),
+				 g_conf->filestore_index_retry_probability,
+				 get_layout(c), this),
 		   RemoveOnDelete(c, this));
     return 0;
   }
@@ -134,3 +169,127 @@ int IndexManager::get_index(coll_t c, const char *path, Index *index) {
   }
   return 0;
 }
+
+void IndexManager::start_split_thread(PerfCounters *l) {
+  Mutex::Locker locker(split_lock);
+  assert(!split_running);
+  logger = l;
+  split_stop = false;
+  split_running = true;
+  split_thread.create();
+}
+
+void IndexManager::stop_split_thread() {
+  split_lock.Lock();
+  if (!split_running) {
+    split_lock.Unlock();
+    return;
+  }
+  split_running = false;
+  split_stop = true;
+  split_cond.Signal();
+  split_lock.Unlock();
+  split_thread.join();
+
+  // anything left is picked up again by the next create in that subdir
+  Mutex::Locker locker(split_lock);
+  split_queue.clear();
+  split_queued.clear();
+  if (logger)
+    logger->set(l_os_split_queue, 0);
+  logger = NULL;
+}
+
+bool IndexManager::queue_split(coll_t c,
+			       const string &base_path,
+			       const vector<string> &path,
+			       double fill) {
+  Mutex::Locker l(split_lock);
+  if (!split_running ||
+      !g_conf->filestore_split_background ||
+      fill > g_conf->filestore_split_inline_fill)
+    return false;
+  if (split_queued.insert(make_pair(c, path)).second) {
+    dout(15) << "queue_split " << c << " " << path << " fill " << fill << dendl;
+    split_queue.push_back(SplitItem(c, base_path, path));
+    if (logger)
+      logger->set(l_os_split_queue, split_queue.size());
+    split_cond.Signal();
+  }
+  return true;
+}
+
+int IndexManager::do_split(const SplitItem &item, uint64_t *moved) {
+  *moved = 0;
+  bool done = false;
+  while (!done) {
+    // the index is only held while one new subdir is filled, so ops on
+    // the collection get their turn in between
+    uint64_t chunk = 0;
+    {
+      Index index;
+      int r = get_index(item.c, item.base_path.c_str(), &index);
+      if (r < 0)
+	return r;
+      HashIndex *hindex = dynamic_cast<HashIndex*>(index.get());
+      if (!hindex)
+	return 0;
+      r = hindex->split_dir(item.path, *moved > 0, &chunk, &done);
+      if (r < 0)
+	return r;
+    }
+    *moved += chunk;
+
+    // what is left is a valid layout, and gets queued again as it grows
+    Mutex::Locker l(split_lock);
+    if (split_stop)
+      break;
+  }
+  return 0;
+}
+
+void IndexManager::split_entry() {
+  split_lock.Lock();
+  while (!split_stop) {
+    if (split_queue.empty()) {
+      split_cond.Wait(split_lock);
+      continue;
+    }
+    SplitItem item = split_queue.front();
+    split_queue.pop_front();
+    split_queued.erase(make_pair(item.c, item.path));
+    if (logger)
+      logger->set(l_os_split_queue, split_queue.size());
+    split_lock.Unlock();
+
+    utime_t start = ceph_clock_now(g_ceph_context);
+    uint64_t moved = 0;
+    int r = do_split(item, &moved);
+    utime_t dur = ceph_clock_now(g_ceph_context) - start;
+    dout(10) << "split " << item.c << " " << item.path << " moved " << moved
+	     << " in " << dur << " r = " << r << dendl;
+    if (r < 0)
+      derr << "split of " << item.c << " " << item.path << " failed: "
+	   << cpp_strerror(r) << dendl;
+
+    split_lock.Lock();
+    if (moved) {
+      if (logger) {
+	logger->inc(l_os_splits);
+	logger->tinc(l_os_split_lat, dur);
+      }
+      // every moved object cost us a link and an unlink; wait out
+      // whatever part of that the budget hasn't paid for yet
+      int rate = g_conf->filestore_split_ops_per_sec;
+      if (rate > 0 && !split_stop) {
+	double owed = (double)(moved * 2) / (double)rate - (double)dur;
+	if (owed > 0) {
+	  utime_t wait;
+	  wait.set_from_double(owed);
+	  split_cond.WaitInterval(g_ceph_context, split_lock, wait);
+	}
+      }
+    }
+  }
+  split_lock.Unlock();
+}
@@ -19,8 +19,10 @@
 
 #include "common/Mutex.h"
 #include "common/Cond.h"
+#include "common/Thread.h"
 #include "common/config.h"
 #include "common/debug.h"
+#include "common/perf_counters.h"
 
 #include "CollectionIndex.h"
 #include "HashIndex.h"
@@ -43,8 +45,15 @@ typedef std::tr1::shared_ptr<CollectionIndex> Index;
  * carry a reference to the parrent index.  Once all
  * shared_ptr<CollectionIndex> references have expired, the destructor
  * removes the weak_ptr from col_indices and wakes waiters.
+ *
+ * Once start_split_thread() has been called, HashIndex subdir splits are
+ * queued here and done by a background thread, paced to
+ * filestore_split_ops_per_sec.  The split thread takes the index like
+ * any other user, but only to move one new subdir's objects at a time,
+ * so ops get the index between those and never see a half-filled
+ * subdir.
  */
-class IndexManager {
+class IndexManager : public HashIndex::SplitQueue {
   Mutex lock; ///< Lock for Index Manager
   Cond cond;  ///< Cond for waiters on col_indices
   bool upgrade;
@@ -52,6 +61,46 @@ class IndexManager {
   /// Currently in use CollectionIndices
   map<coll_t,std::tr1::weak_ptr<CollectionIndex> > col_indices;
 
+  /// Cached HashIndex subdir layouts, kept across get_index calls
+  map<coll_t, HashIndex::LayoutRef> layouts;
+
+  /// Get (creating if needed) the cached layout for c, or null if disabled
+  HashIndex::LayoutRef get_layout(coll_t c);
+
+  /// A subdir waiting to be split @see HashIndex::SplitQueue
+  struct SplitItem {
+    coll_t c;
+    string base_path;
+    vector<string> path;
+    SplitItem(coll_t c, const string &base_path, const vector<string> &path)
+      : c(c), base_path(base_path), path(path) {}
+  };
+  Mutex split_lock;       ///< protects the split_* members below
+  Cond split_cond;        ///< signaled on new work and on stop
+  bool split_running;     ///< split thread accepts work
+  bool split_stop;        ///< split thread should exit
+  list<SplitItem> split_queue;
+  set<pair<coll_t, vector<string> > > split_queued; ///< dedups split_queue
+  PerfCounters *logger;   ///< FileStore perf counters, may be null
+
+  struct SplitThread : public Thread {
+    IndexManager *manager;
+    SplitThread(IndexManager *m) : manager(m) {}
+    void *entry() {
+      manager->split_entry();
+      return 0;
+    }
+  } split_thread;
+
+  /// Body of split_thread
+  void split_entry();
+
+  /// Split one queued subdir
+  int do_split(
+    const SplitItem &item, ///< [in] subdir to split
+    uint64_t *moved        ///< [out] objects moved
+    ); ///< @return error code
+
   /// Cleans up state for c @see RemoveOnDelete
   void put_index(
     coll_t c ///< Put the index for c
@@ -86,7 +135,26 @@ class IndexManager {
 public:
   /// Constructor
   IndexManager(bool upgrade) : lock("IndexManager lock"),
-			       upgrade(upgrade) {}
+			       upgrade(upgrade),
+			       split_lock("IndexManager::split_lock"),
+			       split_running(false), split_stop(false),
+			       logger(NULL),
+			       split_thread(this) {}
+
+  /// Start splitting subdirs in the background
+  void start_split_thread(
+    PerfCounters *l ///< [in] counters to update, may be null
+    );
+
+  /// Stop the split thread, dropping any queued splits
+  void stop_split_thread();
+
+  /// @see HashIndex::SplitQueue
+  bool queue_split(
+    coll_t c,
+    const string &base_path,
+    const vector<string> &path,
+    double fill);
 
   /**
    * Reserve and return index for c
@@ -107,6 +175,19 @@ public:
    * @return error code
    */
   int init_index(coll_t c, const char *path, uint32_t filestore_version);
+
+  /**
+   * Drop the cached layout for c
+   *
+   * Must be called when the directory of c is renamed or removed
+   * behind the index's back.
+   *
+   * @param [in] c Collection whose layout to drop
+   */
+  void forget_layout(coll_t c);
+
+  /// Drop all cached layouts
+  void forget_layouts();
 };
 
 #endif
@@ -2,7 +2,10 @@
 
 #include "JournalingObjectStore.h"
 
+#include "common/Clock.h"
+#include "common/Thread.h"
 #include "common/debug.h"
+#include "include/stringify.h"
 
 #define dout_subsys ceph_subsys_journal
 #undef dout_prefix
@@ -27,6 +30,403 @@ void JournalingObjectStore::journal_stop()
   }
 }
 
+// ------------------------------------
+// parallel replay
+
+/*
+ * A decoded journal entry waiting to be applied.  deps counts the
+ * earlier entries it conflicts with that have not been applied yet.
+ */
+struct ReplayEntry {
+  uint64_t seq;
+  list<ObjectStore::Transaction*> tls;
+  uint64_t bytes;
+  int deps;
+  vector<ReplayEntry*> dependents;
+  vector<string> keys;
+
+  ReplayEntry(uint64_t s, uint64_t b) : seq(s), bytes(b), deps(0) {}
+  ~ReplayEntry() {
+    while (!tls.empty()) {
+      delete tls.front();
+      tls.pop_front();
+    }
+  }
+};
+
+/*
+ * Work out what an entry may not be reordered with.
+ *
+ * Ops on a regular collection take that collection exclusively, so each
+ * collection's ops are applied in journal order.  The meta collection is
+ * shared by every pg, so there we go down to the object, and for omap
+ * key updates down to the key: pg info and log updates from different
+ * pgs touch the same objects but never the same keys.  Ops that involve
+ * two collections take both.
+ *
+ * Returns false if we hit an op we don't know how to decode; the caller
+ * then applies the entry on its own.
+ */
+static bool get_replay_keys(list<ObjectStore::Transaction*>& tls,
+			    map<string, bool> *keys)
+{
+  typedef ObjectStore::Transaction T;
+  for (list<T*>::iterator p = tls.begin(); p != tls.end(); ++p) {
+    T::iterator i = (*p)->begin();
+    while (i.have_op()) {
+      int op = i.get_op();
+      coll_t cid, ncid;
+      hobject_t oid;
+      bool have_oid = false, two_colls = false;
+      set<string> omap_keys;
+      switch (op) {
+      case T::OP_NOP:
+      case T::OP_STARTSYNC:
+	continue;
+      case T::OP_TOUCH:
+      case T::OP_REMOVE:
+      case T::OP_RMATTRS:
+      case T::OP_COLL_REMOVE:
+      case T::OP_OMAP_CLEAR:
+	cid = i.get_cid();
+	oid = i.get_oid();
+	have_oid = true;
+	break;
+      case T::OP_WRITE:
+	{
+	  cid = i.get_cid();
+	  oid = i.get_oid();
+	  have_oid = true;
+	  i.get_length();
+	  i.get_length();
+	  i.get_replica();
+	  bufferlist bl;
+	  i.get_bl(bl);
+	}
+	break;
+      case T::OP_ZERO:
+      case T::OP_TRIMCACHE:
+	cid = i.get_cid();
+	oid = i.get_oid();
+	have_oid = true;
+	i.get_length();
+	i.get_length();
+	break;
+      case T::OP_TRUNCATE:
+	cid = i.get_cid();
+	oid = i.get_oid();
+	have_oid = true;
+	i.get_length();
+	break;
+      case T::OP_SETATTR:
+      case T::OP_OMAP_SETHEADER:
+	{
+	  cid = i.get_cid();
+	  oid = i.get_oid();
+	  have_oid = true;
+	  if (op == T::OP_SETATTR)
+	    i.get_attrname();
+	  bufferlist bl;
+	  i.get_bl(bl);
+	}
+	break;
+      case T::OP_SETATTRS:
+	{
+	  cid = i.get_cid();
+	  oid = i.get_oid();
+	  have_oid = true;
+	  map<string, bufferptr> aset;
+	  i.get_attrset(aset);
+	}
+	break;
+      case T::OP_RMATTR:
+	cid = i.get_cid();
+	oid = i.get_oid();
+	have_oid = true;
+	i.get_attrname();
+	break;
+      case T::OP_CLONE:
+      case T::OP_CLONERANGE:
+      case T::OP_CLONERANGE2:
+	// clones share the source's omap, so take the whole collection
+	cid = i.get_cid();
+	i.get_oid();
+	i.get_oid();
+	if (op != T::OP_CLONE) {
+	  i.get_length();
+	  i.get_length();
+	}
+	if (op == T::OP_CLONERANGE2)
+	  i.get_length();
+	break;
+      case T::OP_MKCOLL:
+      case T::OP_RMCOLL:
+	cid = i.get_cid();
+	break;
+      case T::OP_COLL_ADD:
+      case T::OP_COLL_MOVE:
+	cid = i.get_cid();
+	ncid = i.get_cid();
+	i.get_oid();
+	two_colls = true;
+	break;
+      case T::OP_COLL_SETATTR:
+	{
+	  cid = i.get_cid();
+	  i.get_attrname();
+	  bufferlist bl;
+	  i.get_bl(bl);
+	}
+	break;
+      case T::OP_COLL_RMATTR:
+	cid = i.get_cid();
+	i.get_attrname();
+	break;
+      case T::OP_COLL_RENAME:
+	cid = i.get_cid();
+	ncid = i.get_cid();
+	two_colls = true;
+	break;
+      case T::OP_OMAP_SETKEYS:
+	{
+	  cid = i.get_cid();
+	  oid = i.get_oid();
+	  have_oid = true;
+	  map<string, bufferlist> aset;
+	  i.get_attrset(aset);
+	  for (map<string, bufferlist>::iterator k = aset.begin();
+	       k != aset.end(); ++k)
+	    omap_keys.insert(k->first);
+	}
+	break;
+      case T::OP_OMAP_RMKEYS:
+	cid = i.get_cid();
+	oid = i.get_oid();
+	have_oid = true;
+	i.get_keyset(omap_keys);
+	break;
+      case T::OP_SPLIT_COLLECTION:
+      case T::OP_SPLIT_COLLECTION2:
+	cid = i.get_cid();
+	i.get_u32();
+	i.get_u32();
+	ncid = i.get_cid();
+	two_colls = true;
+	break;
+      default:
+	return false;
+      }
+
+      if (two_colls) {
+	(*keys)["c" + stringify(cid)] = true;
+	(*keys)["c" + stringify(ncid)] = true;
+      } else if (cid != coll_t::META_COLL || !have_oid) {
+	(*keys)["c" + stringify(cid)] = true;
+      } else {
+	string ckey = "c" + stringify(cid);
+	string okey = "o" + stringify(oid);
+	if (!keys->count(ckey))
+	  (*keys)[ckey] = false;
+	if (omap_keys.empty() ||
+	    op == T::OP_OMAP_CLEAR) {
+	  (*keys)[okey] = true;
+	} else {
+	  if (!keys->count(okey))
+	    (*keys)[okey] = false;
+	  for (set<string>::iterator k = omap_keys.begin();
+	       k != omap_keys.end(); ++k)
+	    (*keys)["k" + stringify(oid) + "/" + *k] = true;
+	}
+      }
+    }
+  }
+  return true;
+}
+
+/*
+ * Applies decoded entries on a handful of threads.  Each key names
+ * something entries must not be reordered around (see get_replay_keys),
+ * taken either exclusive or shared; an entry runs once every earlier
+ * conflicting entry has been applied.  Only unapplied entries are
+ * tracked, so memory is bounded by max_in_flight.
+ */
+class JournalingObjectStore::ReplayPool {
+  struct KeyState {
+    ReplayEntry *exclusive;
+    set<ReplayEntry*> shared;
+    KeyState() : exclusive(NULL) {}
+  };
+
+  class Worker : public Thread {
+    ReplayPool *pool;
+  public:
+    Worker(ReplayPool *p) : pool(p) {}
+    void *entry() {
+      pool->worker();
+      return 0;
+    }
+  };
+
+  JournalingObjectStore *store;
+  Mutex lock;
+  Cond cond;
+  map<string, KeyState> keys;
+  list<ReplayEntry*> ready;
+  unsigned in_flight, max_in_flight;
+  bool stopping;
+  vector<Worker*> workers;
+
+  void worker() {
+    lock.Lock();
+    while (true) {
+      if (ready.empty()) {
+	if (stopping)
+	  break;
+	cond.Wait(lock);
+	continue;
+      }
+      ReplayEntry *e = ready.front();
+      ready.pop_front();
+      lock.Unlock();
+
+      dout(3) << "journal_replay: applying op seq " << e->seq << dendl;
+      int r = store->do_transactions(e->tls, e->seq);
+      store->apply_manager.op_apply_finish(e->seq);
+      dout(3) << "journal_replay: r = " << r << ", op seq " << e->seq
+	      << " applied" << dendl;
+      store->replay_applied(e->seq, e->bytes);
+
+      lock.Lock();
+      finish(e);
+    }
+    lock.Unlock();
+  }
+
+  void finish(ReplayEntry *e) {
+    assert(lock.is_locked());
+    for (vector<string>::iterator k = e->keys.begin(); k != e->keys.end(); ++k) {
+      map<string, KeyState>::iterator p = keys.find(*k);
+      if (p == keys.end())
+	continue;
+      if (p->second.exclusive == e)
+	p->second.exclusive = NULL;
+      p->second.shared.erase(e);
+      if (!p->second.exclusive && p->second.shared.empty())
+	keys.erase(p);
+    }
+    for (vector<ReplayEntry*>::iterator d = e->dependents.begin();
+	 d != e->dependents.end(); ++d) {
+      if (--(*d)->deps == 0)
+	ready.push_back(*d);
+    }
+    delete e;
+    in_flight--;
+    cond.SignalAll();
+  }
+
+public:
+  ReplayPool(JournalingObjectStore *s, unsigned max)
+    : store(s), lock("JOS::ReplayPool::lock"),
+      in_flight(0), max_in_flight(max), stopping(false) {}
+
+  void start(unsigned n) {
+    for (unsigned i = 0; i < n; ++i) {
+      workers.push_back(new Worker(this));
+      workers.back()->create();
+    }
+  }
+
+  void stop() {
+    drain();
+    lock.Lock();
+    stopping = true;
+    cond.SignalAll();
+    lock.Unlock();
+    for (vector<Worker*>::iterator p = workers.begin(); p != workers.end(); ++p) {
+      (*p)->join();
+      delete *p;
+    }
+    workers.clear();
+  }
+
+  /// wait until every queued entry has been applied
+  void drain() {
+    Mutex::Locker l(lock);
+    while (in_flight)
+      cond.Wait(lock);
+  }
+
+  unsigned get_in_flight() {
+    Mutex::Locker l(lock);
+    return in_flight;
+  }
+
+  /// queue e, waiting for room first; e must already be op_apply_start()ed
+  void queue(ReplayEntry *e, const map<string, bool>& ekeys) {
+    Mutex::Locker l(lock);
+    while (in_flight >= max_in_flight)
+      cond.Wait(lock);
+    set<ReplayEntry*> after;
+    for (map<string, bool>::const_iterator k = ekeys.begin(); k != ekeys.end(); ++k) {
+      KeyState &ks = keys[k->first];
+      if (ks.exclusive)
+	after.insert(ks.exclusive);
+      if (k->second) {
+	// everything that came before waits on (or is) the exclusive holder
+	after.insert(ks.shared.begin(), ks.shared.end());
+	ks.shared.clear();
+	ks.exclusive = e;
+      } else {
+	ks.shared.insert(e);
+      }
+      e->keys.push_back(k->first);
+    }
+    for (set<ReplayEntry*>::iterator p = after.begin(); p != after.end(); ++p) {
+      (*p)->dependents.push_back(e);
+      e->deps++;
+    }
+    in_flight++;
+    if (!e->deps) {
+      ready.push_back(e);
+      cond.SignalAll();
+    }
+  }
+};
+
+void JournalingObjectStore::replay_applied(uint64_t seq, uint64_t bytes)
+{
+  Mutex::Locker l(replay_stats_lock);
+  if (seq > replay_stats.applied_seq)
+    replay_stats.applied_seq = seq;
+  replay_stats.applied_ops++;
+  replay_stats.applied_bytes += bytes;
+  replay_stats.in_flight--;
+}
+
+void JournalingObjectStore::dump_replay_status(Formatter *f)
+{
+  Mutex::Locker l(replay_stats_lock);
+  utime_t now = replay_stats.active ? ceph_clock_now(g_ceph_context) :
+    replay_stats.finish;
+  utime_t elapsed = now - replay_stats.start;
+  f->open_object_section("journal_replay");
+  f->dump_string("state", replay_stats.active ? "replaying" :
+		 (replay_stats.start == utime_t() ? "not started" : "done"));
+  f->dump_unsigned("threads", replay_stats.threads);
+  f->dump_unsigned("first_seq", replay_stats.first_seq);
+  f->dump_unsigned("read_seq", replay_stats.read_seq);
+  f->dump_unsigned("applied_seq", replay_stats.applied_seq);
+  f->dump_unsigned("applied_ops", replay_stats.applied_ops);
+  f->dump_unsigned("applied_bytes", replay_stats.applied_bytes);
+  f->dump_unsigned("in_flight", replay_stats.in_flight);
+  f->dump_stream("elapsed") << elapsed;
+  if ((double)elapsed > 0) {
+    f->dump_float("ops_per_sec", (double)replay_stats.applied_ops / (double)elapsed);
+    f->dump_float("bytes_per_sec", (double)replay_stats.applied_bytes / (double)elapsed);
+  }
+  f->close_section();
+}
+
 int JournalingObjectStore::journal_replay(uint64_t fs_op_seq)
 {
   dout(10) << "journal_replay fs op_seq " << fs_op_seq << dendl;
@@ -56,6 +456,23 @@ int JournalingObjectStore::journal_replay(uint64_t fs_op_seq)
 
   replaying = true;
 
+  unsigned threads = g_conf->journal_replay_threads > 1 ?
+    g_conf->journal_replay_threads : 0;
+  {
+    Mutex::Locker l(replay_stats_lock);
+    replay_stats = ReplayStats();
+    replay_stats.active = true;
+    replay_stats.start = ceph_clock_now(g_ceph_context);
+    replay_stats.first_seq = replay_stats.read_seq =
+      replay_stats.applied_seq = op_seq;
+    replay_stats.threads = threads;
+  }
+
+  // decode here while the pool applies; with no pool every entry is
+  // applied inline, in order, as it always was
+  ReplayPool pool(this, MAX(1, g_conf->journal_replay_max_in_flight));
+  pool.start(threads);
+
   int count = 0;
   while (1) {
     bufferlist bl;
@@ -71,26 +488,49 @@ int JournalingObjectStore::journal_replay(uint64_t fs_op_seq)
     }
     assert(op_seq == seq-1);
     
-    dout(3) << "journal_replay: applying op seq " << seq << dendl;
+    ReplayEntry *e = new ReplayEntry(seq, bl.length());
     bufferlist::iterator p = bl.begin();
-    list<Transaction*> tls;
     while (!p.end()) {
       Transaction *t = new Transaction(p);
-      tls.push_back(t);
+      e->tls.push_back(t);
+    }
+    {
+      Mutex::Locker l(replay_stats_lock);
+      replay_stats.read_seq = seq;
+      replay_stats.in_flight++;
     }
 
-    apply_manager.op_apply_start(seq);
-    int r = do_transactions(tls, seq);
-    apply_manager.op_apply_finish(seq);
+    map<string, bool> keys;
+    if (!threads || !get_replay_keys(e->tls, &keys)) {
+      if (threads)
+	pool.drain();
+      dout(3) << "journal_replay: applying op seq " << seq << dendl;
+      apply_manager.op_apply_start(seq);
+      int r = do_transactions(e->tls, seq);
+      apply_manager.op_apply_finish(seq);
+      replay_applied(seq, e->bytes);
+      delete e;
+      dout(3) << "journal_replay: r = " << r << ", op_seq now " << seq << dendl;
+    } else {
+      // start the apply here, in journal order: a commit waits for every
+      // queued entry, so whatever it declares applied really is
+      apply_manager.op_apply_start(seq);
+      pool.queue(e, keys);
+    }
 
     op_seq = seq;
+  }
 
-    while (!tls.empty()) {
-      delete tls.front(); 
-      tls.pop_front();
-    }
+  pool.stop();
 
-    dout(3) << "journal_replay: r = " << r << ", op_seq now " << op_seq << dendl;
+  {
+    Mutex::Locker l(replay_stats_lock);
+    replay_stats.active = false;
+    replay_stats.finish = ceph_clock_now(g_ceph_context);
+    dout(1) << "journal_replay: applied " << replay_stats.applied_ops << " ops ("
+	    << replay_stats.applied_bytes << " bytes) in "
+	    << (replay_stats.finish - replay_stats.start)
+	    << " with " << threads << " threads" << dendl;
   }
 
   replaying = false;
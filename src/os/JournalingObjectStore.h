@@ -18,6 +18,7 @@
 #include "ObjectStore.h"
 #include "Journal.h"
 #include "common/RWLock.h"
+#include "common/Formatter.h"
 
 class JournalingObjectStore : public ObjectStore {
 protected:
@@ -101,10 +102,34 @@ protected:
 
   bool replaying;
 
+  /// journal replay progress, for the admin socket
+  struct ReplayStats {
+    bool active;
+    utime_t start, finish;
+    uint64_t first_seq;      ///< op_seq replay started after
+    uint64_t read_seq;       ///< last entry read and decoded
+    uint64_t applied_seq;    ///< highest entry applied
+    uint64_t applied_ops;    ///< entries applied
+    uint64_t applied_bytes;  ///< encoded size of the entries applied
+    unsigned in_flight;      ///< decoded, not yet applied
+    unsigned threads;
+    ReplayStats()
+      : active(false), first_seq(0), read_seq(0), applied_seq(0),
+	applied_ops(0), applied_bytes(0), in_flight(0), threads(0) {}
+  };
+  Mutex replay_stats_lock;
+  ReplayStats replay_stats;
+
+  class ReplayPool;
+  friend class ReplayPool;
+
+  void replay_applied(uint64_t seq, uint64_t bytes);
+
 protected:
   void journal_start();
   void journal_stop();
   int journal_replay(uint64_t fs_op_seq);
+  void dump_replay_status(Formatter *f);
 
   void _op_journal_transactions(list<ObjectStore::Transaction*>& tls, uint64_t op,
 				Context *onjournal, TrackedOpRef osd_op);
@@ -122,7 +147,8 @@ public:
 public:
   JournalingObjectStore() : journal(NULL), finisher(g_ceph_context),
 			    apply_manager(journal, finisher),
-			    replaying(false) {}
+			    replaying(false),
+			    replay_stats_lock("JOS::replay_stats_lock") {}
   
 };
 
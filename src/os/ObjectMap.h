@@ -129,6 +129,19 @@ public:
     const SequencerPosition *spos=0   ///< [in] Sequencer
     ) { return 0; }
 
+  /**
+   * Start batching the calling thread's mutations
+   *
+   * Until end_batch(), an implementation may hold back mutations made
+   * by this thread and apply them together.  Operations from this
+   * thread which must read the store first apply whatever has been held
+   * back, so the thread always sees its own writes.
+   */
+  virtual void start_batch() {}
+
+  /// Apply anything held back since start_batch() @see start_batch
+  virtual int end_batch() { return 0; }
+
   virtual bool check(std::ostream &out) { return true; }
 
   class ObjectMapIteratorImpl {
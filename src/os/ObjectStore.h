@@ -67,6 +67,18 @@ enum {
   l_os_commit_len,
   l_os_commit_lat,
   l_os_j_full,
+  l_os_fd_cache_hit,
+  l_os_fd_cache_miss,
+  l_os_split_queue,
+  l_os_splits,
+  l_os_split_lat,
+  l_os_read_zc_bytes,
+  l_os_wb_dirty,
+  l_os_wb_limit,
+  l_os_wb_bw,
+  l_os_wb_early_flush,
+  l_os_wb_forced_sync,
+  l_os_wb_delay,
   l_os_last,
 };
 
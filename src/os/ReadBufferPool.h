@@ -0,0 +1,116 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_READBUFFERPOOL_H
+#define CEPH_READBUFFERPOOL_H
+
+#include <map>
+#include <vector>
+
+#include "common/Mutex.h"
+#include "include/buffer.h"
+
+/**
+ * Pool of page-aligned buffers for large object reads.
+ *
+ * The pool keeps a reference to every buffer it hands out.  Once the
+ * caller (usually an op reply, after the messenger has sent it) drops
+ * every other reference, the buffer is free to be handed out again.
+ * Buffers are grouped in power-of-two page size classes so that a
+ * reused buffer is never more than twice the size of the read.
+ */
+class ReadBufferPool {
+  Mutex lock;
+  uint64_t max_bytes;   ///< cap on memory held by the pool
+  uint64_t bytes;       ///< memory currently held by the pool
+  unsigned max_len;     ///< largest buffer we pool
+  std::map<unsigned, std::vector<bufferptr> > pools; ///< size class -> bufs
+
+  static unsigned size_class(unsigned len) {
+    unsigned s = CEPH_PAGE_SIZE;
+    while (s < len)
+      s <<= 1;
+    return s;
+  }
+
+  void trim() {
+    for (std::map<unsigned, std::vector<bufferptr> >::iterator p =
+	   pools.begin();
+	 p != pools.end() && bytes > max_bytes;
+	 ++p) {
+      std::vector<bufferptr> &v = p->second;
+      while (!v.empty() && bytes > max_bytes) {
+	// buffers still in use just leave the pool; they are freed
+	// whenever their last user drops them
+	bytes -= p->first;
+	v.pop_back();
+      }
+    }
+  }
+
+public:
+  ReadBufferPool(uint64_t max_bytes, unsigned max_len)
+    : lock("ReadBufferPool::lock"),
+      max_bytes(max_bytes), bytes(0), max_len(max_len) {}
+
+  void set_max_bytes(uint64_t m) {
+    Mutex::Locker l(lock);
+    max_bytes = m;
+    trim();
+  }
+
+  bool enabled() const {
+    return max_bytes > 0;
+  }
+
+  /**
+   * Get a page-aligned buffer of at least len bytes
+   *
+   * @param [in] len bytes needed
+   * @param [out] pooled true if the buffer came from (or now belongs to)
+   *              the pool, false if it is a one-off allocation
+   * @return ptr of length len
+   */
+  bufferptr get(unsigned len, bool *pooled) {
+    *pooled = false;
+    if (len > max_len)
+      return bufferptr(buffer::create_page_aligned(len));
+    unsigned s = size_class(len);
+    Mutex::Locker l(lock);
+    std::vector<bufferptr> &v = pools[s];
+    for (std::vector<bufferptr>::iterator i = v.begin(); i != v.end(); ++i) {
+      // only our reference left: nobody else can get at it
+      if (i->raw_nref() == 1) {
+	*pooled = true;
+	return bufferptr(*i, 0, len);
+      }
+    }
+    bufferptr bp(buffer::create_page_aligned(s));
+    if (bytes + s <= max_bytes) {
+      v.push_back(bp);
+      bytes += s;
+      *pooled = true;
+    }
+    return bufferptr(bp, 0, len);
+  }
+
+  /// drop the pool's references to all buffers
+  void clear() {
+    Mutex::Locker l(lock);
+    pools.clear();
+    bytes = 0;
+  }
+};
+
+#endif
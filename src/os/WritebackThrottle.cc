@@ -0,0 +1,163 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "common/config.h"
+#include "common/debug.h"
+#include "os/ObjectStore.h"
+
+#include "WritebackThrottle.h"
+
+#define dout_subsys ceph_subsys_filestore
+#undef dout_prefix
+#define dout_prefix *_dout << "wbthrottle "
+
+// weight of the newest commit in the bandwidth estimate
+static const double BANDWIDTH_ALPHA = 0.3;
+
+// commits smaller than this say little about the device
+static const uint64_t MIN_SAMPLE_BYTES = 1 << 20;
+
+WritebackThrottle::WritebackThrottle(CephContext *cct)
+  : cct(cct), logger(NULL), lock("WritebackThrottle::lock"),
+    dirty(0), committing(0), bandwidth(0), sync_requested(false),
+    early_flushes(0), forced_syncs(0), delayed_ops(0)
+{
+}
+
+uint64_t WritebackThrottle::_get_limit() const
+{
+  uint64_t min = cct->_conf->filestore_wbthrottle_min_bytes;
+  uint64_t max = cct->_conf->filestore_wbthrottle_max_bytes;
+  if (bandwidth == 0)
+    return max;
+  uint64_t limit = bandwidth * cct->_conf->filestore_wbthrottle_target_latency;
+  if (limit < min)
+    limit = min;
+  if (limit > max)
+    limit = max;
+  return limit;
+}
+
+uint64_t WritebackThrottle::get_limit()
+{
+  Mutex::Locker l(lock);
+  return _get_limit();
+}
+
+void WritebackThrottle::_update_logger()
+{
+  if (!logger)
+    return;
+  logger->set(l_os_wb_dirty, dirty);
+  logger->set(l_os_wb_limit, _get_limit());
+  logger->set(l_os_wb_bw, (uint64_t)bandwidth);
+}
+
+bool WritebackThrottle::wrote(uint64_t len, bool *force_sync)
+{
+  *force_sync = false;
+  if (!cct->_conf->filestore_wbthrottle_enable)
+    return false;
+
+  Mutex::Locker l(lock);
+  dirty += len;
+  uint64_t limit = _get_limit();
+  bool flush = dirty >= limit * cct->_conf->filestore_wbthrottle_flush_ratio;
+  if (flush) {
+    early_flushes++;
+    if (logger)
+      logger->inc(l_os_wb_early_flush);
+  }
+  if (dirty >= limit && !sync_requested) {
+    ldout(cct, 10) << "dirty " << dirty << " >= limit " << limit
+		   << ", requesting early commit" << dendl;
+    sync_requested = true;
+    *force_sync = true;
+    forced_syncs++;
+    if (logger)
+      logger->inc(l_os_wb_forced_sync);
+  }
+  _update_logger();
+  return flush;
+}
+
+void WritebackThrottle::throttle()
+{
+  if (!cct->_conf->filestore_wbthrottle_enable)
+    return;
+
+  utime_t delay;
+  {
+    Mutex::Locker l(lock);
+    uint64_t limit = _get_limit();
+    if (dirty <= limit)
+      return;
+    double over = (double)(dirty - limit) / (double)limit;
+    if (over > 1.0)
+      over = 1.0;
+    delay.set_from_double(over * cct->_conf->filestore_wbthrottle_max_delay);
+    delayed_ops++;
+    total_delay += delay;
+    ldout(cct, 15) << "throttle dirty " << dirty << " limit " << limit
+		   << ", delaying " << delay << dendl;
+  }
+  if (logger)
+    logger->tinc(l_os_wb_delay, delay);
+  delay.sleep();
+}
+
+void WritebackThrottle::commit_start()
+{
+  Mutex::Locker l(lock);
+  committing = dirty;
+  dirty = 0;
+  sync_requested = false;
+  _update_logger();
+}
+
+void WritebackThrottle::commit_finish(utime_t lat)
+{
+  Mutex::Locker l(lock);
+  last_commit_lat = lat;
+  if (committing >= MIN_SAMPLE_BYTES && lat > utime_t()) {
+    double sample = (double)committing / (double)lat;
+    if (bandwidth == 0)
+      bandwidth = sample;
+    else
+      bandwidth = (1.0 - BANDWIDTH_ALPHA) * bandwidth + BANDWIDTH_ALPHA * sample;
+    ldout(cct, 10) << "commit synced " << committing << " bytes in " << lat
+		   << ", bandwidth now " << (uint64_t)bandwidth
+		   << ", limit " << _get_limit() << dendl;
+  }
+  committing = 0;
+  _update_logger();
+}
+
+void WritebackThrottle::dump(Formatter *f)
+{
+  Mutex::Locker l(lock);
+  f->open_object_section("writeback_throttle");
+  f->dump_int("enabled", cct->_conf->filestore_wbthrottle_enable);
+  f->dump_unsigned("dirty_bytes", dirty);
+  f->dump_unsigned("committing_bytes", committing);
+  f->dump_unsigned("dirty_limit", _get_limit());
+  f->dump_unsigned("bandwidth", (uint64_t)bandwidth);
+  f->dump_float("target_latency", cct->_conf->filestore_wbthrottle_target_latency);
+  f->dump_stream("last_commit_latency") << last_commit_lat;
+  f->dump_unsigned("early_flushes", early_flushes);
+  f->dump_unsigned("forced_syncs", forced_syncs);
+  f->dump_unsigned("delayed_ops", delayed_ops);
+  f->dump_stream("total_delay") << total_delay;
+  f->close_section();
+}
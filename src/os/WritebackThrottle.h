@@ -0,0 +1,86 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_WRITEBACKTHROTTLE_H
+#define CEPH_WRITEBACKTHROTTLE_H
+
+#include "common/Mutex.h"
+#include "common/Formatter.h"
+#include "common/perf_counters.h"
+#include "include/utime.h"
+
+/**
+ * Keeps the amount of dirty data in the backing fs in line with how
+ * fast the device actually syncs it.
+ *
+ * Every commit measures how many bytes were synced and how long the
+ * sync took.  That gives a bandwidth estimate, and the dirty limit is
+ * the number of bytes the device can sync within the target commit
+ * latency.  Against that limit:
+ *
+ *  - past flush_ratio * limit, writes start their own writeback
+ *    (sync_file_range) right away instead of waiting for flush_min;
+ *  - past the limit, the sync thread is kicked to commit early;
+ *  - between the limit and twice the limit, new ops are delayed by a
+ *    proportional amount up to max_delay, so the queue slows down
+ *    smoothly instead of stalling behind a huge syncfs.
+ *
+ * Until the first commit has been measured the limit is max_bytes.
+ */
+class WritebackThrottle {
+  CephContext *cct;
+  PerfCounters *logger;
+  Mutex lock;
+
+  uint64_t dirty;         ///< bytes written since the last commit started
+  uint64_t committing;    ///< bytes the current commit is syncing
+  double bandwidth;       ///< estimated sync bandwidth, bytes/sec; 0 if unknown
+  bool sync_requested;    ///< asked for an early commit this cycle
+  utime_t last_commit_lat;
+  uint64_t early_flushes, forced_syncs, delayed_ops;
+  utime_t total_delay;
+
+  uint64_t _get_limit() const;
+  void _update_logger();
+
+public:
+  WritebackThrottle(CephContext *cct);
+
+  void set_logger(PerfCounters *l) {
+    logger = l;
+  }
+
+  /**
+   * Account for len bytes just written
+   *
+   * @param [out] force_sync set if the dirty limit has been reached and
+   *              a commit should start now
+   * @return true if the caller should start writeback on this write
+   */
+  bool wrote(uint64_t len, bool *force_sync);
+
+  /// delay the caller in proportion to the dirty data over the limit
+  void throttle();
+
+  /// a commit is about to sync everything dirtied so far
+  void commit_start();
+
+  /// that commit completed after lat
+  void commit_finish(utime_t lat);
+
+  uint64_t get_limit();
+  void dump(Formatter *f);
+};
+
+#endif
@@ -182,6 +182,8 @@ OSDService::OSDService(OSD *osd) :
   map_cache(g_conf->osd_map_cache_size),
   map_bl_cache(g_conf->osd_map_cache_size),
   map_bl_inc_cache(g_conf->osd_map_cache_size),
+  map_msg_cache(osd->client_messenger->cct, "osd",
+		g_conf->osd_map_message_cache_size),
   in_progress_split_lock("OSDService::in_progress_split_lock"),
   full_status_lock("OSDService::full_status_lock"),
   cur_state(NONE),
@@ -4745,7 +4747,14 @@ void OSD::send_incremental_map(epoch_t since, Connection *con)
     epoch_t to = osdmap->get_epoch();
     if (to - since > (epoch_t)g_conf->osd_map_message_max)
       to = since + g_conf->osd_map_message_max;
-    MOSDMap *m = build_incremental_map_msg(since, to);
+    MOSDMap *m = service.map_msg_cache.get(monc->get_fsid(), since + 1, to,
+					   superblock.oldest_map,
+					   superblock.newest_map,
+					   con->get_features());
+    if (!m) {
+      m = build_incremental_map_msg(since, to);
+      service.map_msg_cache.add(m, since + 1, to, con->get_features());
+    }
     send_map(m, con);
     since = to;
   }
@@ -32,6 +32,7 @@
 #include "OSDCap.h"
 
 #include "osd/ClassHandler.h"
+#include "osd/OSDMapMessageCache.h"
 
 #include "include/CompatSet.h"
 
@@ -346,6 +347,7 @@ public:
   SharedLRU<epoch_t, const OSDMap> map_cache;
   SimpleLRU<epoch_t, bufferlist> map_bl_cache;
   SimpleLRU<epoch_t, bufferlist> map_bl_inc_cache;
+  OSDMapMessageCache map_msg_cache;  // encoded MOSDMaps we send to peers
 
   OSDMapRef get_map(epoch_t e);
   OSDMapRef add_map(OSDMap *o) {
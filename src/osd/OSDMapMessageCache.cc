@@ -0,0 +1,96 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "osd/OSDMapMessageCache.h"
+#include "messages/MOSDMap.h"
+#include "common/ceph_context.h"
+#include "common/perf_counters.h"
+#include "include/ceph_features.h"
+
+enum {
+  l_osdmap_msg_cache_first = 533600,
+  l_osdmap_msg_cache_hit,
+  l_osdmap_msg_cache_miss,
+  l_osdmap_msg_cache_hit_bytes,
+  l_osdmap_msg_cache_last,
+};
+
+OSDMapMessageCache::OSDMapMessageCache(CephContext *cct, std::string name,
+				       size_t size)
+  : cct(cct), logger(NULL), cache(size)
+{
+  PerfCountersBuilder b(cct, string("osdmap_msg_cache-") + name,
+			l_osdmap_msg_cache_first, l_osdmap_msg_cache_last);
+  b.add_u64_counter(l_osdmap_msg_cache_hit, "hit");
+  b.add_u64_counter(l_osdmap_msg_cache_miss, "miss");
+  b.add_u64_counter(l_osdmap_msg_cache_hit_bytes, "hit_bytes");
+  logger = b.create_perf_counters();
+  cct->get_perfcounters_collection()->add(logger);
+}
+
+OSDMapMessageCache::~OSDMapMessageCache()
+{
+  cct->get_perfcounters_collection()->remove(logger);
+  delete logger;
+}
+
+uint64_t OSDMapMessageCache::mask_features(uint64_t features)
+{
+  // see MOSDMap::encode_payload()
+  return features & (CEPH_FEATURE_PGID64 |
+		     CEPH_FEATURE_PGPOOL3 |
+		     CEPH_FEATURE_OSDENC);
+}
+
+MOSDMap *OSDMapMessageCache::get(const uuid_d& fsid,
+				 epoch_t first, epoch_t last,
+				 epoch_t oldest, epoch_t newest,
+				 uint64_t features)
+{
+  entry_t e;
+  if (!cache.lookup(key_t(first, last, oldest, newest,
+			  mask_features(features)), &e)) {
+    logger->inc(l_osdmap_msg_cache_miss);
+    return NULL;
+  }
+  logger->inc(l_osdmap_msg_cache_hit);
+  logger->inc(l_osdmap_msg_cache_hit_bytes, e.payload.length());
+
+  MOSDMap *m = new MOSDMap(fsid);
+  m->get_header().version = e.version;
+  m->get_header().compat_version = e.compat_version;
+  m->set_payload(e.payload);
+  // fill in the decoded fields too, so that the message prints and
+  // behaves like a freshly built one; this only references the
+  // payload buffers.
+  m->decode_payload();
+  return m;
+}
+
+void OSDMapMessageCache::add(MOSDMap *m, epoch_t first, epoch_t last,
+			     uint64_t features)
+{
+  features = mask_features(features);
+  if (m->empty_payload()) {
+    m->encode_payload(features);
+    if (m->get_header().compat_version == 0)
+      m->get_header().compat_version = m->get_header().version;
+  }
+
+  entry_t e;
+  e.payload = m->get_payload();
+  e.version = m->get_header().version;
+  e.compat_version = m->get_header().compat_version;
+  cache.add(key_t(first, last, m->oldest_map, m->newest_map, features), e);
+}
@@ -0,0 +1,103 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OSDMAPMESSAGECACHE_H
+#define CEPH_OSDMAPMESSAGECACHE_H
+
+#include <string>
+
+#include "include/types.h"
+#include "include/buffer.h"
+#include "common/simple_cache.hpp"
+
+class CephContext;
+class PerfCounters;
+class MOSDMap;
+
+/**
+ * Cache of encoded MOSDMap payloads.
+ *
+ * When a new osdmap epoch is published the same incremental (or the
+ * same range of incrementals) is sent to every subscriber, and
+ * MOSDMap::encode_payload may have to re-encode every map in the old
+ * format for peers lacking the newer features.  We keep the encoded
+ * payload around, keyed by the map range, the oldest/newest bounds
+ * advertised and the feature bits that affect the encoding, so that
+ * each distinct message is only encoded once.  Payloads are shared
+ * between messages by reference; no map data is copied on a hit.
+ */
+class OSDMapMessageCache {
+public:
+  struct key_t {
+    epoch_t first, last;
+    epoch_t oldest, newest;
+    uint64_t features;
+
+    key_t(epoch_t f, epoch_t l, epoch_t o, epoch_t n, uint64_t feat)
+      : first(f), last(l), oldest(o), newest(n), features(feat) {}
+
+    bool operator<(const key_t& r) const {
+      if (first != r.first)
+	return first < r.first;
+      if (last != r.last)
+	return last < r.last;
+      if (oldest != r.oldest)
+	return oldest < r.oldest;
+      if (newest != r.newest)
+	return newest < r.newest;
+      return features < r.features;
+    }
+  };
+
+private:
+  struct entry_t {
+    bufferlist payload;
+    __u16 version, compat_version;
+    entry_t() : version(0), compat_version(0) {}
+  };
+
+  CephContext *cct;
+  PerfCounters *logger;
+  SimpleLRU<key_t, entry_t> cache;
+
+public:
+  OSDMapMessageCache(CephContext *cct, std::string name, size_t size);
+  ~OSDMapMessageCache();
+
+  /// only these feature bits change how an MOSDMap is encoded
+  static uint64_t mask_features(uint64_t features);
+
+  /**
+   * Look up a cached message.
+   *
+   * @return a new MOSDMap carrying the cached payload, or NULL on a miss
+   */
+  MOSDMap *get(const uuid_d& fsid, epoch_t first, epoch_t last,
+	       epoch_t oldest, epoch_t newest, uint64_t features);
+
+  /**
+   * Encode m for the given features and remember its payload under
+   * the requested [first, last] range.
+   *
+   * The message keeps its encoded payload, so sending it afterwards
+   * does not encode it a second time.
+   */
+  void add(MOSDMap *m, epoch_t first, epoch_t last, uint64_t features);
+
+  void set_size(size_t size) {
+    cache.set_size(size);
+  }
+};
+
+#endif
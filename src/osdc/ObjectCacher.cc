@@ -13,6 +13,7 @@
 
 /*** ObjectCacher::BufferHead ***/
 
+ObjectPool ObjectCacher::BufferHead::pool(sizeof(ObjectCacher::BufferHead));
 
 /*** ObjectCacher::Object ***/
 
@@ -45,13 +46,11 @@ ObjectCacher::BufferHead *ObjectCacher::Object::split(BufferHead *left, loff_t o
   // add right
   oc->bh_add(this, right);
   
-  // split buffers too
-  bufferlist bl;
-  bl.claim(left->bl);
-  if (bl.length()) {
-    assert(bl.length() == (left->length() + right->length()));
-    right->bl.substr_of(bl, left->length(), right->length());
-    left->bl.substr_of(bl, 0, left->length());
+  // split buffers too; move the tail over rather than copying the
+  // whole list into both halves
+  if (left->bl.length()) {
+    assert(left->bl.length() == (left->length() + right->length()));
+    left->bl.splice(left->length(), right->length(), &right->bl);
   }
 
   // move read waiters
@@ -89,6 +88,12 @@ void ObjectCacher::Object::merge_left(BufferHead *left, BufferHead *right)
 
   // data
   left->bl.claim_append(right->bl);
+  // every small write that merges into a dirty bh adds its own
+  // bufferptrs, and split() and readx() walk all of them, so copy them
+  // into one buffer before a hot object's bh holds thousands.  the list
+  // stays short, so counting it here is cheap.
+  if (left->bl.length() && left->bl.buffers().size() > 64)
+    left->bl.rebuild();
   
   // version 
   // note: this is sorta busted, but should only be used for dirty buffers
@@ -481,6 +486,28 @@ void ObjectCacher::Object::discard(loff_t off, loff_t len)
 }
 
 
+/*
+ * A write can skip the cache if nothing it overlaps is dirty or being
+ * written (it would reorder with those), and no read is in flight on
+ * the object (its -ENOENT could mark the object nonexistent after our
+ * write has created it).  Reads sent while it is in flight don't trust
+ * -ENOENT either; see bh_read_finish().
+ */
+bool ObjectCacher::Object::can_write_around(loff_t off, loff_t len)
+{
+  assert(oc->lock.is_locked());
+  if (!reads.empty())
+    return false;
+  for (map<loff_t, BufferHead*>::iterator p = data_lower_bound(off);
+       p != data.end() && p->first < off + len;
+       ++p) {
+    BufferHead *bh = p->second;
+    if (bh->is_dirty() || bh->is_tx())
+      return false;
+  }
+  return true;
+}
+
 
 /*** ObjectCacher ***/
 
@@ -499,10 +526,12 @@ ObjectCacher::ObjectCacher(CephContext *cct_, string name, WritebackHandler& wb,
     max_dirty(max_dirty), target_dirty(target_dirty),
     max_size(max_bytes), max_objects(max_objects),
     block_writes_upfront(block_writes_upfront),
+    write_around_bytes(0), write_around_seq_writes(0),
     flush_set_callback(flush_callback), flush_set_callback_arg(flush_callback_arg),
     flusher_stop(false), flusher_thread(this), finisher(cct),
     stat_clean(0), stat_zero(0), stat_dirty(0), stat_rx(0), stat_tx(0), stat_missing(0),
-    stat_error(0), stat_dirty_waiting(0), reads_outstanding(0)
+    stat_error(0), stat_dirty_waiting(0), dirty_budget(NULL),
+    reads_outstanding(0)
 {
   this->max_dirty_age.set_from_double(max_dirty_age);
   perf_start();
@@ -511,6 +540,10 @@ ObjectCacher::ObjectCacher(CephContext *cct_, string name, WritebackHandler& wb,
 
 ObjectCacher::~ObjectCacher()
 {
+  if (dirty_budget) {
+    Mutex::Locker l(dirty_budget->lock);
+    dirty_budget->members.remove(this);
+  }
   finisher.stop();
   perf_stop();
   // we should be empty.
@@ -538,6 +571,8 @@ void ObjectCacher::perf_start()
   plb.add_u64_counter(l_objectcacher_data_flushed, "data_flushed");
   plb.add_u64_counter(l_objectcacher_overwritten_in_flush,
                       "data_overwritten_while_flushing");
+  plb.add_u64_counter(l_objectcacher_data_written_around,
+                      "data_written_around");
   plb.add_u64_counter(l_objectcacher_write_ops_blocked, "write_ops_blocked");
   plb.add_u64_counter(l_objectcacher_write_bytes_blocked, "write_bytes_blocked");
   plb.add_time(l_objectcacher_write_time_blocked, "write_time_blocked");
@@ -634,12 +669,23 @@ void ObjectCacher::bh_read_finish(int64_t poolid, sobject_t oid, loff_t start,
 
   list<Context*> ls;
   int err = 0;
+  Object *retry_ob = NULL;
 
   if (objects[poolid].count(oid) == 0) {
     ldout(cct, 7) << "bh_read_finish no object cache" << dendl;
   } else {
     Object *ob = objects[poolid][oid];
-    
+
+    if (r == -ENOENT && ob->writes_around) {
+      // a write around the cache may be creating the object (a clone's
+      // goes guard, parent read, copyup), and this read overtook it.
+      // drop what we read and try again once that write commits.
+      ldout(cct, 7) << "bh_read_finish ENOENT with writes around, retrying after tid "
+		    << ob->last_write_tid << " on " << *ob << dendl;
+      trust_enoent = false;
+      retry_ob = ob;
+    }
+
     if (r == -ENOENT && !ob->complete) {
       // wake up *all* rx waiters, or else we risk reordering identical reads. e.g.
       //   read 1~1
@@ -740,7 +786,7 @@ void ObjectCacher::bh_read_finish(int64_t poolid, sobject_t oid, loff_t start,
       opos = bh->end();
 
       if (r == -ENOENT) {
-	if (trust_enoent) {
+	if (trust_enoent || retry_ob) {
 	  ldout(cct, 10) << "bh_read_finish removing " << *bh << dendl;
 	  bh_remove(ob, bh);
 	  delete bh;
@@ -767,6 +813,13 @@ void ObjectCacher::bh_read_finish(int64_t poolid, sobject_t oid, loff_t start,
     }
   }
 
+  if (retry_ob) {
+    // the write around pins the object until it commits
+    ldout(cct, 20) << "deferring waiters " << ls << dendl;
+    list<Context*>& waiters = retry_ob->waitfor_commit[retry_ob->last_write_tid];
+    waiters.splice(waiters.end(), ls);
+  }
+
   // called with lock held.
   ldout(cct, 20) << "finishing waiters " << ls << dendl;
 
@@ -1247,6 +1300,9 @@ int ObjectCacher::writex(OSDWrite *wr, ObjectSet *oset, Mutex& wait_on_lock,
 			 Context *onfreespace)
 {
   assert(lock.is_locked());
+  if (should_write_around(wr, oset))
+    return write_around(wr, oset, wait_on_lock, onfreespace);
+
   utime_t now = ceph_clock_now(cct);
   uint64_t bytes_written = 0;
   uint64_t bytes_written_in_flush = 0;
@@ -1277,7 +1333,7 @@ int ObjectCacher::writex(OSDWrite *wr, ObjectSet *oset, Mutex& wait_on_lock,
          f_it != ex_it->buffer_extents.end();
          ++f_it) {
       ldout(cct, 10) << "writex writing " << f_it->first << "~" << f_it->second << " into " << *bh << " at " << opos << dendl;
-      uint64_t bhoff = bh->start() - opos;
+      uint64_t bhoff = opos - bh->start();
       assert(f_it->second <= bh->length() - bhoff);
 
       // get the frag we're mapping in
@@ -1319,6 +1375,137 @@ int ObjectCacher::writex(OSDWrite *wr, ObjectSet *oset, Mutex& wait_on_lock,
   return r;
 }
 
+bool ObjectCacher::should_write_around(OSDWrite *wr, ObjectSet *oset)
+{
+  assert(lock.is_locked());
+  if (wr->extents.empty())
+    return false;
+
+  // a write continues a stream if it starts where the last one ended,
+  // or at the start of another object right after a run of them
+  const ObjectExtent &first = wr->extents.front();
+  if ((first.oid == oset->last_write_oid &&
+       (loff_t)first.offset == oset->last_write_end) ||
+      (first.offset == 0 && first.oid != oset->last_write_oid &&
+       oset->seq_writes > 0))
+    oset->seq_writes++;
+  else
+    oset->seq_writes = 0;
+  const ObjectExtent &last = wr->extents.back();
+  oset->last_write_oid = last.oid;
+  oset->last_write_end = last.offset + last.length;
+
+  if (!(write_around_bytes && wr->bl.length() >= write_around_bytes) &&
+      !(write_around_seq_writes && oset->seq_writes >= write_around_seq_writes))
+    return false;
+
+  for (vector<ObjectExtent>::iterator ex_it = wr->extents.begin();
+       ex_it != wr->extents.end();
+       ++ex_it) {
+    sobject_t soid(ex_it->oid, CEPH_NOSNAP);
+    Object *o = get_object_maybe(soid, ex_it->oloc);
+    if (o && !o->can_write_around(ex_it->offset, ex_it->length)) {
+      ldout(cct, 10) << "writex can't write around " << *o << dendl;
+      return false;
+    }
+  }
+  return true;
+}
+
+int ObjectCacher::write_around(OSDWrite *wr, ObjectSet *oset,
+			       Mutex& wait_on_lock, Context *onfreespace)
+{
+  assert(lock.is_locked());
+  C_GatherBuilder gather(cct);
+
+  for (vector<ObjectExtent>::iterator ex_it = wr->extents.begin();
+       ex_it != wr->extents.end();
+       ++ex_it) {
+    sobject_t soid(ex_it->oid, CEPH_NOSNAP);
+    Object *o = get_object(soid, oset, ex_it->oloc);
+    ldout(cct, 10) << "writex writing around " << *o << " "
+		   << ex_it->offset << "~" << ex_it->length << dendl;
+
+    // drop the clean data we are about to overwrite
+    o->discard(ex_it->offset, ex_it->length);
+
+    bufferlist bl;
+    for (vector<pair<uint64_t, uint64_t> >::iterator f_it = ex_it->buffer_extents.begin();
+         f_it != ex_it->buffer_extents.end();
+         ++f_it) {
+      bufferlist frag;
+      frag.substr_of(wr->bl, f_it->first, f_it->second);
+      bl.claim_append(frag);
+    }
+
+    o->get();
+    o->writes_around++;
+    C_WriteAroundCommit *oncommit =
+      new C_WriteAroundCommit(this, oset->poolid, soid, gather.new_sub());
+    tid_t tid = writeback_handler.write(o->get_oid(), o->get_oloc(),
+					ex_it->offset, ex_it->length,
+					wr->snapc, bl, wr->mtime,
+					oset->truncate_size,
+					oset->truncate_seq, oncommit);
+    ldout(cct, 20) << " tid " << tid << " on " << o->get_oid() << dendl;
+    // flushes of this object now wait for it too
+    oncommit->tid = tid;
+    o->last_write_tid = tid;
+  }
+
+  if (perfcounter)
+    perfcounter->inc(l_objectcacher_data_written_around, wr->bl.length());
+  delete wr;
+
+  int ret = 0;
+  if (!gather.has_subs()) {
+    if (onfreespace)
+      onfreespace->complete(0);
+  } else if (block_writes_upfront) {
+    Cond cond;
+    bool done;
+    gather.set_finisher(new C_Cond(&cond, &done, &ret));
+    gather.activate();
+    while (!done)
+      cond.Wait(wait_on_lock);
+    if (onfreespace)
+      onfreespace->complete(ret);
+  } else {
+    assert(onfreespace);
+    gather.set_finisher(onfreespace);
+    gather.activate();
+  }
+
+  trim();
+  return ret;
+}
+
+void ObjectCacher::write_around_commit(int64_t poolid, sobject_t oid,
+				       tid_t tid, int r, Context *onfinish)
+{
+  assert(lock.is_locked());
+  ldout(cct, 7) << "write_around_commit " << oid << " tid " << tid
+		<< " returned " << r << dendl;
+
+  // the object was pinned when the write was sent
+  assert(objects[poolid].count(oid));
+  Object *ob = objects[poolid][oid];
+  assert(ob->writes_around > 0);
+  ob->writes_around--;
+  assert(ob->last_commit_tid < tid);
+  ob->last_commit_tid = tid;
+
+  if (ob->waitfor_commit.count(tid)) {
+    list<Context*> ls;
+    ls.splice(ls.begin(), ob->waitfor_commit[tid]);
+    ob->waitfor_commit.erase(tid);
+    finish_contexts(cct, ls, r);
+  }
+  ob->put();
+
+  onfinish->complete(r);
+}
+
 void ObjectCacher::C_WaitForWrite::finish(int r)
 {
   Mutex::Locker l(m_oc->lock);
@@ -1336,14 +1523,24 @@ void ObjectCacher::maybe_wait_for_writeback(uint64_t len)
   //  - do not wait for bytes other waiters are waiting on.  this means that
   //    threads do not wait for each other.  this effectively allows the cache
   //    size to balloon proportional to the data that is in flight.
-  while (get_stat_dirty() + get_stat_tx() >= max_dirty + get_stat_dirty_waiting()) {
+  while (get_limit_dirty() + get_limit_tx() >=
+	 max_dirty + get_limit_dirty_waiting()) {
     ldout(cct, 10) << __func__ << " waiting for dirty|tx "
-		   << (get_stat_dirty() + get_stat_tx()) << " >= max "
+		   << (get_limit_dirty() + get_limit_tx()) << " >= max "
 		   << max_dirty << " + dirty_waiting "
-		   << get_stat_dirty_waiting() << dendl;
-    flusher_cond.Signal();
+		   << get_limit_dirty_waiting() << dendl;
     stat_dirty_waiting += len;
-    stat_cond.Wait(lock);
+    if (dirty_budget) {
+      // what is to be written back may be in another cache, whose
+      // wakeups come without our lock and so can be missed
+      dirty_budget->waiting.add(len);
+      kick_flushers();
+      stat_cond.WaitInterval(cct, lock, utime_t(1, 0));
+      dirty_budget->waiting.sub(len);
+    } else {
+      flusher_cond.Signal();
+      stat_cond.Wait(lock);
+    }
     stat_dirty_waiting -= len;
     ++blocked;
     ldout(cct, 10) << __func__ << " woke up" << dendl;
@@ -1391,14 +1588,50 @@ int ObjectCacher::_wait_for_write(OSDWrite *wr, uint64_t len, ObjectSet *oset, M
   }
 
   // start writeback anyway?
-  if (get_stat_dirty() > target_dirty) {
-    ldout(cct, 10) << "wait_for_write " << get_stat_dirty() << " > target "
+  if (get_limit_dirty() > target_dirty) {
+    ldout(cct, 10) << "wait_for_write " << get_limit_dirty() << " > target "
 		   << target_dirty << ", nudging flusher" << dendl;
-    flusher_cond.Signal();
+    if (dirty_budget)
+      kick_flushers();
+    else
+      flusher_cond.Signal();
   }
   return ret;
 }
 
+void ObjectCacher::set_dirty_budget(DirtyBudget *budget)
+{
+  assert(!flusher_thread.is_started());
+  assert(!dirty_budget);
+  dirty_budget = budget;
+  Mutex::Locker l(budget->lock);
+  budget->members.push_back(this);
+}
+
+void ObjectCacher::kick_flushers()
+{
+  Mutex::Locker l(dirty_budget->lock);
+  for (list<ObjectCacher*>::iterator p = dirty_budget->members.begin();
+       p != dirty_budget->members.end(); ++p) {
+    if (*p == this)
+      flusher_cond.Signal();
+    else
+      (*p)->flusher_cond.SloppySignal();
+  }
+}
+
+void ObjectCacher::wake_writers()
+{
+  Mutex::Locker l(dirty_budget->lock);
+  for (list<ObjectCacher*>::iterator p = dirty_budget->members.begin();
+       p != dirty_budget->members.end(); ++p) {
+    if (*p == this)
+      stat_cond.Signal();
+    else
+      (*p)->stat_cond.SloppySignal();
+  }
+}
+
 void ObjectCacher::flusher_entry()
 {
   ldout(cct, 10) << "flusher start" << dendl;
@@ -1414,15 +1647,20 @@ void ObjectCacher::flusher_entry()
 		   << target_dirty << " target, "
 		   << max_dirty << " max)"
 		   << dendl;
-    loff_t actual = get_stat_dirty() + get_stat_dirty_waiting();
+    loff_t actual = get_limit_dirty() + get_limit_dirty_waiting();
     if (actual > target_dirty) {
       // flush some dirty pages
       ldout(cct, 10) << "flusher " 
-		     << get_stat_dirty() << " dirty + " << get_stat_dirty_waiting()
+		     << get_limit_dirty() << " dirty + " << get_limit_dirty_waiting()
 		     << " dirty_waiting > target "
 		     << target_dirty
 		     << ", flushing some dirty bhs" << dendl;
-      flush(actual - target_dirty);
+      loff_t amount = actual - target_dirty;
+      // the other caches sharing the budget flush their part of it
+      if (dirty_budget && get_limit_dirty() > 0)
+	amount = MAX(1, (loff_t)((double)amount * stat_dirty /
+				 get_limit_dirty()));
+      flush(amount);
     } else {
       // check tail of lru for old dirty items
       utime_t cutoff = ceph_clock_now(cct);
@@ -1538,6 +1776,8 @@ bool ObjectCacher::flush(Object *ob, loff_t offset, loff_t length)
     bh_write(bh);
     clean = false;
   }
+  if (ob->writes_around)
+    clean = false;
   return clean;
 }
 
@@ -1894,11 +2134,15 @@ void ObjectCacher::bh_stat_add(BufferHead *bh)
     break;
   case BufferHead::STATE_DIRTY:
     stat_dirty += bh->length();
+    if (dirty_budget)
+      dirty_budget->dirty.add(bh->length());
     bh->ob->dirty_or_tx += bh->length();
     bh->ob->oset->dirty_or_tx += bh->length();
     break;
   case BufferHead::STATE_TX:
     stat_tx += bh->length();
+    if (dirty_budget)
+      dirty_budget->tx.add(bh->length());
     bh->ob->dirty_or_tx += bh->length();
     bh->ob->oset->dirty_or_tx += bh->length();
     break;
@@ -1911,8 +2155,12 @@ void ObjectCacher::bh_stat_add(BufferHead *bh)
   default:
     assert(0 == "bh_stat_add: invalid bufferhead state");
   }
-  if (get_stat_dirty_waiting() > 0)
-    stat_cond.Signal();
+  if (get_limit_dirty_waiting() > 0) {
+    if (dirty_budget)
+      wake_writers();
+    else
+      stat_cond.Signal();
+  }
 }
 
 void ObjectCacher::bh_stat_sub(BufferHead *bh)
@@ -1930,11 +2178,15 @@ void ObjectCacher::bh_stat_sub(BufferHead *bh)
     break;
   case BufferHead::STATE_DIRTY:
     stat_dirty -= bh->length();
+    if (dirty_budget)
+      dirty_budget->dirty.sub(bh->length());
     bh->ob->dirty_or_tx -= bh->length();
     bh->ob->oset->dirty_or_tx -= bh->length();
     break;
   case BufferHead::STATE_TX:
     stat_tx -= bh->length();
+    if (dirty_budget)
+      dirty_budget->tx.sub(bh->length());
     bh->ob->dirty_or_tx -= bh->length();
     bh->ob->oset->dirty_or_tx -= bh->length();
     break;
@@ -7,9 +7,11 @@
 #include "include/lru.h"
 #include "include/Context.h"
 #include "include/xlist.h"
+#include "include/atomic.h"
 
 #include "common/Cond.h"
 #include "common/Finisher.h"
+#include "common/ObjectPool.h"
 #include "common/Thread.h"
 
 #include "Objecter.h"
@@ -32,6 +34,7 @@ enum {
   l_objectcacher_data_written, // bytes written to cache
   l_objectcacher_data_flushed, // bytes flushed to WritebackHandler
   l_objectcacher_overwritten_in_flush, // bytes overwritten while flushing is in progress
+  l_objectcacher_data_written_around, // bytes written straight to WritebackHandler
 
   l_objectcacher_write_ops_blocked, // total write ops we delayed due to dirty limits
   l_objectcacher_write_bytes_blocked, // total number of write bytes we delayed due to dirty limits
@@ -50,6 +53,20 @@ class ObjectCacher {
 
   typedef void (*flush_set_callback_t) (void *p, ObjectSet *oset);
 
+  /**
+   * One max_dirty/target_dirty shared by several ObjectCachers, e.g.
+   * librbd's cache shards: each checks the limits against the dirty and
+   * in-flight bytes of all of them.  Must outlive its members.
+   */
+  class DirtyBudget {
+    friend class ObjectCacher;
+    Mutex lock; // protects members
+    std::list<ObjectCacher*> members;
+    atomic_t dirty, tx, waiting;
+  public:
+    DirtyBudget() : lock("ObjectCacher::DirtyBudget::lock") {}
+  };
+
   // read scatter/gather  
   struct OSDRead {
     vector<ObjectExtent> extents;
@@ -119,6 +136,16 @@ class ObjectCacher {
       error(0) {
       ex.start = ex.length = 0;
     }
+
+    // small random writes create and merge away one of these each, so
+    // keep them off the heap; see ObjectPool
+    static ObjectPool pool;
+    static void *operator new(size_t num_bytes) {
+      return pool.alloc(num_bytes);
+    }
+    void operator delete(void *p, size_t num_bytes) {
+      pool.free(p, num_bytes);
+    }
   
     // extent
     loff_t start() const { return ex.start; }
@@ -182,6 +209,7 @@ class ObjectCacher {
     tid_t last_commit_tid; // last update commited.
 
     int dirty_or_tx;
+    int writes_around;  // uncached writes in flight
 
     map< tid_t, list<Context*> > waitfor_commit;
     xlist<C_ReadFinish*> reads;
@@ -196,7 +224,7 @@ class ObjectCacher {
       oid(o), oset(os), set_item(this), oloc(l),
       complete(false), exists(true),
       last_write_tid(0), last_commit_tid(0),
-      dirty_or_tx(0) {
+      dirty_or_tx(0), writes_around(0) {
       // add to set
       os->objects.push_back(&set_item);
     }
@@ -282,6 +310,7 @@ class ObjectCacher {
     
     void truncate(loff_t s);
     void discard(loff_t off, loff_t len);
+    bool can_write_around(loff_t off, loff_t len);
 
     // reference counting
     int get() {
@@ -310,10 +339,15 @@ class ObjectCacher {
     int dirty_or_tx;
     bool return_enoent;
 
+    // end of the last write, to spot sequential writers
+    object_t last_write_oid;
+    loff_t last_write_end;
+    unsigned seq_writes;
+
     ObjectSet(void *p, int64_t _poolid, inodeno_t i)
       : parent(p), ino(i), truncate_seq(0),
 	truncate_size(0), poolid(_poolid), dirty_or_tx(0),
-	return_enoent(false) {}
+	return_enoent(false), last_write_end(0), seq_writes(0) {}
 
   };
 
@@ -329,6 +363,8 @@ class ObjectCacher {
   int64_t max_dirty, target_dirty, max_size, max_objects;
   utime_t max_dirty_age;
   bool block_writes_upfront;
+  uint64_t write_around_bytes;
+  unsigned write_around_seq_writes;
 
   flush_set_callback_t flush_set_callback;
   void *flush_set_callback_arg;
@@ -379,6 +415,7 @@ class ObjectCacher {
   loff_t stat_error;
   loff_t stat_dirty_waiting;   // bytes that writers are waiting on to write
 
+  DirtyBudget *dirty_budget;   // NULL when the limits are ours alone
   void verify_stats() const;
 
   void bh_stat_add(BufferHead *bh);
@@ -390,6 +427,20 @@ class ObjectCacher {
   loff_t get_stat_clean() { return stat_clean; }
   loff_t get_stat_zero() { return stat_zero; }
 
+  // what max_dirty and target_dirty are checked against
+  loff_t get_limit_dirty() {
+    return dirty_budget ? (loff_t)dirty_budget->dirty.read() : stat_dirty;
+  }
+  loff_t get_limit_tx() {
+    return dirty_budget ? (loff_t)dirty_budget->tx.read() : stat_tx;
+  }
+  loff_t get_limit_dirty_waiting() {
+    return dirty_budget ? (loff_t)dirty_budget->waiting.read() :
+      stat_dirty_waiting;
+  }
+  void kick_flushers();
+  void wake_writers();
+
   void touch_bh(BufferHead *bh) {
     if (bh->is_dirty())
       bh_lru_dirty.lru_touch(bh);
@@ -501,6 +552,21 @@ class ObjectCacher {
     }
   };
 
+  class C_WriteAroundCommit : public Context {
+    ObjectCacher *oc;
+    int64_t poolid;
+    sobject_t oid;
+    Context *onfinish;
+  public:
+    tid_t tid;
+    C_WriteAroundCommit(ObjectCacher *c, int64_t _poolid, sobject_t o,
+			Context *fin) :
+      oc(c), poolid(_poolid), oid(o), onfinish(fin), tid(0) {}
+    void finish(int r) {
+      oc->write_around_commit(poolid, oid, tid, r, onfinish);
+    }
+  };
+
   class C_WaitForWrite : public Context {
   public:
     C_WaitForWrite(ObjectCacher *oc, uint64_t len, Context *onfinish) :
@@ -572,6 +638,13 @@ class ObjectCacher {
   bool is_cached(ObjectSet *oset, vector<ObjectExtent>& extents, snapid_t snapid);
 
 private:
+  // write-around
+  bool should_write_around(OSDWrite *wr, ObjectSet *oset);
+  int write_around(OSDWrite *wr, ObjectSet *oset, Mutex& wait_on_lock,
+		   Context *onfreespace);
+  void write_around_commit(int64_t poolid, sobject_t oid, tid_t tid, int r,
+			   Context *onfinish);
+
   // write blocking
   int _wait_for_write(OSDWrite *wr, uint64_t len, ObjectSet *oset, Mutex& lock,
 		      Context *onfreespace);
@@ -618,6 +691,22 @@ public:
   void set_max_objects(int64_t v) {
     max_objects = v;
   }
+  /**
+   * Check max_dirty and target_dirty against the bytes of every cache
+   * sharing budget instead of our own.  Call before start().
+   */
+  void set_dirty_budget(DirtyBudget *budget);
+  /**
+   * Send writes straight to the WritebackHandler, bypassing the cache,
+   * if they are at least bytes long (0 for never) or part of a run of
+   * at least seq_writes sequential writes (0 for never).  Writes that
+   * overlap dirty or in-flight buffers are still cached, so ordering
+   * is kept; overlapping clean buffers are dropped.
+   */
+  void set_write_around(uint64_t bytes, unsigned seq_writes) {
+    write_around_bytes = bytes;
+    write_around_seq_writes = seq_writes;
+  }
 
 
   // file functions
@@ -46,6 +46,7 @@
 #undef dout_prefix
 #define dout_prefix *_dout << messenger->get_myname() << ".objecter "
 
+ObjectPool Objecter::Op::pool(sizeof(Objecter::Op));
 
 enum {
   l_osdc_first = 123200,
@@ -225,6 +226,8 @@ void Objecter::shutdown_locked()
 {
   assert(client_lock.is_locked());
   assert(initialized);
+
+  rwlock.get_write();
   initialized = false;
 
   map<int,OSDSession*>::iterator p;
@@ -232,6 +235,7 @@ void Objecter::shutdown_locked()
     p = osd_sessions.begin();
     close_session(p->second);
   }
+  rwlock.unlock();
 
   if (tick_event) {
     timer.cancel_event(tick_event);
@@ -280,17 +284,20 @@ void Objecter::send_linger(LingerOp *info)
 
   if (info->register_tid) {
     // repeat send.  cancel old registeration op, if any.
-    if (ops.count(info->register_tid)) {
-      Op *o = ops[info->register_tid];
-      cancel_op(o);
-    }
+    Op *old = _lookup_op(info->register_tid);
+    if (old)
+      cancel_op(old);
     info->register_tid = _op_submit(o);
   } else {
     // first send
     // populate info->pgid and info->acting so we
     // don't resend the linger op on the next osdmap update
     recalc_linger_op_target(info);
-    info->register_tid = op_submit(o);
+    // we hold rwlock, so don't block on the budget
+    op_throttle_bytes.take(calc_op_budget(o));
+    op_throttle_ops.take(1);
+    o->budgeted = true;
+    info->register_tid = _op_submit(o);
   }
 
   OSDSession *s = o->session;
@@ -307,16 +314,25 @@ void Objecter::send_linger(LingerOp *info)
 void Objecter::_linger_ack(LingerOp *info, int r) 
 {
   ldout(cct, 10) << "_linger_ack " << info->linger_id << dendl;
+  // op replies may be handled without client_lock
+  bool locked = client_lock.is_locked_by_me();
+  if (!locked)
+    client_lock.Lock();
   if (info->on_reg_ack) {
     info->on_reg_ack->finish(r);
     delete info->on_reg_ack;
     info->on_reg_ack = NULL;
   }
+  if (!locked)
+    client_lock.Unlock();
 }
 
 void Objecter::_linger_commit(LingerOp *info, int r) 
 {
   ldout(cct, 10) << "_linger_commit " << info->linger_id << dendl;
+  bool locked = client_lock.is_locked_by_me();
+  if (!locked)
+    client_lock.Lock();
   if (info->on_reg_commit) {
     info->on_reg_commit->finish(r);
     delete info->on_reg_commit;
@@ -326,6 +342,8 @@ void Objecter::_linger_commit(LingerOp *info, int r)
   // only tell the user the first time we do this
   info->registered = true;
   info->pobjver = NULL;
+  if (!locked)
+    client_lock.Unlock();
 }
 
 void Objecter::unregister_linger(uint64_t linger_id)
@@ -367,7 +385,9 @@ tid_t Objecter::linger_mutate(const object_t& oid, const object_locator_t& oloc,
 
   logger->set(l_osdc_linger_active, linger_ops.size());
 
+  rwlock.get_write();
   send_linger(info);
+  rwlock.unlock();
 
   return info->linger_id;
 }
@@ -396,7 +416,9 @@ tid_t Objecter::linger_read(const object_t& oid, const object_locator_t& oloc,
 
   logger->set(l_osdc_linger_active, linger_ops.size());
 
+  rwlock.get_write();
   send_linger(info);
+  rwlock.unlock();
 
   return info->linger_id;
 }
@@ -458,12 +480,17 @@ void Objecter::scan_requests(bool skipped_map,
   }
 
   // check for changed request mappings
-  map<tid_t,Op*>::iterator p = ops.begin();
-  while (p != ops.end()) {
+  map<tid_t,Op*> all;
+  _get_ops(all);
+  for (map<tid_t,Op*>::iterator p = all.begin(); p != all.end(); ++p) {
     Op *op = p->second;
-    ++p;   // check_op_pool_dne() may touch ops; prevent iterator invalidation
     ldout(cct, 10) << " checking op " << op->tid << dendl;
+    OSDSession *from = op->session;
     int r = recalc_op_target(op);
+    if (op->session != from) {
+      (from ? from : &homeless_session)->ops.erase(op->tid);
+      _session_op_add(op);
+    }
     switch (r) {
     case RECALC_OP_TARGET_NO_ACTION:
       // resend if skipped map; otherwise do nothing.
@@ -493,6 +520,8 @@ void Objecter::handle_osd_map(MOSDMap *m)
     return;
   }
 
+  rwlock.get_write();
+
   bool was_pauserd = osdmap->test_flag(CEPH_OSDMAP_PAUSERD);
   bool was_pausewr = osdmap->test_flag(CEPH_OSDMAP_PAUSEWR) || osdmap->test_flag(CEPH_OSDMAP_FULL);
   
@@ -543,10 +572,9 @@ void Objecter::handle_osd_map(MOSDMap *m)
 	  continue;
 	}
 	logger->set(l_osdc_map_epoch, osdmap->get_epoch());
-	
-	scan_requests(skipped_map, need_resend, need_resend_linger);
 
-	// osd addr changes?
+	// osd addr changes?  anything left on a closed session is
+	// retargeted by scan_requests() below.
 	for (map<int,OSDSession*>::iterator p = osd_sessions.begin();
 	     p != osd_sessions.end(); ) {
 	  OSDSession *s = p->second;
@@ -559,6 +587,8 @@ void Objecter::handle_osd_map(MOSDMap *m)
 	  }
 	}
 
+	scan_requests(skipped_map, need_resend, need_resend_linger);
+
 	assert(e == osdmap->get_epoch());
       }
       
@@ -586,9 +616,11 @@ void Objecter::handle_osd_map(MOSDMap *m)
   
   // unpause requests?
   if ((was_pauserd && !pauserd) ||
-      (was_pausewr && !pausewr))
-    for (map<tid_t,Op*>::iterator p = ops.begin();
-	 p != ops.end();
+      (was_pausewr && !pausewr)) {
+    map<tid_t,Op*> all;
+    _get_ops(all);
+    for (map<tid_t,Op*>::iterator p = all.begin();
+	 p != all.end();
 	 ++p) {
       Op *op = p->second;
       if (op->paused &&
@@ -596,6 +628,7 @@ void Objecter::handle_osd_map(MOSDMap *m)
 	  !((op->flags & CEPH_OSD_FLAG_WRITE) && pausewr))    // not still paused as a write
 	need_resend[op->tid] = op;
     }
+  }
 
   // resend requests
   for (map<tid_t, Op*>::iterator p = need_resend.begin(); p != need_resend.end(); ++p) {
@@ -618,6 +651,9 @@ void Objecter::handle_osd_map(MOSDMap *m)
   }
 
   dump_active();
+
+  rwlock.unlock();
+  finish_pool_dne_contexts();
   
   // finish any Contexts that were waiting on a map update
   map<epoch_t,list< pair< Context*, int > > >::iterator p =
@@ -667,7 +703,10 @@ void Objecter::C_Op_Map_Latest::finish(int r)
   if (op->map_dne_bound == 0)
     op->map_dne_bound = latest;
 
+  objecter->rwlock.get_write();
   objecter->check_op_pool_dne(op);
+  objecter->rwlock.unlock();
+  objecter->finish_pool_dne_contexts();
 }
 
 void Objecter::check_op_pool_dne(Op *op)
@@ -683,20 +722,32 @@ void Objecter::check_op_pool_dne(Op *op)
 		     << " concluding pool " << op->pgid.pool() << " dne"
 		     << dendl;
       if (op->onack) {
-	op->onack->complete(-ENOENT);
+	pool_dne_contexts.push_back(op->onack);
+	op->onack = NULL;
+	num_unacked.dec();
       }
       if (op->oncommit) {
-	op->oncommit->complete(-ENOENT);
+	pool_dne_contexts.push_back(op->oncommit);
+	op->oncommit = NULL;
+	num_uncommitted.dec();
       }
-      op->session_item.remove_myself();
-      ops.erase(op->tid);
-      delete op;
+      finish_op(op);
     }
   } else {
     _send_op_map_check(op);
   }
 }
 
+void Objecter::finish_pool_dne_contexts()
+{
+  assert(client_lock.is_locked());
+  while (!pool_dne_contexts.empty()) {
+    Context *c = pool_dne_contexts.front();
+    pool_dne_contexts.pop_front();
+    c->complete(-ENOENT);
+  }
+}
+
 void Objecter::_send_op_map_check(Op *op)
 {
   // ask the monitor
@@ -730,6 +781,7 @@ void Objecter::C_Linger_Map_Latest::finish(int r)
     op->map_dne_bound = latest;
 
   objecter->check_linger_pool_dne(op);
+  objecter->finish_pool_dne_contexts();
 }
 
 void Objecter::check_linger_pool_dne(LingerOp *op)
@@ -741,10 +793,12 @@ void Objecter::check_linger_pool_dne(LingerOp *op)
   if (op->map_dne_bound > 0) {
     if (osdmap->get_epoch() >= op->map_dne_bound) {
       if (op->on_reg_ack) {
-	op->on_reg_ack->complete(-ENOENT);
+	pool_dne_contexts.push_back(op->on_reg_ack);
+	op->on_reg_ack = NULL;
       }
       if (op->on_reg_commit) {
-	op->on_reg_commit->complete(-ENOENT);
+	pool_dne_contexts.push_back(op->on_reg_commit);
+	op->on_reg_commit = NULL;
       }
       unregister_linger(op->linger_id);
     }
@@ -784,12 +838,16 @@ void Objecter::linger_cancel_map_check(LingerOp *op)
   }
 }
 
+/*
+ * opens the session if need be, so the caller must hold rwlock for
+ * write.  lookup_session() only needs it for read.
+ */
 Objecter::OSDSession *Objecter::get_session(int osd)
 {
-  map<int,OSDSession*>::iterator p = osd_sessions.find(osd);
-  if (p != osd_sessions.end())
-    return p->second;
-  OSDSession *s = new OSDSession(osd);
+  OSDSession *s = lookup_session(osd);
+  if (s)
+    return s;
+  s = new OSDSession(osd);
   osd_sessions[osd] = s;
   s->con = messenger->get_connection(osdmap->get_inst(osd));
   logger->inc(l_osdc_osd_session_open);
@@ -797,6 +855,14 @@ Objecter::OSDSession *Objecter::get_session(int osd)
   return s;
 }
 
+Objecter::OSDSession *Objecter::lookup_session(int osd)
+{
+  map<int,OSDSession*>::iterator p = osd_sessions.find(osd);
+  if (p == osd_sessions.end())
+    return NULL;
+  return p->second;
+}
+
 void Objecter::reopen_session(OSDSession *s)
 {
   entity_inst_t inst = osdmap->get_inst(s->osd);
@@ -819,14 +885,69 @@ void Objecter::close_session(OSDSession *s)
     s->con->put();
     logger->inc(l_osdc_osd_session_close);
   }
-  s->ops.clear();
-  s->linger_ops.clear();
+  // whatever is still here goes homeless until it is retargeted
+  while (!s->ops.empty()) {
+    Op *op = s->ops.begin()->second;
+    s->ops.erase(s->ops.begin());
+    op->session = NULL;
+    op->acting.clear();
+    homeless_session.ops[op->tid] = op;
+  }
+  while (!s->linger_ops.empty()) {
+    LingerOp *info = s->linger_ops.front();
+    info->session_item.remove_myself();
+    info->session = NULL;
+    info->acting.clear();
+  }
   osd_sessions.erase(s->osd);
   delete s;
 
   logger->set(l_osdc_osd_sessions, osd_sessions.size());
 }
 
+/*
+ * track op in its session (or as homeless).  the caller holds rwlock;
+ * a read lock is enough as long as nobody else can see op yet.
+ */
+void Objecter::_session_op_add(Op *op)
+{
+  OSDSession *s = op->session ? op->session : &homeless_session;
+  Mutex::Locker l(s->lock);
+  s->ops[op->tid] = op;
+}
+
+/* the caller holds rwlock for write */
+void Objecter::_session_op_remove(Op *op)
+{
+  OSDSession *s = op->session ? op->session : &homeless_session;
+  s->ops.erase(op->tid);
+}
+
+Objecter::Op *Objecter::_lookup_op(tid_t tid)
+{
+  map<tid_t,Op*>::iterator p = homeless_session.ops.find(tid);
+  if (p != homeless_session.ops.end())
+    return p->second;
+  for (map<int,OSDSession*>::iterator s = osd_sessions.begin();
+       s != osd_sessions.end();
+       ++s) {
+    p = s->second->ops.find(tid);
+    if (p != s->second->ops.end())
+      return p->second;
+  }
+  return NULL;
+}
+
+/* every op in flight, by tid.  the caller holds rwlock for write. */
+void Objecter::_get_ops(map<tid_t,Op*>& all) const
+{
+  all.insert(homeless_session.ops.begin(), homeless_session.ops.end());
+  for (map<int,OSDSession*>::const_iterator s = osd_sessions.begin();
+       s != osd_sessions.end();
+       ++s)
+    all.insert(s->second->ops.begin(), s->second->ops.end());
+}
+
 void Objecter::wait_for_osd_map()
 {
   if (osdmap->get_epoch()) return;
@@ -868,8 +989,8 @@ void Objecter::kick_requests(OSDSession *session)
 
   // resend ops
   map<tid_t,Op*> resend;  // resend in tid order
-  for (xlist<Op*>::iterator p = session->ops.begin(); !p.end();) {
-    Op *op = *p;
+  for (map<tid_t,Op*>::iterator p = session->ops.begin(); p != session->ops.end();) {
+    Op *op = p->second;
     ++p;
     logger->inc(l_osdc_op_resend);
     if (op->should_resend) {
@@ -919,16 +1040,27 @@ void Objecter::tick()
   cutoff -= cct->_conf->objecter_timeout;  // timeout
 
   unsigned laggy_ops = 0;
-  for (map<tid_t,Op*>::iterator p = ops.begin();
-       p != ops.end();
-       ++p) {
-    Op *op = p->second;
-    if (op->session && op->stamp < cutoff) {
-      ldout(cct, 2) << " tid " << p->first << " on osd." << op->session->osd << " is laggy" << dendl;
-      toping.insert(op->session);
-      ++laggy_ops;
+  bool have_homeless;
+  rwlock.get_read();
+  for (map<int,OSDSession*>::iterator s = osd_sessions.begin();
+       s != osd_sessions.end();
+       ++s) {
+    Mutex::Locker l(s->second->lock);
+    for (map<tid_t,Op*>::iterator p = s->second->ops.begin();
+	 p != s->second->ops.end();
+	 ++p) {
+      Op *op = p->second;
+      if (op->stamp < cutoff) {
+	ldout(cct, 2) << " tid " << p->first << " on osd." << op->session->osd << " is laggy" << dendl;
+	toping.insert(op->session);
+	++laggy_ops;
+      }
     }
   }
+  homeless_session.lock.Lock();
+  have_homeless = !homeless_session.ops.empty();
+  homeless_session.lock.Unlock();
+  rwlock.unlock();
   for (map<uint64_t,LingerOp*>::iterator p = linger_ops.begin();
        p != linger_ops.end();
        ++p) {
@@ -943,7 +1075,7 @@ void Objecter::tick()
   logger->set(l_osdc_op_laggy, laggy_ops);
   logger->set(l_osdc_osd_laggy, toping.size());
 
-  if (num_homeless_ops || !toping.empty())
+  if (have_homeless || !toping.empty())
     maybe_request_map();
 
   if (!toping.empty()) {
@@ -1000,7 +1132,7 @@ void Objecter::resend_mon_ops()
 
 tid_t Objecter::op_submit(Op *op)
 {
-  assert(client_lock.is_locked());
+  assert(unlocked_ops || client_lock.is_locked());
   assert(initialized);
 
   assert(op->ops.size() == op->out_bl.size());
@@ -1011,35 +1143,131 @@ tid_t Objecter::op_submit(Op *op)
   // take_op_budget() may drop our lock while it blocks.
   take_op_budget(op);
 
-  return _op_submit(op);
+  return _op_submit_budgeted(op);
 }
 
-tid_t Objecter::_op_submit(Op *op)
+tid_t Objecter::_op_submit_budgeted(Op *op)
+{
+  // usually the read lock and the session lock are all we need
+  rwlock.get_read();
+  tid_t tid = _op_submit(op, false);
+  rwlock.unlock();
+  if (tid)
+    return tid;
+
+  // we need a new session, or the pool looks gone and we have to ask
+  // the monitor; both need client_lock and the write lock.
+  bool locked = client_lock.is_locked_by_me();
+  if (!locked)
+    client_lock.Lock();
+  rwlock.get_write();
+  tid = _op_submit(op, true);
+  rwlock.unlock();
+  if (!locked)
+    client_lock.Unlock();
+  return tid;
+}
+
+void Objecter::op_submit_batch(vector<Op*>& ops)
+{
+  assert(unlocked_ops || client_lock.is_locked());
+  assert(initialized);
+
+  // budget as much as we can without waiting, and send that before we
+  // wait for the rest: it's what would free the budget up, for us or
+  // for another batch.  take_op_budget() may drop our lock.
+  vector<Op*>::iterator start = ops.begin();
+  for (vector<Op*>::iterator p = ops.begin(); p != ops.end(); ++p) {
+    if (try_take_op_budget(*p))
+      continue;
+    _op_submit_batch_budgeted(start, p);
+    start = p;
+    take_op_budget(*p);
+  }
+  _op_submit_batch_budgeted(start, ops.end());
+}
+
+void Objecter::_op_submit_batch_budgeted(vector<Op*>::iterator begin,
+					 vector<Op*>::iterator end)
+{
+  if (begin == end)
+    return;
+
+  // target the whole batch under one read lock, then send it grouped
+  // by osd so that each session's messages are queued back to back
+  vector<Op*> slow;
+  map<int, vector<Op*> > by_osd;
+  rwlock.get_read();
+  for (vector<Op*>::iterator p = begin; p != end; ++p) {
+    Op *op = *p;
+    if (!op->tid)
+      op->tid = last_tid.inc();
+    int r = recalc_op_target(op, false);
+    if (r == RECALC_OP_TARGET_NEED_SESSION ||
+	r == RECALC_OP_TARGET_POOL_DNE) {
+      slow.push_back(op);
+      continue;
+    }
+    by_osd[op->session ? op->session->osd : -1].push_back(op);
+  }
+  ldout(cct, 10) << "op_submit_batch " << (end - begin) << " ops to "
+		 << by_osd.size() << " osds, " << slow.size()
+		 << " need the write lock" << dendl;
+  for (map<int, vector<Op*> >::iterator p = by_osd.begin();
+       p != by_osd.end();
+       ++p) {
+    for (vector<Op*>::iterator q = p->second.begin();
+	 q != p->second.end();
+	 ++q)
+      _op_submit_targeted(*q, false);
+  }
+  rwlock.unlock();
+
+  // new sessions, or pools we need a newer map for; already budgeted
+  for (vector<Op*>::iterator p = slow.begin(); p != slow.end(); ++p)
+    _op_submit_budgeted(*p);
+}
+
+/*
+ * The caller holds rwlock.  With only the read lock (!exclusive) we
+ * return 0 without side effects if the op needs the write lock, and
+ * the caller retries with it.
+ */
+tid_t Objecter::_op_submit(Op *op, bool exclusive)
 {
   // pick tid
-  tid_t mytid = ++last_tid;
-  op->tid = mytid;
+  if (!op->tid)
+    op->tid = last_tid.inc();
   assert(client_inc >= 0);
 
   // pick target
-  num_homeless_ops++;  // initially; recalc_op_target() will decrement if it finds a target
-  int r = recalc_op_target(op);
-  bool check_for_latest_map = (r == RECALC_OP_TARGET_POOL_DNE);
+  int r = recalc_op_target(op, exclusive);
+  if (r == RECALC_OP_TARGET_NEED_SESSION ||
+      (r == RECALC_OP_TARGET_POOL_DNE && !exclusive))
+    return 0;
+  return _op_submit_targeted(op, r == RECALC_OP_TARGET_POOL_DNE);
+}
 
+/*
+ * Account for and send an op whose target recalc_op_target() has
+ * just set.  The caller holds rwlock.
+ */
+tid_t Objecter::_op_submit_targeted(Op *op, bool check_for_latest_map)
+{
   // add to gather set(s)
   if (op->onack) {
-    ++num_unacked;
+    num_unacked.inc();
   } else {
     ldout(cct, 20) << " note: not requesting ack" << dendl;
   }
   if (op->oncommit) {
-    ++num_uncommitted;
+    num_uncommitted.inc();
   } else {
     ldout(cct, 20) << " note: not requesting commit" << dendl;
   }
-  ops[op->tid] = op;
+  num_in_flight.inc();
 
-  logger->set(l_osdc_op_active, ops.size());
+  logger->set(l_osdc_op_active, num_in_flight.read());
 
   logger->inc(l_osdc_op);
   if ((op->flags & (CEPH_OSD_FLAG_READ|CEPH_OSD_FLAG_WRITE)) == (CEPH_OSD_FLAG_READ|CEPH_OSD_FLAG_WRITE))
@@ -1093,34 +1321,46 @@ tid_t Objecter::_op_submit(Op *op)
 
   assert(op->flags & (CEPH_OSD_FLAG_READ|CEPH_OSD_FLAG_WRITE));
 
+  // once it is in the session and sent, a reply may finish op as soon
+  // as we drop the session lock
+  tid_t tid = op->tid;
+  OSDSession *s = op->session ? op->session : &homeless_session;
+  bool need_map = false;
+  s->lock.Lock();
+  s->ops[tid] = op;
+
   if ((op->flags & CEPH_OSD_FLAG_WRITE) &&
       osdmap->test_flag(CEPH_OSDMAP_PAUSEWR)) {
-    ldout(cct, 10) << " paused modify " << op << " tid " << last_tid << dendl;
+    ldout(cct, 10) << " paused modify " << op << " tid " << tid << dendl;
     op->paused = true;
-    maybe_request_map();
+    need_map = true;
   } else if ((op->flags & CEPH_OSD_FLAG_READ) &&
 	     osdmap->test_flag(CEPH_OSDMAP_PAUSERD)) {
-    ldout(cct, 10) << " paused read " << op << " tid " << last_tid << dendl;
+    ldout(cct, 10) << " paused read " << op << " tid " << tid << dendl;
     op->paused = true;
-    maybe_request_map();
+    need_map = true;
   } else if ((op->flags & CEPH_OSD_FLAG_WRITE) &&
 	     osdmap->test_flag(CEPH_OSDMAP_FULL)) {
-    ldout(cct, 0) << " FULL, paused modify " << op << " tid " << last_tid << dendl;
+    ldout(cct, 0) << " FULL, paused modify " << op << " tid " << tid << dendl;
     op->paused = true;
-    maybe_request_map();
+    need_map = true;
   } else if (op->session) {
     send_op(op);
   } else {
-    maybe_request_map();
+    need_map = true;
   }
 
   if (check_for_latest_map) {
     _send_op_map_check(op);
   }
+  s->lock.Unlock();
 
-  ldout(cct, 5) << num_unacked << " unacked, " << num_uncommitted << " uncommitted" << dendl;
+  if (need_map)
+    maybe_request_map();
+
+  ldout(cct, 5) << num_unacked.read() << " unacked, " << num_uncommitted.read() << " uncommitted" << dendl;
   
-  return op->tid;
+  return tid;
 }
 
 bool Objecter::is_pg_changed(vector<int>& o, vector<int>& n, bool any_change)
@@ -1136,7 +1376,7 @@ bool Objecter::is_pg_changed(vector<int>& o, vector<int>& n, bool any_change)
   return false;      // same primary (tho replicas may have changed)
 }
 
-int Objecter::recalc_op_target(Op *op)
+int Objecter::recalc_op_target(Op *op, bool exclusive)
 {
   vector<int> acting;
   pg_t pgid = op->pgid;
@@ -1152,20 +1392,15 @@ int Objecter::recalc_op_target(Op *op)
   osdmap->pg_to_acting_osds(pgid, acting);
 
   if (op->pgid != pgid || is_pg_changed(op->acting, acting, op->used_replica)) {
-    op->pgid = pgid;
-    op->acting = acting;
-    ldout(cct, 10) << "recalc_op_target tid " << op->tid
-	     << " pgid " << pgid << " acting " << acting << dendl;
-
     OSDSession *s = NULL;
-    op->used_replica = false;
+    bool used_replica = false;
     if (!acting.empty()) {
       int osd;
       bool read = (op->flags & CEPH_OSD_FLAG_READ) && (op->flags & CEPH_OSD_FLAG_WRITE) == 0;
       if (read && (op->flags & CEPH_OSD_FLAG_BALANCE_READS)) {
 	int p = rand() % acting.size();
 	if (p)
-	  op->used_replica = true;
+	  used_replica = true;
 	osd = acting[p];
 	ldout(cct, 10) << " chose random osd." << osd << " of " << acting << dendl;
       } else if (read && (op->flags & CEPH_OSD_FLAG_LOCALIZE_READS)) {
@@ -1177,7 +1412,7 @@ int Objecter::recalc_op_target(Op *op)
          * order.) */
 	for (i = acting.size()-1; i > 0; --i) {
 	  if (osdmap->get_addr(acting[i]).is_same_host(messenger->get_myaddr())) {
-	    op->used_replica = true;
+	    used_replica = true;
 	    ldout(cct, 10) << " chose local osd." << acting[i] << " of " << acting << dendl;
 	    break;
 	  }
@@ -1185,19 +1420,24 @@ int Objecter::recalc_op_target(Op *op)
 	osd = acting[i];
       } else
 	osd = acting[0];
-      s = get_session(osd);
+      if (exclusive) {
+	s = get_session(osd);
+      } else {
+	// opening a session needs the write lock
+	s = lookup_session(osd);
+	if (!s)
+	  return RECALC_OP_TARGET_NEED_SESSION;
+      }
     }
 
-    if (op->session != s) {
-      if (!op->session)
-	num_homeless_ops--;
-      op->session_item.remove_myself();
-      op->session = s;
-      if (s)
-	s->ops.push_back(&op->session_item);
-      else
-	num_homeless_ops++;
-    }
+    op->pgid = pgid;
+    op->acting = acting;
+    op->used_replica = used_replica;
+    ldout(cct, 10) << "recalc_op_target tid " << op->tid
+	     << " pgid " << pgid << " acting " << acting << dendl;
+
+    // the caller moves op between session op maps
+    op->session = s;
     return RECALC_OP_TARGET_NEED_RESEND;
   }
   return RECALC_OP_TARGET_NO_ACTION;
@@ -1248,14 +1488,20 @@ void Objecter::finish_op(Op *op)
 {
   ldout(cct, 15) << "finish_op " << op->tid << dendl;
 
-  op->session_item.remove_myself();
+  _session_op_remove(op);
+  _finish_op(op);
+}
+
+/* op is no longer in any session */
+void Objecter::_finish_op(Op *op)
+{
   if (op->budgeted)
     put_op_budget(op);
   if (op->con)
     op->con->put();
 
-  ops.erase(op->tid);
-  logger->set(l_osdc_op_active, ops.size());
+  num_in_flight.dec();
+  logger->set(l_osdc_op_active, num_in_flight.read());
 
   delete op;
 }
@@ -1338,32 +1584,56 @@ void Objecter::throttle_op(Op *op, int op_budget)
 {
   if (!op_budget)
     op_budget = calc_op_budget(op);
+  bool locked = client_lock.is_locked_by_me();
   if (!op_throttle_bytes.get_or_fail(op_budget)) { //couldn't take right now
-    client_lock.Unlock();
+    if (locked)
+      client_lock.Unlock();
     op_throttle_bytes.get(op_budget);
-    client_lock.Lock();
+    if (locked)
+      client_lock.Lock();
   }
   if (!op_throttle_ops.get_or_fail(1)) { //couldn't take right now
-    client_lock.Unlock();
+    if (locked)
+      client_lock.Unlock();
     op_throttle_ops.get(1);
-    client_lock.Lock();
+    if (locked)
+      client_lock.Lock();
   }
 }
 
 /* This function DOES put the passed message before returning */
 void Objecter::handle_osd_op_reply(MOSDOpReply *m)
 {
-  assert(client_lock.is_locked());
-  assert(initialized);
+  assert(unlocked_ops || client_lock.is_locked());
   ldout(cct, 10) << "in handle_osd_op_reply" << dendl;
 
   // get pio
   tid_t tid = m->get_tid();
 
-  if (ops.count(tid) == 0) {
+  rwlock.get_read();
+  if (!initialized) {
+    rwlock.unlock();
+    m->put();
+    return;
+  }
+
+  OSDSession *s = NULL;
+  if (m->get_source().is_osd())
+    s = lookup_session(m->get_source().num());
+  map<tid_t,Op*>::iterator iter;
+  if (s) {
+    s->lock.Lock();
+    iter = s->ops.find(tid);
+    if (iter == s->ops.end()) {
+      s->lock.Unlock();
+      s = NULL;
+    }
+  }
+  if (!s) {
     ldout(cct, 7) << "handle_osd_op_reply " << tid
 	    << (m->is_ondisk() ? " ondisk":(m->is_onnvram() ? " onnvram":" ack"))
 	    << " ... stray" << dendl;
+    rwlock.unlock();
     m->put();
     return;
   }
@@ -1373,14 +1643,16 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
 		<< " v " << m->get_version() << " in " << m->get_pg()
 		<< " attempt " << m->get_retry_attempt()
 		<< dendl;
-  Op *op = ops[tid];
+  Op *op = iter->second;
 
   if (m->get_retry_attempt() >= 0) {
     if (m->get_retry_attempt() != (op->attempts - 1)) {
       ldout(cct, 7) << " ignoring reply from attempt " << m->get_retry_attempt()
 		    << " from " << m->get_source_inst()
 		    << "; last attempt " << (op->attempts - 1) << " sent to "
-		    << op->session->con->get_peer_addr() << dendl;
+		    << s->con->get_peer_addr() << dendl;
+      s->lock.Unlock();
+      rwlock.unlock();
       m->put();
       return;
     }
@@ -1398,10 +1670,24 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
   if (rc == -EAGAIN) {
     ldout(cct, 7) << " got -EAGAIN, resubmitting" << dendl;
     if (op->onack)
-      num_unacked--;
+      num_unacked.dec();
     if (op->oncommit)
-      num_uncommitted--;
-    op_submit(op);
+      num_uncommitted.dec();
+    // take it out of the session; it gets a new tid and target, and
+    // keeps its budget
+    s->ops.erase(iter);
+    num_in_flight.dec();
+    if (op->con) {
+      op->con->revoke_rx_buffer(op->tid);
+      op->con->put();
+      op->con = NULL;
+    }
+    op->session = NULL;
+    op->acting.clear();
+    op->tid = 0;
+    s->lock.Unlock();
+    rwlock.unlock();
+    _op_submit_budgeted(op);
     m->put();
     return;
   }
@@ -1420,9 +1706,11 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
 		  << " != request ops " << op->ops
 		  << " from " << m->get_source_inst() << dendl;
 
-  vector<bufferlist*>::iterator pb = op->out_bl.begin();
-  vector<int*>::iterator pr = op->out_rval.begin();
-  vector<Context*>::iterator ph = op->out_handler.begin();
+  // handlers are called after we drop our locks
+  list<pair<Context*, int> > handlers;
+  bufferlist **pb = op->out_bl.begin();
+  int **pr = op->out_rval.begin();
+  Context **ph = op->out_handler.begin();
   assert(op->out_bl.size() == op->out_rval.size());
   assert(op->out_bl.size() == op->out_handler.size());
   vector<OSDOp>::iterator p = out_ops.begin();
@@ -1437,7 +1725,7 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
       **pr = p->rval;
     if (*ph) {
       ldout(cct, 10) << " op " << i << " handler " << *ph << dendl;
-      (*ph)->complete(p->rval);
+      handlers.push_back(pair<Context*, int>(*ph, p->rval));
       *ph = NULL;
     }
   }
@@ -1448,14 +1736,14 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
     op->version = m->get_version();
     onack = op->onack;
     op->onack = 0;  // only do callback once
-    num_unacked--;
+    num_unacked.dec();
     logger->inc(l_osdc_op_ack);
   }
   if (op->oncommit && (m->is_ondisk() || rc)) {
     ldout(cct, 15) << "handle_osd_op_reply safe" << dendl;
     oncommit = op->oncommit;
     op->oncommit = 0;
-    num_uncommitted--;
+    num_uncommitted.dec();
     logger->inc(l_osdc_op_commit);
   }
 
@@ -1470,12 +1758,19 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
   // done with this tid?
   if (!op->onack && !op->oncommit) {
     ldout(cct, 15) << "handle_osd_op_reply completed tid " << tid << dendl;
-    finish_op(op);
+    s->ops.erase(iter);
+    _finish_op(op);
   }
+  s->lock.Unlock();
+  rwlock.unlock();
   
-  ldout(cct, 5) << num_unacked << " unacked, " << num_uncommitted << " uncommitted" << dendl;
+  ldout(cct, 5) << num_unacked.read() << " unacked, " << num_uncommitted.read() << " uncommitted" << dendl;
 
   // do callbacks
+  for (list<pair<Context*, int> >::iterator h = handlers.begin();
+       h != handlers.end();
+       ++h)
+    h->first->complete(h->second);
   if (onack) {
     onack->finish(rc);
     delete onack;
@@ -1506,8 +1801,11 @@ void Objecter::list_objects(ListContext *list_context, Context *onfinish) {
     return;
   }
 
+  // we may be called from an op completion without client_lock
+  rwlock.get_read();
   const pg_pool_t *pool = osdmap->get_pg_pool(list_context->pool_id);
   int pg_num = pool->get_pg_num();
+  rwlock.unlock();
 
   if (list_context->starting_pg_num == 0) {     // there can't be zero pgs!
     list_context->starting_pg_num = pg_num;
@@ -1632,7 +1930,7 @@ int Objecter::create_pool_snap(int64_t pool, string& snap_name, Context *onfinis
   PoolOp *op = new PoolOp;
   if (!op)
     return -ENOMEM;
-  op->tid = ++last_tid;
+  op->tid = last_tid.inc();
   op->pool = pool;
   op->name = snap_name;
   op->onfinish = onfinish;
@@ -1665,7 +1963,7 @@ int Objecter::allocate_selfmanaged_snap(int64_t pool, snapid_t *psnapid,
   ldout(cct, 10) << "allocate_selfmanaged_snap; pool: " << pool << dendl;
   PoolOp *op = new PoolOp;
   if (!op) return -ENOMEM;
-  op->tid = ++last_tid;
+  op->tid = last_tid.inc();
   op->pool = pool;
   C_SelfmanagedSnap *fin = new C_SelfmanagedSnap(psnapid, onfinish);
   op->onfinish = fin;
@@ -1690,7 +1988,7 @@ int Objecter::delete_pool_snap(int64_t pool, string& snap_name, Context *onfinis
   PoolOp *op = new PoolOp;
   if (!op)
     return -ENOMEM;
-  op->tid = ++last_tid;
+  op->tid = last_tid.inc();
   op->pool = pool;
   op->name = snap_name;
   op->onfinish = onfinish;
@@ -1708,7 +2006,7 @@ int Objecter::delete_selfmanaged_snap(int64_t pool, snapid_t snap,
 	   << snap << dendl;
   PoolOp *op = new PoolOp;
   if (!op) return -ENOMEM;
-  op->tid = ++last_tid;
+  op->tid = last_tid.inc();
   op->pool = pool;
   op->onfinish = onfinish;
   op->pool_op = POOL_OP_DELETE_UNMANAGED_SNAP;
@@ -1731,7 +2029,7 @@ int Objecter::create_pool(string& name, Context *onfinish, uint64_t auid,
   PoolOp *op = new PoolOp;
   if (!op)
     return -ENOMEM;
-  op->tid = ++last_tid;
+  op->tid = last_tid.inc();
   op->pool = 0;
   op->name = name;
   op->onfinish = onfinish;
@@ -1754,7 +2052,7 @@ int Objecter::delete_pool(int64_t pool, Context *onfinish)
 
   PoolOp *op = new PoolOp;
   if (!op) return -ENOMEM;
-  op->tid = ++last_tid;
+  op->tid = last_tid.inc();
   op->pool = pool;
   op->name = "delete";
   op->onfinish = onfinish;
@@ -1777,7 +2075,7 @@ int Objecter::change_pool_auid(int64_t pool, Context *onfinish, uint64_t auid)
   ldout(cct, 10) << "change_pool_auid " << pool << " to " << auid << dendl;
   PoolOp *op = new PoolOp;
   if (!op) return -ENOMEM;
-  op->tid = ++last_tid;
+  op->tid = last_tid.inc();
   op->pool = pool;
   op->name = "change_pool_auid";
   op->onfinish = onfinish;
@@ -1855,7 +2153,7 @@ void Objecter::get_pool_stats(list<string>& pools, map<string,pool_stat_t> *resu
   ldout(cct, 10) << "get_pool_stats " << pools << dendl;
 
   PoolStatOp *op = new PoolStatOp;
-  op->tid = ++last_tid;
+  op->tid = last_tid.inc();
   op->pools = pools;
   op->pool_stats = result;
   op->onfinish = onfinish;
@@ -1908,7 +2206,7 @@ void Objecter::get_fs_stats(ceph_statfs& result, Context *onfinish)
   ldout(cct, 10) << "get_fs_stats" << dendl;
 
   StatfsOp *op = new StatfsOp;
-  op->tid = ++last_tid;
+  op->tid = last_tid.inc();
   op->stats = &result;
   op->onfinish = onfinish;
   statfs_ops[op->tid] = op;
@@ -2003,6 +2301,7 @@ void Objecter::ms_handle_reset(Connection *con)
     int osd = osdmap->identify_osd(con->get_peer_addr());
     if (osd >= 0) {
       ldout(cct, 1) << "ms_handle_reset on osd." << osd << dendl;
+      rwlock.get_write();
       map<int,OSDSession*>::iterator p = osd_sessions.find(osd);
       if (p != osd_sessions.end()) {
 	OSDSession *session = p->second;
@@ -2010,6 +2309,7 @@ void Objecter::ms_handle_reset(Connection *con)
 	kick_requests(session);
 	maybe_request_map();
       }
+      rwlock.unlock();
     } else {
       ldout(cct, 10) << "ms_handle_reset on unknown osd addr " << con->get_peer_addr() << dendl;
     }
@@ -2027,8 +2327,10 @@ void Objecter::ms_handle_remote_reset(Connection *con)
 
 void Objecter::dump_active()
 {
-  ldout(cct, 20) << "dump_active .. " << num_homeless_ops << " homeless" << dendl;
-  for (map<tid_t,Op*>::iterator p = ops.begin(); p != ops.end(); ++p) {
+  ldout(cct, 20) << "dump_active .. " << homeless_session.ops.size() << " homeless" << dendl;
+  map<tid_t,Op*> all;
+  _get_ops(all);
+  for (map<tid_t,Op*>::iterator p = all.begin(); p != all.end(); ++p) {
     Op *op = p->second;
     ldout(cct, 20) << op->tid << "\t" << op->pgid << "\tosd." << (op->session ? op->session->osd : -1)
 	    << "\t" << op->oid << "\t" << op->ops << dendl;
@@ -2040,7 +2342,9 @@ void Objecter::dump_requests(Formatter& fmt) const
   assert(client_lock.is_locked());
 
   fmt.open_object_section("requests");
+  rwlock.get_write();
   dump_ops(fmt);
+  rwlock.unlock();
   dump_linger_ops(fmt);
   dump_pool_ops(fmt);
   dump_pool_stat_ops(fmt);
@@ -2050,9 +2354,11 @@ void Objecter::dump_requests(Formatter& fmt) const
 
 void Objecter::dump_ops(Formatter& fmt) const
 {
+  map<tid_t,Op*> all;
+  _get_ops(all);
   fmt.open_array_section("ops");
-  for (map<tid_t,Op*>::const_iterator p = ops.begin();
-       p != ops.end();
+  for (map<tid_t,Op*>::const_iterator p = all.begin();
+       p != all.end();
        ++p) {
     Op *op = p->second;
     fmt.open_object_section("op");
@@ -23,7 +23,11 @@
 #include "messages/MOSDOp.h"
 
 #include "common/admin_socket.h"
+#include "common/RWLock.h"
 #include "common/Timer.h"
+#include "common/ObjectPool.h"
+#include "include/atomic.h"
+#include "include/small_vector.h"
 #include "include/rados/rados_types.h"
 #include "include/rados/rados_types.hpp"
 
@@ -48,14 +52,20 @@ class PerfCounters;
 
 // -----------------------------------------
 
+/*
+ * Nearly every op carries one to three OSDOps; size the per-op
+ * vectors so that case never touches the heap.
+ */
+#define OBJECTER_SMALL_OPS 3
+
 struct ObjectOperation {
   vector<OSDOp> ops;
   int flags;
   int priority;
 
-  vector<bufferlist*> out_bl;
-  vector<Context*> out_handler;
-  vector<int*> out_rval;
+  small_vector<bufferlist*, OBJECTER_SMALL_OPS> out_bl;
+  small_vector<Context*, OBJECTER_SMALL_OPS> out_handler;
+  small_vector<int*, OBJECTER_SMALL_OPS> out_rval;
 
   ObjectOperation() : flags(0), priority(0) {}
   ~ObjectOperation() {
@@ -76,14 +86,13 @@ struct ObjectOperation {
 
   OSDOp& add_op(int op) {
     int s = ops.size();
+    if (s == 0)
+      ops.reserve(OBJECTER_SMALL_OPS);
     ops.resize(s+1);
     ops[s].op.op = op;
     out_bl.resize(s+1);
-    out_bl[s] = NULL;
     out_handler.resize(s+1);
-    out_handler[s] = NULL;
     out_rval.resize(s+1);
-    out_rval[s] = NULL;
     return ops[s];
   }
   void add_data(int op, uint64_t off, uint64_t len, bufferlist& bl) {
@@ -253,6 +262,10 @@ struct ObjectOperation {
     bufferlist bl;
     add_data(CEPH_OSD_OP_DELETE, 0, 0, bl);
   }
+  void rollback(uint64_t snapid) {
+    OSDOp& osd_op = add_op(CEPH_OSD_OP_ROLLBACK);
+    osd_op.op.snap.snapid = snapid;
+  }
   void mapext(uint64_t off, uint64_t len) {
     bufferlist bl;
     add_data(CEPH_OSD_OP_MAPEXT, off, len, bl);
@@ -634,14 +647,16 @@ class Objecter {
   bool initialized;
  
  private:
-  tid_t last_tid;
+  atomic_t last_tid;
   int client_inc;
   uint64_t max_linger_id;
-  int num_unacked;
-  int num_uncommitted;
+  atomic_t num_unacked;
+  atomic_t num_uncommitted;
+  atomic_t num_in_flight;
   int global_op_flags; // flags which are applied to each IO op
   bool keep_balanced_budget;
   bool honor_osdmap_full;
+  bool unlocked_ops;
 
   void maybe_request_map();
 
@@ -651,6 +666,29 @@ class Objecter {
   Mutex &client_lock;
   SafeTimer &timer;
 
+  /**
+   * Locking
+   *
+   * client_lock covers lingering ops, pool/stat ops, map checks and
+   * everything the timer and monitor paths touch.  rwlock covers the
+   * osdmap, osd_sessions and which session each in-flight op lives
+   * in; each OSDSession::lock covers that session's ops.
+   *
+   * Changing the osdmap, opening or closing sessions, or moving ops
+   * between sessions takes client_lock and then rwlock for write.
+   * Submitting an op or handling its reply only needs rwlock for read
+   * plus the lock of the op's session, so ops to different OSDs do not
+   * contend; if a new session is needed or the pool is missing we drop
+   * back to client_lock and the write lock.  Ordering is client_lock,
+   * rwlock, OSDSession::lock.  Op completions are never called with
+   * rwlock held.
+   *
+   * Holding client_lock is enough to read the osdmap.  Unless
+   * set_unlocked_ops() was called, op_submit() and
+   * handle_osd_op_reply() still expect client_lock to be held.
+   */
+  mutable RWLock rwlock;
+
   PerfCounters *logger;
   
   class C_Tick : public Context {
@@ -681,7 +719,6 @@ public:
 
   struct Op {
     OSDSession *session;
-    xlist<Op*>::item session_item;
     int incarnation;
     
     object_t oid;
@@ -700,9 +737,9 @@ public:
     utime_t mtime;
 
     bufferlist *outbl;
-    vector<bufferlist*> out_bl;
-    vector<Context*> out_handler;
-    vector<int*> out_rval;
+    small_vector<bufferlist*, OBJECTER_SMALL_OPS> out_bl;
+    small_vector<Context*, OBJECTER_SMALL_OPS> out_handler;
+    small_vector<int*, OBJECTER_SMALL_OPS> out_rval;
 
     int flags, priority;
     Context *onack, *oncommit;
@@ -728,7 +765,7 @@ public:
 
     Op(const object_t& o, const object_locator_t& ol, vector<OSDOp>& op,
        int f, Context *ac, Context *co, eversion_t *ov) :
-      session(NULL), session_item(this), incarnation(0),
+      session(NULL), incarnation(0),
       oid(o), oloc(ol),
       used_replica(false), con(NULL),
       snapid(CEPH_NOSNAP),
@@ -741,15 +778,10 @@ public:
       should_resend(true) {
       ops.swap(op);
       
-      /* initialize out_* to match op vector */
+      /* initialize out_* (to NULL) to match op vector */
       out_bl.resize(ops.size());
       out_rval.resize(ops.size());
       out_handler.resize(ops.size());
-      for (unsigned i = 0; i < ops.size(); i++) {
-	out_bl[i] = NULL;
-	out_handler[i] = NULL;
-	out_rval[i] = NULL;
-      }
 
       if (oloc.key == o)
 	oloc.key.clear();
@@ -761,6 +793,16 @@ public:
       }
     }
 
+    // ops are allocated by the submitting thread and freed by the
+    // messenger's; see ObjectPool
+    static ObjectPool pool;
+    static void *operator new(size_t num_bytes) {
+      return pool.alloc(num_bytes);
+    }
+    void operator delete(void *p, size_t num_bytes) {
+      pool.free(p, num_bytes);
+    }
+
     bool operator<(const Op& other) const {
       return tid < other.tid;
     }
@@ -972,21 +1014,23 @@ public:
 
   // -- osd sessions --
   struct OSDSession {
-    xlist<Op*> ops;
+    Mutex lock;
+    map<tid_t,Op*> ops;
     xlist<LingerOp*> linger_ops;
     int osd;
     int incarnation;
     Connection *con;
 
-    OSDSession(int o) : osd(o), incarnation(0), con(NULL) {}
+    OSDSession(int o) :
+      lock("Objecter::OSDSession::lock"),
+      osd(o), incarnation(0), con(NULL) {}
   };
   map<int,OSDSession*> osd_sessions;
 
 
  private:
-  // pending ops
-  map<tid_t,Op*>            ops;
-  int                       num_homeless_ops;
+  // pending ops.  ops without a target osd live in homeless_session.
+  OSDSession                homeless_session;
   map<uint64_t, LingerOp*>  linger_ops;
   map<tid_t,PoolStatOp*>    poolstat_ops;
   map<tid_t,StatfsOp*>      statfs_ops;
@@ -999,16 +1043,23 @@ public:
 
   map<epoch_t,list< pair<Context*, int> > > waiting_for_map;
 
+  // completions of ops whose pool is gone, to be called with -ENOENT
+  // once rwlock has been dropped
+  list<Context*> pool_dne_contexts;
+  void finish_pool_dne_contexts();
+
   void send_op(Op *op);
   void cancel_op(Op *op);
   void finish_op(Op *op);
+  void _finish_op(Op *op);
   bool is_pg_changed(vector<int>& a, vector<int>& b, bool any_change=false);
   enum recalc_op_target_result {
     RECALC_OP_TARGET_NO_ACTION = 0,
     RECALC_OP_TARGET_NEED_RESEND,
     RECALC_OP_TARGET_POOL_DNE,
+    RECALC_OP_TARGET_NEED_SESSION,
   };
-  int recalc_op_target(Op *op);
+  int recalc_op_target(Op *op, bool exclusive=true);
   bool recalc_linger_op_target(LingerOp *op);
 
   void send_linger(LingerOp *info);
@@ -1025,8 +1076,13 @@ public:
   void kick_requests(OSDSession *session);
 
   OSDSession *get_session(int osd);
+  OSDSession *lookup_session(int osd);
   void reopen_session(OSDSession *session);
   void close_session(OSDSession *session);
+  void _session_op_add(Op *op);
+  void _session_op_remove(Op *op);
+  Op *_lookup_op(tid_t tid);
+  void _get_ops(map<tid_t,Op*>& all) const;
   
   void _list_reply(ListContext *list_context, int r, bufferlist *bl, Context *final_finish,
 		   epoch_t reply_epoch);
@@ -1037,7 +1093,8 @@ public:
    * handle a budget for in-flight ops
    * budget is taken whenever an op goes into the ops map
    * and returned whenever an op is removed from the map
-   * If throttle_op needs to throttle it will unlock client_lock.
+   * If throttle_op needs to throttle it will unlock client_lock, if
+   * we hold it.
    */
   int calc_op_budget(Op *op);
   void throttle_op(Op *op, int op_size=0);
@@ -1051,6 +1108,23 @@ public:
     }
     op->budgeted = true;
   }
+  /// take_op_budget(), unless that would have to wait
+  bool try_take_op_budget(Op *op) {
+    int op_budget = calc_op_budget(op);
+    if (keep_balanced_budget) {
+      if (!op_throttle_bytes.get_or_fail(op_budget))
+	return false;
+      if (!op_throttle_ops.get_or_fail(1)) {
+	op_throttle_bytes.put(op_budget);
+	return false;
+      }
+    } else {
+      op_throttle_bytes.take(op_budget);
+      op_throttle_ops.take(1);
+    }
+    op->budgeted = true;
+    return true;
+  }
   void put_op_budget(Op *op) {
     assert(op->budgeted);
     int op_budget = calc_op_budget(op);
@@ -1064,16 +1138,16 @@ public:
 	   OSDMap *om, Mutex& l, SafeTimer& t) : 
     messenger(m), monc(mc), osdmap(om), cct(cct_),
     initialized(false),
-    last_tid(0), client_inc(-1), max_linger_id(0),
-    num_unacked(0), num_uncommitted(0),
+    client_inc(-1), max_linger_id(0),
     global_op_flags(0),
     keep_balanced_budget(false), honor_osdmap_full(true),
+    unlocked_ops(false),
     last_seen_osdmap_version(0),
     last_seen_pgmap_version(0),
-    client_lock(l), timer(t),
+    client_lock(l), timer(t), rwlock("Objecter::rwlock"),
     logger(NULL), tick_event(NULL),
     m_request_state_hook(NULL),
-    num_homeless_ops(0),
+    homeless_session(-1),
     op_throttle_bytes(cct, "objecter_bytes", cct->_conf->objecter_inflight_op_bytes),
     op_throttle_ops(cct, "objecter_ops", cct->_conf->objecter_inflight_ops)
   { }
@@ -1101,6 +1175,13 @@ public:
   void set_honor_osdmap_full() { honor_osdmap_full = true; }
   void unset_honor_osdmap_full() { honor_osdmap_full = false; }
 
+  /**
+   * Let op_submit() and handle_osd_op_reply() run without client_lock.
+   * Op completions are then called without client_lock as well, so
+   * only set this if none of the caller's completions rely on it.
+   */
+  void set_unlocked_ops() { unlocked_ops = true; }
+
   void scan_requests(bool skipped_map,
 		     map<tid_t, Op*>& need_resend,
 		     list<LingerOp*>& need_resend_linger);
@@ -1115,12 +1196,16 @@ public:
 private:
   // low-level
   tid_t op_submit(Op *op);
-  tid_t _op_submit(Op *op);
+  tid_t _op_submit_budgeted(Op *op);
+  void _op_submit_batch_budgeted(vector<Op*>::iterator begin,
+				 vector<Op*>::iterator end);
+  tid_t _op_submit(Op *op, bool exclusive=true);
+  tid_t _op_submit_targeted(Op *op, bool check_for_latest_map);
 
   // public interface
  public:
   bool is_active() {
-    return !(ops.empty() && linger_ops.empty() && poolstat_ops.empty() && statfs_ops.empty());
+    return !(num_in_flight.read() == 0 && linger_ops.empty() && poolstat_ops.empty() && statfs_ops.empty());
   }
 
   /**
@@ -1147,20 +1232,32 @@ private:
   void clear_global_op_flag(int flags) { global_op_flags &= ~flags; }
 
   // mid-level helpers
-  tid_t mutate(const object_t& oid, const object_locator_t& oloc, 
-	       ObjectOperation& op,
-	       const SnapContext& snapc, utime_t mtime, int flags,
-	       Context *onack, Context *oncommit, eversion_t *objver = NULL) {
+  /**
+   * Submit many ops at once
+   *
+   * Targets for the whole batch are computed under a single read lock
+   * and each OSD's ops are sent together.  Each op still completes
+   * through its own onack/oncommit.  If the batch doesn't fit in the
+   * in-flight budget, what does fit is sent before waiting for more.
+   */
+  void op_submit_batch(vector<Op*>& ops);
+
+  // build an Op without submitting it (see op_submit_batch)
+  Op *prepare_mutate_op(const object_t& oid, const object_locator_t& oloc,
+			ObjectOperation& op,
+			const SnapContext& snapc, utime_t mtime, int flags,
+			Context *onack, Context *oncommit,
+			eversion_t *objver = NULL) {
     Op *o = new Op(oid, oloc, op.ops, flags | global_op_flags | CEPH_OSD_FLAG_WRITE, onack, oncommit, objver);
     o->priority = op.priority;
     o->mtime = mtime;
     o->snapc = snapc;
-    return op_submit(o);
+    return o;
   }
-  tid_t read(const object_t& oid, const object_locator_t& oloc,
-	     ObjectOperation& op,
-	     snapid_t snapid, bufferlist *pbl, int flags,
-	     Context *onack, eversion_t *objver = NULL) {
+  Op *prepare_read_op(const object_t& oid, const object_locator_t& oloc,
+		      ObjectOperation& op,
+		      snapid_t snapid, bufferlist *pbl, int flags,
+		      Context *onack, eversion_t *objver = NULL) {
     Op *o = new Op(oid, oloc, op.ops, flags | global_op_flags | CEPH_OSD_FLAG_READ, onack, NULL, objver);
     o->priority = op.priority;
     o->snapid = snapid;
@@ -1168,7 +1265,22 @@ private:
     o->out_bl.swap(op.out_bl);
     o->out_handler.swap(op.out_handler);
     o->out_rval.swap(op.out_rval);
-    return op_submit(o);
+    return o;
+  }
+
+  tid_t mutate(const object_t& oid, const object_locator_t& oloc, 
+	       ObjectOperation& op,
+	       const SnapContext& snapc, utime_t mtime, int flags,
+	       Context *onack, Context *oncommit, eversion_t *objver = NULL) {
+    return op_submit(prepare_mutate_op(oid, oloc, op, snapc, mtime, flags,
+				       onack, oncommit, objver));
+  }
+  tid_t read(const object_t& oid, const object_locator_t& oloc,
+	     ObjectOperation& op,
+	     snapid_t snapid, bufferlist *pbl, int flags,
+	     Context *onack, eversion_t *objver = NULL) {
+    return op_submit(prepare_read_op(oid, oloc, op, snapid, pbl, flags,
+				     onack, objver));
   }
   tid_t linger_mutate(const object_t& oid, const object_locator_t& oloc,
 		      ObjectOperation& op,
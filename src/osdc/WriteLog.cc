@@ -0,0 +1,904 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "common/ceph_context.h"
+#include "common/Clock.h"
+#include "common/dout.h"
+#include "common/errno.h"
+#include "common/safe_io.h"
+#include "include/crc32c.h"
+#include "include/intarith.h"
+#include "osdc/WritebackHandler.h"
+#include "osdc/WriteLog.h"
+
+#include "include/assert.h"
+
+#define dout_subsys ceph_subsys_objectcacher
+#undef dout_prefix
+#define dout_prefix *_dout << "writelog(" << m_path << ") "
+
+using std::list;
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+static const uint64_t BLOCK_SIZE = 4096;
+static const uint64_t WRITE_LOG_MAGIC = 0x6c6f672d65746972ull;
+static const uint32_t WRITE_LOG_VERSION = 1;
+
+enum {
+  RECORD_ENTRY = 1,
+  RECORD_PAD = 2,   // the rest of the file is unused; go back to the start
+};
+
+/*
+ * The first block of the file.  The data area is the rest of it, used
+ * as a ring from head on.
+ */
+struct write_log_super_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t crc;       // of the fields below
+  uint64_t log_id;
+  uint64_t size;
+  uint64_t head;      // first record we may still need
+  uint64_t head_seq;  // and its seq
+
+  uint32_t calc_crc() const {
+    return ceph_crc32c_le(0, (const unsigned char *)&log_id,
+			  sizeof(*this) - offsetof(write_log_super_t, log_id));
+  }
+} __attribute__((__packed__, aligned(4)));
+
+/*
+ * Starts each record, followed by the encoded metadata and the data,
+ * padded out to a block.
+ */
+struct write_log_record_t {
+  uint64_t seq;
+  uint32_t type;
+  uint32_t crc;       // of the metadata and data
+  uint64_t len;       // of the whole record
+  uint32_t meta_len;
+  uint32_t data_len;
+  uint64_t magic1;
+  uint64_t magic2;
+
+  void make_magic(uint64_t pos, uint64_t log_id) {
+    magic1 = pos;
+    magic2 = log_id ^ seq ^ len;
+  }
+  bool check_magic(uint64_t pos, uint64_t log_id) const {
+    return magic1 == pos && magic2 == (log_id ^ seq ^ len);
+  }
+} __attribute__((__packed__, aligned(4)));
+
+/// copy without going through bl's cached iterator, which isn't ours
+static void copy_out(const bufferlist &bl, char *dest)
+{
+  for (list<bufferptr>::const_iterator p = bl.buffers().begin();
+       p != bl.buffers().end(); ++p) {
+    memcpy(dest, p->c_str(), p->length());
+    dest += p->length();
+  }
+}
+
+uint64_t WriteLog::Entry::data_pos() const
+{
+  return pos + sizeof(write_log_record_t) + meta_len;
+}
+
+const uint64_t WriteLog::REPLAY_NONE;
+const uint64_t WriteLog::REPLAY_ANY;
+
+WriteLog::WriteLog(CephContext *cct, const string &path, uint64_t size,
+		   WritebackHandler &wb, Mutex &lock, unsigned max_in_flight)
+  : m_cct(cct), m_path(path), m_size(size), m_wb(wb), m_lock(lock),
+    m_max_in_flight(max_in_flight),
+    m_fd(-1), m_log_id(0), m_writer(this), m_finisher(cct),
+    m_stopping(false),
+    m_next_seq(1), m_logged_seq(0),
+    m_tail(BLOCK_SIZE), m_log_bytes(0),
+    m_head(BLOCK_SIZE), m_head_seq(1),
+    m_sb_head(BLOCK_SIZE), m_sb_head_seq(1),
+    m_retired_bytes(0),
+    m_writeback_next(m_entries.end()),
+    m_in_flight(0), m_writeback_error(0), m_retry(false)
+{
+}
+
+WriteLog::~WriteLog()
+{
+  if (m_fd >= 0)
+    close();
+}
+
+int WriteLog::open(uint64_t replay_id)
+{
+  m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT, 0600);
+  if (m_fd < 0) {
+    int r = -errno;
+    lderr(m_cct) << "error opening write log: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+
+  int r = 0;
+  struct stat st;
+  if (::flock(m_fd, LOCK_EX | LOCK_NB) < 0) {
+    r = -errno;
+    if (r == -EWOULDBLOCK)
+      r = -EBUSY;
+    lderr(m_cct) << "unable to lock write log: " << cpp_strerror(r) << dendl;
+    goto fail;
+  }
+  if (::fstat(m_fd, &st) < 0) {
+    r = -errno;
+    goto fail;
+  }
+
+  if (st.st_size == 0) {
+    r = create();
+  } else {
+    r = read_super();
+    if (r == 0 && (uint64_t)st.st_size < m_size) {
+      lderr(m_cct) << "write log is truncated" << dendl;
+      r = -EINVAL;
+    }
+    if (r == 0 && replay_id != REPLAY_ANY && replay_id != m_log_id) {
+      ldout(m_cct, 0) << "write log " << m_log_id << " is not the expected "
+		      << replay_id << ", dropping its writes" << dendl;
+      m_head = m_sb_head = BLOCK_SIZE;
+      m_head_seq = m_sb_head_seq = 1;
+      r = create();
+    } else if (r == 0) {
+      r = replay();
+    }
+  }
+  if (r < 0)
+    goto fail;
+
+  m_finisher.start();
+  m_writer.create();
+  return 0;
+
+ fail:
+  ::close(m_fd);
+  m_fd = -1;
+  return r;
+}
+
+int WriteLog::create()
+{
+  m_size = m_size / BLOCK_SIZE * BLOCK_SIZE;
+  if (m_size < 3 * BLOCK_SIZE) {
+    lderr(m_cct) << "write log size " << m_size << " is too small" << dendl;
+    return -EINVAL;
+  }
+  if (::ftruncate(m_fd, m_size) < 0) {
+    int r = -errno;
+    lderr(m_cct) << "error sizing write log: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+
+  // a new id, so old records don't look like ours
+  utime_t now = ceph_clock_now(m_cct);
+  uint64_t old_id = m_log_id;
+  m_log_id = ((uint64_t)now.sec() << 32) ^ now.nsec() ^ getpid();
+  while (m_log_id == old_id || m_log_id == REPLAY_NONE ||
+	 m_log_id == REPLAY_ANY)
+    ++m_log_id;
+  ldout(m_cct, 1) << "creating write log of " << m_size << " bytes" << dendl;
+  return write_super(m_head, m_head_seq);
+}
+
+int WriteLog::read_super()
+{
+  bufferptr bp = buffer::create_page_aligned(BLOCK_SIZE);
+  int r = safe_pread_exact(m_fd, bp.c_str(), BLOCK_SIZE, 0);
+  if (r < 0) {
+    lderr(m_cct) << "error reading write log superblock: "
+		 << cpp_strerror(r) << dendl;
+    return r == -EDOM ? -EINVAL : r;
+  }
+
+  write_log_super_t s;
+  memcpy(&s, bp.c_str(), sizeof(s));
+  if (s.magic != WRITE_LOG_MAGIC || s.version != WRITE_LOG_VERSION ||
+      s.crc != s.calc_crc() ||
+      s.size < 3 * BLOCK_SIZE || s.size % BLOCK_SIZE ||
+      s.head < BLOCK_SIZE || s.head >= s.size || s.head % BLOCK_SIZE) {
+    lderr(m_cct) << "not a valid write log" << dendl;
+    return -EINVAL;
+  }
+  if (s.size != m_size)
+    ldout(m_cct, 1) << "keeping the log's size of " << s.size
+		    << " bytes" << dendl;
+
+  m_size = s.size;
+  m_log_id = s.log_id;
+  m_head = m_sb_head = s.head;
+  m_head_seq = m_sb_head_seq = s.head_seq;
+  return 0;
+}
+
+int WriteLog::write_super(uint64_t head, uint64_t head_seq)
+{
+  bufferptr bp = buffer::create_page_aligned(BLOCK_SIZE);
+  bp.zero();
+  write_log_super_t s;
+  s.magic = WRITE_LOG_MAGIC;
+  s.version = WRITE_LOG_VERSION;
+  s.log_id = m_log_id;
+  s.size = m_size;
+  s.head = head;
+  s.head_seq = head_seq;
+  s.crc = s.calc_crc();
+  memcpy(bp.c_str(), &s, sizeof(s));
+
+  int r = safe_pwrite(m_fd, bp.c_str(), BLOCK_SIZE, 0);
+  if (r == 0 && ::fdatasync(m_fd) < 0)
+    r = -errno;
+  return r;
+}
+
+int WriteLog::replay()
+{
+  uint64_t cap = m_size - BLOCK_SIZE;
+  uint64_t pos = m_head;
+  uint64_t seq = m_head_seq;
+  uint64_t bytes = 0;
+  uint64_t pad = 0;
+  while (true) {
+    Entry *e = new Entry;
+    bool is_pad = false;
+    int r = read_record(pos, seq, e, &is_pad);
+    if (r == 0 && bytes + e->len > cap)
+      r = -ENOENT;
+    if (r == 0 && is_pad && (pad || pos + e->len != m_size))
+      r = -ENOENT;
+    if (r < 0) {
+      delete e;
+      if (r == -ENOENT)
+	break;
+      lderr(m_cct) << "error reading write log: " << cpp_strerror(r)
+		   << dendl;
+      return r;
+    }
+
+    if (is_pad) {
+      pad = e->len;
+      bytes += pad;
+      pos = BLOCK_SIZE;
+      delete e;
+      continue;
+    }
+
+    e->state = STATE_LOGGED;
+    e->seq = seq++;
+    e->pos = pos;
+    e->pad = pad;
+    pad = 0;
+    bytes += e->len;
+    pos += e->len;
+    if (pos == m_size)
+      pos = BLOCK_SIZE;
+    m_entries.push_back(e);
+    m_objects[e->oid].push_back(e);
+  }
+  if (pad) {
+    // nothing made it in after the pad; it is free again
+    bytes -= pad;
+    pos = m_size - pad;
+  }
+
+  m_tail = pos;
+  m_log_bytes = bytes;
+  m_next_seq = seq;
+  m_logged_seq = seq - 1;
+  m_writeback_next = m_entries.begin();
+  ldout(m_cct, 1) << "replaying " << m_entries.size() << " writes ("
+		  << bytes << " bytes of log)" << dendl;
+  return 0;
+}
+
+/*
+ * Check and decode the record at pos, if it is the one we expect.
+ *
+ * @returns 0 on success, -ENOENT if there is no such record, or
+ * another negative error code if the file can't be read
+ */
+int WriteLog::read_record(uint64_t pos, uint64_t seq, Entry *e, bool *pad)
+{
+  bufferptr bp = buffer::create_page_aligned(BLOCK_SIZE);
+  int r = safe_pread_exact(m_fd, bp.c_str(), BLOCK_SIZE, pos);
+  if (r < 0)
+    return r == -EDOM ? -ENOENT : r;
+
+  write_log_record_t h;
+  memcpy(&h, bp.c_str(), sizeof(h));
+  if (h.seq != seq || !h.check_magic(pos, m_log_id) ||
+      h.len < BLOCK_SIZE || h.len % BLOCK_SIZE || pos + h.len > m_size)
+    return -ENOENT;
+  e->len = h.len;
+  if (h.type == RECORD_PAD) {
+    *pad = true;
+    return 0;
+  }
+  if (h.type != RECORD_ENTRY ||
+      sizeof(h) + h.meta_len + h.data_len > h.len)
+    return -ENOENT;
+
+  if (h.len > BLOCK_SIZE) {
+    bp = buffer::create_page_aligned(h.len);
+    r = safe_pread_exact(m_fd, bp.c_str(), h.len, pos);
+    if (r < 0)
+      return r == -EDOM ? -ENOENT : r;
+  }
+  const char *p = bp.c_str() + sizeof(h);
+  if (ceph_crc32c_le(0, (const unsigned char *)p,
+		     h.meta_len + h.data_len) != h.crc)
+    return -ENOENT;
+
+  bufferlist meta;
+  meta.append(p, h.meta_len);
+  bufferlist::iterator i = meta.begin();
+  try {
+    ::decode(e->oid, i);
+    ::decode(e->oloc, i);
+    ::decode(e->off, i);
+    ::decode(e->snapc, i);
+  } catch (buffer::error& err) {
+    return -ENOENT;
+  }
+  e->meta_len = h.meta_len;
+  e->length = h.data_len;
+  return 0;
+}
+
+uint64_t WriteLog::record_len(const Entry *e) const
+{
+  return ROUND_UP_TO(sizeof(write_log_record_t) + e->meta.length() +
+		     e->length, BLOCK_SIZE);
+}
+
+int WriteLog::write_record(Entry *e)
+{
+  bufferptr bp = buffer::create_page_aligned(e->len);
+  bp.zero();
+  char *p = bp.c_str() + sizeof(write_log_record_t);
+  copy_out(e->meta, p);
+  copy_out(e->bl, p + e->meta_len);
+
+  write_log_record_t h;
+  memset(&h, 0, sizeof(h));
+  h.seq = e->seq;
+  h.type = RECORD_ENTRY;
+  h.len = e->len;
+  h.meta_len = e->meta_len;
+  h.data_len = e->length;
+  h.crc = ceph_crc32c_le(0, (const unsigned char *)p,
+			 e->meta_len + e->length);
+  h.make_magic(e->pos, m_log_id);
+  memcpy(bp.c_str(), &h, sizeof(h));
+  return safe_pwrite(m_fd, bp.c_str(), e->len, e->pos);
+}
+
+int WriteLog::write_pad(uint64_t pos, uint64_t seq, uint64_t len)
+{
+  bufferptr bp = buffer::create_page_aligned(BLOCK_SIZE);
+  bp.zero();
+  write_log_record_t h;
+  memset(&h, 0, sizeof(h));
+  h.seq = seq;
+  h.type = RECORD_PAD;
+  h.len = len;
+  h.make_magic(pos, m_log_id);
+  memcpy(bp.c_str(), &h, sizeof(h));
+  return safe_pwrite(m_fd, bp.c_str(), BLOCK_SIZE, pos);
+}
+
+void WriteLog::close()
+{
+  m_lock.Lock();
+  m_stopping = true;
+  m_cond.SignalAll();
+  m_lock.Unlock();
+  m_writer.join();
+
+  m_lock.Lock();
+  while (m_in_flight > 0)
+    m_cond.Wait(m_lock);
+  complete_waiters(m_sync_waiters, (uint64_t)-1, -ESHUTDOWN);
+  complete_waiters(m_flush_waiters, (uint64_t)-1, -ESHUTDOWN);
+  complete_waiters(m_retire_waiters, (uint64_t)-1, -ESHUTDOWN);
+  m_lock.Unlock();
+
+  m_finisher.wait_for_empty();
+  m_finisher.stop();
+  ::close(m_fd);
+  m_fd = -1;
+
+  ldout(m_cct, 1) << "closed with " << m_entries.size()
+		  << " writes not written back" << dendl;
+  for (list<Entry*>::iterator p = m_entries.begin();
+       p != m_entries.end(); ++p)
+    delete *p;
+  m_entries.clear();
+  m_writeback_next = m_entries.end();
+  m_objects.clear();
+}
+
+bool WriteLog::empty()
+{
+  Mutex::Locker l(m_lock);
+  return m_queued.empty() && m_entries.empty();
+}
+
+void WriteLog::write(const object_t &oid, const object_locator_t &oloc,
+		     uint64_t off, const bufferlist &bl,
+		     const SnapContext &snapc, Context *onsafe)
+{
+  Entry *e = new Entry;
+  e->oid = oid;
+  e->oloc = oloc;
+  e->off = off;
+  e->length = bl.length();
+  e->snapc = snapc;
+  e->bl = bl;
+  e->onsafe = onsafe;
+  ::encode(oid, e->meta);
+  ::encode(oloc, e->meta);
+  ::encode(off, e->meta);
+  ::encode(snapc, e->meta);
+  e->meta_len = e->meta.length();
+  e->len = record_len(e);
+  assert(e->len <= (m_size - BLOCK_SIZE) / 2);
+
+  Mutex::Locker l(m_lock);
+  assert(!m_stopping);
+  e->seq = m_next_seq++;
+  ldout(m_cct, 20) << "write " << oid << " " << off << "~" << e->length
+		   << " seq " << e->seq << dendl;
+  m_queued.push_back(e);
+  m_objects[oid].push_back(e);
+  m_cond.SignalAll();
+}
+
+bool WriteLog::covered(const list<Entry*> &entries, uint64_t off,
+		       uint64_t len) const
+{
+  vector<pair<uint64_t, uint64_t> > extents;
+  for (list<Entry*>::const_iterator p = entries.begin();
+       p != entries.end(); ++p)
+    extents.push_back(make_pair((*p)->off, (*p)->off + (*p)->length));
+  sort(extents.begin(), extents.end());
+
+  uint64_t pos = off;
+  for (vector<pair<uint64_t, uint64_t> >::iterator p = extents.begin();
+       p != extents.end() && pos < off + len; ++p) {
+    if (p->first > pos)
+      return false;
+    pos = MAX(pos, p->second);
+  }
+  return pos >= off + len;
+}
+
+/*
+ * Data that is only in the file is read under the lock, which keeps
+ * its record from being retired and overwritten meanwhile.
+ */
+int WriteLog::copy_from_log(const list<Entry*> &entries, uint64_t off,
+			    uint64_t len, extents_t *plogged)
+{
+  assert(m_lock.is_locked());
+  for (list<Entry*>::const_iterator p = entries.begin();
+       p != entries.end(); ++p) {
+    Entry *e = *p;
+    uint64_t start = MAX(off, e->off);
+    uint64_t end = MIN(off + len, e->off + e->length);
+    bufferlist bl;
+    if (e->bl.length()) {
+      bl.substr_of(e->bl, start - e->off, end - start);
+    } else {
+      bufferptr bp(end - start);
+      int r = safe_pread_exact(m_fd, bp.c_str(), end - start,
+			       e->data_pos() + (start - e->off));
+      if (r < 0) {
+	lderr(m_cct) << "error reading " << e->oid << " from the log: "
+		     << cpp_strerror(r) << dendl;
+	return r == -EDOM ? -EIO : r;
+      }
+      bl.push_back(bp);
+    }
+    plogged->push_back(make_pair(start, bl));
+  }
+  return 0;
+}
+
+void WriteLog::overlay(const extents_t &logged, uint64_t off, uint64_t len,
+		       char *dest)
+{
+  for (extents_t::const_iterator p = logged.begin(); p != logged.end(); ++p) {
+    assert(p->first >= off && p->first + p->second.length() <= off + len);
+    copy_out(p->second, dest + (p->first - off));
+  }
+}
+
+int WriteLog::read(const object_t &oid, uint64_t off, uint64_t len,
+		   bufferlist *pbl, extents_t *plogged)
+{
+  Mutex::Locker l(m_lock);
+  map<object_t, list<Entry*> >::iterator p = m_objects.find(oid);
+  if (p == m_objects.end())
+    return 0;
+  list<Entry*> overlap;  // oldest first, so newer data wins
+  for (list<Entry*>::iterator q = p->second.begin();
+       q != p->second.end(); ++q) {
+    if ((*q)->off < off + len && (*q)->off + (*q)->length > off)
+      overlap.push_back(*q);
+  }
+  if (overlap.empty())
+    return 0;
+
+  if (!covered(overlap, off, len)) {
+    // the backend may have older data under these, but has the rest
+    ldout(m_cct, 20) << "read " << oid << " " << off << "~" << len
+		     << " partly in the log, up to seq " << overlap.back()->seq
+		     << dendl;
+    return copy_from_log(overlap, off, len, plogged);
+  }
+
+  extents_t logged;
+  int r = copy_from_log(overlap, off, len, &logged);
+  if (r < 0)
+    return r;
+  bufferptr bp(len);
+  overlay(logged, off, len, bp.c_str());
+  pbl->append(bp);
+  return len;
+}
+
+void WriteLog::wait_for_writeback(const object_t &oid, uint64_t off,
+				  uint64_t len, Context *onfinish)
+{
+  int r = 0;
+  {
+    Mutex::Locker l(m_lock);
+    map<object_t, list<Entry*> >::iterator p = m_objects.find(oid);
+    if (p != m_objects.end()) {
+      // newest first; waiting for it covers the older ones too
+      for (list<Entry*>::reverse_iterator q = p->second.rbegin();
+	   q != p->second.rend(); ++q) {
+	if ((*q)->off < off + len && (*q)->off + (*q)->length > off) {
+	  if (m_writeback_error) {
+	    r = m_writeback_error;
+	    break;
+	  }
+	  ldout(m_cct, 20) << "wait_for_writeback " << oid << " " << off
+			   << "~" << len << " waiting for seq " << (*q)->seq
+			   << dendl;
+	  m_retire_waiters[(*q)->seq].push_back(onfinish);
+	  return;
+	}
+      }
+    }
+  }
+  onfinish->complete(r);
+}
+
+void WriteLog::sync(Context *onsafe)
+{
+  {
+    Mutex::Locker l(m_lock);
+    uint64_t seq = m_next_seq - 1;
+    if (m_logged_seq < seq) {
+      m_sync_waiters[seq].push_back(onsafe);
+      return;
+    }
+  }
+  onsafe->complete(0);
+}
+
+void WriteLog::flush(Context *onfinish)
+{
+  {
+    Mutex::Locker l(m_lock);
+    uint64_t seq = m_next_seq - 1;
+    if (m_writeback_error) {
+      ldout(m_cct, 10) << "flush retrying writeback after error "
+		       << m_writeback_error << dendl;
+      m_writeback_error = 0;
+      m_retry = true;
+      m_cond.SignalAll();
+    }
+    if (m_sb_head_seq <= seq) {
+      m_flush_waiters[seq].push_back(onfinish);
+      return;
+    }
+  }
+  onfinish->complete(0);
+}
+
+void WriteLog::complete_waiters(map<uint64_t, list<Context*> > &waiters,
+				uint64_t upto, int r)
+{
+  assert(m_lock.is_locked());
+  while (!waiters.empty() && waiters.begin()->first <= upto) {
+    list<Context*> &ls = waiters.begin()->second;
+    for (list<Context*>::iterator p = ls.begin(); p != ls.end(); ++p)
+      m_finisher.queue(*p, r);
+    waiters.erase(waiters.begin());
+  }
+}
+
+void WriteLog::writer_entry()
+{
+  m_lock.Lock();
+  while (true) {
+    vector<Context*> finished;
+    bool progress = persist_head(finished);
+    if (append(finished))
+      progress = true;
+    if (start_writeback())
+      progress = true;
+    if (!progress && m_stopping && !m_queued.empty() &&
+	m_writeback_error && !m_in_flight) {
+      // nothing is going to make room for these
+      fail_queued(m_writeback_error, finished);
+    }
+    if (!finished.empty())
+      m_finisher.queue(finished);
+
+    if (progress)
+      continue;
+    if (m_stopping && m_queued.empty())
+      break;
+    m_cond.Wait(m_lock);
+  }
+  m_lock.Unlock();
+}
+
+bool WriteLog::persist_head(vector<Context*> &finished)
+{
+  assert(m_lock.is_locked());
+  if (m_head == m_sb_head && m_head_seq == m_sb_head_seq)
+    return false;
+
+  uint64_t head = m_head;
+  uint64_t head_seq = m_head_seq;
+  uint64_t freed = m_retired_bytes;
+  m_lock.Unlock();
+  int r = write_super(head, head_seq);
+  m_lock.Lock();
+  if (r < 0) {
+    lderr(m_cct) << "error writing write log superblock: "
+		 << cpp_strerror(r) << dendl;
+    assert(0 == "unable to write the write log superblock");
+  }
+
+  ldout(m_cct, 20) << "head is now " << head << " seq " << head_seq << dendl;
+  m_sb_head = head;
+  m_sb_head_seq = head_seq;
+  m_log_bytes -= freed;
+  m_retired_bytes -= freed;
+  complete_waiters(m_flush_waiters, head_seq - 1, 0);
+  return true;
+}
+
+bool WriteLog::append(vector<Context*> &finished)
+{
+  assert(m_lock.is_locked());
+  uint64_t cap = m_size - BLOCK_SIZE;
+  bool writeback_waiting = m_writeback_next == m_entries.end();
+  list<Entry*>::iterator first = m_entries.end();
+  list<Entry*> batch;
+  while (!m_queued.empty()) {
+    Entry *e = m_queued.front();
+    uint64_t pad = 0;
+    if (m_tail + e->len > m_size)
+      pad = m_size - m_tail;
+    if (m_log_bytes + pad + e->len > cap)
+      break;  // until the head moves
+
+    m_queued.pop_front();
+    e->state = STATE_LOGGING;
+    e->pad = pad;
+    e->pos = pad ? BLOCK_SIZE : m_tail;
+    m_tail = e->pos + e->len;
+    if (m_tail == m_size)
+      m_tail = BLOCK_SIZE;
+    m_log_bytes += pad + e->len;
+    m_entries.push_back(e);
+    if (batch.empty())
+      first = --m_entries.end();
+    batch.push_back(e);
+  }
+  if (batch.empty())
+    return false;
+
+  m_lock.Unlock();
+  int r = 0;
+  for (list<Entry*>::iterator p = batch.begin(); p != batch.end(); ++p) {
+    Entry *e = *p;
+    if (e->pad)
+      r = write_pad(m_size - e->pad, e->seq, e->pad);
+    if (r == 0)
+      r = write_record(e);
+    if (r < 0)
+      break;
+  }
+  if (r == 0 && ::fdatasync(m_fd) < 0)
+    r = -errno;
+  m_lock.Lock();
+  if (r < 0) {
+    lderr(m_cct) << "error writing to write log: " << cpp_strerror(r)
+		 << dendl;
+    assert(0 == "unable to write to the write log");
+  }
+
+  ldout(m_cct, 20) << "logged " << batch.size() << " writes up to seq "
+		   << batch.back()->seq << dendl;
+  for (list<Entry*>::iterator p = batch.begin(); p != batch.end(); ++p) {
+    Entry *e = *p;
+    e->state = STATE_LOGGED;
+    e->meta.clear();
+    e->bl.clear();
+    if (e->onsafe)
+      finished.push_back(e->onsafe);
+    e->onsafe = NULL;
+  }
+  m_logged_seq = batch.back()->seq;
+  complete_waiters(m_sync_waiters, m_logged_seq, 0);
+  if (writeback_waiting)
+    m_writeback_next = first;
+  return true;
+}
+
+bool WriteLog::start_writeback()
+{
+  assert(m_lock.is_locked());
+  if (m_retry) {
+    if (m_in_flight)
+      return false;
+    // go over everything again, in order, so nothing older lands on
+    // top of something newer that made it
+    for (list<Entry*>::iterator p = m_entries.begin();
+	 p != m_entries.end(); ++p) {
+      if ((*p)->state == STATE_DONE)
+	(*p)->state = STATE_LOGGED;
+    }
+    m_writeback_next = m_entries.begin();
+    m_retry = false;
+  }
+  if (m_writeback_error)
+    return false;
+
+  list<Entry*> batch;
+  while (m_writeback_next != m_entries.end() &&
+	 m_in_flight < m_max_in_flight &&
+	 (*m_writeback_next)->state == STATE_LOGGED) {
+    Entry *e = *m_writeback_next;
+    e->state = STATE_WRITEBACK;
+    ++m_in_flight;
+    batch.push_back(e);
+    ++m_writeback_next;
+  }
+  if (batch.empty())
+    return false;
+
+  // these can't be retired until we are done, so their records stay
+  m_lock.Unlock();
+  vector<bufferlist> data(batch.size());
+  int r = 0;
+  unsigned i = 0;
+  for (list<Entry*>::iterator p = batch.begin(); p != batch.end(); ++p, ++i) {
+    Entry *e = *p;
+    bufferptr bp(e->length);
+    r = safe_pread_exact(m_fd, bp.c_str(), e->length, e->data_pos());
+    if (r < 0)
+      break;
+    data[i].push_back(bp);
+  }
+  m_lock.Lock();
+  if (r < 0) {
+    lderr(m_cct) << "error reading from write log: " << cpp_strerror(r)
+		 << dendl;
+    assert(0 == "unable to read from the write log");
+  }
+
+  utime_t now = ceph_clock_now(m_cct);
+  i = 0;
+  for (list<Entry*>::iterator p = batch.begin(); p != batch.end(); ++p, ++i) {
+    Entry *e = *p;
+    ldout(m_cct, 20) << "writing back " << e->oid << " " << e->off << "~"
+		     << e->length << " seq " << e->seq << dendl;
+    m_wb.write(e->oid, e->oloc, e->off, e->length, e->snapc, data[i], now,
+	       0, 0, new C_WritebackDone(this, e));
+  }
+  return true;
+}
+
+void WriteLog::fail_queued(int r, vector<Context*> &finished)
+{
+  assert(m_lock.is_locked());
+  lderr(m_cct) << "dropping " << m_queued.size() << " writes that can't be"
+	       << " logged: " << cpp_strerror(r) << dendl;
+  while (!m_queued.empty()) {
+    Entry *e = m_queued.back();
+    m_queued.pop_back();
+    list<Entry*> &ls = m_objects[e->oid];
+    assert(ls.back() == e);
+    ls.pop_back();
+    if (ls.empty())
+      m_objects.erase(e->oid);
+    if (e->onsafe)
+      m_finisher.queue(e->onsafe, r);
+    delete e;
+  }
+  m_next_seq = m_logged_seq + 1;
+  complete_waiters(m_sync_waiters, (uint64_t)-1, r);
+}
+
+void WriteLog::writeback_done(Entry *e, int r)
+{
+  assert(m_lock.is_locked());
+  assert(m_in_flight > 0);
+  --m_in_flight;
+  ldout(m_cct, 20) << "wrote back " << e->oid << " " << e->off << "~"
+		   << e->length << " seq " << e->seq << " r = " << r << dendl;
+  if (r < 0) {
+    lderr(m_cct) << "error writing back " << e->oid << " " << e->off << "~"
+		 << e->length << ": " << cpp_strerror(r) << dendl;
+    e->state = STATE_LOGGED;
+    if (!m_writeback_error) {
+      m_writeback_error = r;
+      complete_waiters(m_flush_waiters, (uint64_t)-1, r);
+      complete_waiters(m_retire_waiters, (uint64_t)-1, r);
+    }
+  } else {
+    e->state = STATE_DONE;
+    retire();
+  }
+  m_cond.SignalAll();
+}
+
+void WriteLog::retire()
+{
+  assert(m_lock.is_locked());
+  bool moved = false;
+  while (!m_entries.empty() && m_entries.front()->state == STATE_DONE) {
+    Entry *e = m_entries.front();
+    m_entries.pop_front();
+    list<Entry*> &ls = m_objects[e->oid];
+    assert(ls.front() == e);
+    ls.pop_front();
+    if (ls.empty())
+      m_objects.erase(e->oid);
+    m_retired_bytes += e->pad + e->len;
+    delete e;
+    moved = true;
+  }
+  if (!moved)
+    return;
+
+  if (!m_entries.empty()) {
+    Entry *e = m_entries.front();
+    m_head = e->pad ? m_size - e->pad : e->pos;
+    m_head_seq = e->seq;
+  } else {
+    m_head = m_tail;
+    m_head_seq = m_queued.empty() ? m_next_seq : m_queued.front()->seq;
+  }
+  complete_waiters(m_retire_waiters, m_head_seq - 1, 0);
+}
@@ -0,0 +1,227 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+#ifndef CEPH_OSDC_WRITELOG_H
+#define CEPH_OSDC_WRITELOG_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/Cond.h"
+#include "common/Finisher.h"
+#include "common/Mutex.h"
+#include "common/Thread.h"
+#include "common/snap_types.h"
+#include "include/Context.h"
+#include "include/buffer.h"
+#include "include/types.h"
+#include "osd/osd_types.h"
+
+class CephContext;
+class WritebackHandler;
+
+/**
+ * Persistent write-back log of object writes in a local file.
+ *
+ * Writes are appended to a ring of records in the file and are safe
+ * once the batch they went out in has been synced.  A background
+ * thread then reads them back and hands them to the WritebackHandler
+ * in the order they were logged, and moves the log's head past them
+ * once they (and everything before them) are committed.  The head is
+ * kept in a superblock at the start of the file, so after a crash
+ * open() finds every record that was acknowledged and writes them back
+ * again.  Records carry their position, the log's id and a sequence
+ * number, like FileJournal's entries, so a torn or stale record ends
+ * the replay.
+ *
+ * Unlike ObjectCacher, the lock is taken here; none of the methods may
+ * be called with it held.  The WritebackHandler must complete writes
+ * with the lock held.
+ */
+class WriteLog {
+public:
+  WriteLog(CephContext *cct, const std::string &path, uint64_t size,
+	   WritebackHandler &wb, Mutex &lock, unsigned max_in_flight);
+  ~WriteLog();
+
+  static const uint64_t REPLAY_NONE = 0;
+  static const uint64_t REPLAY_ANY = (uint64_t)-1;
+
+  /**
+   * Create the log file, or replay an existing one, and start writing
+   * back.  An existing log keeps the size it was created with.
+   *
+   * @param replay_id only replay the log if it has this id; otherwise
+   * its writes are dropped and it starts again empty, with a new id
+   * @returns 0 on success, -EBUSY if another process has it open,
+   * -EINVAL if it is not a valid log, or another negative error code
+   */
+  int open(uint64_t replay_id = REPLAY_ANY);
+  /**
+   * Log whatever has been queued and stop.  Writes that have not been
+   * written back yet stay in the file for the next open().
+   */
+  void close();
+
+  /// never REPLAY_NONE or REPLAY_ANY; valid once open
+  uint64_t get_log_id() const { return m_log_id; }
+  /// whether everything written so far has been written back
+  bool empty();
+
+  /**
+   * onsafe is completed once the write is durable in the log.  A write
+   * (with its header) may take up at most half of the log.
+   */
+  void write(const object_t &oid, const object_locator_t &oloc,
+	     uint64_t off, const bufferlist &bl, const SnapContext &snapc,
+	     Context *onsafe);
+  /// parts of an object extent, by object offset, oldest first
+  typedef std::vector<std::pair<uint64_t, bufferlist> > extents_t;
+
+  /**
+   * Read data that is still in the log.
+   *
+   * If the whole extent is in the log, it is put in pbl.  Otherwise the
+   * parts of it that are, if any, go in plogged: the extent has to be
+   * read from the backend then, and those laid over it with overlay(),
+   * since they may not have been written back yet.
+   *
+   * @returns the number of bytes put in pbl, 0 if the backend has to
+   * be read, or a negative error code
+   */
+  int read(const object_t &oid, uint64_t off, uint64_t len,
+	   bufferlist *pbl, extents_t *plogged);
+  /// copy what read() put in logged over the data of [off, off+len)
+  static void overlay(const extents_t &logged, uint64_t off, uint64_t len,
+		      char *dest);
+  /**
+   * onfinish is completed once no write queued so far that overlaps
+   * the extent is left in the log, or with the error if writing one
+   * back failed.  Lets something else change the backend there without
+   * older logged data being written back on top of it.
+   */
+  void wait_for_writeback(const object_t &oid, uint64_t off, uint64_t len,
+			  Context *onfinish);
+  /// onsafe is completed once every write queued so far is in the log
+  void sync(Context *onsafe);
+  /**
+   * onfinish is completed once every write queued so far has been
+   * written back and is out of the log.  If writing back failed, it
+   * gets the error, and the writes are retried on the next flush.
+   */
+  void flush(Context *onfinish);
+
+private:
+  enum {
+    STATE_QUEUED,     ///< waiting to be logged
+    STATE_LOGGING,    ///< being written to the log
+    STATE_LOGGED,     ///< safe, waiting to be written back
+    STATE_WRITEBACK,  ///< being written back
+    STATE_DONE,       ///< written back, waiting for those before it
+  };
+
+  struct Entry {
+    int state;
+    uint64_t seq;
+    uint64_t pos;       ///< start of the record
+    uint64_t len;       ///< of the record, whole blocks
+    uint64_t pad;       ///< bytes skipped at the end of the file before it
+    object_t oid;
+    object_locator_t oloc;
+    uint64_t off;
+    uint64_t length;    ///< of the data
+    SnapContext snapc;
+    uint64_t meta_len;
+    bufferlist meta;    ///< encoded oid, oloc, offset and snapc
+    bufferlist bl;      ///< the data, unless it is only in the file
+    Context *onsafe;
+
+    Entry() : state(STATE_QUEUED), seq(0), pos(0), len(0), pad(0),
+	      off(0), length(0), meta_len(0), onsafe(NULL) {}
+    /// where the record's data starts in the file
+    uint64_t data_pos() const;
+  };
+
+  class C_WritebackDone : public Context {
+    WriteLog *log;
+    Entry *entry;
+  public:
+    C_WritebackDone(WriteLog *l, Entry *e) : log(l), entry(e) {}
+    void finish(int r) {
+      log->writeback_done(entry, r);
+    }
+  };
+
+  class WriterThread : public Thread {
+    WriteLog *log;
+  public:
+    WriterThread(WriteLog *l) : log(l) {}
+    void *entry() {
+      log->writer_entry();
+      return 0;
+    }
+  };
+
+  int create();
+  int read_super();
+  int write_super(uint64_t head, uint64_t head_seq);
+  int replay();
+  int read_record(uint64_t pos, uint64_t seq, Entry *e, bool *pad);
+  uint64_t record_len(const Entry *e) const;
+  int write_record(Entry *e);
+  int write_pad(uint64_t pos, uint64_t seq, uint64_t len);
+
+  void writer_entry();
+  bool persist_head(std::vector<Context*> &finished);
+  bool append(std::vector<Context*> &finished);
+  bool start_writeback();
+  void fail_queued(int r, std::vector<Context*> &finished);
+  bool covered(const std::list<Entry*> &entries, uint64_t off,
+	       uint64_t len) const;
+  int copy_from_log(const std::list<Entry*> &entries, uint64_t off,
+		    uint64_t len, extents_t *plogged);
+  void writeback_done(Entry *e, int r);
+  void retire();
+  void complete_waiters(std::map<uint64_t, std::list<Context*> > &waiters,
+			uint64_t upto, int r);
+
+  CephContext *m_cct;
+  std::string m_path;
+  uint64_t m_size;
+  WritebackHandler &m_wb;
+  Mutex &m_lock;
+  unsigned m_max_in_flight;
+
+  int m_fd;
+  uint64_t m_log_id;
+  WriterThread m_writer;
+  Finisher m_finisher;
+  Cond m_cond;
+  bool m_stopping;
+
+  uint64_t m_next_seq;
+  uint64_t m_logged_seq;     ///< everything up to here is safe
+  uint64_t m_tail;           ///< where the next record goes
+  uint64_t m_log_bytes;      ///< from the persisted head to m_tail
+  uint64_t m_head, m_head_seq;  ///< oldest record still needed
+  uint64_t m_sb_head, m_sb_head_seq;  ///< the head in the superblock
+  uint64_t m_retired_bytes;  ///< between m_sb_head and m_head
+
+  std::list<Entry*> m_queued;
+  std::list<Entry*> m_entries;  ///< in the log, oldest first
+  std::list<Entry*>::iterator m_writeback_next;
+  unsigned m_in_flight;
+  int m_writeback_error;
+  bool m_retry;
+  std::map<object_t, std::list<Entry*> > m_objects;
+
+  std::map<uint64_t, std::list<Context*> > m_sync_waiters;
+  std::map<uint64_t, std::list<Context*> > m_flush_waiters;
+  std::map<uint64_t, std::list<Context*> > m_retire_waiters;
+
+  friend class C_WritebackDone;
+  friend class WriterThread;
+};
+
+#endif
@@ -85,6 +85,7 @@ void usage(ostream& out)
 "\n"
 "   listsnaps <obj-name>             list the snapshots of this object\n"
 "   bench <seconds> write|seq|rand [-t concurrent_operations] [--no-cleanup]\n"
+"                                  [--batch N]\n"
 "                                    default is 16 concurrent IOs and 4 MB ops\n"
 "                                    default is to clean up after write benchmark\n"
 "   cleanup <prefix>                 clean up a previous benchmark operation\n"
@@ -154,6 +155,8 @@ void usage(ostream& out)
 "        Set number of concurrent I/O operations\n"
 "   --show-time\n"
 "        prefix output with date/time\n"
+"   --batch=N\n"
+"        write N objects per concurrent operation, in one batched call\n"
 "\n"
 "LOAD GEN OPTIONS:\n"
 "   --num-objects                    total number of objects\n"
@@ -800,6 +803,20 @@ protected:
     return io_ctx.aio_write(oid, completions[slot], bl, len, 0);
   }
 
+  int aio_write_batch(const std::vector<std::string>& oids, int slot,
+		      std::vector<bufferlist>& bls, size_t len) {
+    std::vector<std::pair<std::string, librados::ObjectWriteOperation*> > batch;
+    for (size_t i = 0; i < oids.size(); ++i) {
+      librados::ObjectWriteOperation *op = new librados::ObjectWriteOperation;
+      op->write(0, bls[i]);
+      batch.push_back(make_pair(oids[i], op));
+    }
+    int r = io_ctx.aio_operate_batch(completions[slot], batch);
+    for (size_t i = 0; i < batch.size(); ++i)
+      delete batch[i].second;
+    return r;
+  }
+
   int aio_remove(const std::string& oid, int slot) {
     return io_ctx.aio_remove(oid, completions[slot]);
   }
@@ -1023,6 +1040,7 @@ static int rados_tool_common(const std::map < std::string, std::string > &opts,
   const char *target_pool_name = NULL;
   string oloc, target_oloc;
   int concurrent_ios = 16;
+  int batch = 1;
   int op_size = 1 << 22;
   bool cleanup = true;
   const char *snapname = NULL;
@@ -1074,6 +1092,10 @@ static int rados_tool_common(const std::map < std::string, std::string > &opts,
   if (i != opts.end()) {
     concurrent_ios = strtol(i->second.c_str(), NULL, 10);
   }
+  i = opts.find("batch");
+  if (i != opts.end()) {
+    batch = strtol(i->second.c_str(), NULL, 10);
+  }
   i = opts.find("block-size");
   if (i != opts.end()) {
     op_size = strtol(i->second.c_str(), NULL, 10);
@@ -1901,6 +1923,7 @@ static int rados_tool_common(const std::map < std::string, std::string > &opts,
       usage_exit();
     RadosBencher bencher(rados, io_ctx);
     bencher.set_show_time(show_time);
+    bencher.set_batch(batch);
     ret = bencher.aio_bench(operation, seconds, concurrent_ios, op_size, cleanup);
     if (ret != 0)
       cerr << "error during benchmark: " << ret << std::endl;
@@ -2197,6 +2220,8 @@ int main(int argc, const char **argv)
       opts["category"] = val;
     } else if (ceph_argparse_witharg(args, i, &val, "-t", "--concurrent-ios", (char*)NULL)) {
       opts["concurrent-ios"] = val;
+    } else if (ceph_argparse_witharg(args, i, &val, "--batch", (char*)NULL)) {
+      opts["batch"] = val;
     } else if (ceph_argparse_witharg(args, i, &val, "--block-size", (char*)NULL)) {
       opts["block-size"] = val;
     } else if (ceph_argparse_witharg(args, i, &val, "-b", (char*)NULL)) {
@@ -23,6 +23,8 @@
 #include "global/global_init.h"
 #include "common/safe_io.h"
 #include "common/secret.h"
+#include "common/Thread.h"
+#include "common/Throttle.h"
 #include "include/stringify.h"
 #include "include/rados/librados.hpp"
 #include "include/rbd/librbd.hpp"
@@ -34,6 +36,7 @@
 #include "common/blkdev.h"
 
 #include <boost/scoped_ptr.hpp>
+#include <deque>
 #include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -166,6 +169,8 @@ static string feature_str(uint64_t feature)
     return "layering";
   case RBD_FEATURE_STRIPINGV2:
     return "striping";
+  case RBD_FEATURE_OBJECT_MAP:
+    return "object map";
   default:
     return "";
   }
@@ -175,7 +180,7 @@ static string features_str(uint64_t features)
 {
   string s = "";
 
-  for (uint64_t feature = 1; feature <= RBD_FEATURE_STRIPINGV2;
+  for (uint64_t feature = 1; feature <= RBD_FEATURE_OBJECT_MAP;
        feature <<= 1) {
     if (feature & features) {
       if (s.size())
@@ -189,7 +194,7 @@ static string features_str(uint64_t features)
 static void format_features(Formatter *f, uint64_t features)
 {
   f->open_array_section("features");
-  for (uint64_t feature = 1; feature <= RBD_FEATURE_STRIPINGV2;
+  for (uint64_t feature = 1; feature <= RBD_FEATURE_OBJECT_MAP;
        feature <<= 1) {
     f->dump_string("feature", feature_str(feature));
   }
@@ -948,17 +953,97 @@ static int do_bench_write(librbd::Image& image, uint64_t io_size,
   return 0;
 }
 
+// runs of zeros shorter than this are copied like any other data
+static const size_t SPARSE_CHUNK = 4096;
+
+/*
+ * Find the next run of buf~len that isn't zero, looking at it in
+ * SPARSE_CHUNK pieces from *pos on.  *pos is moved to the start of the
+ * run, and *run_len is 0 if there is no more data.
+ */
+static void find_data_run(const char *buf, size_t len, size_t *pos,
+			  size_t *run_len)
+{
+  size_t p = *pos;
+  while (p < len && buf_is_zero(buf + p, MIN(SPARSE_CHUNK, len - p)))
+    p += MIN(SPARSE_CHUNK, len - p);
+  *pos = p;
+  while (p < len && !buf_is_zero(buf + p, MIN(SPARSE_CHUNK, len - p)))
+    p += MIN(SPARSE_CHUNK, len - p);
+  *run_len = p - *pos;
+}
+
+static void rbd_throttle_completion(void *vc, void *arg)
+{
+  librbd::RBD::AioCompletion *c = (librbd::RBD::AioCompletion *)vc;
+  SimpleThrottle *throttle = static_cast<SimpleThrottle *>(arg);
+  int r = c->get_return_value();
+  c->release();
+  throttle->end_op(r);
+}
+
+/// write bl at off once there is room under the throttle
+static int throttled_aio_write(librbd::Image &image, SimpleThrottle &throttle,
+			       uint64_t off, bufferlist &bl)
+{
+  throttle.start_op();
+  librbd::RBD::AioCompletion *c =
+    new librbd::RBD::AioCompletion((void *)&throttle, rbd_throttle_completion);
+  int r = image.aio_write(off, bl.length(), bl, c);
+  if (r < 0) {
+    c->release();
+    throttle.end_op(r);
+  }
+  return r;
+}
+
+/// discard off~len once there is room under the throttle
+static int throttled_aio_discard(librbd::Image &image,
+				 SimpleThrottle &throttle,
+				 uint64_t off, uint64_t len)
+{
+  throttle.start_op();
+  librbd::RBD::AioCompletion *c =
+    new librbd::RBD::AioCompletion((void *)&throttle, rbd_throttle_completion);
+  int r = image.aio_discard(off, len, c);
+  if (r < 0) {
+    c->release();
+    throttle.end_op(r);
+  }
+  return r;
+}
+
+/// an extent of an export-diff, possibly still being read
+struct DiffExtent {
+  uint64_t off;
+  uint64_t len;
+  bool exists;
+  bufferlist bl;
+  librbd::RBD::AioCompletion *c;  ///< the read, if it exists
+
+  DiffExtent(uint64_t o, uint64_t l, bool e)
+    : off(o), len(l), exists(e), c(NULL) {}
+};
+
 struct ExportContext {
   librbd::Image *image;
   int fd;
   uint64_t totalsize;
   MyProgressContext pc;
 
+  // export-diff reads up to max_extents ahead, and writes them in order
+  std::deque<DiffExtent*> extents;
+  unsigned max_extents;
+  /// first error reading or writing an extent; nothing is written after it
+  int error;
+
   ExportContext(librbd::Image *i, int f, uint64_t t) :
     image(i),
     fd(f),
     totalsize(t),
-    pc("Exporting image")
+    pc("Exporting image"),
+    max_extents(MAX(1, g_conf->rbd_concurrent_management_ops)),
+    error(0)
   {}
 };
 
@@ -997,16 +1082,25 @@ static int export_read_cb(uint64_t ofs, size_t len, const char *buf, void *arg)
       ret = write(fd, buf, len);
     }
   } else {		// not stdout
-    if (!buf || buf_is_zero(buf, len)) {
+    if (!buf) {
       /* a hole */
       return 0;
     }
 
-    ret = lseek64(fd, ofs, SEEK_SET);
-    if (ret < 0)
-      return -errno;
-    ret = write(fd, buf, len);
+    // only write what isn't zero, so holes stay holes
+    size_t pos = 0;
+    size_t run;
+    while (true) {
+      find_data_run(buf, len, &pos, &run);
+      if (!run)
+	break;
+      int r = safe_pwrite(fd, buf + pos, run, ofs + pos);
+      if (r < 0)
+	return r;
+      pos += run;
+    }
     ec->pc.update_progress(ofs, ec->totalsize);
+    return 0;
   }
 
   if (ret < 0)
@@ -1051,35 +1145,95 @@ static int do_export(librbd::Image& image, const char *path)
   return r;
 }
 
+static void encode_diff_extent(__u8 tag, uint64_t off, uint64_t len,
+			       bufferlist &bl)
+{
+  ::encode(tag, bl);
+  ::encode(off, bl);
+  ::encode(len, bl);
+}
+
+/*
+ * Wait for the oldest extent to be read, and write it out unless an
+ * earlier extent failed.  Runs of zeros in the data go out as zero
+ * extents, so they take no room in the stream.  Returns ec->error,
+ * so a stream with an extent missing is never finished.
+ */
+static int finish_diff_extent(ExportContext *ec)
+{
+  DiffExtent *e = ec->extents.front();
+  ec->extents.pop_front();
+
+  int r = 0;
+  if (e->c) {
+    e->c->wait_for_complete();
+    r = e->c->get_return_value();
+    e->c->release();
+    if (r >= 0 && e->bl.length() != e->len)
+      r = -EIO;
+  }
+  if (r < 0 && !ec->error)
+    ec->error = r;
+  if (ec->error) {
+    delete e;
+    return ec->error;
+  }
+
+  bufferlist out;
+  if (!e->exists) {
+    encode_diff_extent('z', e->off, e->len, out);
+  } else {
+    const char *buf = e->bl.c_str();
+    size_t pos = 0;
+    while (pos < e->len) {
+      size_t start = pos;
+      size_t run;
+      find_data_run(buf, e->len, &pos, &run);
+      if (pos > start)
+	encode_diff_extent('z', e->off + start, pos - start, out);
+      if (run) {
+	encode_diff_extent('w', e->off + pos, run, out);
+	bufferlist data;
+	data.substr_of(e->bl, pos, run);
+	out.claim_append(data);
+	pos += run;
+      }
+    }
+  }
+  r = out.write_fd(ec->fd);
+  if (r >= 0)
+    ec->pc.update_progress(e->off, ec->totalsize);
+  else
+    ec->error = r;
+  delete e;
+  return r;
+}
+
 static int export_diff_cb(uint64_t ofs, size_t _len, int exists, void *arg)
 {
   ExportContext *ec = static_cast<ExportContext *>(arg);
   int r;
 
-  // extent
-  bufferlist bl;
-  __u8 tag = exists ? 'w' : 'z';
-  ::encode(tag, bl);
-  ::encode(ofs, bl);
-  uint64_t len = _len;
-  ::encode(len, bl);
-  r = bl.write_fd(ec->fd);
-  if (r < 0)
-    return r;
-
+  if (ec->error)
+    return ec->error;
+  DiffExtent *e = new DiffExtent(ofs, _len, exists);
   if (exists) {
-    // read block
-    bl.clear();
-    r = ec->image->read(ofs, len, bl);
-    if (r < 0)
+    e->c = new librbd::RBD::AioCompletion(NULL, NULL);
+    r = ec->image->aio_read(ofs, _len, e->bl, e->c);
+    if (r < 0) {
+      e->c->release();
+      delete e;
+      ec->error = r;
       return r;
-    r = bl.write_fd(ec->fd);
+    }
+  }
+  ec->extents.push_back(e);
+
+  while (ec->extents.size() > ec->max_extents) {
+    r = finish_diff_extent(ec);
     if (r < 0)
       return r;
   }
-
-  ec->pc.update_progress(ofs, ec->totalsize);
-
   return 0;
 }
 
@@ -1134,6 +1288,12 @@ static int do_export_diff(librbd::Image& image, const char *fromsnapname,
 
   ExportContext ec(&image, fd, info.size);
   r = image.diff_iterate(fromsnapname, 0, info.size, export_diff_cb, (void *)&ec);
+  if (r < 0 && !ec.error)
+    ec.error = r;
+  // write out what is still being read; after an error, just wait for it
+  while (!ec.extents.empty())
+    finish_diff_extent(&ec);
+  r = ec.error;
   if (r < 0)
     goto out;
 
@@ -1141,9 +1301,7 @@ static int do_export_diff(librbd::Image& image, const char *fromsnapname,
     __u8 tag = 'e';
     bufferlist bl;
     ::encode(tag, bl);
-    bl.write_fd(fd);
-    if (r < 0)
-      return r;
+    r = bl.write_fd(fd);
   }
 
  out:
@@ -1268,6 +1426,109 @@ done_img:
   update_snap_name(*new_img, snap);
 }
 
+/*
+ * Reads the input of an import in its own thread, up to max_blocks
+ * ahead of the writes to the image.  Every block is full but the last.
+ */
+class ImportReader : public Thread {
+public:
+  ImportReader(int fd, size_t block_size, unsigned max_blocks)
+    : m_fd(fd), m_block_size(block_size), m_max_blocks(max_blocks),
+      m_lock("ImportReader::m_lock"),
+      m_ret(0), m_eof(false), m_stop(false) {}
+
+  /**
+   * Get the next block of input.
+   *
+   * @returns 1 if there was one, 0 at the end of the input, or a
+   * negative error code
+   */
+  int next(bufferptr *bp) {
+    Mutex::Locker l(m_lock);
+    while (m_blocks.empty() && !m_eof && !m_ret)
+      m_cond.Wait(m_lock);
+    if (m_blocks.empty())
+      return m_ret;
+    *bp = m_blocks.front();
+    m_blocks.pop_front();
+    m_cond.SignalAll();
+    return 1;
+  }
+
+  /// stop reading (after the read in progress, if any) and join
+  void stop() {
+    m_lock.Lock();
+    m_stop = true;
+    m_cond.SignalAll();
+    m_lock.Unlock();
+    join();
+  }
+
+  void *entry() {
+    while (true) {
+      m_lock.Lock();
+      while (m_blocks.size() >= m_max_blocks && !m_stop)
+	m_cond.Wait(m_lock);
+      bool stop = m_stop;
+      m_lock.Unlock();
+      if (stop)
+	break;
+
+      bufferptr bp(m_block_size);
+      ssize_t r = safe_read(m_fd, bp.c_str(), m_block_size);
+
+      Mutex::Locker l(m_lock);
+      if (r < 0) {
+	m_ret = r;
+      } else {
+	if (r > 0) {
+	  bp.set_length(r);
+	  m_blocks.push_back(bp);
+	}
+	if ((size_t)r < m_block_size)
+	  m_eof = true;
+      }
+      m_cond.SignalAll();
+      if (m_ret || m_eof)
+	break;
+    }
+    return NULL;
+  }
+
+private:
+  int m_fd;
+  size_t m_block_size;
+  unsigned m_max_blocks;
+  Mutex m_lock;
+  Cond m_cond;
+  std::deque<bufferptr> m_blocks;
+  int m_ret;
+  bool m_eof;
+  bool m_stop;
+};
+
+/*
+ * Write the parts of bp that aren't zero at off, so holes in the input
+ * stay holes in the image.  The writes share bp's memory.
+ */
+static int write_sparse(librbd::Image &image, SimpleThrottle &throttle,
+			uint64_t off, const bufferptr &bp)
+{
+  size_t pos = 0;
+  size_t run;
+  while (true) {
+    find_data_run(bp.c_str(), bp.length(), &pos, &run);
+    if (!run)
+      return 0;
+    bufferlist bl;
+    bl.push_back(bufferptr(bp, pos, run));
+    int r = throttled_aio_write(image, throttle, off + pos, bl);
+    if (r < 0)
+      return r;
+    pos += run;
+  }
+}
+
 static int do_import(librbd::RBD &rbd, librados::IoCtx& io_ctx,
 		     const char *imgname, int *order, const char *path,
 		     int format, uint64_t features, uint64_t size)
@@ -1282,13 +1543,9 @@ static int do_import(librbd::RBD &rbd, librados::IoCtx& io_ctx,
   if (*order == 0)
     *order = 22;
 
-  // try to fill whole imgblklen blocks for sparsification
+  // read whole imgblklen blocks; only their non-zero parts are written
   uint64_t image_pos = 0;
   size_t imgblklen = 1 << *order;
-  char *p = new char[imgblklen];
-  size_t reqlen = imgblklen;	// amount requested from read
-  ssize_t readlen;		// amount received from one read
-  size_t blklen = 0;		// amount accumulated from reads to fill blk
   librbd::Image image;
 
   bool from_stdin = !strcmp(path, "-");
@@ -1335,46 +1592,53 @@ static int do_import(librbd::RBD &rbd, librados::IoCtx& io_ctx,
     goto done;
   }
 
-  // loop body handles 0 return, as we may have a block to flush
-  while ((readlen = ::read(fd, p + blklen, reqlen)) >= 0) {
-    blklen += readlen;
-    // if read was short, try again to fill the block before writing
-    if (readlen && ((size_t)readlen < reqlen)) {
-      reqlen -= readlen;
-      continue;
-    }
-    if (!from_stdin)
-      pc.update_progress(image_pos, size);
-
-    bufferlist bl(blklen);
-    bl.append(p, blklen);
-    // resize output image by binary expansion as we go for stdin
-    if (from_stdin && (image_pos + (size_t)blklen) > size) {
-      size *= 2;
-      r = image.resize(size);
-      if (r < 0) {
-	cerr << "rbd: can't resize image during import" << std::endl;
-	goto done;
+  {
+    // a reader thread keeps the input coming while up to
+    // rbd_concurrent_management_ops writes are in flight
+    int depth = MAX(1, g_conf->rbd_concurrent_management_ops);
+    SimpleThrottle throttle(depth, false);
+    ImportReader reader(fd, imgblklen, depth);
+    reader.create();
+
+    bufferptr bp;
+    while (true) {
+      r = reader.next(&bp);
+      if (r < 0)
+	cerr << "rbd: error reading " << path << ": " << cpp_strerror(r)
+	     << std::endl;
+      if (r <= 0)
+	break;
+      if (!from_stdin)
+	pc.update_progress(image_pos, size);
+
+      // resize output image by binary expansion as we go for stdin
+      if (from_stdin && (image_pos + bp.length()) > size) {
+	size *= 2;
+	r = image.resize(size);
+	if (r < 0) {
+	  cerr << "rbd: can't resize image during import" << std::endl;
+	  break;
+	}
       }
-    }
 
-    // write as much as we got; perhaps less than imgblklen
-    // but skip writing zeros to create sparse images
-    if (!bl.is_zero()) {
-      r = image.write(image_pos, blklen, bl);
+      r = write_sparse(image, throttle, image_pos, bp);
       if (r < 0) {
 	cerr << "rbd: error writing to image position " << image_pos
 	     << std::endl;
-	goto done;
+	break;
       }
+      image_pos += bp.length();
     }
-    // done with whole block, whether written or not
-    image_pos += blklen;
-    // if read had returned 0, we're at EOF and should quit
-    if (readlen == 0)
-      break;
-    blklen = 0;
-    reqlen = imgblklen;
+    reader.stop();
+
+    int r2 = throttle.wait_for_ret();
+    if (r == 0 && r2 < 0) {
+      cerr << "rbd: error writing to image: " << cpp_strerror(r2)
+	   << std::endl;
+      r = r2;
+    }
+    if (r < 0)
+      goto done;
   }
   if (from_stdin) {
     r = image.resize(image_pos);
@@ -1430,6 +1694,9 @@ static int do_import_diff(librbd::Image &image, const char *path)
   uint64_t size = 0;
   uint64_t off = 0;
   string from, to;
+  // extents in a diff don't overlap, so they can be applied in any order
+  SimpleThrottle throttle(MAX(1, g_conf->rbd_concurrent_management_ops),
+			  false);
 
   bool from_stdin = !strcmp(path, "-");
   if (from_stdin) {
@@ -1504,6 +1771,9 @@ static int do_import_diff(librbd::Image &image, const char *path)
       ::decode(end_size, p);
       uint64_t cur_size;
       image.size(&cur_size);
+      r = throttle.wait_for_ret();
+      if (r < 0)
+	goto done;
       if (cur_size != end_size) {
 	dout(2) << "resize " << cur_size << " -> " << end_size << dendl;
 	image.resize(end_size);
@@ -1532,11 +1802,13 @@ static int do_import_diff(librbd::Image &image, const char *path)
 	bufferlist data;
 	data.append(bp);
 	dout(2) << " write " << off << "~" << len << dendl;
-	image.write(off, len, data);
+	r = throttled_aio_write(image, throttle, off, data);
       } else {
 	dout(2) << " zero " << off << "~" << len << dendl;
-	image.discard(off, len);
+	r = throttled_aio_discard(image, throttle, off, len);
       }
+      if (r < 0)
+	goto done;
     } else {
       cerr << "unrecognized tag byte " << (int)tag << " in stream; aborting" << std::endl;
       r = -EINVAL;
@@ -1553,6 +1825,12 @@ static int do_import_diff(librbd::Image &image, const char *path)
     }
   }
 
+  r = throttle.wait_for_ret();
+  if (r < 0) {
+    cerr << "rbd: error writing to image: " << cpp_strerror(r) << std::endl;
+    goto done;
+  }
+
   // take final snap
   if (to.length()) {
     dout(2) << " create end snap " << to << dendl;
@@ -1560,6 +1838,12 @@ static int do_import_diff(librbd::Image &image, const char *path)
   }
 
  done:
+  {
+    // nothing may still be writing when we return
+    int r2 = throttle.wait_for_ret();
+    if (r == 0)
+      r = r2;
+  }
   if (r < 0)
     pc.fail();
   else
@@ -1,5 +1,6 @@
 // -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
 #include <tr1/memory>
+#include <algorithm>
 #include <map>
 #include <set>
 #include <boost/scoped_ptr.hpp>
@@ -13,6 +14,9 @@
 #include <sys/types.h>
 #include "global/global_init.h"
 #include "common/ceph_argparse.h"
+#include "common/perf_counters.h"
+#include "common/Clock.h"
+#include "include/stringify.h"
 #include <dirent.h>
 
 #include "gtest/gtest.h"
@@ -747,3 +751,130 @@ TEST_F(ObjectMapTest, RandomTest) {
     }
   }
 }
+
+TEST_F(ObjectMapTest, HeaderCache) {
+  PerfCounters *logger = static_cast<DBObjectMap*>(db.get())->logger;
+  hobject_t hoid(sobject_t("foo", CEPH_NOSNAP));
+  hobject_t hoid2(sobject_t("foo2", CEPH_NOSNAP));
+  string result;
+
+  tester.set_key(hoid, "foo", "bar");
+  uint64_t hits = logger->get(l_dbom_map_header_hit);
+  for (unsigned i = 0; i < 10; ++i) {
+    ASSERT_EQ(1, tester.get_key(hoid, "foo", &result));
+    ASSERT_EQ("bar", result);
+  }
+  ASSERT_LE(hits + 9, logger->get(l_dbom_map_header_hit));
+
+  // clone replaces the map header of both objects
+  db->clone(hoid, hoid2);
+  tester.set_key(hoid, "foo", "baz");
+  ASSERT_EQ(1, tester.get_key(hoid, "foo", &result));
+  ASSERT_EQ("baz", result);
+  ASSERT_EQ(1, tester.get_key(hoid2, "foo", &result));
+  ASSERT_EQ("bar", result);
+
+  // parent headers are cached too
+  hits = logger->get(l_dbom_parent_hit);
+  for (unsigned i = 0; i < 10; ++i) {
+    ASSERT_EQ(1, tester.get_key(hoid2, "foo", &result));
+    ASSERT_EQ("bar", result);
+  }
+  ASSERT_LE(hits + 9, logger->get(l_dbom_parent_hit));
+
+  // clear drops the cached header
+  db->clear(hoid);
+  ASSERT_EQ(0, tester.get_key(hoid, "foo", &result));
+  set<string> keys;
+  ASSERT_EQ(-ENOENT, db->get_keys(hoid, &keys));
+  ASSERT_EQ(0, db->get_keys(hoid2, &keys));
+  ASSERT_EQ(1u, keys.size());
+
+  db->clear(hoid2);
+}
+
+TEST_F(ObjectMapTest, Batch) {
+  hobject_t hoid(sobject_t("foo", CEPH_NOSNAP));
+  hobject_t hoid2(sobject_t("foo2", CEPH_NOSNAP));
+  string result;
+
+  db->start_batch();
+  // the second write must find the header created earlier in the batch
+  tester.set_key(hoid, "foo", "bar");
+  // which is in the db at once, for other threads to find
+  vector<hobject_t> objs;
+  ASSERT_EQ(0, static_cast<DBObjectMap*>(db.get())->list_objects(&objs));
+  ASSERT_EQ(1, std::count(objs.begin(), objs.end(), hoid));
+  tester.set_key(hoid, "foo2", "bar2");
+  tester.remove_key(hoid, "foo2");
+  map<string, bufferlist> attrs;
+  attrs["attr"].append("val");
+  ASSERT_EQ(0, db->set_xattrs(hoid, attrs));
+  // reads see the batch so far
+  ASSERT_EQ(1, tester.get_key(hoid, "foo", &result));
+  ASSERT_EQ("bar", result);
+  ASSERT_EQ(0, tester.get_key(hoid, "foo2", &result));
+  tester.set_key(hoid2, "foo", "baz");
+  ASSERT_EQ(0, db->end_batch());
+
+  ASSERT_EQ(1, tester.get_key(hoid, "foo", &result));
+  ASSERT_EQ("bar", result);
+  ASSERT_EQ(1, tester.get_key(hoid2, "foo", &result));
+  ASSERT_EQ("baz", result);
+  set<string> to_get;
+  to_get.insert("attr");
+  map<string, bufferlist> got;
+  ASSERT_EQ(0, db->get_xattrs(hoid, to_get, &got));
+  ASSERT_EQ(1u, got.size());
+  ASSERT_EQ("val", string(got["attr"].c_str(), got["attr"].length()));
+
+  db->clear(hoid);
+  db->clear(hoid2);
+}
+
+static double time_get_values(ObjectMap *omap, unsigned objects,
+			      unsigned reads)
+{
+  set<string> to_get;
+  to_get.insert("key");
+  utime_t start = ceph_clock_now(g_ceph_context);
+  for (unsigned i = 0; i < reads; ++i) {
+    map<string, bufferlist> got;
+    omap->get_values(hobject_t(sobject_t("obj" + num_str(i % objects),
+					 CEPH_NOSNAP)),
+		     to_get, &got);
+    assert(got.size() == 1);
+  }
+  return (double)(ceph_clock_now(g_ceph_context) - start);
+}
+
+TEST_F(ObjectMapTest, HeaderCacheBenchmark) {
+  const unsigned objects = 100;
+  const unsigned reads = 100000;
+  double elapsed[2];
+  const char *sizes[2] = { "0", "1024" };
+  string saved = stringify(g_conf->filestore_omap_header_cache_size);
+
+  for (unsigned run = 0; run < 2; ++run) {
+    g_ceph_context->_conf->set_val_or_die("filestore_omap_header_cache_size",
+					  sizes[run]);
+    g_ceph_context->_conf->apply_changes(NULL);
+    DBObjectMap omap(new KeyValueDBMemory());
+    for (unsigned i = 0; i < objects; ++i) {
+      map<string, bufferlist> to_set;
+      to_set["key"].append("value");
+      omap.set_keys(hobject_t(sobject_t("obj" + num_str(i), CEPH_NOSNAP)),
+		    to_set);
+    }
+    elapsed[run] = time_get_values(&omap, objects, reads);
+    std::cout << "cache size " << sizes[run] << ": " << reads << " reads in "
+	      << elapsed[run] << "s (" << (double)reads / elapsed[run]
+	      << " reads/s), header cache hits "
+	      << omap.logger->get(l_dbom_map_header_hit)
+	      << " misses " << omap.logger->get(l_dbom_map_header_miss)
+	      << std::endl;
+  }
+  g_ceph_context->_conf->set_val_or_die("filestore_omap_header_cache_size",
+					saved.c_str());
+  g_ceph_context->_conf->apply_changes(NULL);
+}
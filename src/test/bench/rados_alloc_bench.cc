@@ -0,0 +1,185 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Count heap allocations per rados_aio_write.
+ *
+ * Replaces the global operator new/delete with counting versions (which
+ * librados picks up as well) and reports how many allocations, and how
+ * many bytes, the whole process makes per op once warmed up, messenger
+ * threads included.  Plain malloc is not counted.
+ *
+ * ceph_rados_alloc_bench --pool P [--ops N] [--depth N] [--size N]
+ *                        [--objects N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <string>
+#include <deque>
+#include <vector>
+
+#include "include/rados/librados.h"
+#include "common/Clock.h"
+
+using namespace std;
+
+static uint64_t num_allocs = 0, alloc_bytes = 0;
+
+static void *counted_alloc(size_t n)
+{
+  __sync_fetch_and_add(&num_allocs, 1);
+  __sync_fetch_and_add(&alloc_bytes, n);
+  void *p = malloc(n ? n : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void *operator new(size_t n) throw (std::bad_alloc)
+{
+  return counted_alloc(n);
+}
+
+void *operator new[](size_t n) throw (std::bad_alloc)
+{
+  return counted_alloc(n);
+}
+
+void operator delete(void *p) throw ()
+{
+  free(p);
+}
+
+void operator delete[](void *p) throw ()
+{
+  free(p);
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: ceph_rados_alloc_bench --pool P [--ops N] [--depth N]"
+	  " [--size N] [--objects N]\n");
+}
+
+static int run(rados_ioctx_t io, int ops, int depth, int num_objects,
+	       const char *buf, int size)
+{
+  deque<rados_completion_t> q;
+  char oid[64];
+  int err = 0;
+  for (int i = 0; i < ops || !q.empty(); ++i) {
+    if ((int)q.size() >= depth || i >= ops) {
+      rados_completion_t c = q.front();
+      q.pop_front();
+      rados_aio_wait_for_complete(c);
+      int r = rados_aio_get_return_value(c);
+      if (r < 0 && !err)
+	err = r;
+      rados_aio_release(c);
+      if (i >= ops)
+	continue;
+    }
+    rados_completion_t c;
+    rados_aio_create_completion(NULL, NULL, NULL, &c);
+    snprintf(oid, sizeof(oid), "rados_alloc_bench_%d", i % num_objects);
+    int r = rados_aio_write(io, oid, c, buf, size, 0);
+    if (r < 0) {
+      rados_aio_release(c);
+      return r;
+    }
+    q.push_back(c);
+  }
+  return err;
+}
+
+int main(int argc, const char **argv)
+{
+  const char *pool = NULL;
+  int ops = 10000, depth = 16, size = 4096, num_objects = 100;
+  vector<const char*> args;
+  for (int i = 1; i < argc; ++i) {
+    if (i + 1 < argc && strcmp(argv[i], "--pool") == 0) {
+      pool = argv[++i];
+    } else if (i + 1 < argc && strcmp(argv[i], "--ops") == 0) {
+      ops = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "--depth") == 0) {
+      depth = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "--size") == 0) {
+      size = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "--objects") == 0) {
+      num_objects = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      usage();
+      return 0;
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+  if (!pool || ops < 1 || depth < 1 || size < 1 || num_objects < 1) {
+    usage();
+    return 1;
+  }
+
+  rados_t cluster;
+  int r = rados_create(&cluster, NULL);
+  if (r < 0) {
+    fprintf(stderr, "rados_create failed: %s\n", strerror(-r));
+    return 1;
+  }
+  rados_conf_read_file(cluster, NULL);
+  rados_conf_parse_env(cluster, NULL);
+  args.insert(args.begin(), argv[0]);
+  rados_conf_parse_argv(cluster, args.size(), &args[0]);
+  r = rados_connect(cluster);
+  if (r < 0) {
+    fprintf(stderr, "rados_connect failed: %s\n", strerror(-r));
+    return 1;
+  }
+  rados_ioctx_t io;
+  r = rados_ioctx_create(cluster, pool, &io);
+  if (r < 0) {
+    fprintf(stderr, "can't open pool %s: %s\n", pool, strerror(-r));
+    rados_shutdown(cluster);
+    return 1;
+  }
+
+  char *buf = (char*)malloc(size);
+  memset(buf, 'x', size);
+
+  // warm up: sessions, caches and pools fill here
+  r = run(io, ops / 10 + depth, depth, num_objects, buf, size);
+  if (r >= 0) {
+    uint64_t start_allocs = num_allocs, start_bytes = alloc_bytes;
+    utime_t start = ceph_clock_now(NULL);
+    r = run(io, ops, depth, num_objects, buf, size);
+    utime_t elapsed = ceph_clock_now(NULL) - start;
+    uint64_t allocs = num_allocs - start_allocs;
+    uint64_t bytes = alloc_bytes - start_bytes;
+    if (r >= 0)
+      printf("%d aio_write ops of %d bytes, depth %d: %.1f allocs/op,"
+	     " %.0f bytes/op, %.0f ops/sec\n",
+	     ops, size, depth, (double)allocs / ops, (double)bytes / ops,
+	     (double)ops / (double)elapsed);
+  }
+  if (r < 0)
+    fprintf(stderr, "aio_write failed: %s\n", strerror(-r));
+
+  free(buf);
+  rados_ioctx_destroy(io);
+  rados_shutdown(cluster);
+  return r < 0 ? 1 : 0;
+}
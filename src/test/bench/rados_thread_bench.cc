@@ -0,0 +1,251 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Small aio ops from a growing number of threads sharing one librados
+ * client, to see how op submission and completion scale with threads.
+ *
+ * ceph_rados_thread_bench --pool P [--threads N] [--depth N]
+ *                         [--seconds N] [--objects N] [--size N]
+ *                         [--op read|write|stat]
+ */
+
+#include <stdlib.h>
+#include <iostream>
+#include <deque>
+#include <vector>
+
+#include "include/rados/librados.hpp"
+#include "include/stringify.h"
+#include "common/ceph_argparse.h"
+#include "common/Clock.h"
+#include "common/errno.h"
+#include "common/Thread.h"
+
+using namespace std;
+
+static void usage()
+{
+  cout << "usage: ceph_rados_thread_bench --pool P [--threads N] [--depth N]"
+       << " [--seconds N] [--objects N] [--size N] [--op read|write|stat]"
+       << std::endl;
+}
+
+static string bench_oid(int i)
+{
+  return "rados_thread_bench_" + stringify(i);
+}
+
+class BenchThread : public Thread {
+  librados::Rados &rados;
+  librados::IoCtx &ioctx;
+  const string &op;
+  int num_objects, size, depth;
+  utime_t end;
+
+public:
+  uint64_t ops;
+  int err;
+
+  BenchThread(librados::Rados &r, librados::IoCtx &io, const string &o,
+	      int n, int s, int d, utime_t e)
+    : rados(r), ioctx(io), op(o), num_objects(n), size(s), depth(d),
+      end(e), ops(0), err(0) {}
+
+  struct Pending {
+    librados::AioCompletion *c;
+    bufferlist bl;
+    uint64_t psize;
+    time_t pmtime;
+  };
+
+  int reap(deque<Pending*> &q) {
+    Pending *p = q.front();
+    q.pop_front();
+    p->c->wait_for_complete();
+    int r = p->c->get_return_value();
+    p->c->release();
+    delete p;
+    ++ops;
+    return r;
+  }
+
+  void *entry() {
+    bufferlist data;
+    data.append(string(size, 'x'));
+    deque<Pending*> q;
+    unsigned seed = (unsigned)(uint64_t)this;
+    while (ceph_clock_now(NULL) < end) {
+      while ((int)q.size() >= depth) {
+	int r = reap(q);
+	if (r < 0 && !err)
+	  err = r;
+      }
+      Pending *p = new Pending;
+      p->c = rados.aio_create_completion();
+      string oid = bench_oid(rand_r(&seed) % num_objects);
+      if (op == "write")
+	ioctx.aio_write(oid, p->c, data, size, 0);
+      else if (op == "stat")
+	ioctx.aio_stat(oid, p->c, &p->psize, &p->pmtime);
+      else
+	ioctx.aio_read(oid, p->c, &p->bl, size, 0);
+      q.push_back(p);
+    }
+    while (!q.empty()) {
+      int r = reap(q);
+      if (r < 0 && !err)
+	err = r;
+    }
+    return 0;
+  }
+};
+
+static int run(librados::Rados &rados, const string &pool, int threads,
+	       int depth, int seconds, int num_objects, int size,
+	       const string &op, double *rate)
+{
+  vector<librados::IoCtx> ioctxs(threads);
+  for (int i = 0; i < threads; ++i) {
+    int r = rados.ioctx_create(pool.c_str(), ioctxs[i]);
+    if (r < 0)
+      return r;
+  }
+
+  utime_t start = ceph_clock_now(NULL);
+  utime_t end = start;
+  end += (double)seconds;
+  vector<BenchThread*> workers;
+  for (int i = 0; i < threads; ++i) {
+    BenchThread *t = new BenchThread(rados, ioctxs[i], op, num_objects, size,
+				     depth, end);
+    t->create();
+    workers.push_back(t);
+  }
+
+  uint64_t ops = 0;
+  int err = 0;
+  for (vector<BenchThread*>::iterator p = workers.begin();
+       p != workers.end();
+       ++p) {
+    (*p)->join();
+    ops += (*p)->ops;
+    if ((*p)->err && !err)
+      err = (*p)->err;
+    delete *p;
+  }
+  utime_t elapsed = ceph_clock_now(NULL) - start;
+  *rate = (double)ops / (double)elapsed;
+  return err;
+}
+
+int main(int argc, const char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, argv, args);
+  env_to_vec(args);
+
+  string pool, op = "read";
+  int threads = 16;
+  int depth = 16;
+  int seconds = 10;
+  int num_objects = 1000;
+  int size = 4096;
+
+  std::string val;
+  for (std::vector<const char*>::iterator i = args.begin(); i != args.end(); ) {
+    if (ceph_argparse_double_dash(args, i)) {
+      break;
+    } else if (ceph_argparse_witharg(args, i, &val, "--pool", (char*)NULL)) {
+      pool = val;
+    } else if (ceph_argparse_witharg(args, i, &val, "--threads", (char*)NULL)) {
+      threads = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--depth", (char*)NULL)) {
+      depth = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--seconds", (char*)NULL)) {
+      seconds = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--objects", (char*)NULL)) {
+      num_objects = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--size", (char*)NULL)) {
+      size = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--op", (char*)NULL)) {
+      op = val;
+    } else if (ceph_argparse_flag(args, i, "-h", "--help", (char*)NULL)) {
+      usage();
+      return 0;
+    } else {
+      ++i;
+    }
+  }
+  if (pool.empty() || threads < 1 || depth < 1 || seconds < 1 ||
+      num_objects < 1 || size < 1 ||
+      (op != "read" && op != "write" && op != "stat")) {
+    usage();
+    return 1;
+  }
+
+  librados::Rados rados;
+  int r = rados.init(NULL);
+  if (r < 0) {
+    cerr << "init failed: " << cpp_strerror(r) << std::endl;
+    return 1;
+  }
+  rados.conf_read_file(NULL);
+  rados.conf_parse_env(NULL);
+  rados.conf_parse_argv(argc, argv);
+  r = rados.connect();
+  if (r < 0) {
+    cerr << "connect failed: " << cpp_strerror(r) << std::endl;
+    return 1;
+  }
+
+  if (op != "write") {
+    librados::IoCtx ioctx;
+    r = rados.ioctx_create(pool.c_str(), ioctx);
+    if (r < 0) {
+      cerr << "can't open pool " << pool << ": " << cpp_strerror(r) << std::endl;
+      rados.shutdown();
+      return 1;
+    }
+    bufferlist data;
+    data.append(string(size, 'x'));
+    for (int i = 0; i < num_objects; ++i) {
+      r = ioctx.write_full(bench_oid(i), data);
+      if (r < 0) {
+	cerr << "prefill failed: " << cpp_strerror(r) << std::endl;
+	rados.shutdown();
+	return 1;
+      }
+    }
+  }
+
+  for (int t = 1; ; t *= 2) {
+    if (t > threads)
+      t = threads;
+    double rate;
+    r = run(rados, pool, t, depth, seconds, num_objects, size, op, &rate);
+    if (r < 0) {
+      cerr << op << " failed: " << cpp_strerror(r) << std::endl;
+      rados.shutdown();
+      return 1;
+    }
+    cout << "threads " << t << " depth " << depth << " " << op
+	 << " " << rate << " ops/sec" << std::endl;
+    if (t == threads)
+      break;
+  }
+
+  rados.shutdown();
+  return 0;
+}
@@ -33,6 +33,8 @@ using ::librbd::cls_client::get_children;
 using ::librbd::cls_client::get_snapcontext;
 using ::librbd::cls_client::snapshot_list;
 using ::librbd::cls_client::copyup;
+using ::librbd::cls_client::object_map_update;
+using ::librbd::cls_client::object_map_merge;
 using ::librbd::cls_client::get_id;
 using ::librbd::cls_client::set_id;
 using ::librbd::cls_client::dir_get_id;
@@ -110,6 +112,53 @@ TEST(cls_rbd, copyup)
   ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
 }
 
+TEST(cls_rbd, object_map)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  string oid = "rbd_object_map_test";
+  bufferlist bl;
+
+  // the map has to exist
+  ASSERT_EQ(-ENOENT, object_map_update(&ioctx, oid, 0, 1, 1));
+  ASSERT_EQ(-ENOENT, object_map_merge(&ioctx, oid, bl));
+  ASSERT_EQ(0, ioctx.create(oid, true));
+  ASSERT_EQ(-EINVAL, object_map_update(&ioctx, oid, 1, 1, 1));
+
+  ASSERT_EQ(0, object_map_update(&ioctx, oid, 3, 4, 1));
+  ASSERT_EQ(0, object_map_update(&ioctx, oid, 6, 10, 1));
+  ASSERT_EQ(2, ioctx.read(oid, bl, 0, 0));
+  ASSERT_EQ(0xc8, (unsigned char)bl[0]);
+  ASSERT_EQ(0x03, (unsigned char)bl[1]);
+
+  // clearing doesn't grow the map
+  ASSERT_EQ(0, object_map_update(&ioctx, oid, 7, 100, 0));
+  bl.clear();
+  ASSERT_EQ(2, ioctx.read(oid, bl, 0, 0));
+  ASSERT_EQ(0x48, (unsigned char)bl[0]);
+  ASSERT_EQ(0x00, (unsigned char)bl[1]);
+
+  bufferlist merge_bl;
+  merge_bl.append((char)0x01);
+  merge_bl.append((char)0x00);
+  merge_bl.append((char)0x80);
+  ASSERT_EQ(0, object_map_merge(&ioctx, oid, merge_bl));
+  bl.clear();
+  ASSERT_EQ(3, ioctx.read(oid, bl, 0, 0));
+  ASSERT_EQ(0x49, (unsigned char)bl[0]);
+  ASSERT_EQ(0x00, (unsigned char)bl[1]);
+  ASSERT_EQ(0x80, (unsigned char)bl[2]);
+
+  ASSERT_EQ(0, ioctx.remove(oid));
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
 TEST(cls_rbd, get_and_set_id)
 {
   librados::Rados rados;
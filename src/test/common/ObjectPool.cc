@@ -0,0 +1,132 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <set>
+#include <vector>
+
+#include "common/ObjectPool.h"
+#include "common/Thread.h"
+#include "gtest/gtest.h"
+
+// pools are never destroyed, so each test leaks its own
+
+namespace {
+  class Freer : public Thread {
+    ObjectPool *pool;
+    std::vector<void*> objs;
+  public:
+    Freer(ObjectPool *p, const std::vector<void*>& o) : pool(p), objs(o) {}
+    void *entry() {
+      for (std::vector<void*>::iterator i = objs.begin(); i != objs.end(); ++i)
+	pool->free(*i, 64);
+      return 0;
+    }
+  };
+
+  // free objs on another thread, which then exits
+  void free_elsewhere(ObjectPool *pool, const std::vector<void*>& objs) {
+    Freer f(pool, objs);
+    f.create();
+    f.join();
+  }
+
+  struct Pooled {
+    static ObjectPool pool;
+    static void *operator new(size_t n) { return pool.alloc(n); }
+    void operator delete(void *p, size_t n) { pool.free(p, n); }
+    virtual ~Pooled() {}
+    char pad[48];
+  };
+  ObjectPool Pooled::pool(sizeof(Pooled));
+
+  struct Bigger : public Pooled {
+    char more[64];
+  };
+}
+
+TEST(ObjectPool, local_reuse)
+{
+  ObjectPool *pool = new ObjectPool(64, 4, 2);
+  void *a = pool->alloc(64);
+  void *b = pool->alloc(64);
+  pool->free(a, 64);
+  pool->free(b, 64);
+  ASSERT_EQ(b, pool->alloc(64));
+  ASSERT_EQ(a, pool->alloc(64));
+  ASSERT_EQ(0u, pool->get_depot_batches());
+}
+
+TEST(ObjectPool, cross_thread)
+{
+  ObjectPool *pool = new ObjectPool(64, 4, 2);
+  std::vector<void*> objs;
+  for (int i = 0; i < 8; ++i)
+    objs.push_back(pool->alloc(64));
+
+  // one batch goes to the depot when the freer's cache hits two, the
+  // other when the thread exits
+  free_elsewhere(pool, objs);
+  ASSERT_EQ(2u, pool->get_depot_batches());
+
+  // and this thread refills from them, a batch at a time
+  std::set<void*> freed(objs.begin(), objs.end());
+  std::set<void*> got;
+  for (int i = 0; i < 4; ++i) {
+    void *p = pool->alloc(64);
+    ASSERT_TRUE(freed.count(p));
+    got.insert(p);
+  }
+  ASSERT_EQ(1u, pool->get_depot_batches());
+  for (int i = 0; i < 4; ++i) {
+    void *p = pool->alloc(64);
+    ASSERT_TRUE(freed.count(p));
+    got.insert(p);
+  }
+  ASSERT_EQ(0u, pool->get_depot_batches());
+  ASSERT_TRUE(freed == got);
+
+  // then back to malloc
+  void *p = pool->alloc(64);
+  ASSERT_FALSE(freed.count(p));
+}
+
+TEST(ObjectPool, depot_capped)
+{
+  ObjectPool *pool = new ObjectPool(64, 4, 1);
+  std::vector<void*> objs;
+  for (int i = 0; i < 12; ++i)
+    objs.push_back(pool->alloc(64));
+  free_elsewhere(pool, objs);
+  ASSERT_EQ(1u, pool->get_depot_batches());
+
+  std::set<void*> freed(objs.begin(), objs.end());
+  for (int i = 0; i < 4; ++i)
+    ASSERT_TRUE(freed.count(pool->alloc(64)));
+  ASSERT_EQ(0u, pool->get_depot_batches());
+}
+
+TEST(ObjectPool, size_mismatch)
+{
+  ObjectPool *pool = new ObjectPool(64, 4, 2);
+  void *a = pool->alloc(64);
+  pool->free(a, 64);
+
+  // other sizes skip the cache both ways
+  void *b = pool->alloc(128);
+  ASSERT_NE(a, b);
+  memset(b, 0, 128);
+  pool->free(b, 128);
+  ASSERT_EQ(a, pool->alloc(64));
+  pool->free(a, 64);
+
+  // which is what a derived class gets through the base's operators
+  Pooled *p = new Pooled;
+  delete p;
+  Bigger *big = new Bigger;
+  ASSERT_NE((void*)p, (void*)big);
+  memset(big->more, 0, sizeof(big->more));
+  delete big;
+  Pooled *q = new Pooled;
+  ASSERT_EQ(p, q);
+  delete q;
+}
@@ -0,0 +1,76 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "common/Readahead.h"
+#include "gtest/gtest.h"
+
+TEST(Readahead, disabled)
+{
+  Readahead ra;
+  ra.set_trigger_requests(1);
+  Readahead::read_type_t type;
+  Readahead::extent_t e = ra.update(0, 4096, 1 << 20, &type);
+  ASSERT_EQ(0u, e.second);
+  ASSERT_EQ(Readahead::READ_RANDOM, type);
+}
+
+TEST(Readahead, window)
+{
+  Readahead ra;
+  ra.set_trigger_requests(4);
+  ra.set_max_readahead_size(32768);
+  Readahead::read_type_t type;
+  uint64_t off = 0;
+  for (int i = 0; i < 3; ++i, off += 1024) {
+    ASSERT_EQ(0u, ra.update(off, 1024, 1 << 20, &type).second);
+    ASSERT_EQ(Readahead::READ_RANDOM, type);
+  }
+
+  // the first window is what has been read so far
+  Readahead::extent_t e = ra.update(off, 1024, 1 << 20, &type);
+  off += 1024;
+  ASSERT_EQ(Readahead::READ_SEQ_MISS, type);
+  ASSERT_EQ(off, e.first);
+  ASSERT_EQ(4096u, e.second);
+
+  // nothing more until we are halfway through it
+  ASSERT_EQ(0u, ra.update(off, 1024, 1 << 20, &type).second);
+  ASSERT_EQ(Readahead::READ_SEQ_HIT, type);
+  off += 1024;
+
+  // then it doubles, starting where the last one ended
+  e = ra.update(off, 1024, 1 << 20, &type);
+  off += 1024;
+  ASSERT_EQ(Readahead::READ_SEQ_HIT, type);
+  ASSERT_EQ(8192u, e.first);
+  ASSERT_EQ(8192u, e.second);
+
+  // up to the maximum
+  uint64_t last = 0;
+  for (int i = 0; i < 100; ++i, off += 1024) {
+    e = ra.update(off, 1024, 1 << 20, &type);
+    ASSERT_EQ(Readahead::READ_SEQ_HIT, type);
+    if (e.second) {
+      ASSERT_LE(e.second, 32768u);
+      last = e.second;
+    }
+  }
+  ASSERT_EQ(32768u, last);
+
+  // a random read starts over
+  e = ra.update(0, 1024, 1 << 20, &type);
+  ASSERT_EQ(0u, e.second);
+  ASSERT_EQ(Readahead::READ_RANDOM, type);
+}
+
+TEST(Readahead, limit)
+{
+  Readahead ra;
+  ra.set_trigger_requests(2);
+  ra.set_max_readahead_size(1 << 20);
+  ASSERT_EQ(0u, ra.update(0, 4096, 10000).second);
+  Readahead::extent_t e = ra.update(4096, 4096, 10000);
+  ASSERT_EQ(8192u, e.first);
+  ASSERT_EQ(10000u - 8192u, e.second);
+  ASSERT_EQ(0u, ra.update(8192, 1808, 10000).second);
+}
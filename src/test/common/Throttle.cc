@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <signal.h>
+#include <errno.h>
 #include "common/Mutex.h"
 #include "common/Thread.h"
 #include "common/Throttle.h"
@@ -240,6 +241,57 @@ TEST_F(ThrottleTest, destructor) {
   }
 }
 
+TEST(SimpleThrottle, errors) {
+  {
+    SimpleThrottle throttle(2, false);
+    C_SimpleThrottle *a = new C_SimpleThrottle(&throttle);
+    C_SimpleThrottle *b = new C_SimpleThrottle(&throttle);
+    a->complete(-ENOENT);
+    b->complete(-EIO);
+    ASSERT_EQ(-ENOENT, throttle.wait_for_ret());
+  }
+  {
+    SimpleThrottle throttle(2, true);
+    C_SimpleThrottle *a = new C_SimpleThrottle(&throttle);
+    a->complete(-ENOENT);
+    ASSERT_EQ(0, throttle.wait_for_ret());
+    C_SimpleThrottle *b = new C_SimpleThrottle(&throttle);
+    b->complete(-EIO);
+    ASSERT_EQ(-EIO, throttle.wait_for_ret());
+  }
+}
+
+class Thread_start_op : public Thread {
+public:
+  SimpleThrottle &throttle;
+  bool started;
+
+  Thread_start_op(SimpleThrottle &_throttle)
+    : throttle(_throttle), started(false) {}
+
+  virtual void *entry() {
+    throttle.start_op();
+    started = true;
+    throttle.end_op(0);
+    return NULL;
+  }
+};
+
+TEST(SimpleThrottle, start_op) {
+  SimpleThrottle throttle(1, false);
+  C_SimpleThrottle *c = new C_SimpleThrottle(&throttle);
+
+  Thread_start_op t(throttle);
+  t.create();
+  usleep(10000);
+  ASSERT_FALSE(t.started);
+
+  c->complete(0);
+  t.join();
+  ASSERT_TRUE(t.started);
+  ASSERT_EQ(0, throttle.wait_for_ret());
+}
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
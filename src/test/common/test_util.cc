@@ -29,3 +29,26 @@ TEST(util, unit_to_bytesize)
 
   ASSERT_EQ(65536ll, unit_to_bytesize(" 64K", &cerr));
 }
+
+TEST(util, buf_is_zero)
+{
+  char buf[300];
+  memset(buf, 0, sizeof(buf));
+  ASSERT_TRUE(buf_is_zero(buf, 0));
+  ASSERT_TRUE(buf_is_zero(buf, sizeof(buf)));
+
+  // every position, at every alignment, and nothing past the end
+  for (size_t start = 0; start < 9; ++start) {
+    for (size_t i = start; i < sizeof(buf) - 1; ++i) {
+      buf[i] = 1;
+      ASSERT_FALSE(buf_is_zero(buf + start, sizeof(buf) - 1 - start));
+      ASSERT_TRUE(buf_is_zero(buf + i + 1, sizeof(buf) - i - 2));
+      if (i > start) {
+	ASSERT_TRUE(buf_is_zero(buf + start, i - start));
+      }
+      buf[i] = 0;
+    }
+  }
+  buf[sizeof(buf) - 1] = 1;
+  ASSERT_TRUE(buf_is_zero(buf, sizeof(buf) - 1));
+}
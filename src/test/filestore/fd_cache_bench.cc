@@ -0,0 +1,171 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Small writes, reads and stats against a working set of objects, run
+ * once with the FileStore fd cache disabled and once with it enabled.
+ *
+ * ceph_test_filestore_fd_cache_bench [--objects N] [--ops N]
+ *                                    [--cache-size N] [--io-size N] [dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <sstream>
+#include <boost/scoped_ptr.hpp>
+
+#include "os/FileStore.h"
+#include "common/ceph_argparse.h"
+#include "common/Clock.h"
+#include "common/errno.h"
+#include "global/global_init.h"
+#include "include/stringify.h"
+
+static void usage()
+{
+  cout << "usage: ceph_test_filestore_fd_cache_bench [--objects N] [--ops N]"
+       << " [--cache-size N] [--io-size N] [dir]" << std::endl;
+}
+
+static hobject_t bench_obj(int i)
+{
+  return hobject_t(sobject_t(object_t("fd_cache_bench_" + stringify(i)),
+			     CEPH_NOSNAP));
+}
+
+static double run(ObjectStore *store, coll_t cid, int num_objects, int num_ops,
+		  int io_size, const char *what)
+{
+  bufferlist data;
+  data.append(string(io_size, 'x'));
+
+  utime_t start = ceph_clock_now(g_ceph_context);
+  for (int i = 0; i < num_ops; ++i) {
+    hobject_t hoid = bench_obj(rand() % num_objects);
+    uint64_t off = (rand() % 1024) * io_size;
+    int r = 0;
+    if (what[0] == 'w') {
+      ObjectStore::Transaction t;
+      t.write(cid, hoid, off, io_size, data);
+      r = store->apply_transaction(t);
+    } else if (what[0] == 'r') {
+      bufferlist out;
+      r = store->read(cid, hoid, off, io_size, out);
+    } else {
+      struct stat st;
+      r = store->stat(cid, hoid, &st);
+    }
+    if (r < 0) {
+      cerr << what << " failed: " << cpp_strerror(r) << std::endl;
+      exit(1);
+    }
+  }
+  utime_t elapsed = ceph_clock_now(g_ceph_context) - start;
+  return (double)num_ops / (double)elapsed;
+}
+
+static int bench(const string &dir, int cache_size, int num_objects,
+		 int num_ops, int io_size)
+{
+  g_ceph_context->_conf->set_val("filestore_fd_cache_size",
+				 stringify(cache_size).c_str());
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  string journal = dir + ".journal";
+  ::mkdir(dir.c_str(), 0777);
+  boost::scoped_ptr<ObjectStore> store(new FileStore(dir, journal));
+  int r = store->mkfs();
+  if (r < 0) {
+    cerr << "mkfs failed: " << cpp_strerror(r) << std::endl;
+    return r;
+  }
+  r = store->mount();
+  if (r < 0) {
+    cerr << "mount failed: " << cpp_strerror(r) << std::endl;
+    return r;
+  }
+
+  coll_t cid("fd_cache_bench");
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid);
+    for (int i = 0; i < num_objects; ++i)
+      t.touch(cid, bench_obj(i));
+    store->apply_transaction(t);
+  }
+
+  const char *ops[] = { "write", "read", "stat" };
+  for (unsigned i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+    srand(0);
+    double rate = run(store.get(), cid, num_objects, num_ops, io_size, ops[i]);
+    cout << "fd_cache_size " << cache_size << " " << ops[i]
+	 << " " << rate << " ops/sec" << std::endl;
+  }
+
+  store->umount();
+  return 0;
+}
+
+int main(int argc, const char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, argv, args);
+  env_to_vec(args);
+
+  global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+  g_ceph_context->_conf->set_val("osd_journal_size", "400");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  int num_objects = 1000;
+  int num_ops = 100000;
+  int cache_size = 1024;
+  int io_size = 4096;
+  string dir = "fd_cache_bench_temp_dir";
+
+  std::string val;
+  for (std::vector<const char*>::iterator i = args.begin(); i != args.end(); ) {
+    if (ceph_argparse_double_dash(args, i)) {
+      break;
+    } else if (ceph_argparse_witharg(args, i, &val, "--objects", (char*)NULL)) {
+      num_objects = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--ops", (char*)NULL)) {
+      num_ops = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--cache-size", (char*)NULL)) {
+      cache_size = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--io-size", (char*)NULL)) {
+      io_size = atoi(val.c_str());
+    } else if (ceph_argparse_flag(args, i, "-h", "--help", (char*)NULL)) {
+      usage();
+      return 0;
+    } else {
+      ++i;
+    }
+  }
+  if (!args.empty())
+    dir = args[0];
+  if (num_objects < 1 || num_ops < 1 || io_size < 1) {
+    usage();
+    return 1;
+  }
+
+  int r = bench(dir + ".nocache", 0, num_objects, num_ops, io_size);
+  if (r < 0)
+    return 1;
+  r = bench(dir + ".cache", cache_size, num_objects, num_ops, io_size);
+  if (r < 0)
+    return 1;
+  return 0;
+}
@@ -0,0 +1,157 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Whole-object reads, the way `rados bench seq` issues them, run with
+ * the FileStore read pool off, on, and on with O_DIRECT.
+ *
+ * ceph_test_filestore_read_pool_bench [--objects N] [--passes N]
+ *                                     [--object-size N] [dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <boost/scoped_ptr.hpp>
+
+#include "os/FileStore.h"
+#include "common/ceph_argparse.h"
+#include "common/Clock.h"
+#include "common/errno.h"
+#include "global/global_init.h"
+#include "include/stringify.h"
+
+static void usage()
+{
+  cout << "usage: ceph_test_filestore_read_pool_bench [--objects N]"
+       << " [--passes N] [--object-size N] [dir]" << std::endl;
+}
+
+static hobject_t bench_obj(int i)
+{
+  return hobject_t(sobject_t(object_t("read_pool_bench_" + stringify(i)),
+			     CEPH_NOSNAP));
+}
+
+static int bench(const string &dir, const char *name, bool pool, bool direct,
+		 int num_objects, int passes, int object_size)
+{
+  g_ceph_context->_conf->set_val("filestore_read_pool_bytes",
+				 pool ? stringify(64 * object_size).c_str() : "0");
+  g_ceph_context->_conf->set_val("filestore_read_pool_max",
+				 stringify(object_size).c_str());
+  g_ceph_context->_conf->set_val("filestore_read_direct",
+				 direct ? "true" : "false");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  string journal = dir + ".journal";
+  ::mkdir(dir.c_str(), 0777);
+  boost::scoped_ptr<ObjectStore> store(new FileStore(dir, journal));
+  int r = store->mkfs();
+  if (r < 0) {
+    cerr << "mkfs failed: " << cpp_strerror(r) << std::endl;
+    return r;
+  }
+  r = store->mount();
+  if (r < 0) {
+    cerr << "mount failed: " << cpp_strerror(r) << std::endl;
+    return r;
+  }
+
+  coll_t cid("read_pool_bench");
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid);
+    store->apply_transaction(t);
+  }
+  bufferlist data;
+  data.append(string(object_size, 'x'));
+  for (int i = 0; i < num_objects; ++i) {
+    ObjectStore::Transaction t;
+    t.write(cid, bench_obj(i), 0, object_size, data);
+    store->apply_transaction(t);
+  }
+
+  utime_t start = ceph_clock_now(g_ceph_context);
+  uint64_t bytes = 0;
+  for (int pass = 0; pass < passes; ++pass) {
+    for (int i = 0; i < num_objects; ++i) {
+      bufferlist out;
+      r = store->read(cid, bench_obj(i), 0, object_size, out);
+      if (r < 0) {
+	cerr << "read failed: " << cpp_strerror(r) << std::endl;
+	return r;
+      }
+      bytes += r;
+    }
+  }
+  utime_t elapsed = ceph_clock_now(g_ceph_context) - start;
+  cout << name << " " << (double)bytes / (double)elapsed / (1 << 20)
+       << " MB/sec" << std::endl;
+
+  store->umount();
+  return 0;
+}
+
+int main(int argc, const char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, argv, args);
+  env_to_vec(args);
+
+  global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+  g_ceph_context->_conf->set_val("osd_journal_size", "400");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  int num_objects = 64;
+  int passes = 16;
+  int object_size = 4 << 20;
+  string dir = "read_pool_bench_temp_dir";
+
+  std::string val;
+  for (std::vector<const char*>::iterator i = args.begin(); i != args.end(); ) {
+    if (ceph_argparse_double_dash(args, i)) {
+      break;
+    } else if (ceph_argparse_witharg(args, i, &val, "--objects", (char*)NULL)) {
+      num_objects = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--passes", (char*)NULL)) {
+      passes = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--object-size", (char*)NULL)) {
+      object_size = atoi(val.c_str());
+    } else if (ceph_argparse_flag(args, i, "-h", "--help", (char*)NULL)) {
+      usage();
+      return 0;
+    } else {
+      ++i;
+    }
+  }
+  if (!args.empty())
+    dir = args[0];
+  if (num_objects < 1 || passes < 1 || object_size < 1) {
+    usage();
+    return 1;
+  }
+
+  if (bench(dir + ".nopool", "no pool", false, false,
+	    num_objects, passes, object_size) < 0)
+    return 1;
+  if (bench(dir + ".pool", "pool", true, false,
+	    num_objects, passes, object_size) < 0)
+    return 1;
+  if (bench(dir + ".direct", "pool+direct", true, true,
+	    num_objects, passes, object_size) < 0)
+    return 1;
+  return 0;
+}
@@ -16,12 +16,16 @@
 #include <string.h>
 #include <iostream>
 #include <time.h>
+#include <sys/stat.h>
 #include "os/FileStore.h"
+#include "os/FileJournal.h"
 #include "include/Context.h"
+#include "include/stringify.h"
 #include "common/ceph_argparse.h"
 #include "global/global_init.h"
 #include "common/Mutex.h"
 #include "common/Cond.h"
+#include "common/Finisher.h"
 #include <boost/scoped_ptr.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int.hpp>
@@ -122,6 +126,162 @@ TEST_F(StoreTest, SimpleObjectTest) {
   }
 }
 
+TEST_F(StoreTest, IndexLayoutRecreateTest) {
+  // enough objects to split the root, so a stale cached layout for a
+  // removed collection would point lookups at missing subdirs
+  int NUM_OBJS = 1000;
+  int r = 0;
+  coll_t cid("layout");
+  for (int round = 0; round < 2; ++round) {
+    {
+      ObjectStore::Transaction t;
+      t.create_collection(cid);
+      r = store->apply_transaction(t);
+      ASSERT_EQ(r, 0);
+    }
+    // only create objects the second time around
+    int num = round ? 10 : NUM_OBJS;
+    for (int i = 0; i < num; ++i) {
+      ObjectStore::Transaction t;
+      char buf[100];
+      snprintf(buf, sizeof(buf), "%d", i);
+      t.touch(cid, hobject_t(sobject_t(string(buf), CEPH_NOSNAP)));
+      r = store->apply_transaction(t);
+      ASSERT_EQ(r, 0);
+    }
+    for (int i = 0; i < NUM_OBJS; ++i) {
+      char buf[100];
+      snprintf(buf, sizeof(buf), "%d", i);
+      struct stat st;
+      r = store->stat(cid, hobject_t(sobject_t(string(buf), CEPH_NOSNAP)), &st);
+      ASSERT_EQ(i < num ? 0 : -ENOENT, r);
+    }
+    ObjectStore::Transaction t;
+    for (int i = 0; i < num; ++i) {
+      char buf[100];
+      snprintf(buf, sizeof(buf), "%d", i);
+      t.remove(cid, hobject_t(sobject_t(string(buf), CEPH_NOSNAP)));
+    }
+    t.remove_collection(cid);
+    r = store->apply_transaction(t);
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_F(StoreTest, PreSplitTest) {
+  int NUM_OBJS = 200;
+  int r = 0;
+  coll_t cid("presplit");
+  // two hash levels
+  g_ceph_context->_conf->set_val("filestore_pre_split_objects", "10000");
+  g_ceph_context->_conf->apply_changes(NULL);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid);
+    r = store->apply_transaction(t);
+    ASSERT_EQ(r, 0);
+  }
+  g_ceph_context->_conf->set_val("filestore_pre_split_objects", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+  const char *leaves[] = {
+    "store_test_temp_dir/current/presplit/DIR_0/DIR_0",
+    "store_test_temp_dir/current/presplit/DIR_F/DIR_F",
+    "store_test_temp_dir/current/presplit/DIR_7/DIR_A",
+  };
+  for (unsigned i = 0; i < sizeof(leaves) / sizeof(leaves[0]); ++i) {
+    struct stat st;
+    ASSERT_EQ(0, ::stat(leaves[i], &st)) << leaves[i];
+    ASSERT_TRUE(S_ISDIR(st.st_mode)) << leaves[i];
+  }
+  set<hobject_t> created;
+  for (int i = 0; i < NUM_OBJS; ++i) {
+    ObjectStore::Transaction t;
+    char buf[100];
+    snprintf(buf, sizeof(buf), "%d", i);
+    hobject_t hoid(sobject_t(string(buf), CEPH_NOSNAP));
+    t.touch(cid, hoid);
+    created.insert(hoid);
+    r = store->apply_transaction(t);
+    ASSERT_EQ(r, 0);
+  }
+  vector<hobject_t> objects;
+  r = store->collection_list(cid, objects);
+  ASSERT_EQ(r, 0);
+  ASSERT_EQ(created.size(), objects.size());
+  {
+    ObjectStore::Transaction t;
+    for (set<hobject_t>::iterator i = created.begin(); i != created.end(); ++i) {
+      struct stat st;
+      ASSERT_EQ(0, store->stat(cid, *i, &st));
+      t.remove(cid, *i);
+    }
+    r = store->apply_transaction(t);
+    ASSERT_EQ(r, 0);
+  }
+  // emptying the collection doesn't merge the pre-split levels away
+  for (unsigned i = 0; i < sizeof(leaves) / sizeof(leaves[0]); ++i) {
+    struct stat st;
+    ASSERT_EQ(0, ::stat(leaves[i], &st)) << leaves[i];
+  }
+  ObjectStore::Transaction t;
+  t.remove_collection(cid);
+  r = store->apply_transaction(t);
+  ASSERT_EQ(r, 0);
+}
+
+TEST_F(StoreTest, PooledReadTest) {
+  int r;
+  coll_t cid("pooledread");
+  hobject_t hoid(sobject_t("Object 1", CEPH_NOSNAP));
+  g_ceph_context->_conf->set_val("filestore_read_pool_bytes", "1048576");
+  g_ceph_context->_conf->set_val("filestore_read_direct", "true");
+  g_ceph_context->_conf->apply_changes(NULL);
+  bufferlist data;
+  for (unsigned i = 0; i < 65536 * 2 + 100; ++i)
+    data.append((char)(i % 251));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid);
+    t.write(cid, hoid, 0, data.length(), data);
+    r = store->apply_transaction(t);
+    ASSERT_EQ(r, 0);
+  }
+  for (int pass = 0; pass < 2; ++pass) {
+    // aligned, unaligned, and running past eof
+    bufferlist bl;
+    r = store->read(cid, hoid, 0, 65536, bl);
+    ASSERT_EQ(65536, r);
+    ASSERT_TRUE(bl.is_page_aligned());
+    bufferlist expected;
+    expected.substr_of(data, 0, 65536);
+    ASSERT_TRUE(bl.contents_equal(expected));
+
+    bl.clear();
+    r = store->read(cid, hoid, 100, 65536, bl);
+    ASSERT_EQ(65536, r);
+    expected.clear();
+    expected.substr_of(data, 100, 65536);
+    ASSERT_TRUE(bl.contents_equal(expected));
+
+    bl.clear();
+    r = store->read(cid, hoid, 65536, 131072, bl);
+    ASSERT_EQ(65536 + 100, r);
+    expected.clear();
+    expected.substr_of(data, 65536, 65536 + 100);
+    ASSERT_TRUE(bl.contents_equal(expected));
+  }
+  g_ceph_context->_conf->set_val("filestore_read_pool_bytes", "0");
+  g_ceph_context->_conf->set_val("filestore_read_direct", "false");
+  g_ceph_context->_conf->apply_changes(NULL);
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = store->apply_transaction(t);
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_F(StoreTest, SimpleObjectLongnameTest) {
   int r;
   coll_t cid = coll_t("coll");
@@ -823,6 +983,225 @@ TEST_F(StoreTest, ColSplitTest3) {
 }
 #endif
 
+static hobject_t replay_obj(const string &name)
+{
+  return hobject_t(sobject_t(object_t(name), CEPH_NOSNAP));
+}
+
+/*
+ * Journal entries shaped like an osd's: pgs writing their own
+ * collections, every pg updating its key in one shared meta object
+ * (and a key they all share), whole-object meta updates, and objects
+ * moving from one pg to another.
+ */
+static void replay_workload(vector<ObjectStore::Transaction*> *entries)
+{
+  coll_t meta = coll_t::META_COLL;
+  hobject_t infos = replay_obj("infos");
+  hobject_t osdmap = replay_obj("osdmap");
+  vector<coll_t> pgs;
+  for (int i = 0; i < 4; ++i)
+    pgs.push_back(coll_t("replay_pg_" + stringify(i)));
+
+  ObjectStore::Transaction *t = new ObjectStore::Transaction;
+  t->create_collection(meta);
+  for (vector<coll_t>::iterator p = pgs.begin(); p != pgs.end(); ++p)
+    t->create_collection(*p);
+  t->touch(meta, infos);
+  t->touch(meta, osdmap);
+  entries->push_back(t);
+
+  for (int i = 0; i < 400; ++i) {
+    coll_t pg = pgs[i % pgs.size()];
+    bufferlist data;
+    data.append("entry " + stringify(i));
+    t = new ObjectStore::Transaction;
+
+    hobject_t oid = replay_obj("obj_" + stringify(i % 10));
+    t->write(pg, oid, (i % 3) * 4, data.length(), data);
+    t->setattr(pg, oid, "entry", data);
+    if (i % 10 == 7)
+      t->remove(pg, oid);
+
+    if (i % 10 == 3) {
+      t->write(pg, replay_obj("moved_" + stringify(i)), 0, data.length(), data);
+    } else if (i % 10 == 9) {
+      // written six entries ago, by another pg
+      hobject_t moved = replay_obj("moved_" + stringify(i - 6));
+      t->collection_move(pg, pgs[(i - 6) % pgs.size()], moved);
+      t->write(pg, moved, data.length(), data.length(), data);
+    }
+
+    if (i % 50 == 25)
+      t->omap_clear(meta, infos);
+    if (i % 13 == 0)
+      t->omap_setheader(meta, infos, data);
+    map<string, bufferlist> keys;
+    keys["info_" + stringify(pg)] = data;
+    keys["last"] = data;
+    if (i % 5 != 4)
+      keys["log_" + stringify(pg)] = data;
+    t->omap_setkeys(meta, infos, keys);
+    if (i % 5 == 4) {
+      set<string> rm;
+      rm.insert("log_" + stringify(pg));
+      t->omap_rmkeys(meta, infos, rm);
+    }
+
+    if (i % 7 == 0) {
+      t->truncate(meta, osdmap, 0);
+      t->write(meta, osdmap, 0, data.length(), data);
+    }
+    entries->push_back(t);
+  }
+}
+
+/// journal entries behind a fresh store's back, then mount it to replay them
+static ObjectStore *replay_into(const string &dir, const char *threads,
+				const char *max_in_flight,
+				vector<ObjectStore::Transaction*> &entries)
+{
+  string journal = dir + ".journal";
+  ::system(("rm -rf " + dir + " " + journal).c_str());
+  ::mkdir(dir.c_str(), 0777);
+  uuid_d fsid;
+  {
+    boost::scoped_ptr<ObjectStore> store(new FileStore(dir, journal));
+    if (store->mkfs() < 0 || store->mount() < 0)
+      return NULL;
+    fsid = store->get_fsid();
+    store->umount();
+  }
+
+  uint64_t seq = 0;
+  FILE *f = ::fopen((dir + "/current/commit_op_seq").c_str(), "r");
+  if (!f)
+    return NULL;
+  int n = ::fscanf(f, "%" SCNu64, &seq);
+  ::fclose(f);
+  if (n != 1)
+    return NULL;
+
+  {
+    Finisher finisher(g_ceph_context);
+    Cond sync_cond;
+    Mutex lock("replay_into::lock");
+    Cond cond;
+    bool done = false;
+    finisher.start();
+    FileJournal j(fsid, &finisher, &sync_cond, journal.c_str(),
+		  g_conf->journal_dio);
+    if (j.open(seq) < 0) {
+      finisher.stop();
+      return NULL;
+    }
+    j.make_writeable();
+    C_GatherBuilder gather(g_ceph_context, new C_SafeCond(&lock, &cond, &done));
+    for (vector<ObjectStore::Transaction*>::iterator p = entries.begin();
+	 p != entries.end(); ++p) {
+      bufferlist bl;
+      ::encode(**p, bl);
+      j.submit_entry(++seq, bl, 0, gather.new_sub());
+    }
+    gather.activate();
+    lock.Lock();
+    while (!done)
+      cond.Wait(lock);
+    lock.Unlock();
+    j.close();
+    finisher.stop();
+  }
+
+  g_ceph_context->_conf->set_val("journal_replay_threads", threads);
+  g_ceph_context->_conf->set_val("journal_replay_max_in_flight", max_in_flight);
+  g_ceph_context->_conf->apply_changes(NULL);
+  ObjectStore *store = new FileStore(dir, journal);
+  if (store->mount() < 0) {
+    delete store;
+    return NULL;
+  }
+  return store;
+}
+
+static string replay_str(bufferlist &bl)
+{
+  string s;
+  bl.copy(0, bl.length(), s);
+  return s;
+}
+
+/// every collection, object, xattr, omap header and key, flattened
+static void replay_dump(ObjectStore *store, map<string, string> *out)
+{
+  vector<coll_t> colls;
+  store->list_collections(colls);
+  for (vector<coll_t>::iterator c = colls.begin(); c != colls.end(); ++c) {
+    (*out)[stringify(*c)] = "";
+    vector<hobject_t> objs;
+    store->collection_list(*c, objs);
+    for (vector<hobject_t>::iterator o = objs.begin(); o != objs.end(); ++o) {
+      string prefix = stringify(*c) + "/" + stringify(*o);
+      bufferlist bl;
+      store->read(*c, *o, 0, 0, bl);
+      (*out)[prefix] = replay_str(bl);
+
+      map<string, bufferptr> attrs;
+      store->getattrs(*c, *o, attrs, true);
+      for (map<string, bufferptr>::iterator a = attrs.begin();
+	   a != attrs.end(); ++a)
+	(*out)[prefix + " attr " + a->first] =
+	  string(a->second.c_str(), a->second.length());
+
+      bufferlist header;
+      map<string, bufferlist> omap;
+      store->omap_get(*c, *o, &header, &omap);
+      (*out)[prefix + " omap_header"] = replay_str(header);
+      for (map<string, bufferlist>::iterator k = omap.begin();
+	   k != omap.end(); ++k)
+	(*out)[prefix + " omap " + k->first] = replay_str(k->second);
+    }
+  }
+}
+
+TEST(JournalReplayTest, ParallelMatchesSerial) {
+  vector<ObjectStore::Transaction*> entries;
+  replay_workload(&entries);
+
+  map<string, string> serial, parallel;
+  ObjectStore *store = replay_into("store_test_replay_serial", "1", "1024",
+				   entries);
+  ASSERT_TRUE(store);
+  replay_dump(store, &serial);
+  store->umount();
+  delete store;
+
+  // a small window so the reader keeps waiting on the workers
+  store = replay_into("store_test_replay_parallel", "4", "16", entries);
+  ASSERT_TRUE(store);
+  replay_dump(store, &parallel);
+  store->umount();
+  delete store;
+
+  g_ceph_context->_conf->set_val("journal_replay_threads", "4");
+  g_ceph_context->_conf->set_val("journal_replay_max_in_flight", "1024");
+  g_ceph_context->_conf->apply_changes(NULL);
+  for (vector<ObjectStore::Transaction*>::iterator p = entries.begin();
+       p != entries.end(); ++p)
+    delete *p;
+
+  // the journal really was replayed
+  string infos = stringify(coll_t::META_COLL) + "/" +
+    stringify(replay_obj("infos"));
+  ASSERT_EQ("entry 399", serial[infos + " omap last"]);
+  ASSERT_EQ("entry 390", serial[infos + " omap_header"]);
+
+  ASSERT_EQ(serial.size(), parallel.size());
+  for (map<string, string>::iterator p = serial.begin(); p != serial.end(); ++p) {
+    ASSERT_TRUE(parallel.count(p->first)) << p->first;
+    ASSERT_EQ(p->second, parallel[p->first]) << p->first;
+  }
+}
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
@@ -842,6 +842,100 @@ TEST(LibRadosAio, RoundTripWriteFullPP) {
   delete my_completion3;
 }
 
+TEST(LibRadosAio, RoundTripBatchPP) {
+  AioTestDataPP test_data;
+  ASSERT_EQ("", test_data.init());
+  const int num = 20;
+  char buf[128];
+  ObjectWriteOperation wops[num];
+  std::vector<pair<std::string, ObjectWriteOperation*> > writes;
+  for (int i = 0; i < num; ++i) {
+    ostringstream oss;
+    oss << "batch" << i;
+    memset(buf, i, sizeof(buf));
+    bufferlist bl;
+    bl.append(buf, sizeof(buf));
+    wops[i].write_full(bl);
+    writes.push_back(make_pair(oss.str(), &wops[i]));
+  }
+  AioCompletion *my_completion = test_data.m_cluster.aio_create_completion(
+	  (void*)&test_data, set_completion_complete, set_completion_safe);
+  AioCompletion *my_completion_null = NULL;
+  ASSERT_NE(my_completion, my_completion_null);
+  ASSERT_EQ(0, test_data.m_ioctx.aio_operate_batch(my_completion, writes));
+  {
+    TestAlarm alarm;
+    ASSERT_EQ(0, my_completion->wait_for_safe());
+  }
+  ASSERT_EQ(0, my_completion->get_return_value());
+
+  ObjectReadOperation rops[num];
+  std::vector<bufferlist> bls(num);
+  std::vector<int> rvals(num, -1);
+  std::vector<pair<std::string, ObjectReadOperation*> > reads;
+  for (int i = 0; i < num; ++i) {
+    rops[i].read(0, sizeof(buf), &bls[i], &rvals[i]);
+    reads.push_back(make_pair(writes[i].first, &rops[i]));
+  }
+  AioCompletion *my_completion2 = test_data.m_cluster.aio_create_completion(
+	  (void*)&test_data, set_completion_complete, set_completion_safe);
+  ASSERT_NE(my_completion2, my_completion_null);
+  ASSERT_EQ(0, test_data.m_ioctx.aio_operate_batch(my_completion2, reads));
+  {
+    TestAlarm alarm;
+    ASSERT_EQ(0, my_completion2->wait_for_complete());
+  }
+  ASSERT_EQ(0, my_completion2->get_return_value());
+  for (int i = 0; i < num; ++i) {
+    ASSERT_EQ(0, rvals[i]);
+    ASSERT_EQ(sizeof(buf), bls[i].length());
+    memset(buf, i, sizeof(buf));
+    ASSERT_EQ(0, memcmp(buf, bls[i].c_str(), sizeof(buf)));
+  }
+  delete my_completion;
+  delete my_completion2;
+}
+
+TEST(LibRadosAio, BatchOverBudgetPP) {
+  AioTestDataPP test_data;
+  ASSERT_EQ("", test_data.init());
+  // two batches, each bigger than the objecter_inflight_ops budget
+  const int num = 1500;
+  char buf[16];
+  ObjectWriteOperation wops[2 * num];
+  std::vector<pair<std::string, ObjectWriteOperation*> > writes[2];
+  for (int i = 0; i < 2 * num; ++i) {
+    ostringstream oss;
+    oss << "batch" << i;
+    memset(buf, i, sizeof(buf));
+    bufferlist bl;
+    bl.append(buf, sizeof(buf));
+    wops[i].write_full(bl);
+    writes[i / num].push_back(make_pair(oss.str(), &wops[i]));
+  }
+  AioCompletion *my_completion[2];
+  for (int i = 0; i < 2; ++i) {
+    my_completion[i] = test_data.m_cluster.aio_create_completion(
+	  (void*)&test_data, set_completion_complete, set_completion_safe);
+    ASSERT_EQ(0, test_data.m_ioctx.aio_operate_batch(my_completion[i],
+						      writes[i]));
+  }
+  {
+    TestAlarm alarm;
+    ASSERT_EQ(0, my_completion[0]->wait_for_safe());
+    ASSERT_EQ(0, my_completion[1]->wait_for_safe());
+  }
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_EQ(0, my_completion[i]->get_return_value());
+    delete my_completion[i];
+  }
+
+  bufferlist bl;
+  ASSERT_EQ((int)sizeof(buf), test_data.m_ioctx.read("batch2999", bl,
+						      sizeof(buf), 0));
+  memset(buf, 2999, sizeof(buf));
+  ASSERT_EQ(0, memcmp(buf, bl.c_str(), sizeof(buf)));
+}
 
 TEST(LibRadosAio, SimpleStat) {
   AioTestData test_data;
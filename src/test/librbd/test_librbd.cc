@@ -19,6 +19,7 @@
 
 #include "gtest/gtest.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <stdarg.h>
@@ -1703,6 +1704,452 @@ TEST(LibRBD, DiffIterateDiscard)
   ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
 }
 
+/// the whole objects that extents in s fall in
+interval_set<uint64_t> whole_objects(const interval_set<uint64_t>& s, int order)
+{
+  uint64_t object_size = 1ull << order;
+  interval_set<uint64_t> objects;
+  for (interval_set<uint64_t>::const_iterator p = s.begin(); p != s.end(); ++p) {
+    uint64_t start = p.get_start() & ~(object_size - 1);
+    uint64_t end = p.get_start() + p.get_len();
+    for (uint64_t o = start; o < end; o += object_size)
+      if (!objects.contains(o, object_size))
+	objects.insert(o, object_size);
+  }
+  return objects;
+}
+
+TEST(LibRBD, DiffIterateSparse)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  int seed = getpid();
+  cout << "seed " << seed << std::endl;
+  srand(seed);
+
+  {
+    librbd::RBD rbd;
+    librbd::Image image;
+    int order = 0;
+    const char *name = "testimg";
+    uint64_t size = 10ull << 30;
+
+    ASSERT_EQ(0, create_image_pp(rbd, ioctx, name, size, &order));
+    ASSERT_EQ(0, rbd.open(ioctx, image, name, NULL));
+
+    // a few small writes scattered over a big, mostly empty image
+    interval_set<uint64_t> one, two;
+    bufferlist bl;
+    bl.append(buffer::create(4096));
+    bl.zero();
+    for (int i = 0; i < 10; i++) {
+      uint64_t off = (rand() % (size >> 12)) << 12;
+      ASSERT_EQ(4096, image.write(off, 4096, bl));
+      if (!one.contains(off, 4096))
+	one.insert(off, 4096);
+    }
+    ASSERT_EQ(0, image.snap_create("one"));
+    for (int i = 0; i < 10; i++) {
+      uint64_t off = (rand() % (size >> 12)) << 12;
+      ASSERT_EQ(4096, image.write(off, 4096, bl));
+      if (!two.contains(off, 4096))
+	two.insert(off, 4096);
+    }
+
+    // remove one object written before the snap, so the diff since it
+    // has to find an object that no longer exists at the head
+    uint64_t object_size = 1ull << order;
+    interval_set<uint64_t> touched_two = whole_objects(two, order);
+    uint64_t removed = 0;
+    bool have_removed = false;
+    for (interval_set<uint64_t>::iterator p = one.begin(); p != one.end(); ++p) {
+      uint64_t obj_off = p.get_start() & ~(object_size - 1);
+      if (!touched_two.intersects(obj_off, object_size)) {
+	removed = obj_off;
+	have_removed = true;
+	break;
+      }
+    }
+    ASSERT_TRUE(have_removed);
+    ASSERT_EQ((int)object_size, image.discard(removed, object_size));
+    interval_set<uint64_t> gone;
+    gone.insert(removed, object_size);
+    interval_set<uint64_t> still_one = one;
+    interval_set<uint64_t> lost;
+    lost.intersection_of(one, gone);
+    still_one.subtract(lost);
+
+    // from the beginning of time: everything still there, and only in
+    // the objects that were written
+    interval_set<uint64_t> all;
+    all.union_of(still_one, two);
+    interval_set<uint64_t> diff;
+    ASSERT_EQ(0, image.diff_iterate(NULL, 0, size, iterate_cb, (void *)&diff));
+    cout << " full diff was " << diff << std::endl;
+    ASSERT_TRUE(all.subset_of(diff));
+    ASSERT_TRUE(diff.subset_of(whole_objects(all, order)));
+    ASSERT_FALSE(diff.intersects(removed, object_size));
+
+    // since the snap: the new writes and the removed object, nothing in
+    // objects only written before it
+    diff.clear();
+    ASSERT_EQ(0, image.diff_iterate("one", 0, size, iterate_cb, (void *)&diff));
+    cout << " diff since snap was " << diff << std::endl;
+    ASSERT_TRUE(two.subset_of(diff));
+    ASSERT_TRUE(lost.subset_of(diff));
+    interval_set<uint64_t> changed = touched_two;
+    changed.union_of(gone);
+    ASSERT_TRUE(diff.subset_of(changed));
+
+    // and at the snap itself, the removed object is still there
+    ASSERT_EQ(0, image.snap_set("one"));
+    diff.clear();
+    ASSERT_EQ(0, image.diff_iterate(NULL, 0, size, iterate_cb, (void *)&diff));
+    cout << " diff at snap was " << diff << std::endl;
+    ASSERT_TRUE(one.subset_of(diff));
+    ASSERT_TRUE(diff.subset_of(whole_objects(one, order)));
+  }
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibRBD, ObjectMap)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  {
+    librbd::RBD rbd;
+    int order = 22;
+    const char *name = "testimg";
+    uint64_t object_size = 1 << order;
+    uint64_t size = 1000 * object_size;
+
+    ASSERT_EQ(0, rbd.create2(ioctx, name, size,
+			     RBD_FEATURE_LAYERING | RBD_FEATURE_OBJECT_MAP,
+			     &order));
+
+    bufferlist bl, zero_bl, read_bl;
+    bl.append(string(4096, '1'));
+    zero_bl.append(buffer::create(4096));
+    zero_bl.zero();
+
+    {
+      librbd::Image image;
+      ASSERT_EQ(0, rbd.open(ioctx, image, name, NULL));
+
+      ASSERT_EQ(4096, image.write(3 * object_size, 4096, bl));
+      ASSERT_EQ(0, image.snap_create("one"));
+      ASSERT_EQ(4096, image.write(700 * object_size + 8192, 4096, bl));
+
+      // written and unwritten objects read back right
+      ASSERT_EQ(4096, image.read(3 * object_size, 4096, read_bl));
+      ASSERT_TRUE(read_bl.contents_equal(bl));
+      read_bl.clear();
+      ASSERT_EQ(4096, image.read(700 * object_size + 8192, 4096, read_bl));
+      ASSERT_TRUE(read_bl.contents_equal(bl));
+      read_bl.clear();
+      ASSERT_EQ(4096, image.read(500 * object_size, 4096, read_bl));
+      ASSERT_TRUE(read_bl.contents_equal(zero_bl));
+
+      // and so does the snapshot
+      {
+	librbd::Image snap;
+	ASSERT_EQ(0, rbd.open(ioctx, snap, name, "one"));
+	read_bl.clear();
+	ASSERT_EQ(4096, snap.read(3 * object_size, 4096, read_bl));
+	ASSERT_TRUE(read_bl.contents_equal(bl));
+	read_bl.clear();
+	ASSERT_EQ(4096, snap.read(700 * object_size + 8192, 4096, read_bl));
+	ASSERT_TRUE(read_bl.contents_equal(zero_bl));
+      }
+
+      interval_set<uint64_t> expected, diff;
+      expected.insert(3 * object_size, 4096);
+      expected.insert(700 * object_size + 8192, 4096);
+      ASSERT_EQ(0, image.diff_iterate(NULL, 0, size, iterate_cb, (void *)&diff));
+      ASSERT_TRUE(expected.subset_of(diff));
+      ASSERT_EQ(2, diff.num_intervals());
+      diff.clear();
+      expected.erase(3 * object_size, 4096);
+      ASSERT_EQ(0, image.diff_iterate("one", 0, size, iterate_cb, (void *)&diff));
+      ASSERT_TRUE(expected.subset_of(diff));
+      ASSERT_EQ(1, diff.num_intervals());
+
+      // shrink past the second write and grow back: it must be gone
+      ASSERT_EQ(0, image.resize(600 * object_size));
+      ASSERT_EQ(0, image.resize(size));
+      read_bl.clear();
+      ASSERT_EQ(4096, image.read(700 * object_size + 8192, 4096, read_bl));
+      ASSERT_TRUE(read_bl.contents_equal(zero_bl));
+
+      // rolling back restores the first write
+      ASSERT_EQ(4096, image.write(3 * object_size, 4096, zero_bl));
+      ASSERT_EQ(0, image.snap_rollback("one"));
+      read_bl.clear();
+      ASSERT_EQ(4096, image.read(3 * object_size, 4096, read_bl));
+      ASSERT_TRUE(read_bl.contents_equal(bl));
+
+      ASSERT_EQ(0, image.snap_remove("one"));
+    }
+    ASSERT_EQ(0, rbd.remove(ioctx, name));
+  }
+
+  // the maps go with the image
+  for (librados::ObjectIterator it = ioctx.objects_begin();
+       it != ioctx.objects_end(); ++it) {
+    ASSERT_NE(0, it->first.compare(0, strlen(RBD_OBJECT_MAP_PREFIX),
+				   RBD_OBJECT_MAP_PREFIX));
+  }
+
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibRBD, ObjectMapTwoClients)
+{
+  librados::Rados rados, rados2;
+  librados::IoCtx ioctx, ioctx2;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+  ASSERT_EQ("", connect_cluster_pp(rados2));
+  ASSERT_EQ(0, rados2.ioctx_create(pool_name.c_str(), ioctx2));
+
+  {
+    librbd::RBD rbd;
+    int order = 22;
+    const char *name = "testimg";
+    uint64_t object_size = 1 << order;
+    uint64_t size = 100 * object_size;
+
+    ASSERT_EQ(0, rbd.create2(ioctx, name, size,
+			     RBD_FEATURE_LAYERING | RBD_FEATURE_OBJECT_MAP,
+			     &order));
+
+    bufferlist bl, bl2, read_bl;
+    bl.append(string(4096, '1'));
+    bl2.append(string(4096, '2'));
+
+    {
+      librbd::Image a, b;
+      ASSERT_EQ(0, rbd.open(ioctx, a, name, NULL));
+      ASSERT_EQ(0, rbd.open(ioctx2, b, name, NULL));
+
+      // objects the other client creates don't show up in our map
+      ASSERT_EQ(4096, b.write(10 * object_size, 4096, bl));
+      ASSERT_EQ(0, b.flush());
+      ASSERT_EQ(4096, a.read(10 * object_size, 4096, read_bl));
+      ASSERT_TRUE(read_bl.contents_equal(bl));
+
+      // nor do they with a lock held by someone else
+      ASSERT_EQ(0, b.lock_exclusive("b"));
+      ASSERT_EQ(4096, b.write(20 * object_size, 4096, bl2));
+      ASSERT_EQ(0, b.flush());
+      read_bl.clear();
+      ASSERT_EQ(4096, a.read(20 * object_size, 4096, read_bl));
+      ASSERT_TRUE(read_bl.contents_equal(bl2));
+      ASSERT_EQ(0, b.unlock("b"));
+
+      // the lock holder still reads what it wrote
+      ASSERT_EQ(0, a.lock_exclusive("a"));
+      ASSERT_EQ(4096, a.write(30 * object_size, 4096, bl));
+      read_bl.clear();
+      ASSERT_EQ(4096, a.read(30 * object_size, 4096, read_bl));
+      ASSERT_TRUE(read_bl.contents_equal(bl));
+
+      // a snapshot's map is only sealed once the lock holder has
+      // merged its writes into it
+      ASSERT_EQ(0, b.snap_create("snap"));
+      string snap_map;
+      for (librados::ObjectIterator it = ioctx.objects_begin();
+	   it != ioctx.objects_end(); ++it) {
+	if (it->first.compare(0, strlen(RBD_OBJECT_MAP_PREFIX),
+			      RBD_OBJECT_MAP_PREFIX) == 0 &&
+	    it->first.find('.', strlen(RBD_OBJECT_MAP_PREFIX)) != string::npos)
+	  snap_map = it->first;
+      }
+      ASSERT_NE("", snap_map);
+      bufferlist attr;
+      ASSERT_EQ(-ENODATA, ioctx.getxattr(snap_map, RBD_OBJECT_MAP_SEALED,
+					 attr));
+      ASSERT_EQ(4096, a.write(40 * object_size, 4096, bl));
+      ASSERT_LE(0, ioctx.getxattr(snap_map, RBD_OBJECT_MAP_SEALED, attr));
+      {
+	librbd::Image snap;
+	ASSERT_EQ(0, rbd.open(ioctx, snap, name, "snap"));
+	read_bl.clear();
+	ASSERT_EQ(4096, snap.read(30 * object_size, 4096, read_bl));
+	ASSERT_TRUE(read_bl.contents_equal(bl));
+      }
+      ASSERT_EQ(0, a.unlock("a"));
+      ASSERT_EQ(0, a.snap_remove("snap"));
+    }
+    ASSERT_EQ(0, rbd.remove(ioctx, name));
+  }
+
+  ioctx2.close();
+  rados2.shutdown();
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibRBD, ObjectMapAioWrites)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  {
+    librbd::RBD rbd;
+    int order = 22;
+    const char *name = "testimg";
+    uint64_t object_size = 1 << order;
+    const int num_objects = 50;
+    uint64_t size = num_objects * object_size;
+
+    ASSERT_EQ(0, rbd.create2(ioctx, name, size,
+			     RBD_FEATURE_LAYERING | RBD_FEATURE_OBJECT_MAP,
+			     &order));
+
+    bufferlist bl, bl2, read_bl;
+    bl.append(string(4096, '1'));
+    bl2.append(string(4096, '2'));
+
+    {
+      librbd::Image image;
+      ASSERT_EQ(0, rbd.open(ioctx, image, name, NULL));
+
+      // new objects, each written twice before anything completes: the
+      // second write must still land last
+      vector<librbd::RBD::AioCompletion *> comps;
+      for (int i = 0; i < num_objects; ++i) {
+	for (int j = 0; j < 2; ++j) {
+	  librbd::RBD::AioCompletion *comp =
+	    new librbd::RBD::AioCompletion(NULL, NULL);
+	  ASSERT_EQ(0, image.aio_write(i * object_size, 4096, j ? bl2 : bl,
+				       comp));
+	  comps.push_back(comp);
+	}
+      }
+      librbd::RBD::AioCompletion *flush_comp =
+	new librbd::RBD::AioCompletion(NULL, NULL);
+      ASSERT_EQ(0, image.aio_flush(flush_comp));
+      ASSERT_EQ(0, flush_comp->wait_for_complete());
+      ASSERT_EQ(0, flush_comp->get_return_value());
+      flush_comp->release();
+      for (size_t i = 0; i < comps.size(); ++i) {
+	ASSERT_EQ(1, comps[i]->is_complete());
+	ASSERT_EQ(0, comps[i]->get_return_value());
+	comps[i]->release();
+      }
+    }
+
+    // a fresh open trusts the map it reads back
+    {
+      librbd::Image image;
+      ASSERT_EQ(0, rbd.open(ioctx, image, name, NULL));
+      for (int i = 0; i < num_objects; ++i) {
+	read_bl.clear();
+	ASSERT_EQ(4096, image.read(i * object_size, 4096, read_bl));
+	ASSERT_TRUE(read_bl.contents_equal(bl2));
+      }
+    }
+    ASSERT_EQ(0, rbd.remove(ioctx, name));
+  }
+
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibRBD, WriteLogSecondOpen)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  char dir[] = "/tmp/test_librbd_write_log.XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != NULL);
+  ASSERT_EQ(0, rados.conf_set("rbd_write_log_path", dir));
+
+  {
+    librbd::RBD rbd;
+    int order = 22;
+    const char *name = "testimg";
+    uint64_t size = 10 << order;
+    ASSERT_EQ(0, rbd.create(ioctx, name, size, &order));
+
+    bufferlist bl, read_bl;
+    bl.append(string(4096, '1'));
+
+    {
+      // the first open gets the log; a second writer, even on the same
+      // host, would have its writes undone when the log is written back
+      librbd::Image a, b;
+      ASSERT_EQ(0, rbd.open(ioctx, a, name, NULL));
+      ASSERT_EQ(-EBUSY, rbd.open(ioctx, b, name, NULL));
+      ASSERT_EQ(0, rbd.open_read_only(ioctx, b, name, NULL));
+
+      // a snapshot has what was flushed, though it was only in the log
+      ASSERT_EQ(4096, a.write(0, 4096, bl));
+      ASSERT_EQ(0, a.flush());
+      ASSERT_EQ(0, a.snap_create("snap"));
+      {
+	librbd::Image at_snap;
+	ASSERT_EQ(0, rbd.open_read_only(ioctx, at_snap, name, "snap"));
+	ASSERT_EQ(4096, at_snap.read(0, 4096, read_bl));
+	ASSERT_TRUE(read_bl.contents_equal(bl));
+      }
+      ASSERT_EQ(0, a.snap_remove("snap"));
+
+      // an opener that can't reach the log may not write
+      ASSERT_EQ(0, rados.conf_set("rbd_write_log_path", ""));
+      librbd::Image c;
+      ASSERT_EQ(-EBUSY, rbd.open(ioctx, c, name, NULL));
+      ASSERT_EQ(0, rbd.open_read_only(ioctx, c, name, NULL));
+      ASSERT_EQ(0, rados.conf_set("rbd_write_log_path", dir));
+    }
+
+    // once the log is written back and closed, it may
+    {
+      ASSERT_EQ(0, rados.conf_set("rbd_write_log_path", ""));
+      librbd::Image c;
+      ASSERT_EQ(0, rbd.open(ioctx, c, name, NULL));
+    }
+    ASSERT_EQ(0, rbd.remove(ioctx, name));
+  }
+
+  ASSERT_EQ(0, rados.conf_set("rbd_write_log_path", ""));
+  DIR *d = opendir(dir);
+  ASSERT_TRUE(d != NULL);
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    if (de->d_name[0] != '.')
+      unlink((string(dir) + "/" + de->d_name).c_str());
+  }
+  closedir(d);
+  ASSERT_EQ(0, rmdir(dir));
+
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
 TEST(LibRBD, DiffIterateStress)
 {
   librados::Rados rados;
@@ -1772,3 +2219,223 @@ TEST(LibRBD, DiffIterateStress)
   ioctx.close();
   ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
 }
+
+/*
+ * A writeback cache split into shards, with objects small enough that
+ * every test touches all of them.
+ */
+static void set_sharded_cache(librados::Rados &rados, bool cache)
+{
+  ASSERT_EQ(0, rados.conf_set("rbd_cache", cache ? "true" : "false"));
+  ASSERT_EQ(0, rados.conf_set("rbd_cache_shards", cache ? "4" : "1"));
+}
+
+static void read_and_check(librbd::Image &image, uint64_t off, size_t len,
+			   char c)
+{
+  bufferlist bl;
+  ASSERT_EQ((ssize_t)len, image.read(off, len, bl));
+  ASSERT_EQ(string(len, c), string(bl.c_str(), bl.length()))
+    << "at " << off << "~" << len;
+}
+
+TEST(LibRBD, ShardedCacheFlush)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  {
+    librbd::RBD rbd;
+    int order = 16;
+    const char *name = "testimg";
+    int num_objs = 32;
+    uint64_t obj_size = 1 << order;
+    uint64_t size = num_objs * obj_size;
+    ASSERT_EQ(0, create_image_pp(rbd, ioctx, name, size, &order));
+
+    set_sharded_cache(rados, true);
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name, NULL));
+
+    librbd::RBD::AioCompletion *comps[num_objs];
+    for (int i = 0; i < num_objs; ++i) {
+      bufferlist bl;
+      bl.append(string(4096, 'a' + i % 26));
+      comps[i] = new librbd::RBD::AioCompletion(NULL, NULL);
+      ASSERT_EQ(0, image.aio_write(i * obj_size + 512, 4096, bl, comps[i]));
+    }
+
+    // one flush covers the dirty data of every shard
+    librbd::RBD::AioCompletion *flush_comp =
+      new librbd::RBD::AioCompletion(NULL, NULL);
+    ASSERT_EQ(0, image.aio_flush(flush_comp));
+    ASSERT_EQ(0, flush_comp->wait_for_complete());
+    ASSERT_EQ(0, flush_comp->get_return_value());
+    flush_comp->release();
+    for (int i = 0; i < num_objs; ++i) {
+      ASSERT_EQ(1, comps[i]->is_complete());
+      ASSERT_EQ(0, comps[i]->get_return_value());
+      comps[i]->release();
+    }
+
+    // so an uncached open sees all of it
+    set_sharded_cache(rados, false);
+    librbd::Image other;
+    ASSERT_EQ(0, rbd.open(ioctx, other, name, NULL));
+    for (int i = 0; i < num_objs; ++i) {
+      read_and_check(other, i * obj_size, 512, '\0');
+      read_and_check(other, i * obj_size + 512, 4096, 'a' + i % 26);
+    }
+  }
+
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibRBD, ShardedCacheDiscard)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  {
+    librbd::RBD rbd;
+    int order = 16;
+    const char *name = "testimg";
+    uint64_t obj_size = 1 << order;
+    uint64_t size = 16 * obj_size;
+    ASSERT_EQ(0, create_image_pp(rbd, ioctx, name, size, &order));
+
+    set_sharded_cache(rados, true);
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name, NULL));
+
+    bufferlist bl;
+    bl.append(string(size, 'x'));
+    ASSERT_EQ((ssize_t)size, image.write(0, size, bl));
+
+    // the tail of one object, ten whole ones and the head of another,
+    // spread over every shard and still dirty
+    uint64_t off = obj_size / 2;
+    uint64_t len = 11 * obj_size;
+    ASSERT_EQ((int)len, image.discard(off, len));
+    read_and_check(image, 0, off, 'x');
+    read_and_check(image, off, len, '\0');
+    read_and_check(image, off + len, size - off - len, 'x');
+
+    ASSERT_EQ(0, image.flush());
+    set_sharded_cache(rados, false);
+    librbd::Image other;
+    ASSERT_EQ(0, rbd.open(ioctx, other, name, NULL));
+    read_and_check(other, 0, off, 'x');
+    read_and_check(other, off, len, '\0');
+    read_and_check(other, off + len, size - off - len, 'x');
+  }
+
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibRBD, ShardedCacheInvalidate)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  {
+    librbd::RBD rbd;
+    int order = 16;
+    const char *name = "testimg";
+    uint64_t obj_size = 1 << order;
+    uint64_t size = 16 * obj_size;
+    ASSERT_EQ(0, create_image_pp(rbd, ioctx, name, size, &order));
+
+    set_sharded_cache(rados, true);
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name, NULL));
+
+    bufferlist a, b;
+    a.append(string(size, 'a'));
+    b.append(string(size, 'b'));
+    ASSERT_EQ((ssize_t)size, image.write(0, size, a));
+    ASSERT_EQ(0, image.snap_create("snap"));
+
+    // rolling back drops what every shard holds, dirty or not
+    ASSERT_EQ((ssize_t)size, image.write(0, size, b));
+    read_and_check(image, 0, size, 'b');
+    ASSERT_EQ(0, image.snap_rollback("snap"));
+    read_and_check(image, 0, size, 'a');
+
+    // as does shrinking: nothing cached survives past the new end
+    ASSERT_EQ(0, image.resize(2 * obj_size));
+    ASSERT_EQ(0, image.resize(size));
+    read_and_check(image, 0, 2 * obj_size, 'a');
+    read_and_check(image, 2 * obj_size, size - 2 * obj_size, '\0');
+
+    ASSERT_EQ(0, image.snap_remove("snap"));
+  }
+
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibRBD, ShardedCacheDirtyLimit)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  {
+    librbd::RBD rbd;
+    int order = 16;
+    const char *name = "testimg";
+    int num_objs = 32;
+    uint64_t obj_size = 1 << order;
+    uint64_t size = num_objs * obj_size;
+    ASSERT_EQ(0, create_image_pp(rbd, ioctx, name, size, &order));
+
+    // less dirty data than one object allowed, for all shards together,
+    // so writers wait on writeback in other shards than their own
+    set_sharded_cache(rados, true);
+    ASSERT_EQ(0, rados.conf_set("rbd_cache_max_dirty", "32768"));
+    ASSERT_EQ(0, rados.conf_set("rbd_cache_target_dirty", "16384"));
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name, NULL));
+
+    librbd::RBD::AioCompletion *comps[num_objs];
+    for (int i = 0; i < num_objs; ++i) {
+      bufferlist bl;
+      bl.append(string(16384, 'a' + i % 26));
+      comps[i] = new librbd::RBD::AioCompletion(NULL, NULL);
+      ASSERT_EQ(0, image.aio_write(i * obj_size, 16384, bl, comps[i]));
+    }
+    ASSERT_EQ(0, image.flush());
+    for (int i = 0; i < num_objs; ++i) {
+      ASSERT_EQ(0, comps[i]->wait_for_complete());
+      ASSERT_EQ(0, comps[i]->get_return_value());
+      comps[i]->release();
+    }
+
+    set_sharded_cache(rados, false);
+    librbd::Image other;
+    ASSERT_EQ(0, rbd.open(ioctx, other, name, NULL));
+    for (int i = 0; i < num_objs; ++i)
+      read_and_check(other, i * obj_size, 16384, 'a' + i % 26);
+  }
+
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
@@ -0,0 +1,110 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "mon/PGMap.h"
+#include "gtest/gtest.h"
+
+static pg_stat_t make_stat(int state, int primary, utime_t t, epoch_t lec)
+{
+  pg_stat_t s;
+  s.state = state;
+  s.acting.push_back(primary);
+  s.last_active = t;
+  s.last_clean = t;
+  s.last_unstale = t;
+  s.last_epoch_clean = lec;
+  return s;
+}
+
+// walk every pg, the way get_stuck_stats() used to
+static unsigned count_stuck(const PGMap &m, PGMap::StuckPG type, utime_t cutoff)
+{
+  unsigned n = 0;
+  for (hash_map<pg_t,pg_stat_t>::const_iterator p = m.pg_stat.begin();
+       p != m.pg_stat.end();
+       ++p) {
+    switch (type) {
+    case PGMap::STUCK_INACTIVE:
+      if ((p->second.state & PG_STATE_ACTIVE) == 0 && p->second.last_active < cutoff)
+	n++;
+      break;
+    case PGMap::STUCK_UNCLEAN:
+      if ((p->second.state & PG_STATE_CLEAN) == 0 && p->second.last_clean < cutoff)
+	n++;
+      break;
+    case PGMap::STUCK_STALE:
+      if ((p->second.state & PG_STATE_STALE) && p->second.last_unstale < cutoff)
+	n++;
+      break;
+    default:
+      break;
+    }
+  }
+  return n;
+}
+
+TEST(PGMap, IncrementalIndexes)
+{
+  PGMap m;
+  int states[] = { PG_STATE_ACTIVE | PG_STATE_CLEAN,
+		   PG_STATE_ACTIVE,
+		   PG_STATE_PEERING,
+		   PG_STATE_STALE | PG_STATE_ACTIVE };
+  srand(1);
+  for (int round = 0; round < 50; ++round) {
+    PGMap::Incremental inc;
+    inc.version = m.version + 1;
+    inc.stamp = utime_t(1000 + round, 0);
+    for (int i = 0; i < 20; ++i) {
+      pg_t pgid(rand() % 64, rand() % 3, -1);
+      inc.pg_stat_updates[pgid] = make_stat(states[rand() % 4], rand() % 8,
+					    utime_t(rand() % 100, 0),
+					    rand() % 10 + 1);
+    }
+    if (round % 5 == 4)
+      inc.pg_remove.insert(m.pg_stat.begin()->first);
+    m.apply_incremental(NULL, inc);
+
+    for (int t = PGMap::STUCK_INACTIVE; t < PGMap::STUCK_NONE; ++t) {
+      hash_map<pg_t,pg_stat_t> stuck;
+      m.get_stuck_stats((PGMap::StuckPG)t, utime_t(50, 0), stuck);
+      ASSERT_EQ(count_stuck(m, (PGMap::StuckPG)t, utime_t(50, 0)), stuck.size());
+    }
+
+    epoch_t min = 0;
+    unsigned by_osd = 0;
+    for (hash_map<pg_t,pg_stat_t>::iterator p = m.pg_stat.begin();
+	 p != m.pg_stat.end();
+	 ++p) {
+      if (min == 0 || p->second.last_epoch_clean < min)
+	min = p->second.last_epoch_clean;
+      ASSERT_TRUE(m.pg_by_osd[p->second.acting[0]].count(p->first));
+    }
+    for (hash_map<int,set<pg_t> >::iterator p = m.pg_by_osd.begin();
+	 p != m.pg_by_osd.end();
+	 ++p)
+      by_osd += p->second.size();
+    ASSERT_EQ(min, m.calc_min_last_epoch_clean());
+    ASSERT_EQ(m.pg_stat.size(), by_osd);
+  }
+
+  // a full recalculation must agree with the incrementally built state
+  PGMap c;
+  bufferlist bl;
+  m.encode(bl);
+  bufferlist::iterator p = bl.begin();
+  c.decode(p);
+  ASSERT_EQ(m.stuck_inactive, c.stuck_inactive);
+  ASSERT_EQ(m.stuck_unclean, c.stuck_unclean);
+  ASSERT_EQ(m.stuck_stale, c.stuck_stale);
+  ASSERT_EQ(m.num_pg_by_last_epoch_clean, c.num_pg_by_last_epoch_clean);
+}
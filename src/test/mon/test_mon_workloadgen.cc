@@ -49,6 +49,7 @@
 #include "messages/MOSDPGRemove.h"
 #include "messages/MOSDMap.h"
 #include "messages/MPGStats.h"
+#include "messages/MPGStatsAck.h"
 #include "messages/MLog.h"
 #include "messages/MOSDPGTemp.h"
 
@@ -310,6 +311,11 @@ class OSDStub : public TestStub
   utime_t last_boot_attempt;
   static const double STUB_BOOT_INTERVAL;
 
+  double tick_interval;
+  // committed updates, as observed through the mons' replies
+  uint64_t num_pgstats_acked;
+  uint64_t num_osdmap_epochs;
+
 
  public:
 
@@ -339,7 +345,7 @@ class OSDStub : public TestStub
   };
 
 
-  OSDStub(int whoami, CephContext *cct)
+  OSDStub(int whoami, CephContext *cct, double tick_interval = 1.0)
     : TestStub(cct, "osd"),
       auth_handler_registry(new AuthAuthorizeHandlerRegistry(
 				  cct,
@@ -348,7 +354,10 @@ class OSDStub : public TestStub
 				  cct->_conf->auth_supported)),
       whoami(whoami),
       gen(whoami),
-      mon_osd_rng(STUB_MON_OSD_FIRST, STUB_MON_OSD_LAST)
+      mon_osd_rng(STUB_MON_OSD_FIRST, STUB_MON_OSD_LAST),
+      tick_interval(tick_interval),
+      num_pgstats_acked(0),
+      num_osdmap_epochs(0)
   {
     dout(20) << __func__ << " auth supported: "
 	     << cct->_conf->auth_supported << dendl;
@@ -428,7 +437,7 @@ class OSDStub : public TestStub
 
     update_osd_stat();
 
-    start_ticking();
+    start_ticking(tick_interval);
     // give a chance to the mons to inform us of what PGs we should create
     timer.add_event_after(30.0, new C_CreatePGs(this));
 
@@ -801,6 +810,8 @@ class OSDStub : public TestStub
     }
 
     epoch_t start_full = MAX(osdmap.get_epoch() + 1, first);
+    if (osdmap.get_epoch() > 0)
+      num_osdmap_epochs += last - osdmap.get_epoch();
 
     if (m->maps.size() > 0) {
       map<epoch_t,bufferlist>::reverse_iterator rit;
@@ -870,6 +881,11 @@ class OSDStub : public TestStub
     case CEPH_MSG_OSD_MAP:
       handle_osd_map((MOSDMap*)m);
       break;
+    case MSG_PGSTATSACK:
+      // the mon only acks our stats once they have been committed
+      num_pgstats_acked++;
+      m->put();
+      break;
     default:
       m->put();
       break;
@@ -877,6 +893,14 @@ class OSDStub : public TestStub
     return true;
   }
 
+  uint64_t get_num_pgstats_acked() {
+    return num_pgstats_acked;
+  }
+
+  uint64_t get_num_osdmap_epochs() {
+    return num_osdmap_epochs;
+  }
+
   void ms_handle_connect(Connection *con) {
     dout(1) << __func__ << " " << con << dendl;
     if (con->get_peer_type() == CEPH_ENTITY_TYPE_MON) {
@@ -951,6 +975,12 @@ Test-specific Options:\n\
   --stub-id ID1..ID2        Interval of OSD ids for multiple stubs to mimic.\n\
   --stub-id ID              OSD id a stub will mimic to be\n\
                             (same as --stub-id ID..ID)\n\
+  --duration SECONDS        Run the test for SECONDS (default: 300)\n\
+  --tick SECONDS            Interval between each stub's random ops\n\
+                            (default: 1.0); lower it to stress the mons\n\
+\n\
+On exit, the rate of committed pgmap updates (acked pg stats) and osdmap\n\
+epochs observed by the stubs is reported.\n\
 " << std::endl;
 }
 
@@ -996,6 +1026,7 @@ int main(int argc, const char *argv[])
 
   set<int> stub_ids;
   double duration = 300.0;
+  double tick_interval = 1.0;
 
   for (std::vector<const char*>::iterator i = args.begin(); i != args.end();) {
     string val;
@@ -1021,6 +1052,15 @@ int main(int argc, const char *argv[])
 		  << err << std::endl;
 	exit(1);
       }
+    } else if (ceph_argparse_witharg(args, i, &val,
+	"--tick", (char*) NULL)) {
+      string err;
+      tick_interval = strict_strtod(val.c_str(), &err);
+      if (!err.empty() || tick_interval <= 0) {
+	std::cerr << "** error parsing '--tick " << val << "': '"
+		  << err << std::endl;
+	exit(1);
+      }
     } else if (ceph_argparse_flag(args, i, "--help", (char*) NULL)) {
       usage();
       exit(0);
@@ -1041,7 +1081,7 @@ int main(int argc, const char *argv[])
     int whoami = *i;
 
     std::cout << __func__ << " starting stub." << whoami << std::endl;
-    OSDStub *stub = new OSDStub(whoami, g_ceph_context);
+    OSDStub *stub = new OSDStub(whoami, g_ceph_context, tick_interval);
     int err = stub->init();
     if (err < 0) {
       std::cerr << "** osd stub error: " << cpp_strerror(-err) << std::endl;
@@ -1063,6 +1103,8 @@ int main(int argc, const char *argv[])
   register_async_signal_handler_oneshot(SIGINT, handle_test_signal);
   register_async_signal_handler_oneshot(SIGTERM, handle_test_signal);
 
+  utime_t start = ceph_clock_now(g_ceph_context);
+
   shutdown_lock.Lock();
   shutdown_timer = new SafeTimer(g_ceph_context, shutdown_lock);
   shutdown_timer->init();
@@ -1081,18 +1123,32 @@ int main(int argc, const char *argv[])
   unregister_async_signal_handler(SIGINT, handle_test_signal);
   unregister_async_signal_handler(SIGTERM, handle_test_signal);
 
+  double elapsed = (double)(ceph_clock_now(g_ceph_context) - start);
   std::cout << __func__ << " waiting for stubs to finish" << std::endl;
   vector<TestStub*>::iterator it;
   int i;
+  uint64_t pgstats_acked = 0, osdmap_epochs = 0;
   for (i = 0, it = stubs.begin(); it != stubs.end(); ++it, ++i) {
     if (*it != NULL) {
       (*it)->shutdown();
       (*it)->wait();
+      OSDStub *osd_stub = dynamic_cast<OSDStub*>(*it);
+      if (osd_stub) {
+	pgstats_acked += osd_stub->get_num_pgstats_acked();
+	osdmap_epochs = MAX(osdmap_epochs, osd_stub->get_num_osdmap_epochs());
+      }
       std::cout << __func__ << " finished " << (*it)->get_name() << std::endl;
       delete (*it);
       (*it) = NULL;
     }
   }
 
+  std::cout << __func__ << " committed over " << elapsed << "s:"
+	    << " pg stats " << pgstats_acked
+	    << " (" << (elapsed > 0 ? pgstats_acked / elapsed : 0) << "/s),"
+	    << " osdmap epochs " << osdmap_epochs
+	    << " (" << (elapsed > 0 ? osdmap_epochs / elapsed : 0) << "/s)"
+	    << std::endl;
+
   return 0;
 }
@@ -0,0 +1,282 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "os/IndexManager.h"
+#include "os/ObjectStore.h"
+#include "os/chain_xattr.h"
+#include "common/Clock.h"
+#include "common/ceph_argparse.h"
+#include "common/perf_counters.h"
+#include "global/global_init.h"
+#include <gtest/gtest.h>
+
+/**
+ * Collections whose subdirs split once they hold more than 16 objects,
+ * in a fresh directory for each test.
+ */
+class IndexManagerTest : public ::testing::Test {
+public:
+  IndexManager manager;
+  PerfCounters *logger;
+  string base;
+
+  IndexManagerTest() : manager(false), logger(NULL) {}
+
+  virtual void SetUp() {
+    set_conf("filestore_merge_threshold", "1");
+    set_conf("filestore_split_multiple", "1");
+    set_conf("filestore_split_ops_per_sec", "0");
+    set_conf("filestore_split_inline_fill", "4");
+
+    PerfCountersBuilder plb(g_ceph_context, "index_manager_test",
+			    l_os_split_queue - 1, l_os_split_lat + 1);
+    plb.add_u64(l_os_split_queue, "split_queue");
+    plb.add_u64_counter(l_os_splits, "splits");
+    plb.add_time_avg(l_os_split_lat, "split_latency");
+    logger = plb.create_perf_counters();
+
+    base = string("index_manager_test_") +
+      ::testing::UnitTest::GetInstance()->current_test_info()->name();
+    ASSERT_EQ(0, ::system(("rm -rf " + base).c_str()));
+    ASSERT_EQ(0, ::mkdir(base.c_str(), 0700));
+  }
+
+  virtual void TearDown() {
+    manager.stop_split_thread();
+    delete logger;
+    ::system(("rm -rf " + base).c_str());
+  }
+
+  void set_conf(const char *key, const char *val) {
+    g_ceph_context->_conf->set_val(key, val);
+    g_ceph_context->_conf->apply_changes(NULL);
+  }
+
+  string path(coll_t c) {
+    return base + "/" + c.to_str();
+  }
+
+  hobject_t object(int i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "obj_%d", i);
+    return hobject_t(object_t(buf), "", CEPH_NOSNAP, i * 0x01010101, 0);
+  }
+
+  int create_collection(coll_t c) {
+    if (::mkdir(path(c).c_str(), 0700) < 0)
+      return -errno;
+    return manager.init_index(c, path(c).c_str(),
+			      CollectionIndex::HOBJECT_WITH_POOL);
+  }
+
+  /// create objects [from, to) through index
+  int create_objects(Index &index, int from, int to) {
+    for (int i = from; i < to; ++i) {
+      hobject_t hoid = object(i);
+      CollectionIndex::IndexedPath p;
+      int exists;
+      int r = index->lookup(hoid, &p, &exists);
+      if (r < 0)
+	return r;
+      int fd = ::creat(p->path(), 0600);
+      if (fd < 0)
+	return -errno;
+      ::close(fd);
+      r = index->created(hoid, p->path());
+      if (r < 0)
+	return r;
+    }
+    return 0;
+  }
+
+  /// number of hash subdirs at the root of c
+  int subdirs(coll_t c) {
+    DIR *dir = ::opendir(path(c).c_str());
+    if (!dir)
+      return -errno;
+    int n = 0;
+    struct dirent *de;
+    while ((de = ::readdir(dir)) != NULL)
+      if (strncmp(de->d_name, "DIR_", 4) == 0)
+	++n;
+    ::closedir(dir);
+    return n;
+  }
+
+  /// wait up to 30s for the split thread to have done n splits
+  bool wait_for_splits(uint64_t n) {
+    for (int i = 0; i < 3000; ++i) {
+      if (logger->get(l_os_splits) >= n)
+	return true;
+      usleep(10000);
+    }
+    return false;
+  }
+};
+
+TEST_F(IndexManagerTest, split_inline_without_thread) {
+  coll_t c("inline");
+  ASSERT_EQ(0, create_collection(c));
+  {
+    Index index;
+    ASSERT_EQ(0, manager.get_index(c, path(c).c_str(), &index));
+    ASSERT_EQ(0, create_objects(index, 0, 17));
+    // split by the create that crossed the threshold
+    ASSERT_LT(0, subdirs(c));
+  }
+  ASSERT_EQ(0u, logger->get(l_os_splits));
+}
+
+TEST_F(IndexManagerTest, split_in_background) {
+  coll_t c("background");
+  ASSERT_EQ(0, create_collection(c));
+  manager.start_split_thread(logger);
+  {
+    Index index;
+    ASSERT_EQ(0, manager.get_index(c, path(c).c_str(), &index));
+    ASSERT_EQ(0, create_objects(index, 0, 17));
+    // queued, and the thread can't get at it while we hold the index
+    ASSERT_EQ(0, subdirs(c));
+    ASSERT_EQ(1u, logger->get(l_os_split_queue));
+    // more creates don't queue it twice
+    ASSERT_EQ(0, create_objects(index, 17, 20));
+    ASSERT_EQ(1u, logger->get(l_os_split_queue));
+  }
+  ASSERT_TRUE(wait_for_splits(1));
+  ASSERT_EQ(0u, logger->get(l_os_split_queue));
+  ASSERT_LT(0, subdirs(c));
+
+  // every object is still found where the split put it
+  Index index;
+  ASSERT_EQ(0, manager.get_index(c, path(c).c_str(), &index));
+  for (int i = 0; i < 20; ++i) {
+    CollectionIndex::IndexedPath p;
+    int exists = 0;
+    ASSERT_EQ(0, index->lookup(object(i), &p, &exists));
+    ASSERT_EQ(1, exists);
+    struct stat st;
+    ASSERT_EQ(0, ::stat(p->path(), &st));
+  }
+  vector<hobject_t> ls;
+  ASSERT_EQ(0, index->collection_list(&ls));
+  ASSERT_EQ(20u, ls.size());
+}
+
+TEST_F(IndexManagerTest, split_inline_when_overfull) {
+  coll_t c("overfull");
+  ASSERT_EQ(0, create_collection(c));
+  // 17 objects are already over this
+  set_conf("filestore_split_inline_fill", "1");
+  manager.start_split_thread(logger);
+  {
+    Index index;
+    ASSERT_EQ(0, manager.get_index(c, path(c).c_str(), &index));
+    ASSERT_EQ(0, create_objects(index, 0, 17));
+    ASSERT_LT(0, subdirs(c));
+    ASSERT_EQ(0u, logger->get(l_os_split_queue));
+  }
+  ASSERT_EQ(0u, logger->get(l_os_splits));
+}
+
+TEST_F(IndexManagerTest, split_paced) {
+  // each split moves 17 objects: 34 ops, or 2s at this rate
+  set_conf("filestore_split_ops_per_sec", "17");
+  coll_t c1("paced1"), c2("paced2");
+  ASSERT_EQ(0, create_collection(c1));
+  ASSERT_EQ(0, create_collection(c2));
+  manager.start_split_thread(logger);
+  {
+    Index index;
+    ASSERT_EQ(0, manager.get_index(c1, path(c1).c_str(), &index));
+    ASSERT_EQ(0, create_objects(index, 0, 17));
+  }
+  {
+    Index index;
+    ASSERT_EQ(0, manager.get_index(c2, path(c2).c_str(), &index));
+    ASSERT_EQ(0, create_objects(index, 0, 17));
+  }
+  ASSERT_TRUE(wait_for_splits(1));
+  utime_t first = ceph_clock_now(g_ceph_context);
+  ASSERT_TRUE(wait_for_splits(2));
+  utime_t second = ceph_clock_now(g_ceph_context);
+  ASSERT_LE(1.5, (double)(second - first));
+  ASSERT_LT(0, subdirs(c1));
+  ASSERT_LT(0, subdirs(c2));
+}
+
+TEST_F(IndexManagerTest, split_one_subdir_at_a_time) {
+  coll_t c("chunked");
+  ASSERT_EQ(0, create_collection(c));
+  manager.start_split_thread(logger);
+  Index index;
+  ASSERT_EQ(0, manager.get_index(c, path(c).c_str(), &index));
+  ASSERT_EQ(0, create_objects(index, 0, 17));
+  HashIndex *hindex = dynamic_cast<HashIndex*>(index.get());
+  ASSERT_TRUE(hindex != NULL);
+
+  // the steps the split thread gives the index up between
+  uint64_t total = 0;
+  int steps = 0;
+  bool done = false;
+  while (!done) {
+    uint64_t moved = 0;
+    ASSERT_EQ(0, hindex->split_dir(vector<string>(), total > 0, &moved,
+				   &done));
+    ASSERT_LT(0u, moved);
+    total += moved;
+    ++steps;
+    ASSERT_EQ(steps, subdirs(c));
+
+    // and in between, every object is found, once
+    for (int i = 0; i < 17; ++i) {
+      CollectionIndex::IndexedPath p;
+      int exists = 0;
+      ASSERT_EQ(0, index->lookup(object(i), &p, &exists));
+      ASSERT_EQ(1, exists);
+      struct stat st;
+      ASSERT_EQ(0, ::stat(p->path(), &st));
+    }
+    vector<hobject_t> ls;
+    ASSERT_EQ(0, index->collection_list(&ls));
+    ASSERT_EQ(17u, ls.size());
+  }
+  ASSERT_EQ(17u, total);
+  ASSERT_LT(1, steps);
+}
+
+int main(int argc, char **argv) {
+  int fd = ::creat("detect", 0600);
+  int ret = chain_fsetxattr(fd, "user.test", "A", 1);
+  ::close(fd);
+  ::unlink("detect");
+  if (ret < 0) {
+    cerr << "SKIP IndexManager because unable to test for xattr" << std::endl;
+  } else {
+    vector<const char*> args;
+    argv_to_vec(argc, (const char **)argv, args);
+
+    global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+    common_init_finish(g_ceph_context);
+
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+  }
+}
+
+// Local Variables:
+// compile-command: "cd ../.. ; make unittest_index_manager ; ./unittest_index_manager # --gtest_filter=IndexManagerTest.* --log-to-stderr=true --debug-filestore=20"
+// End:
@@ -0,0 +1,170 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2013 Inktank, Inc
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "os/WritebackThrottle.h"
+#include "common/Clock.h"
+#include "common/ceph_argparse.h"
+#include "common/ceph_context.h"
+#include "common/config.h"
+#include "global/global_context.h"
+#include "global/global_init.h"
+#include "include/stringify.h"
+#include <gtest/gtest.h>
+
+static const uint64_t MB = 1 << 20;
+
+class WritebackThrottleTest : public ::testing::Test {
+public:
+  virtual void SetUp() {
+    set_conf("filestore_wbthrottle_enable", "true");
+    set_conf("filestore_wbthrottle_target_latency", "1");
+    set_conf("filestore_wbthrottle_min_bytes", stringify(16 * MB).c_str());
+    set_conf("filestore_wbthrottle_max_bytes", stringify(1024 * MB).c_str());
+    set_conf("filestore_wbthrottle_flush_ratio", ".25");
+    set_conf("filestore_wbthrottle_max_delay", ".2");
+  }
+
+  void set_conf(const char *key, const char *val) {
+    g_ceph_context->_conf->set_val(key, val);
+    g_ceph_context->_conf->apply_changes(NULL);
+  }
+
+  /// commit bytes in lat seconds
+  void commit(WritebackThrottle &t, uint64_t bytes, double lat) {
+    bool force_sync;
+    t.wrote(bytes, &force_sync);
+    t.commit_start();
+    utime_t l;
+    l.set_from_double(lat);
+    t.commit_finish(l);
+  }
+
+  /// how long throttle() held us up
+  double throttled(WritebackThrottle &t) {
+    utime_t start = ceph_clock_now(g_ceph_context);
+    t.throttle();
+    return (double)(ceph_clock_now(g_ceph_context) - start);
+  }
+};
+
+TEST_F(WritebackThrottleTest, disabled) {
+  set_conf("filestore_wbthrottle_enable", "false");
+  WritebackThrottle t(g_ceph_context);
+  bool force_sync = true;
+  ASSERT_FALSE(t.wrote(2048 * MB, &force_sync));
+  ASSERT_FALSE(force_sync);
+  ASSERT_GT(0.05, throttled(t));
+}
+
+TEST_F(WritebackThrottleTest, limit_before_first_commit) {
+  WritebackThrottle t(g_ceph_context);
+  ASSERT_EQ(1024 * MB, t.get_limit());
+
+  // writeback starts at a quarter of the limit
+  bool force_sync;
+  ASSERT_FALSE(t.wrote(255 * MB, &force_sync));
+  ASSERT_FALSE(force_sync);
+  ASSERT_TRUE(t.wrote(1 * MB, &force_sync));
+  ASSERT_FALSE(force_sync);
+}
+
+TEST_F(WritebackThrottleTest, early_commit_once_per_cycle) {
+  WritebackThrottle t(g_ceph_context);
+  bool force_sync;
+  t.wrote(1023 * MB, &force_sync);
+  ASSERT_FALSE(force_sync);
+  t.wrote(1 * MB, &force_sync);
+  ASSERT_TRUE(force_sync);
+  t.wrote(1 * MB, &force_sync);
+  ASSERT_FALSE(force_sync);
+
+  // a new cycle may ask again
+  t.commit_start();
+  t.wrote(1024 * MB, &force_sync);
+  ASSERT_TRUE(force_sync);
+}
+
+TEST_F(WritebackThrottleTest, limit_follows_bandwidth) {
+  WritebackThrottle t(g_ceph_context);
+  commit(t, 100 * MB, 1.0);
+  ASSERT_EQ(100 * MB, t.get_limit());
+
+  // a moving average, not the last sample
+  commit(t, 200 * MB, 1.0);
+  uint64_t limit = t.get_limit();
+  ASSERT_LT(129 * MB, limit);
+  ASSERT_GT(131 * MB, limit);
+
+  // and scaled to the target latency
+  set_conf("filestore_wbthrottle_target_latency", ".5");
+  ASSERT_GT(66 * MB, t.get_limit());
+  ASSERT_LT(64 * MB, t.get_limit());
+}
+
+TEST_F(WritebackThrottleTest, small_commits_ignored) {
+  WritebackThrottle t(g_ceph_context);
+  commit(t, MB / 2, 10.0);
+  ASSERT_EQ(1024 * MB, t.get_limit());
+}
+
+TEST_F(WritebackThrottleTest, limit_clamped) {
+  WritebackThrottle t(g_ceph_context);
+  commit(t, 2 * MB, 1.0);
+  ASSERT_EQ(16 * MB, t.get_limit());
+
+  WritebackThrottle t2(g_ceph_context);
+  commit(t2, 4096 * MB, 1.0);
+  ASSERT_EQ(1024 * MB, t2.get_limit());
+}
+
+TEST_F(WritebackThrottleTest, delay_proportional) {
+  WritebackThrottle t(g_ceph_context);
+  commit(t, 100 * MB, 1.0);
+  bool force_sync;
+
+  // under the limit: no delay
+  t.wrote(100 * MB, &force_sync);
+  ASSERT_GT(0.05, throttled(t));
+
+  // half way to twice the limit: half of max_delay
+  t.wrote(50 * MB, &force_sync);
+  double d = throttled(t);
+  ASSERT_LT(0.09, d);
+  ASSERT_GT(0.19, d);
+
+  // capped at max_delay
+  t.wrote(1000 * MB, &force_sync);
+  d = throttled(t);
+  ASSERT_LT(0.19, d);
+  ASSERT_GT(0.4, d);
+
+  // a commit clears it
+  t.commit_start();
+  ASSERT_GT(0.05, throttled(t));
+}
+
+int main(int argc, char **argv) {
+  vector<const char*> args;
+  argv_to_vec(argc, (const char **)argv, args);
+
+  global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+
+// Local Variables:
+// compile-command: "cd ../.. ; make unittest_wbthrottle ; ./unittest_wbthrottle"
+// End:
@@ -0,0 +1,260 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <errno.h>
+#include <string.h>
+
+#include <list>
+#include <map>
+
+#include "common/Mutex.h"
+#include "common/snap_types.h"
+#include "include/buffer.h"
+#include "include/Context.h"
+#include "osdc/ObjectCacher.h"
+#include "osdc/WritebackHandler.h"
+#include "test/unit.h"
+
+/**
+ * An in-memory pool whose reads and writes only complete when the test
+ * says so, so it can reorder them the way a clone's copyup can: a write
+ * is only applied when it completes, and until then reads of an object
+ * nobody has written return -ENOENT.
+ */
+class QueuedWriteback : public WritebackHandler {
+public:
+  struct Read {
+    object_t oid;
+    uint64_t off, len;
+    bufferlist *pbl;
+    Context *onfinish;
+  };
+  struct Write {
+    object_t oid;
+    uint64_t off;
+    bufferlist bl;
+    Context *oncommit;
+  };
+
+  QueuedWriteback() : last_tid(0) {}
+
+  virtual void read(const object_t& oid, const object_locator_t& oloc,
+		    uint64_t off, uint64_t len, snapid_t snapid,
+		    bufferlist *pbl, uint64_t trunc_size,  __u32 trunc_seq,
+		    Context *onfinish) {
+    Read r = { oid, off, len, pbl, onfinish };
+    reads.push_back(r);
+  }
+  virtual tid_t write(const object_t& oid, const object_locator_t& oloc,
+		      uint64_t off, uint64_t len, const SnapContext& snapc,
+		      const bufferlist &bl, utime_t mtime, uint64_t trunc_size,
+		      __u32 trunc_seq, Context *oncommit) {
+    Write w = { oid, off, bl, oncommit };
+    writes.push_back(w);
+    return ++last_tid;
+  }
+  virtual bool may_copy_on_write(const object_t&, uint64_t, uint64_t,
+				 snapid_t) {
+    return false;
+  }
+
+  /// answer the reads sent so far; call with the cache's lock held
+  void complete_reads() {
+    std::list<Read> ls;
+    ls.swap(reads);
+    for (std::list<Read>::iterator p = ls.begin(); p != ls.end(); ++p) {
+      std::map<object_t, bufferlist>::iterator o = objects.find(p->oid);
+      if (o == objects.end()) {
+	p->onfinish->complete(-ENOENT);
+	continue;
+      }
+      if (p->off < o->second.length()) {
+	uint64_t len = MIN(p->len, o->second.length() - p->off);
+	p->pbl->substr_of(o->second, p->off, len);
+      }
+      p->onfinish->complete(p->pbl->length());
+    }
+  }
+
+  /// apply and commit the writes sent so far; call with the lock held
+  void complete_writes() {
+    std::list<Write> ls;
+    ls.swap(writes);
+    for (std::list<Write>::iterator p = ls.begin(); p != ls.end(); ++p) {
+      bufferlist &obj = objects[p->oid];
+      uint64_t end = p->off + p->bl.length();
+      if (obj.length() < end) {
+	bufferptr bp(end - obj.length());
+	bp.zero();
+	obj.push_back(bp);
+      }
+      bufferlist bl;
+      if (p->off)
+	bl.substr_of(obj, 0, p->off);
+      bl.append(p->bl);
+      if (end < obj.length()) {
+	bufferlist tail;
+	tail.substr_of(obj, end, obj.length() - end);
+	bl.claim_append(tail);
+      }
+      obj.swap(bl);
+      p->oncommit->complete(0);
+    }
+  }
+
+  tid_t last_tid;
+  std::list<Read> reads;
+  std::list<Write> writes;
+  std::map<object_t, bufferlist> objects;
+};
+
+class C_Done : public Context {
+  bool *done;
+  int *ret;
+public:
+  C_Done(bool *d, int *r) : done(d), ret(r) {}
+  void finish(int r) {
+    *done = true;
+    *ret = r;
+  }
+};
+
+class ObjectCacherTest : public ::testing::Test {
+public:
+  ObjectCacherTest()
+    : lock("ObjectCacherTest::lock"),
+      oc(g_ceph_context, "test", wb, lock, NULL, NULL,
+	 1 << 20, 10, 1 << 19, 1 << 18, 1.0, false),
+      oset(NULL, 0, 0) {}
+
+  virtual void TearDown() {
+    Mutex::Locker l(lock);
+    oc.release_set(&oset);
+  }
+
+  ObjectExtent extent(const char *oid, uint64_t off, uint64_t len) {
+    ObjectExtent ex(object_t(oid), 0, off, len);
+    ex.oloc.pool = 0;
+    ex.buffer_extents.push_back(make_pair(0, len));
+    return ex;
+  }
+
+  bufferlist filled(uint64_t len, char c) {
+    bufferptr bp(len);
+    memset(bp.c_str(), c, len);
+    bufferlist bl;
+    bl.push_back(bp);
+    return bl;
+  }
+
+  // call with the lock held
+  void write(const char *oid, uint64_t off, bufferlist &bl, bool *done,
+	     int *r) {
+    ObjectCacher::OSDWrite *wr = oc.prepare_write(SnapContext(), bl,
+						  utime_t(), 0);
+    wr->extents.push_back(extent(oid, off, bl.length()));
+    oc.writex(wr, &oset, lock, new C_Done(done, r));
+  }
+
+  // call with the lock held; returns what readx() did
+  int read(const char *oid, uint64_t off, uint64_t len, bufferlist *pbl,
+	   bool *done, int *r) {
+    ObjectCacher::OSDRead *rd = oc.prepare_read(CEPH_NOSNAP, pbl, 0);
+    rd->extents.push_back(extent(oid, off, len));
+    Context *onfinish = new C_Done(done, r);
+    int ret = oc.readx(rd, &oset, onfinish);
+    if (ret != 0)
+      delete onfinish;
+    return ret;
+  }
+
+  QueuedWriteback wb;
+  Mutex lock;
+  ObjectCacher oc;
+  ObjectCacher::ObjectSet oset;
+};
+
+TEST_F(ObjectCacherTest, enoent)
+{
+  Mutex::Locker l(lock);
+  bufferlist bl;
+  bool done = false;
+  int r = 0;
+  ASSERT_EQ(0, read("obj", 0, 4096, &bl, &done, &r));
+  wb.complete_reads();
+  ASSERT_TRUE(done);
+  ASSERT_EQ(4096, r);
+  bufferlist zeros = filled(4096, 0);
+  ASSERT_TRUE(bl.contents_equal(zeros));
+}
+
+TEST_F(ObjectCacherTest, write_around)
+{
+  oc.set_write_around(4096, 0);
+  Mutex::Locker l(lock);
+  bufferlist data = filled(8192, 'a');
+  bool wrote = false;
+  int wr = 0;
+  write("obj", 0, data, &wrote, &wr);
+  ASSERT_EQ(1u, wb.writes.size());
+  ASSERT_FALSE(wrote);
+  wb.complete_writes();
+  ASSERT_TRUE(wrote);
+  ASSERT_EQ(0, wr);
+
+  // nothing was cached, so it comes from the OSD
+  bufferlist bl;
+  bool done = false;
+  int r = 0;
+  ASSERT_EQ(0, read("obj", 0, 8192, &bl, &done, &r));
+  wb.complete_reads();
+  ASSERT_TRUE(done);
+  ASSERT_EQ(8192, r);
+  ASSERT_TRUE(bl.contents_equal(data));
+}
+
+TEST_F(ObjectCacherTest, write_around_enoent_race)
+{
+  oc.set_write_around(4096, 0);
+  Mutex::Locker l(lock);
+
+  // cache the old (absent) contents
+  bufferlist bl;
+  bool done = false;
+  int r = 0;
+  ASSERT_EQ(0, read("obj", 0, 8192, &bl, &done, &r));
+  wb.complete_reads();
+  ASSERT_TRUE(done);
+
+  // the write goes around the cache, and is slow to create the object
+  bufferlist data = filled(8192, 'b');
+  bool wrote = false;
+  int wr = 0;
+  write("obj", 0, data, &wrote, &wr);
+  ASSERT_EQ(1u, wb.writes.size());
+
+  // a read overtakes it and finds nothing there
+  bl.clear();
+  done = false;
+  ASSERT_EQ(0, read("obj", 0, 8192, &bl, &done, &r));
+  ASSERT_EQ(1u, wb.reads.size());
+  wb.complete_reads();
+  ASSERT_FALSE(done);
+  ASSERT_TRUE(wb.reads.empty());
+
+  // once the write is done the read is sent again, and sees it
+  wb.complete_writes();
+  ASSERT_TRUE(wrote);
+  ASSERT_FALSE(done);
+  ASSERT_EQ(1u, wb.reads.size());
+  wb.complete_reads();
+  ASSERT_TRUE(done);
+  ASSERT_EQ(8192, r);
+  ASSERT_TRUE(bl.contents_equal(data));
+
+  // and the object isn't remembered as missing
+  bl.clear();
+  done = false;
+  ASSERT_EQ(8192, read("obj", 0, 8192, &bl, &done, &r));
+  ASSERT_TRUE(bl.contents_equal(data));
+}
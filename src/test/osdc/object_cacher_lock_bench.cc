@@ -0,0 +1,177 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+/*
+ * Measure how long ObjectCacher holds its lock while small random
+ * writes fragment a few hot objects.  Each write is timed from the
+ * moment the lock is taken until it is dropped again.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "common/ceph_argparse.h"
+#include "common/common_init.h"
+#include "common/config.h"
+#include "common/Clock.h"
+#include "common/Mutex.h"
+#include "common/snap_types.h"
+#include "global/global_init.h"
+#include "include/buffer.h"
+#include "include/Context.h"
+#include "include/stringify.h"
+#include "osdc/ObjectCacher.h"
+
+#include "FakeWriteback.h"
+
+int lock_bench(uint64_t num_ops, uint64_t num_objs, uint64_t obj_size,
+	       uint64_t op_len, uint64_t delay_ns)
+{
+  Mutex lock("object_cacher_lock_bench::object_cacher");
+  FakeWriteback writeback(g_ceph_context, &lock, delay_ns);
+
+  ObjectCacher obc(g_ceph_context, "test", writeback, lock, NULL, NULL,
+		   g_conf->client_oc_size,
+		   g_conf->client_oc_max_objects,
+		   g_conf->client_oc_max_dirty,
+		   g_conf->client_oc_target_dirty,
+		   g_conf->client_oc_max_dirty_age,
+		   true);
+  obc.start();
+
+  ObjectCacher::ObjectSet object_set(NULL, 0, 0);
+  SnapContext snapc;
+  ceph::buffer::ptr bp(op_len);
+  bp.zero();
+  ceph::bufferlist bl;
+  bl.append(bp);
+
+  std::cout << "Test configuration:\n\n"
+	    << setw(10) << "ops: " << num_ops << "\n"
+	    << setw(10) << "objects: " << num_objs << "\n"
+	    << setw(10) << "obj size: " << obj_size << "\n"
+	    << setw(10) << "op len: " << op_len << "\n"
+	    << setw(10) << "delay: " << delay_ns << "\n\n";
+
+  vector<double> held;
+  held.reserve(num_ops);
+  uint64_t slots = obj_size / op_len;
+  for (uint64_t i = 0; i < num_ops; ++i) {
+    std::string oid = "test" + stringify(random() % num_objs);
+    uint64_t offset = (random() % slots) * op_len;
+    ObjectExtent extent(oid, 0, offset, op_len);
+    extent.oloc.pool = 0;
+    extent.buffer_extents.push_back(make_pair(0, op_len));
+
+    ObjectCacher::OSDWrite *wr = obc.prepare_write(snapc, bl, utime_t(), 0);
+    wr->extents.push_back(extent);
+    lock.Lock();
+    utime_t start = ceph_clock_now(g_ceph_context);
+    obc.writex(wr, &object_set, lock, NULL);
+    utime_t elapsed = ceph_clock_now(g_ceph_context) - start;
+    lock.Unlock();
+    held.push_back((double)elapsed);
+  }
+
+  std::sort(held.begin(), held.end());
+  double total = 0;
+  for (vector<double>::iterator p = held.begin(); p != held.end(); ++p)
+    total += *p;
+  std::cout << "lock held per write (usec):\n"
+	    << setw(10) << "avg: " << total / num_ops * 1000000 << "\n"
+	    << setw(10) << "p50: " << held[num_ops / 2] * 1000000 << "\n"
+	    << setw(10) << "p99: " << held[num_ops * 99 / 100] * 1000000 << "\n"
+	    << setw(10) << "max: " << held.back() * 1000000 << "\n"
+	    << std::endl;
+
+  int r = 0;
+  Mutex mylock("object_cacher_lock_bench::flush");
+  Cond cond;
+  bool done;
+  Context *onfinish = new C_SafeCond(&mylock, &cond, &done, &r);
+  lock.Lock();
+  obc.flush_set(&object_set, onfinish);
+  lock.Unlock();
+  mylock.Lock();
+  while (!done)
+    cond.Wait(mylock);
+  mylock.Unlock();
+
+  lock.Lock();
+  bool unclean = obc.release_set(&object_set);
+  lock.Unlock();
+  obc.stop();
+
+  if (unclean) {
+    std::cout << "unclean buffers left over!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, const char **argv)
+{
+  std::vector<const char*> args;
+  argv_to_vec(argc, argv, args);
+  env_to_vec(args);
+  global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+
+  long long delay_ns = 0;
+  long long num_ops = 100000;
+  long long obj_bytes = 4 << 20;
+  long long op_len = 512;
+  long long num_objs = 1;
+  int seed = time(0) % 100000;
+  std::ostringstream err;
+  std::vector<const char*>::iterator i;
+  for (i = args.begin(); i != args.end();) {
+    if (ceph_argparse_withlonglong(args, i, &delay_ns, &err, "--delay-ns", (char*)NULL)) {
+      if (!err.str().empty()) {
+	cerr << argv[0] << ": " << err.str() << std::endl;
+	return EXIT_FAILURE;
+      }
+    } else if (ceph_argparse_withlonglong(args, i, &num_ops, &err, "--ops", (char*)NULL)) {
+      if (!err.str().empty()) {
+	cerr << argv[0] << ": " << err.str() << std::endl;
+	return EXIT_FAILURE;
+      }
+    } else if (ceph_argparse_withlonglong(args, i, &num_objs, &err, "--objects", (char*)NULL)) {
+      if (!err.str().empty()) {
+	cerr << argv[0] << ": " << err.str() << std::endl;
+	return EXIT_FAILURE;
+      }
+    } else if (ceph_argparse_withlonglong(args, i, &obj_bytes, &err, "--obj-size", (char*)NULL)) {
+      if (!err.str().empty()) {
+	cerr << argv[0] << ": " << err.str() << std::endl;
+	return EXIT_FAILURE;
+      }
+    } else if (ceph_argparse_withlonglong(args, i, &op_len, &err, "--op-size", (char*)NULL)) {
+      if (!err.str().empty()) {
+	cerr << argv[0] << ": " << err.str() << std::endl;
+	return EXIT_FAILURE;
+      }
+    } else if (ceph_argparse_withint(args, i, &seed, &err, "--seed", (char*)NULL)) {
+      if (!err.str().empty()) {
+	cerr << argv[0] << ": " << err.str() << std::endl;
+	return EXIT_FAILURE;
+      }
+    } else {
+      cerr << "unknown option " << *i << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (num_ops <= 0 || num_objs <= 0 || op_len <= 0 || obj_bytes < op_len) {
+    cerr << argv[0] << ": need at least one op and object, and an object "
+	 << "at least one op long" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  srandom(seed);
+  return lock_bench(num_ops, num_objs, obj_bytes, op_len, delay_ns);
+}
@@ -51,7 +51,8 @@ public:
 
 int stress_test(uint64_t num_ops, uint64_t num_objs,
 		uint64_t max_obj_size, uint64_t delay_ns,
-		uint64_t max_op_len, float percent_reads)
+		uint64_t max_op_len, float percent_reads,
+		uint64_t write_around_bytes)
 {
   Mutex lock("object_cacher_stress::object_cacher");
   FakeWriteback writeback(g_ceph_context, &lock, delay_ns);
@@ -63,6 +64,7 @@ int stress_test(uint64_t num_ops, uint64_t num_objs,
 		   g_conf->client_oc_target_dirty,
 		   g_conf->client_oc_max_dirty_age,
 		   true);
+  obc.set_write_around(write_around_bytes, 0);
   obc.start();
 
   atomic_t outstanding_reads;
@@ -81,7 +83,8 @@ int stress_test(uint64_t num_ops, uint64_t num_objs,
 	    << setw(10) << "obj size: " << max_obj_size << "\n"
 	    << setw(10) << "delay: " << delay_ns << "\n"
 	    << setw(10) << "max op len: " << max_op_len << "\n"
-	    << setw(10) << "percent reads: " << percent_reads << "\n\n";
+	    << setw(10) << "percent reads: " << percent_reads << "\n"
+	    << setw(10) << "write around: " << write_around_bytes << "\n\n";
 
   for (uint64_t i = 0; i < num_ops; ++i) {
     uint64_t offset = random() % max_obj_size;
@@ -182,6 +185,7 @@ int main(int argc, const char **argv)
   long long max_len = 128 << 10;
   long long num_objs = 10;
   float percent_reads = 0.90;
+  long long write_around_bytes = 0;
   int seed = time(0) % 100000;
   std::ostringstream err;
   std::vector<const char*>::iterator i;
@@ -216,6 +220,11 @@ int main(int argc, const char **argv)
 	cerr << argv[0] << ": " << err.str() << std::endl;
 	return EXIT_FAILURE;
       }
+    } else if (ceph_argparse_withlonglong(args, i, &write_around_bytes, &err, "--write-around-bytes", (char*)NULL)) {
+      if (!err.str().empty()) {
+	cerr << argv[0] << ": " << err.str() << std::endl;
+	return EXIT_FAILURE;
+      }
     } else if (ceph_argparse_withint(args, i, &seed, &err, "--seed", (char*)NULL)) {
       if (!err.str().empty()) {
 	cerr << argv[0] << ": " << err.str() << std::endl;
@@ -228,5 +237,6 @@ int main(int argc, const char **argv)
   }
 
   srandom(seed);
-  return stress_test(num_ops, num_objs, obj_bytes, delay_ns, max_len, percent_reads);
+  return stress_test(num_ops, num_objs, obj_bytes, delay_ns, max_len, percent_reads,
+		     write_around_bytes);
 }
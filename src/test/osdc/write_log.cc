@@ -0,0 +1,380 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include "common/Cond.h"
+#include "common/Mutex.h"
+#include "common/safe_io.h"
+#include "common/snap_types.h"
+#include "include/buffer.h"
+#include "include/stringify.h"
+#include "osdc/WritebackHandler.h"
+#include "osdc/WriteLog.h"
+#include "test/unit.h"
+
+/// remembers what was written back, in order
+class RecordingWriteback : public WritebackHandler {
+public:
+  struct Write {
+    object_t oid;
+    uint64_t off;
+    bufferlist bl;
+  };
+
+  RecordingWriteback() : error(0), hold(false) {}
+
+  virtual void read(const object_t& oid, const object_locator_t& oloc,
+		    uint64_t off, uint64_t len, snapid_t snapid,
+		    bufferlist *pbl, uint64_t trunc_size,  __u32 trunc_seq,
+		    Context *onfinish) {
+    assert(0 == "the write log never reads");
+  }
+  virtual bool may_copy_on_write(const object_t&, uint64_t, uint64_t,
+				 snapid_t) {
+    return false;
+  }
+  // called, and completed, with the log's lock held
+  virtual tid_t write(const object_t& oid, const object_locator_t& oloc,
+		      uint64_t off, uint64_t len, const SnapContext& snapc,
+		      const bufferlist &bl, utime_t mtime, uint64_t trunc_size,
+		      __u32 trunc_seq, Context *oncommit) {
+    if (hold) {
+      held.push_back(oncommit);
+      return 0;
+    }
+    if (error == 0) {
+      Write w;
+      w.oid = oid;
+      w.off = off;
+      w.bl = bl;
+      writes.push_back(w);
+    }
+    oncommit->complete(error);
+    return 0;
+  }
+
+  /// complete the writes that were held back; takes the lock
+  void release(Mutex &lock) {
+    Mutex::Locker l(lock);
+    hold = false;
+    while (!held.empty()) {
+      Context *c = held.front();
+      held.pop_front();
+      c->complete(0);
+    }
+  }
+
+  int error;  ///< fail every write with this
+  bool hold;  ///< don't complete writes until release()
+  std::list<Context*> held;
+  std::vector<Write> writes;
+};
+
+class WriteLogTest : public ::testing::Test {
+public:
+  WriteLogTest() : lock("WriteLogTest::lock") {}
+
+  virtual void SetUp() {
+    char tmpl[] = "/tmp/unittest_write_log.XXXXXX";
+    int fd = mkstemp(tmpl);
+    ASSERT_LE(0, fd);
+    ::close(fd);
+    path = tmpl;
+  }
+  virtual void TearDown() {
+    ::unlink(path.c_str());
+  }
+
+  bufferlist make_data(uint64_t len, char c) {
+    bufferptr bp(len);
+    memset(bp.c_str(), c, len);
+    bufferlist bl;
+    bl.push_back(bp);
+    return bl;
+  }
+
+  /// whether bl is len bytes of c
+  bool filled(const bufferlist &bl, uint64_t len, char c) {
+    if (bl.length() != len)
+      return false;
+    for (std::list<bufferptr>::const_iterator p = bl.buffers().begin();
+	 p != bl.buffers().end(); ++p) {
+      for (unsigned i = 0; i < p->length(); ++i)
+	if (p->c_str()[i] != c)
+	  return false;
+    }
+    return true;
+  }
+
+  void write(WriteLog &log, const std::string &oid, uint64_t off,
+	     const bufferlist &bl) {
+    log.write(object_t(oid), object_locator_t(0), off, bl, SnapContext(),
+	      NULL);
+  }
+
+  // run one of the log's asynchronous calls to completion
+  int wait(WriteLog &log, void (WriteLog::*fn)(Context*)) {
+    Mutex mylock("WriteLogTest::wait");
+    Cond cond;
+    bool done;
+    int r;
+    (log.*fn)(new C_SafeCond(&mylock, &cond, &done, &r));
+    mylock.Lock();
+    while (!done)
+      cond.Wait(mylock);
+    mylock.Unlock();
+    return r;
+  }
+
+  Mutex lock;
+  std::string path;
+};
+
+TEST_F(WriteLogTest, writeback)
+{
+  RecordingWriteback wb;
+  WriteLog log(g_ceph_context, path, 1 << 20, wb, lock, 4);
+  ASSERT_EQ(0, log.open());
+  for (int i = 0; i < 10; ++i)
+    write(log, "obj" + stringify(i % 3), i * 1000, make_data(1000, 'a' + i));
+  ASSERT_EQ(0, wait(log, &WriteLog::sync));
+  ASSERT_EQ(0, wait(log, &WriteLog::flush));
+  log.close();
+
+  Mutex::Locker l(lock);
+  ASSERT_EQ(10u, wb.writes.size());
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_EQ(object_t("obj" + stringify(i % 3)), wb.writes[i].oid);
+    ASSERT_EQ((uint64_t)i * 1000, wb.writes[i].off);
+    ASSERT_TRUE(filled(wb.writes[i].bl, 1000, 'a' + i));
+  }
+}
+
+TEST_F(WriteLogTest, read)
+{
+  RecordingWriteback wb;
+  wb.hold = true;
+  WriteLog log(g_ceph_context, path, 1 << 20, wb, lock, 4);
+  ASSERT_EQ(0, log.open());
+  write(log, "obj", 0, make_data(4096, 'a'));
+  write(log, "obj", 2048, make_data(4096, 'b'));
+  ASSERT_EQ(0, wait(log, &WriteLog::sync));
+
+  // newer data wins
+  bufferlist bl;
+  WriteLog::extents_t logged;
+  ASSERT_EQ(6144, log.read(object_t("obj"), 0, 6144, &bl, &logged));
+  bufferlist head, tail;
+  head.substr_of(bl, 0, 2048);
+  tail.substr_of(bl, 2048, 4096);
+  ASSERT_TRUE(filled(head, 2048, 'a'));
+  ASSERT_TRUE(filled(tail, 4096, 'b'));
+
+  ASSERT_TRUE(logged.empty());
+
+  // nothing logged there
+  bl.clear();
+  ASSERT_EQ(0, log.read(object_t("other"), 0, 4096, &bl, &logged));
+  ASSERT_EQ(0u, bl.length());
+  ASSERT_TRUE(logged.empty());
+
+  // partly in the log: go to the backend, without waiting for the
+  // writeback, and lay the logged parts over what it has
+  bl.clear();
+  ASSERT_EQ(0, log.read(object_t("obj"), 4096, 4096, &bl, &logged));
+  ASSERT_EQ(0u, bl.length());
+  ASSERT_EQ(1u, logged.size());
+  char backend[4096];
+  memset(backend, 'z', sizeof(backend));
+  WriteLog::overlay(logged, 4096, sizeof(backend), backend);
+  bl.append(backend, sizeof(backend));
+  head.clear();
+  tail.clear();
+  head.substr_of(bl, 0, 2048);
+  tail.substr_of(bl, 2048, 2048);
+  ASSERT_TRUE(filled(head, 2048, 'b'));
+  ASSERT_TRUE(filled(tail, 2048, 'z'));
+
+  wb.release(lock);
+  ASSERT_EQ(0, wait(log, &WriteLog::flush));
+  log.close();
+}
+
+TEST_F(WriteLogTest, wait_for_writeback)
+{
+  RecordingWriteback wb;
+  wb.hold = true;
+  WriteLog log(g_ceph_context, path, 1 << 20, wb, lock, 4);
+  ASSERT_EQ(0, log.open());
+  write(log, "obj", 0, make_data(4096, 'a'));
+  write(log, "obj", 8192, make_data(4096, 'b'));
+  ASSERT_EQ(0, wait(log, &WriteLog::sync));
+
+  Mutex mylock("WriteLogTest::wait_for_writeback");
+  Cond cond;
+  bool done = false, overlap_done = false;
+  int r, overlap_r;
+
+  // nothing logged there: right away
+  log.wait_for_writeback(object_t("obj"), 4096, 4096,
+			 new C_SafeCond(&mylock, &cond, &done, &r));
+  mylock.Lock();
+  while (!done)
+    cond.Wait(mylock);
+  mylock.Unlock();
+  ASSERT_EQ(0, r);
+
+  // waits for the logged write under it
+  log.wait_for_writeback(object_t("obj"), 8000, 1000,
+			 new C_SafeCond(&mylock, &cond, &overlap_done,
+					&overlap_r));
+  mylock.Lock();
+  ASSERT_FALSE(overlap_done);
+  mylock.Unlock();
+
+  wb.release(lock);
+  mylock.Lock();
+  while (!overlap_done)
+    cond.Wait(mylock);
+  mylock.Unlock();
+  ASSERT_EQ(0, overlap_r);
+  log.close();
+}
+
+TEST_F(WriteLogTest, replay)
+{
+  RecordingWriteback wb;
+  {
+    // a small log, so records wrap around and need padding
+    WriteLog log(g_ceph_context, path, 16 * 4096, wb, lock, 2);
+    ASSERT_EQ(0, log.open());
+    for (int i = 0; i < 10; ++i)
+      write(log, "obj", i * 5000, make_data(5000, 'a' + i));
+    ASSERT_EQ(0, wait(log, &WriteLog::flush));
+
+    // the cluster goes away, and so do we
+    lock.Lock();
+    wb.error = -EIO;
+    lock.Unlock();
+    for (int i = 0; i < 5; ++i)
+      write(log, "obj", i * 5000, make_data(5000, 'k' + i));
+    ASSERT_EQ(0, wait(log, &WriteLog::sync));
+    ASSERT_EQ(-EIO, wait(log, &WriteLog::flush));
+
+    // still readable from the log
+    bufferlist bl;
+    WriteLog::extents_t logged;
+    ASSERT_EQ(5000, log.read(object_t("obj"), 5000, 5000, &bl, &logged));
+    ASSERT_TRUE(filled(bl, 5000, 'l'));
+    log.close();
+  }
+  ASSERT_EQ(10u, wb.writes.size());
+
+  RecordingWriteback wb2;
+  WriteLog log(g_ceph_context, path, 1 << 20, wb2, lock, 2);
+  ASSERT_EQ(0, log.open());
+  ASSERT_EQ(0, wait(log, &WriteLog::flush));
+  log.close();
+
+  Mutex::Locker l(lock);
+  ASSERT_EQ(5u, wb2.writes.size());
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_EQ((uint64_t)i * 5000, wb2.writes[i].off);
+    ASSERT_TRUE(filled(wb2.writes[i].bl, 5000, 'k' + i));
+  }
+}
+
+TEST_F(WriteLogTest, torn_tail)
+{
+  RecordingWriteback wb;
+  wb.error = -EIO;
+  {
+    WriteLog log(g_ceph_context, path, 1 << 20, wb, lock, 2);
+    ASSERT_EQ(0, log.open());
+    for (int i = 0; i < 3; ++i)
+      write(log, "obj", i * 1000, make_data(1000, 'a' + i));
+    ASSERT_EQ(0, wait(log, &WriteLog::sync));
+    log.close();
+  }
+
+  // each record is a block after the superblock; damage the last one's data
+  int fd = ::open(path.c_str(), O_RDWR);
+  ASSERT_LE(0, fd);
+  char c = 'z';
+  ASSERT_EQ(0, safe_pwrite(fd, &c, 1, 3 * 4096 + 500));
+  ::close(fd);
+
+  RecordingWriteback wb2;
+  WriteLog log(g_ceph_context, path, 1 << 20, wb2, lock, 2);
+  ASSERT_EQ(0, log.open());
+  ASSERT_EQ(0, wait(log, &WriteLog::flush));
+
+  // and the log goes on from there
+  write(log, "obj", 0, make_data(1000, 'x'));
+  ASSERT_EQ(0, wait(log, &WriteLog::flush));
+  log.close();
+
+  Mutex::Locker l(lock);
+  ASSERT_EQ(3u, wb2.writes.size());
+  ASSERT_TRUE(filled(wb2.writes[0].bl, 1000, 'a'));
+  ASSERT_TRUE(filled(wb2.writes[1].bl, 1000, 'b'));
+  ASSERT_TRUE(filled(wb2.writes[2].bl, 1000, 'x'));
+}
+
+TEST_F(WriteLogTest, replay_id)
+{
+  RecordingWriteback wb;
+  wb.error = -EIO;
+  uint64_t log_id;
+  {
+    WriteLog log(g_ceph_context, path, 1 << 20, wb, lock, 2);
+    ASSERT_EQ(0, log.open());
+    log_id = log.get_log_id();
+    ASSERT_NE(WriteLog::REPLAY_NONE, log_id);
+    ASSERT_NE(WriteLog::REPLAY_ANY, log_id);
+    write(log, "obj", 0, make_data(1000, 'a'));
+    ASSERT_EQ(0, wait(log, &WriteLog::sync));
+    ASSERT_FALSE(log.empty());
+    log.close();
+  }
+
+  // the log we expect is replayed
+  RecordingWriteback wb2;
+  wb2.error = -EIO;
+  {
+    WriteLog log(g_ceph_context, path, 1 << 20, wb2, lock, 2);
+    ASSERT_EQ(0, log.open(log_id));
+    ASSERT_EQ(log_id, log.get_log_id());
+    ASSERT_FALSE(log.empty());
+    log.close();
+  }
+
+  // any other is dropped
+  RecordingWriteback wb3;
+  WriteLog log(g_ceph_context, path, 1 << 20, wb3, lock, 2);
+  ASSERT_EQ(0, log.open(log_id + 1));
+  ASSERT_NE(log_id, log.get_log_id());
+  ASSERT_TRUE(log.empty());
+  ASSERT_EQ(0, wait(log, &WriteLog::flush));
+  log.close();
+  Mutex::Locker l(lock);
+  ASSERT_EQ(0u, wb3.writes.size());
+}
+
+TEST_F(WriteLogTest, exclusive)
+{
+  RecordingWriteback wb;
+  WriteLog log(g_ceph_context, path, 1 << 20, wb, lock, 2);
+  ASSERT_EQ(0, log.open());
+  WriteLog other(g_ceph_context, path, 1 << 20, wb, lock, 2);
+  ASSERT_EQ(-EBUSY, other.open());
+  log.close();
+}
@@ -0,0 +1,144 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "include/small_vector.h"
+#include "gtest/gtest.h"
+
+typedef small_vector<int, 4> vec_t;
+
+static bool is_inline(const vec_t& v)
+{
+  const char *d = (const char *)v.begin();
+  return d >= (const char *)&v && d < (const char *)(&v + 1);
+}
+
+static void fill(vec_t& v, int n)
+{
+  for (int i = 0; i < n; ++i)
+    v.push_back(i);
+}
+
+TEST(small_vector, inline_then_heap)
+{
+  vec_t v;
+  ASSERT_TRUE(v.empty());
+  fill(v, 4);
+  ASSERT_TRUE(is_inline(v));
+  ASSERT_EQ(4u, v.size());
+
+  v.push_back(4);
+  ASSERT_FALSE(is_inline(v));
+  fill(v, 60);
+  ASSERT_EQ(65u, v.size());
+  for (int i = 0; i < 5; ++i)
+    ASSERT_EQ(i, v[i]);
+  for (int i = 5; i < 65; ++i)
+    ASSERT_EQ(i - 5, v[i]);
+  ASSERT_EQ(59, v.back());
+
+  v.pop_back();
+  ASSERT_EQ(64u, v.size());
+  v.clear();
+  ASSERT_TRUE(v.empty());
+}
+
+TEST(small_vector, resize)
+{
+  vec_t v(2);
+  ASSERT_TRUE(is_inline(v));
+  ASSERT_EQ(0, v[0]);
+  v[1] = 7;
+  v.resize(10);
+  ASSERT_FALSE(is_inline(v));
+  ASSERT_EQ(7, v[1]);
+  for (int i = 2; i < 10; ++i)
+    ASSERT_EQ(0, v[i]);
+  v.resize(1);
+  ASSERT_EQ(1u, v.size());
+}
+
+TEST(small_vector, copy)
+{
+  vec_t small;
+  fill(small, 3);
+  vec_t big;
+  fill(big, 20);
+
+  vec_t a(small);
+  ASSERT_TRUE(is_inline(a));
+  ASSERT_EQ(3u, a.size());
+  a[0] = 100;
+  ASSERT_EQ(0, small[0]);
+
+  vec_t b(big);
+  ASSERT_FALSE(is_inline(b));
+  ASSERT_NE(big.begin(), b.begin());
+  ASSERT_EQ(20u, b.size());
+  for (int i = 0; i < 20; ++i)
+    ASSERT_EQ(i, b[i]);
+  b[0] = 100;
+  ASSERT_EQ(0, big[0]);
+
+  // into an inline vector, and back down into a heap one
+  a = big;
+  ASSERT_EQ(20u, a.size());
+  ASSERT_EQ(19, a.back());
+  b = small;
+  ASSERT_EQ(3u, b.size());
+  ASSERT_EQ(2, b.back());
+
+  a = a;
+  ASSERT_EQ(20u, a.size());
+  ASSERT_EQ(19, a.back());
+}
+
+TEST(small_vector, erase)
+{
+  vec_t v;
+  fill(v, 4);
+  vec_t::iterator p = v.erase(v.begin() + 1);
+  ASSERT_EQ(v.begin() + 1, p);
+  ASSERT_EQ(3u, v.size());
+  ASSERT_EQ(0, v[0]);
+  ASSERT_EQ(2, v[1]);
+  ASSERT_EQ(3, v[2]);
+
+  p = v.erase(v.end() - 1);
+  ASSERT_EQ(v.end(), p);
+  ASSERT_EQ(2u, v.size());
+  ASSERT_EQ(2, v.back());
+
+  v.clear();
+  fill(v, 10);
+  ASSERT_FALSE(is_inline(v));
+  v.erase(v.begin());
+  ASSERT_EQ(9u, v.size());
+  for (int i = 0; i < 9; ++i)
+    ASSERT_EQ(i + 1, v[i]);
+  while (!v.empty())
+    v.erase(v.begin());
+  ASSERT_EQ(0u, v.size());
+}
+
+TEST(small_vector, swap)
+{
+  vec_t small;
+  fill(small, 2);
+  vec_t big;
+  fill(big, 10);
+  vec_t big2;
+  fill(big2, 20);
+
+  small.swap(big);
+  ASSERT_EQ(10u, small.size());
+  ASSERT_EQ(9, small.back());
+  ASSERT_EQ(2u, big.size());
+  ASSERT_EQ(1, big.back());
+
+  // two heap vectors just trade buffers
+  const int *d = big2.begin();
+  small.swap(big2);
+  ASSERT_EQ(d, small.begin());
+  ASSERT_EQ(20u, small.size());
+  ASSERT_EQ(10u, big2.size());
+}